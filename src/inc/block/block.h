@@ -27,6 +27,17 @@
 #define BIO_READ	(0ul)
 #define BIO_SYNC	(1ul << 1)
 
+/* I/O priority classes, lower value means higher priority. Foreground
+   classes are never throttled, background classes go through the bdev
+   rate limiter (if any) and flush always goes before merge. */
+#define BIO_PRIO_READ	0
+#define BIO_PRIO_WAL	1
+#define BIO_PRIO_FLUSH	2
+#define BIO_PRIO_MERGE	3
+#define BIO_PRIO_MAX	4
+
+#define BIO_PRIO_BACKGROUND	BIO_PRIO_FLUSH
+
 
 struct bio_vec {
 	void *buf;
@@ -40,6 +51,7 @@ struct bio {
 	int handled;
 
 	unsigned long flags;
+	int prio;
 	int err;
 
 	struct bdev *bdev;
@@ -48,12 +60,44 @@ struct bio {
 	size_t cnt, cap;
 	struct bio_vec *vec;
 
+	/* next bio in the queue of a reader thread */
+	struct bio *next;
+
 	struct bio_vec _inline[8];
 };
 
+/* token bucket shared by all background I/O of a block device */
+struct bio_limiter {
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+
+	uint64_t rate;		/* bytes per second, 0 means unlimited */
+	uint64_t burst;		/* max number of accumulated tokens */
+	int64_t tokens;
+	uint64_t stamp;		/* time of the last refill in ns */
+
+	unsigned long waiting[BIO_PRIO_MAX];
+};
+
+/* bios submitted with bio_submit_async are handled in order by a reader
+   thread, it's started by the first such bio, so the queue may be set up
+   before the process forks */
+struct bio_queue {
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+	pthread_t thread;
+	int started;
+	int done;
+
+	struct bio *head;
+	struct bio *tail;
+};
+
 struct bdev {
 	void (*handle)(struct bio *);
 	size_t (*size)(struct bdev *);
+	struct bio_limiter *limiter;
+	struct bio_queue *queue;
 };
 
 struct sync_bdev {
@@ -63,12 +107,25 @@ struct sync_bdev {
 
 void sync_bdev_setup(struct sync_bdev *bdev, int fd);
 size_t bdev_size(struct bdev *bdev);
+void bdev_set_limiter(struct bdev *bdev, struct bio_limiter *limiter);
+void bdev_set_queue(struct bdev *bdev, struct bio_queue *queue);
+
+void bio_limiter_setup(struct bio_limiter *limiter, uint64_t rate);
+void bio_limiter_release(struct bio_limiter *limiter);
+void bio_limiter_set_rate(struct bio_limiter *limiter, uint64_t rate);
+void bio_throttle(struct bio_limiter *limiter, int prio, uint64_t bytes);
+
+void bio_queue_setup(struct bio_queue *queue);
+void bio_queue_release(struct bio_queue *queue);
 
 void bio_setup(struct bio *bio, struct bdev *bdev);
 void bio_release(struct bio *bio);
 
 void bio_add_vec(struct bio *bio, void *buf, uint64_t offs, uint64_t size);
 void bio_submit(struct bio *bio);
+/* returns before the bio is handled if the bdev has a queue, otherwise
+   the same as bio_submit; the caller must bio_wait for it in any case */
+void bio_submit_async(struct bio *bio);
 void bio_wait(struct bio *bio);
 void bio_complete(struct bio *bio);
 
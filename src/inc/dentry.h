@@ -22,7 +22,15 @@
 
 struct __myfs_dentry_key {
 	le64_t parent;
-	le32_t hash;
+	le64_t hash;
+	le32_t size;
+	char name[1];
+} __attribute__((packed));
+
+/* inode ordered directory index, see MYFS_FEATURE_DINDEX */
+struct __myfs_dindex_key {
+	le64_t parent;
+	le64_t inode;
 	le32_t size;
 	char name[1];
 } __attribute__((packed));
@@ -35,7 +43,7 @@ struct __myfs_dentry_value {
 struct myfs_dentry {
 	uint64_t parent;
 	uint64_t inode;
-	uint32_t hash;
+	uint64_t hash;
 	uint32_t type;
 	uint32_t size;
 	const char *name;
@@ -50,6 +58,10 @@ void myfs_dentry_key2mem(struct myfs_dentry *mem,
 			const struct __myfs_dentry_key *disk);
 void myfs_dentry_value2mem(struct myfs_dentry *mem,
 			const struct __myfs_dentry_value *disk);
+void myfs_dindex_key2disk(struct __myfs_dindex_key *disk,
+			const struct myfs_dentry *mem);
+void myfs_dindex_key2mem(struct myfs_dentry *mem,
+			const struct __myfs_dindex_key *disk);
 
 
 struct myfs_lsm_sb;
@@ -59,12 +71,16 @@ struct myfs;
 void myfs_dentry_map_setup(struct myfs_lsm *lsm, struct myfs *myfs,
 			const struct myfs_lsm_sb *sb);
 void myfs_dentry_map_release(struct myfs_lsm *lsm);
+void myfs_dindex_map_setup(struct myfs_lsm *lsm, struct myfs *myfs,
+			const struct myfs_lsm_sb *sb);
+void myfs_dindex_map_release(struct myfs_lsm *lsm);
 
 
 struct myfs_inode;
 
 int myfs_dentry_read(struct myfs *myfs, struct myfs_inode *dir,
 			const char *name, struct myfs_dentry *dentry);
+/* writes the entry to the dentry map and the directory index if any */
 int __myfs_dentry_write(struct myfs *myfs, const struct myfs_dentry *dentry);
 
 #endif /*__DENTRY_H__*/
@@ -106,8 +106,14 @@ void __myfs_inode_put(struct myfs *myfs, struct myfs_inode *inode,
 void myfs_inode_put(struct myfs *myfs, struct myfs_inode *inode);
 
 int __myfs_inode_write(struct myfs *myfs, struct myfs_inode *inode);
+int __myfs_inode_write_batch(struct myfs *myfs, struct myfs_inode **inode,
+			size_t size);
 int __myfs_inode_read(struct myfs *myfs, struct myfs_inode *inode);
 int myfs_inode_read(struct myfs *myfs, struct myfs_inode *inode);
+/* Reads all the inodes that aren't read yet with one multi get, the same
+   inode may appear more than once. Returns 0 or the first error. */
+int myfs_inode_read_batch(struct myfs *myfs, struct myfs_inode **inode,
+			size_t size);
 
 
 struct myfs_lsm_sb;
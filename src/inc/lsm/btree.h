@@ -0,0 +1,93 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __BTREE_H__
+#define __BTREE_H__
+
+#include <lsm/hindex.h>
+#include <lsm/lsm.h>
+#include <misc/arena.h>
+
+#include <stdint.h>
+
+
+#define MYFS_BTREE_FANOUT	32
+
+
+struct myfs_btree_entry {
+	struct myfs_key key;
+	struct myfs_value value;
+};
+
+/* Nodes use optimistic lock coupling: readers don't write shared memory,
+   they remember node versions and restart if a version changed, writers
+   lock a node by making its version odd. Nodes are never freed before
+   the tree, so readers may safely look at a node that has just been
+   split. */
+struct myfs_btree_node {
+	uint64_t _Atomic version;
+	uint32_t _Atomic size;
+	uint32_t leaf;
+	/* keys of le64 trees as numbers, avoids entry dereferences */
+	uint64_t _Atomic ikey[MYFS_BTREE_FANOUT];
+	/* items of a leaf or separators of an inner node, separator i is
+	   the largest key of the subtree i */
+	struct myfs_btree_entry * _Atomic entry[MYFS_BTREE_FANOUT];
+	/* leaves only: the right sibling and the largest key the leaf may
+	   hold, NULL high means the leaf is the rightmost one */
+	struct myfs_btree_node * _Atomic next;
+	struct myfs_btree_entry * _Atomic high;
+	uint64_t _Atomic ihigh;
+	/* inner nodes only: size + 1 children */
+	struct myfs_btree_node * _Atomic child[];
+};
+
+struct myfs_btree {
+	struct myfs_mtree mtree;
+	struct myfs_btree_node * _Atomic root;
+	size_t _Atomic size;
+	myfs_cmp_t cmp;
+	/* keys are le64 integers, compare them directly (MYFS_KEY_LE64) */
+	int le64;
+	/* exact lookups go to the hash index (MYFS_KEY_HASH) */
+	int hash;
+	struct myfs_hindex index;
+	/* nodes and entries, an insert of an existing key replaces its entry
+	   and the old one stays here until the tree is released */
+	struct myfs_arena arena;
+};
+
+
+/* flags are MYFS_KEY_* flags of the keys stored in the tree */
+void myfs_btree_setup(struct myfs_btree *tree, myfs_cmp_t cmp,
+			unsigned long flags);
+void myfs_btree_release(struct myfs_btree *tree);
+
+
+int myfs_btree_insert(struct myfs_btree *tree, const struct myfs_key *key,
+			const struct myfs_value *value);
+/* sorted batches are inserted without descents from the root for keys
+   that go to the same leaf as the previous key */
+int myfs_btree_insert_batch(struct myfs_btree *tree,
+			const struct myfs_key *key,
+			const struct myfs_value *value, size_t size);
+int myfs_btree_lookup(struct myfs_btree *tree, struct myfs_query *query);
+int myfs_btree_range(struct myfs_btree *tree, struct myfs_query *query);
+int myfs_btree_scan(struct myfs_btree *tree, struct myfs_query *query);
+size_t myfs_btree_size(const struct myfs_btree *tree);
+size_t myfs_btree_bytes(const struct myfs_btree *tree);
+
+#endif /*__BTREE_H__*/
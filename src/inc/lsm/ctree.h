@@ -17,13 +17,36 @@
 #ifndef __CTREE_H__
 #define __CTREE_H__
 
+#include <block/block.h>
 #include <types.h>
 
+#include <stdatomic.h>
 #include <stddef.h>
 
 
 #define MYFS_MAX_CTREE_HIGHT	8
 #define MYFS_MIN_FANOUT		16
+/* default and maximal size of a ctree node in pages, a node grows past
+   the size only to hold at least fanout items */
+#define MYFS_CTREE_NODE_PAGES	1
+#define MYFS_CTREE_MAX_NODE_PAGES	16
+
+/* ctree node formats, the format is recorded in every node header */
+#define MYFS_CTREE_PLAIN	0
+#define MYFS_CTREE_PREFIX	1
+/* plain items followed by a table of le32 item offsets, items are read in
+   place without decoding the node */
+#define MYFS_CTREE_INDEXED	2
+/* 8 byte little endian integer keys: values, then all keys as a le64
+   array and a table of items + 1 le32 value offsets */
+#define MYFS_CTREE_FIXED	3
+
+/* every MYFS_CTREE_RESTART-th key in a prefix node is stored in full */
+#define MYFS_CTREE_RESTART	16
+
+/* bounds of the number of leaves an iterator reads ahead */
+#define MYFS_CTREE_RA_MIN	2
+#define MYFS_CTREE_RA_MAX	32
 
 
 struct __myfs_ctree_item {
@@ -52,14 +75,54 @@ static inline void myfs_ctree_item2mem(struct myfs_ctree_item *mem,
 }
 
 
+/* Item of a prefix node: the key shares first "shared" bytes with the
+   previous key in the node, only the remaining "unshared" bytes are
+   stored. Keys at restart points have shared == 0, offsets of restart
+   points (le32, relative to the node start) follow the last item. */
+struct __myfs_ctree_prefix_item {
+	le16_t shared;
+	le16_t unshared;
+	le32_t value_size;
+} __attribute__((packed));
+
+struct myfs_ctree_prefix_item {
+	uint16_t shared;
+	uint16_t unshared;
+	uint32_t value_size;
+};
+
+
+static inline void myfs_ctree_prefix_item2disk(
+			struct __myfs_ctree_prefix_item *disk,
+			const struct myfs_ctree_prefix_item *mem)
+{
+	disk->shared = htole16(mem->shared);
+	disk->unshared = htole16(mem->unshared);
+	disk->value_size = htole32(mem->value_size);
+}
+
+static inline void myfs_ctree_prefix_item2mem(
+			struct myfs_ctree_prefix_item *mem,
+			const struct __myfs_ctree_prefix_item *disk)
+{
+	mem->shared = le16toh(disk->shared);
+	mem->unshared = le16toh(disk->unshared);
+	mem->value_size = le32toh(disk->value_size);
+}
+
+
 struct __myfs_ctree_node_sb {
 	le32_t items;
 	le32_t size;
+	le16_t format;
+	le16_t restarts;
 } __attribute__((packed));
 
 struct myfs_ctree_node_sb {
 	uint32_t items;
 	uint32_t size;
+	uint16_t format;
+	uint16_t restarts;
 };
 
 
@@ -68,6 +131,8 @@ static inline void myfs_ctree_node_sb2disk(struct __myfs_ctree_node_sb *disk,
 {
 	disk->items = htole32(mem->items);
 	disk->size = htole32(mem->size);
+	disk->format = htole16(mem->format);
+	disk->restarts = htole16(mem->restarts);
 }
 
 static inline void myfs_ctree_node_sb2mem(struct myfs_ctree_node_sb *mem,
@@ -75,6 +140,8 @@ static inline void myfs_ctree_node_sb2mem(struct myfs_ctree_node_sb *mem,
 {
 	mem->items = le32toh(disk->items);
 	mem->size = le32toh(disk->size);
+	mem->format = le16toh(disk->format);
+	mem->restarts = le16toh(disk->restarts);
 }
 
 
@@ -82,12 +149,23 @@ struct __myfs_ctree_sb {
 	struct __myfs_ptr root;
 	le32_t size;
 	le32_t hight;
+	le16_t fanout;
+	le16_t node_pages;
 } __attribute__((packed));
 
+struct myfs_ctree_pin;
+
 struct myfs_ctree_sb {
 	struct myfs_ptr root;
 	uint64_t size;
 	uint32_t hight;
+	/* parameters the tree was built with, even an empty tree keeps
+	   them, so maps created empty remember them too */
+	uint16_t fanout;
+	uint16_t node_pages;
+
+	/* in memory non-leaf nodes of the tree, NULL if not pinned */
+	struct myfs_ctree_pin *pin;
 };
 
 static inline void myfs_ctree_sb2disk(struct __myfs_ctree_sb *disk,
@@ -96,6 +174,8 @@ static inline void myfs_ctree_sb2disk(struct __myfs_ctree_sb *disk,
 	myfs_ptr2disk(&disk->root, &mem->root);
 	disk->hight = htole32(mem->hight);
 	disk->size = htole64(mem->size);
+	disk->fanout = htole16(mem->fanout);
+	disk->node_pages = htole16(mem->node_pages);
 }
 
 static inline void myfs_ctree_sb2mem(struct myfs_ctree_sb *mem,
@@ -104,18 +184,67 @@ static inline void myfs_ctree_sb2mem(struct myfs_ctree_sb *mem,
 	myfs_ptr2mem(&mem->root, &disk->root);
 	mem->hight = le32toh(disk->hight);
 	mem->size = le64toh(disk->size);
+	mem->fanout = le16toh(disk->fanout);
+	mem->node_pages = le16toh(disk->node_pages);
+	mem->pin = NULL;
 }
 
 
 struct myfs_ctree_node {
 	struct myfs_ptr ptr;
 	struct myfs_ctree_node_sb sb;
-
-	size_t buf_sz;
+	/* prefix nodes only: the first item of the decoded interval,
+	   UINT32_MAX if none is */
+	uint32_t first;
+	/* the buffers belong to a pinned node, this one only refers them */
+	int pinned;
+	/* prefix nodes only: size of kbuf */
+	uint32_t kcap;
+
+	/* a node cache buffer (myfs_ncache_alloc), it may be shared with
+	   the cache and other readers and isn't changed once it's read */
 	void *buf;
 
+	/* items of plain and pinned nodes, the decoded interval between two
+	   restart points of other prefix nodes (MYFS_CTREE_RESTART items) */
 	struct myfs_key *key;
 	struct myfs_value *value;
+
+	/* prefix nodes only: storage for the keys restored from their
+	   prefixes */
+	void *kbuf;
+
+	/* compressed nodes only: the node as stored on disk */
+	void *zbuf;
+};
+
+/* Non-leaf nodes of a tree are read once when the tree is installed and
+   shared by all readers until the last reference to the tree is gone,
+   so a lookup reads only the leaf from disk. Nodes are sorted by their
+   position on disk. */
+struct myfs_ctree_pin {
+	_Atomic unsigned long refcnt;
+
+	size_t size;
+	struct myfs_ctree_node *node;
+};
+
+/* Leaves an iterator reads ahead: when the iterator steps into the last
+   leaf read ahead it submits a read of the next window of leaves, which
+   may span several parents, and waits for it only when it needs the next
+   leaf. The read runs on the bdev queue, if there is one. The window
+   doubles every time it's consumed and is reset by a seek. */
+struct myfs_ctree_ra {
+	struct bio bio;
+	int pending;
+
+	size_t window;
+	size_t size;
+	struct myfs_ptr ptr[MYFS_CTREE_RA_MAX];
+	size_t offs[MYFS_CTREE_RA_MAX];
+
+	void *buf;
+	size_t cap;
 };
 
 struct myfs_ctree_it {
@@ -125,6 +254,9 @@ struct myfs_ctree_it {
 
 	struct myfs_key key;
 	struct myfs_value value;
+
+	/* allocated when the iterator leaves its first leaf */
+	struct myfs_ctree_ra *ra;
 };
 
 
@@ -135,15 +267,31 @@ int myfs_ctree_it_reset(struct myfs *myfs, struct myfs_ctree_it *it);
 int myfs_ctree_it_find(struct myfs *myfs, struct myfs_ctree_it *it,
 			struct myfs_query *query);
 int myfs_ctree_it_next(struct myfs *myfs, struct myfs_ctree_it *it);
+/* Steps back to the previous item, an iterator past the last item steps
+   back to it and stepping back from the first item invalidates it. */
+int myfs_ctree_it_prev(struct myfs *myfs, struct myfs_ctree_it *it);
 int myfs_ctree_it_valid(const struct myfs_ctree_it *it);
 
 
 struct myfs_query;
+struct myfs_lz;
 
 int myfs_ctree_lookup(struct myfs *myfs, const struct myfs_ctree_sb *sb,
 			struct myfs_query *query); 
 int myfs_ctree_range(struct myfs *myfs, const struct myfs_ctree_sb *sb,
 			struct myfs_query *query);
+/* Looks up size queries ordered by their keys with a single iterator, so
+   queries that land in the same leaf share the node reads. Stops at the
+   first non zero emit result and returns it. */
+int myfs_ctree_multi_lookup(struct myfs *myfs, const struct myfs_ctree_sb *sb,
+			struct myfs_query **query, size_t size);
+
+/* Reads all non-leaf nodes of the tree into sb->pin holding a single
+   reference, if it fails the tree stays unpinned and is read from disk.
+   Pinned nodes are checksummed even if the node cache checks lazily. */
+void myfs_ctree_pin(struct myfs *myfs, struct myfs_ctree_sb *sb);
+void myfs_ctree_pin_get(struct myfs_ctree_pin *pin);
+void myfs_ctree_pin_put(struct myfs_ctree_pin *pin);
 
 
 struct myfs_ctree_buffer {
@@ -157,8 +305,18 @@ struct myfs_ctree_buffer {
 
 	size_t value_offs;
 	size_t value_size;
+
+	size_t restarts;
+	/* bytes to be appended after the last item */
+	size_t trailer;
+
+	/* compressed node position and size in the level zbuf */
+	size_t zoffs;
+	size_t zsize;
 };
 
+struct myfs_ctree_flush;
+
 struct myfs_ctree_level {
 	struct myfs_ctree_buffer *node;
 	size_t size;
@@ -167,11 +325,90 @@ struct myfs_ctree_level {
 	size_t buf_size;
 	size_t buf_cap;
 	void *buf;
+
+	/* copy of the last key appended to the level */
+	size_t key_size;
+	size_t key_cap;
+	void *key;
+
+	/* last keys of the nodes in buf, separators for the parent level */
+	size_t keys_size;
+	size_t keys_cap;
+	void *keys;
+
+	/* offsets stored after the last item of the last node: restart
+	   points of a prefix node or every item of an indexed node */
+	uint32_t *restart;
+	size_t restart_cap;
+
+	/* keys of the last fixed node */
+	le64_t *fixed;
+	size_t fixed_cap;
+
+	/* compressed nodes packed densely one after another */
+	size_t zbuf_size;
+	size_t zbuf_cap;
+	void *zbuf;
+
+	/* the previous buffer of the level being written out */
+	struct myfs_ctree_flush *flush;
+};
+
+/* Full level buffers are handed to the writer thread of the builder
+   that compresses, checksums and writes them, while the builder fills
+   the next buffer. Pointers to the written nodes go to the parent level
+   when the level is flushed the next time or when the tree is finished. */
+struct myfs_ctree_flush {
+	struct myfs_ctree_flush *next;
+	/* the builder handed the buffer out and didn't take the results */
+	int busy;
+	/* the buffer is written, guarded by the writer mutex */
+	int written;
+
+	struct myfs *myfs;
+	int prio;
+	int compress;
+	struct myfs_lz *lz;
+
+	/* nodes, keys and data of the buffer being written */
+	struct myfs_ctree_level level;
+
+	/* results: pointers to the nodes and pages written */
+	struct myfs_ptr *ptr;
+	size_t ptr_cap;
+	uint64_t pages;
+	int err;
+};
+
+/* a single thread per builder writes the buffers of all levels in the
+   order they were flushed, it's started by the first flush */
+struct myfs_ctree_writer {
+	pthread_t thread;
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+	struct myfs_ctree_flush *head;
+	struct myfs_ctree_flush **tail;
+	int done;
 };
 
 struct myfs_ctree_builder {
 	struct myfs_ctree_sb sb;
 	struct myfs_ctree_level level[MYFS_MAX_CTREE_HIGHT + 1];
+	struct myfs_ctree_writer *writer;
+
+	/* I/O priority class (BIO_PRIO_*) used to write the tree, if io_prio
+	   is set it picks the class again before every level write */
+	int prio;
+	int (*io_prio)(void *arg);
+	void *io_prio_arg;
+	/* node format (MYFS_CTREE_*) */
+	int format;
+	/* compress nodes before writing them */
+	int compress;
+	/* a node is finished when it has at least fanout items and the
+	   next item doesn't fit into node_pages pages */
+	size_t fanout;
+	size_t node_pages;
 };
 
 
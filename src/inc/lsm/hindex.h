@@ -0,0 +1,76 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __HINDEX_H__
+#define __HINDEX_H__
+
+#include <misc/arena.h>
+#include <types.h>
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stddef.h>
+
+
+#define MYFS_HINDEX_MIN_BITS	10
+
+
+/* there is exactly one slot per key, all tables point to the same slot */
+struct myfs_hindex_slot {
+	const struct myfs_key *key;
+	void * _Atomic value;
+};
+
+/* hash is never 0 in a used cell */
+struct myfs_hindex_cell {
+	uint64_t _Atomic hash;
+	struct myfs_hindex_slot * _Atomic slot;
+};
+
+struct myfs_hindex_table {
+	size_t mask;
+	struct myfs_hindex_cell cell[];
+};
+
+/* Insert only open addressing hash table from exact keys to values,
+   lookups are lock free. When the table is half full it's replaced with
+   a twice larger one, lookups that still use the old table see the same
+   slots. Memory is allocated from the arena of the owner, so it lives as
+   long as the indexed memtable. */
+struct myfs_hindex {
+	struct myfs_hindex_table * _Atomic table;
+	size_t _Atomic size;
+	/* inserts hold it shared, table growth exclusive */
+	pthread_rwlock_t lock;
+};
+
+
+void myfs_hindex_setup(struct myfs_hindex *index, struct myfs_arena *arena);
+void myfs_hindex_release(struct myfs_hindex *index);
+
+/* Inserts of the same key must be serialized by the caller, the key must
+   stay valid while the index is used. */
+void myfs_hindex_insert(struct myfs_hindex *index, struct myfs_arena *arena,
+			const struct myfs_key *key, void *value);
+/* Adds the key unless it's already there, returns the value the key
+   already has or NULL if the key was added. Adds of the same key may run
+   concurrently, exactly one of them adds the key. */
+void *myfs_hindex_add(struct myfs_hindex *index, struct myfs_arena *arena,
+			const struct myfs_key *key, void *value);
+void *myfs_hindex_lookup(struct myfs_hindex *index,
+			const struct myfs_key *key);
+
+#endif /*__HINDEX_H__*/
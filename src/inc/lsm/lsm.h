@@ -20,13 +20,17 @@
 #include <types.h>
 #include <lsm/ctree.h>
 
+#include <stdatomic.h>
 #include <pthread.h>
 
 
 #define MYFS_MAX_TREES	4
-#define MYFS_MTREE_SIZE 32768
+/* default memory budget of the memtable of a single LSM tree in bytes */
+#define MYFS_MTREE_BYTES	(4ul << 20)
 #define MYFS_C0_SIZE	2097152
 #define MYFS_CX_MULT	4		
+/* level 0 is considered backlogged when it exceeds C0 size this many times */
+#define MYFS_C0_BACKLOG	2
 
 
 struct __myfs_lsm_sb {
@@ -56,17 +60,43 @@ static inline void myfs_lsm_sb2mem(struct myfs_lsm_sb *mem,
 struct myfs_mtree {
 	int (*insert)(struct myfs_mtree *, const struct myfs_key *,
 				const struct myfs_value *);
+	/* optional, inserts of sorted arrays of keys and values */
+	int (*insert_batch)(struct myfs_mtree *, const struct myfs_key *,
+				const struct myfs_value *, size_t);
 
 	int (*lookup)(struct myfs_mtree *, struct myfs_query *);
 	int (*range)(struct myfs_mtree *, struct myfs_query *);
 	int (*scan)(struct myfs_mtree *, struct myfs_query *);
 
 	size_t (*size)(const struct myfs_mtree *);
+	/* memory used by the entries in bytes */
+	size_t (*bytes)(const struct myfs_mtree *);
+
+	/* the LSM tree and every read view that contains the memtable
+	   hold a reference, the last one destroys it */
+	_Atomic unsigned long refcnt;
 };
 
 
 struct myfs_lsm;
 
+/* Read view: both memtables and all ctree roots taken at the same time.
+   The view pins the memtables and keeps the trees from being replaced
+   under the reader, blocks of a tree may be reclaimed only once no view
+   refers to it. c0 of a view may still receive new inserts. */
+struct myfs_lsm_view {
+	_Atomic unsigned long refcnt;
+
+	struct myfs_mtree *c0;
+	struct myfs_mtree *c1;
+	struct myfs_ctree_sb tree[MYFS_MAX_TREES];
+
+	/* a replaced view waits on the retired list until readers that
+	   entered at epoch or before are gone */
+	struct myfs_lsm_view *next;
+	uint64_t epoch;
+};
+
 struct myfs_lsm_policy {
 	struct myfs_mtree *(*create)(struct myfs_lsm *);
 	void (*destroy)(struct myfs_lsm *, struct myfs_mtree *);
@@ -75,21 +105,35 @@ struct myfs_lsm_policy {
 				struct myfs_mtree *,
 				const struct myfs_ctree_sb *,
 				struct myfs_ctree_sb *);
-	int (*merge)(struct myfs_lsm *, int drop_deleted,
+	int (*merge)(struct myfs_lsm *, size_t level, int drop_deleted,
 					const struct myfs_ctree_sb *,
 					const struct myfs_ctree_sb *,
 					struct myfs_ctree_sb *);
 
 	int (*insert)(struct myfs_lsm *, const struct myfs_key *,
 				const struct myfs_value *);
+	int (*insert_batch)(struct myfs_lsm *, const struct myfs_key *,
+				const struct myfs_value *, size_t);
 	int (*lookup)(struct myfs_lsm *, struct myfs_query *);
+	int (*multi_get)(struct myfs_lsm *, struct myfs_query **, int *,
+				size_t);
 	int (*range)(struct myfs_lsm *, struct myfs_query *);
 };
 
 
+/* keys have long common prefixes, use prefix compressed ctree nodes */
+#define MYFS_KEY_PREFIX		(1ul << 0)
+/* keys are 8 byte little endian integers ordered as numbers, enables
+   fixed key ctree nodes and integer comparisons */
+#define MYFS_KEY_LE64		(1ul << 1)
+/* keys are equal only if their bytes are equal, exact lookups that
+   provide query->key may use a hash index */
+#define MYFS_KEY_HASH		(1ul << 2)
+
 struct myfs_key_ops {
 	myfs_cmp_t cmp;
 	myfs_del_t deleted;
+	unsigned long flags;
 };
 
 
@@ -104,6 +148,23 @@ struct myfs_lsm {
 
 	struct myfs_mtree *c0;
 	struct myfs_mtree *c1;
+	/* c0 is flushed when it takes more than budget bytes */
+	size_t budget;
+	/* ctree builder parameters, taken from the existing trees or the
+	   mount defaults */
+	size_t fanout;
+	size_t node_pages;
+
+	/* the latest read view, replaced under sblock held for write every
+	   time c0, c1 or the ctree roots change; lookups read it inside an
+	   epoch read section without taking any locks */
+	struct myfs_lsm_view * _Atomic view;
+	/* replaced views, guarded by retire_mtx; the flush or merge that
+	   replaced a view drops it once readers are gone, readers never
+	   touch the list */
+	struct myfs_lsm_view *retired;
+	_Atomic size_t nretired;
+	pthread_mutex_t retire_mtx;
 
 	pthread_rwlock_t sblock;
 	pthread_rwlock_t mtlock;
@@ -116,17 +177,22 @@ struct myfs_lsm {
 
 
 extern const struct myfs_lsm_policy myfs_lsm_default_policy;
+/* the same as default, but c0 is a B+tree instead of a skiplist */
+extern const struct myfs_lsm_policy myfs_lsm_btree_policy;
 
 
 struct myfs_mtree *myfs_lsm_create_default(struct myfs_lsm *lsm);
 void myfs_lsm_destroy_default(struct myfs_lsm *lsm, struct myfs_mtree *mtree);
+struct myfs_mtree *myfs_lsm_create_btree(struct myfs_lsm *lsm);
+void myfs_lsm_destroy_btree(struct myfs_lsm *lsm, struct myfs_mtree *mtree);
 
 
 int myfs_lsm_flush_default(struct myfs_lsm *lsm, int drop_deleted,
 			struct myfs_mtree *new,
 			const struct myfs_ctree_sb *old,
 			struct myfs_ctree_sb *sb);
-int myfs_lsm_merge_default(struct myfs_lsm *lsm, int drop_deleted,
+int myfs_lsm_merge_default(struct myfs_lsm *lsm, size_t level,
+			int drop_deleted,
 			const struct myfs_ctree_sb *new,
 			const struct myfs_ctree_sb *old,
 			struct myfs_ctree_sb *sb);
@@ -134,7 +200,12 @@ int myfs_lsm_merge_default(struct myfs_lsm *lsm, int drop_deleted,
 
 int myfs_lsm_insert_default(struct myfs_lsm *lsm, const struct myfs_key *key,
 			const struct myfs_value *value);
+int myfs_lsm_insert_batch_default(struct myfs_lsm *lsm,
+			const struct myfs_key *key,
+			const struct myfs_value *value, size_t size);
 int myfs_lsm_lookup_default(struct myfs_lsm *lsm, struct myfs_query *query);
+int myfs_lsm_multi_get_default(struct myfs_lsm *lsm, struct myfs_query **query,
+			int *ret, size_t size);
 int myfs_lsm_range_default(struct myfs_lsm *lsm, struct myfs_query *query);
 
 
@@ -148,10 +219,90 @@ void myfs_lsm_get_root(struct myfs_lsm_sb *sb, struct myfs_lsm *lsm);
 
 int myfs_lsm_insert(struct myfs_lsm *lsm, const struct myfs_key *key,
 			const struct myfs_value *value);
+/* Inserts size keys and values at once, if a key repeats the last value
+   wins. The memtable lock is taken once for the whole batch. */
+int myfs_lsm_insert_batch(struct myfs_lsm *lsm, const struct myfs_key *key,
+			const struct myfs_value *value, size_t size);
 int myfs_lsm_lookup(struct myfs_lsm *lsm, struct myfs_query *query);
+/* Looks up size queries ordered by their keys, ret[i] gets what lookup
+   would return for query[i]. Each level is searched once for all the
+   queries not found yet, so keys in the same ctree leaf share the read.
+   Returns 0 or the first I/O error. */
+int myfs_lsm_multi_get(struct myfs_lsm *lsm, struct myfs_query **query,
+			int *ret, size_t size);
 int myfs_lsm_range(struct myfs_lsm *lsm, struct myfs_query *query);
 
 
+/* A reader that makes many queries (e.g. a long scan) may take a view
+   once and run all of them against the same state of the tree. */
+struct myfs_lsm_view *myfs_lsm_view_get(struct myfs_lsm *lsm);
+void myfs_lsm_view_put(struct myfs_lsm *lsm, struct myfs_lsm_view *view);
+int myfs_lsm_view_lookup(struct myfs_lsm *lsm, struct myfs_lsm_view *view,
+			struct myfs_query *query);
+int myfs_lsm_view_range(struct myfs_lsm *lsm, struct myfs_lsm_view *view,
+			struct myfs_query *query);
+
+
+struct myfs_item {
+	size_t item_offs;
+	size_t key_size;
+	size_t value_size;
+};
+
+/* copies of memtable entries packed into a single buffer */
+struct myfs_items {
+	void *buf;
+	size_t buf_size, buf_cap;
+
+	struct myfs_item *item;
+	size_t size, cap;
+};
+
+/* Cursor over a read view of the tree, it can be moved both ways and
+   kept between calls without searching the trees again. Entries of the
+   memtables in the range are copied when the cursor is set up, so
+   inserts made later aren't visible through it. Deleted entries and old
+   versions of a key are skipped. */
+struct myfs_lsm_cursor {
+	struct myfs_lsm *lsm;
+	struct myfs_lsm_view *view;
+	/* the cursor doesn't leave keys the query considers equal, NULL
+	   for the whole tree */
+	struct myfs_query *range;
+
+	struct myfs_items m[2];
+	size_t mpos[2];
+	struct myfs_ctree_it it[MYFS_MAX_TREES];
+
+	/* direction of the last move, 1 or -1 */
+	int dir;
+	/* source of the current entry: memtables first, then the trees,
+	   -1 if the cursor isn't at an entry */
+	int index;
+	struct myfs_key key;
+	struct myfs_value value;
+};
+
+/* range must stay alive while the cursor is used */
+int myfs_lsm_cursor_setup(struct myfs_lsm_cursor *cur, struct myfs_lsm *lsm,
+			struct myfs_query *range);
+void myfs_lsm_cursor_release(struct myfs_lsm_cursor *cur);
+/* Moves to the first entry not less than the query (the first entry of
+   the range if query is NULL) or to the last entry. These and next/prev
+   return 1 if the cursor is at an entry, 0 if it ran out of entries
+   (only a seek makes it valid again) or a negative error. */
+int myfs_lsm_cursor_seek(struct myfs_lsm_cursor *cur, struct myfs_query *query);
+int myfs_lsm_cursor_last(struct myfs_lsm_cursor *cur);
+int myfs_lsm_cursor_next(struct myfs_lsm_cursor *cur);
+int myfs_lsm_cursor_prev(struct myfs_lsm_cursor *cur);
+int myfs_lsm_cursor_valid(const struct myfs_lsm_cursor *cur);
+/* valid until the cursor moves */
+const struct myfs_key *myfs_lsm_cursor_key(const struct myfs_lsm_cursor *cur);
+const struct myfs_value *myfs_lsm_cursor_value(
+			const struct myfs_lsm_cursor *cur);
+
+
+size_t myfs_lsm_bytes(struct myfs_lsm *lsm, size_t *c0);
 int myfs_lsm_need_flush(struct myfs_lsm *lsm);
 int myfs_lsm_need_merge(struct myfs_lsm *lsm, size_t i);
 
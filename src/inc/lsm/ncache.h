@@ -0,0 +1,140 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __NCACHE_H__
+#define __NCACHE_H__
+
+#include <misc/list.h>
+#include <types.h>
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stddef.h>
+
+
+/* default size of the node cache of a mount in bytes */
+#define MYFS_NCACHE_SIZE	(32ul << 20)
+/* the cache is split by node pointers, every shard has a lock */
+#define MYFS_NCACHE_SHARD_BITS	4
+#define MYFS_NCACHE_SHARDS	(1ul << MYFS_NCACHE_SHARD_BITS)
+
+#define MYFS_NCACHE_VERIFIED	0
+#define MYFS_NCACHE_UNVERIFIED	1
+#define MYFS_NCACHE_BAD		2
+
+
+struct myfs_ncache_node {
+	/* must be the first member, nodes are taken from the lru by cast */
+	struct list_head lru;
+	struct myfs_ncache_node *next;
+	struct myfs_ncache_node *vnext;
+	_Atomic unsigned long refcnt;
+
+	struct myfs_ptr ptr;
+	/* MYFS_NCACHE_*, protected by the mutex of the shard */
+	int state;
+
+	/* compressed nodes only: data the checksum covers, kept until the
+	   node is verified */
+	void *raw;
+
+	/* the node as it's decoded from, readers refer to it directly */
+	size_t size;
+	_Alignas(16) char data[];
+};
+
+/* Ctree nodes read from disk, decompressed, keyed by their pointers.
+   A node is checksummed once when it's read from disk and readers of
+   the same node later take a reference to the cached buffer without
+   reading, copying and checking it again. Readers read nodes into
+   buffers of the same kind and the cache takes over the buffer itself,
+   an evicted buffer is freed once the last reader puts it. With lazy verification nodes are cached before
+   they are checksummed and a background thread checks them, readers
+   may get a corrupted node before the check finds it, after that they
+   get -EIO. A cache without size is disabled.
+
+   Nodes are spread over MYFS_NCACHE_SHARDS shards by their pointers,
+   a shard has its own lock, buckets and lru and holds cap / shards
+   bytes, so readers of different nodes rarely wait for each other. */
+struct myfs_ncache_shard {
+	_Alignas(64) pthread_mutex_t mtx;
+	struct myfs_ncache_node **head;
+	struct list_head lru;
+	size_t size;
+	size_t cap;
+
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long errors;
+};
+
+struct myfs_ncache {
+	struct myfs *myfs;
+
+	struct myfs_ncache_shard *shard;
+	/* buckets of a shard */
+	size_t bits;
+	size_t cap;
+
+	/* lazy verification: queue of unverified nodes (guarded by mtx)
+	   and the thread checking them */
+	int lazy;
+	pthread_mutex_t mtx;
+	struct myfs_ncache_node *vhead;
+	struct myfs_ncache_node **vtail;
+	pthread_cond_t cv;
+	pthread_t thread;
+	int done;
+};
+
+
+void myfs_ncache_setup(struct myfs_ncache *cache, struct myfs *myfs,
+			size_t cap, int lazy);
+void myfs_ncache_release(struct myfs_ncache *cache);
+
+struct myfs_ncache_stats {
+	size_t size;
+	size_t cap;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long errors;
+};
+
+/* sums the counters of all shards */
+void myfs_ncache_stats(struct myfs_ncache *cache,
+			struct myfs_ncache_stats *stats);
+
+/* Returns 1 if a node of size bytes is cached before it's checked, nodes
+   that don't fit in the cache must be checked when they are read. */
+int myfs_ncache_lazy(const struct myfs_ncache *cache, size_t size);
+/* A node buffer of size bytes with a reference to it, the buffer is
+   freed when the last reference is put. */
+void *myfs_ncache_alloc(size_t size);
+void myfs_ncache_put(void *buf);
+/* Takes a reference to the buffer of the cached node, of size bytes at
+   least, into *buf. Returns 0 if the node is cached, 1 if it's cached
+   but not checked yet, -ENOENT if it isn't cached and -EIO if it failed
+   the check. */
+int myfs_ncache_get(struct myfs_ncache *cache, const struct myfs_ptr *ptr,
+			size_t size, void **buf);
+/* Caches a node read from disk into buf, a buffer of myfs_ncache_alloc,
+   the caller keeps its reference. An unverified node is checked later
+   against raw (ptr->csize bytes) if it's compressed or against buf
+   otherwise. */
+void myfs_ncache_insert(struct myfs_ncache *cache, const struct myfs_ptr *ptr,
+			void *buf, const void *raw, int verified);
+
+#endif /*__NCACHE_H__*/
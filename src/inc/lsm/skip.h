@@ -17,15 +17,30 @@
 #ifndef __SKIP_LIST_H__
 #define __SKIP_LIST_H__
 
+#include <lsm/hindex.h>
 #include <lsm/lsm.h>
+#include <misc/arena.h>
 
 
 #define MYFS_MAX_MTREE_HIGHT	20
+/* replaced entries up to 1KB are reused, a free list per 16 bytes */
+#define MYFS_SKIP_ALIGN		16
+#define MYFS_SKIP_CLASSES	64
 
 
-struct myfs_skip_node {
+/* key and value of a node, in place updates replace the whole entry */
+struct myfs_skip_entry {
 	struct myfs_key key;
 	struct myfs_value value;
+	/* a replaced entry waits in a free list until no reader can see it,
+	   entries embedded in nodes have no size and are never reused */
+	struct myfs_skip_entry *next;
+	uint64_t epoch;
+	size_t size;
+};
+
+struct myfs_skip_node {
+	struct myfs_skip_entry * _Atomic entry;
 	size_t seq;
 	struct myfs_skip_node * _Atomic next[1];
 };
@@ -34,19 +49,47 @@ struct myfs_skiplist {
 	struct myfs_mtree mtree;
 	struct myfs_skip_node *head;
 	size_t _Atomic size;
+	size_t _Atomic seq;
 	int (*cmp)(const struct myfs_key *, const struct myfs_key *);
+	/* keys are le64 integers, compare them directly (MYFS_KEY_LE64) */
+	int le64;
+	/* an insert of an existing key replaces the entry of the node instead
+	   of adding a newer node, readers and writers of the list run in
+	   epoch read sections, so a replaced entry is reused only when no
+	   one can see it anymore */
+	int inplace;
+	/* exact lookups go to the hash index of nodes (MYFS_KEY_HASH), the
+	   index decides which node owns a key, so it implies inplace */
+	int hash;
+	struct myfs_hindex index;
+	/* all nodes are allocated here and freed together with the list */
+	struct myfs_arena arena;
+	/* replaced entries by size, oldest first, guarded by free_mtx */
+	struct myfs_skip_entry *free[MYFS_SKIP_CLASSES];
+	struct myfs_skip_entry *free_tail[MYFS_SKIP_CLASSES];
+	size_t _Atomic free_bytes;
+	pthread_mutex_t free_mtx;
 };
 
 
-void myfs_skiplist_setup(struct myfs_skiplist *sl, myfs_cmp_t cmp);
+/* flags are MYFS_KEY_* flags of the keys stored in the list */
+void myfs_skiplist_setup(struct myfs_skiplist *sl, myfs_cmp_t cmp,
+			unsigned long flags);
 void myfs_skiplist_release(struct myfs_skiplist *sl);
 
 
 int myfs_skip_insert(struct myfs_skiplist *skip, const struct myfs_key *key,
 			const struct myfs_value *value);
+/* sorted batches are inserted with a finger search that starts from the
+   place of the previous key instead of the head */
+int myfs_skip_insert_batch(struct myfs_skiplist *skip,
+			const struct myfs_key *key,
+			const struct myfs_value *value, size_t size);
 int myfs_skip_lookup(struct myfs_skiplist *skip, struct myfs_query *query);
 int myfs_skip_range(struct myfs_skiplist *skip, struct myfs_query *query);
 int myfs_skip_scan(struct myfs_skiplist *skip, struct myfs_query *query);
 size_t myfs_skip_size(const struct myfs_skiplist *skip);
+/* memory taken by the list less the replaced entries waiting for reuse */
+size_t myfs_skip_bytes(const struct myfs_skiplist *skip);
 
 #endif /*__SKIP_LIST_H__*/
@@ -0,0 +1,58 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <pthread.h>
+
+
+#define MYFS_ARENA_CHUNK	((size_t)1024 * 1024)
+
+
+struct myfs_arena_chunk {
+	struct myfs_arena_chunk *next;
+	size_t size;
+	size_t _Atomic offs;
+	_Alignas(max_align_t) char data[];
+};
+
+/* Bump pointer allocator: memory is allocated from large zeroed chunks
+   without locks and is freed all at once when the arena is released. */
+struct myfs_arena {
+	struct myfs_arena_chunk * _Atomic chunk;
+	/* all chunks, guarded by mtx */
+	struct myfs_arena_chunk *chunks;
+	pthread_mutex_t mtx;
+
+	size_t _Atomic used;
+	size_t _Atomic size;
+};
+
+
+void myfs_arena_setup(struct myfs_arena *arena);
+void myfs_arena_release(struct myfs_arena *arena);
+
+/* Returns zeroed memory suitably aligned for any object. */
+void *myfs_arena_alloc(struct myfs_arena *arena, size_t size);
+
+/* bytes handed out and bytes allocated for chunks respectively */
+size_t myfs_arena_used(const struct myfs_arena *arena);
+size_t myfs_arena_size(const struct myfs_arena *arena);
+
+#endif /*__ARENA_H__*/
@@ -0,0 +1,47 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __CSUM_H__
+#define __CSUM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/* checksum algorithms, a file system uses one of them for everything it
+   checksums: ctree nodes, checkpoints and log records */
+#define MYFS_CSUM_XXH64		0
+#define MYFS_CSUM_XXH3		1
+#define MYFS_CSUM_CRC32C	2
+
+typedef uint64_t (*myfs_csum_t)(const void *buf, size_t size, uint64_t seed);
+
+
+/* Returns the fastest implementation of the algorithm the CPU supports,
+   all implementations of an algorithm return the same values. */
+myfs_csum_t myfs_csum_select(int algo);
+
+uint64_t myfs_xxh64(const void *buf, size_t size, uint64_t seed);
+uint64_t myfs_xxh3(const void *buf, size_t size, uint64_t seed);
+/* CRC32C (Castagnoli) of the data, the seed is the initial CRC */
+uint64_t myfs_crc32c(const void *buf, size_t size, uint64_t seed);
+
+#if defined(__x86_64__) || defined(__i386__)
+uint64_t myfs_xxh3_avx2(const void *buf, size_t size, uint64_t seed);
+uint64_t myfs_crc32c_sse42(const void *buf, size_t size, uint64_t seed);
+#endif
+
+#endif /*__CSUM_H__*/
@@ -0,0 +1,40 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include <stdint.h>
+
+
+/* threads that take a slot of their own, the rest share a slot guarded
+   by a mutex */
+#define MYFS_EPOCH_SLOTS	256
+
+
+/* Epoch based reclamation. A reader brackets its accesses to shared
+   objects with enter/exit, that only writes to a slot owned by the
+   thread. A writer unpublishes an object, takes the epoch returned by
+   myfs_epoch_advance and may free the object once myfs_epoch_safe says
+   that no reader could still see it. Read sections may nest. */
+void myfs_epoch_enter(void);
+void myfs_epoch_exit(void);
+
+uint64_t myfs_epoch_advance(void);
+int myfs_epoch_safe(uint64_t epoch);
+void myfs_epoch_wait(uint64_t epoch);
+
+#endif /*__EPOCH_H__*/
@@ -0,0 +1,44 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/* Simple LZ77 block compressor, the block format follows LZ4: a sequence
+   of (literals, match) pairs, each starts with a token byte holding the
+   literal length and the match length in its high and low nibbles. */
+
+#define MYFS_LZ_HASH_BITS	12
+
+struct myfs_lz {
+	uint32_t table[1 << MYFS_LZ_HASH_BITS];
+};
+
+
+/* Returns the size of the compressed data or 0 if it doesn't fit in cap
+   bytes. */
+size_t myfs_lz_compress(struct myfs_lz *lz, const void *src, size_t size,
+			void *dst, size_t cap);
+
+/* Returns the size of the decompressed data or -EIO if the input is
+   malformed or doesn't fit in cap bytes. */
+long myfs_lz_decompress(const void *src, size_t size, void *dst, size_t cap);
+
+#endif /*__LZ_H__*/
@@ -0,0 +1,28 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SEARCH_H__
+#define __SEARCH_H__
+
+#include <types.h>
+
+
+/* Returns the number of keys in the sorted array of n little endian
+   64 bit keys that are less than key (i.e. the lower bound position).
+   The array doesn't have to be aligned. */
+size_t myfs_search_le64(const void *keys, size_t n, uint64_t key);
+
+#endif /*__SEARCH_H__*/
@@ -25,7 +25,9 @@
 
 #include <endian.h>
 
+#include <lsm/ncache.h>
 #include <lsm/lsm.h>
+#include <misc/csum.h>
 #include <trans/trans.h>
 #include <inode.h>
 #include <types.h>
@@ -34,6 +36,24 @@
 #define MYFS_FS_MAGIC	0x13131313ul
 #define MYFS_FS_ROOT	1
 #define MYFS_FS_NAMEMAX	256
+/* default memory budget of all memtables of a mount in bytes */
+#define MYFS_MEM_BUDGET	(8ul << 20)
+
+/* on-disk features, unknown features prevent mount */
+#define MYFS_FEATURE_COMPRESS	(1ul << 0)	/* compressed ctree nodes */
+/* checksum algorithm, XXH64 if none is set */
+#define MYFS_FEATURE_XXH3	(1ul << 1)
+#define MYFS_FEATURE_CRC32C	(1ul << 2)
+/* dentries are also indexed by (parent, inode), readdir uses the index */
+#define MYFS_FEATURE_DINDEX	(1ul << 3)
+#define MYFS_FEATURES		(MYFS_FEATURE_COMPRESS | \
+				MYFS_FEATURE_XXH3 | MYFS_FEATURE_CRC32C | \
+				MYFS_FEATURE_DINDEX)
+
+/* on-disk format version, only the current one can be mounted; the
+   original layout of ctree nodes, pointers, tree superblocks, dentry
+   keys and checkpoints is version 0 */
+#define MYFS_FS_VERSION		1
 
 
 struct __myfs_check {
@@ -43,6 +63,7 @@ struct __myfs_check {
 	struct __myfs_log_sb log_sb;
 	struct __myfs_lsm_sb inode_sb;
 	struct __myfs_lsm_sb dentry_sb;
+	struct __myfs_lsm_sb dindex_sb;
 } __attribute__((packed));
 
 struct myfs_check {
@@ -52,6 +73,7 @@ struct myfs_check {
 	struct myfs_log_sb log_sb;
 	struct myfs_lsm_sb inode_sb;
 	struct myfs_lsm_sb dentry_sb;
+	struct myfs_lsm_sb dindex_sb;
 };
 
 
@@ -64,6 +86,7 @@ static inline void myfs_check2disk(struct __myfs_check *disk,
 	myfs_log_sb2disk(&disk->log_sb, &mem->log_sb);
 	myfs_lsm_sb2disk(&disk->inode_sb, &mem->inode_sb);
 	myfs_lsm_sb2disk(&disk->dentry_sb, &mem->dentry_sb);
+	myfs_lsm_sb2disk(&disk->dindex_sb, &mem->dindex_sb);
 }
 
 static inline void myfs_check2mem(struct myfs_check *mem,
@@ -75,6 +98,7 @@ static inline void myfs_check2mem(struct myfs_check *mem,
 	myfs_log_sb2mem(&mem->log_sb, &disk->log_sb);
 	myfs_lsm_sb2mem(&mem->inode_sb, &disk->inode_sb);
 	myfs_lsm_sb2mem(&mem->dentry_sb, &disk->dentry_sb);
+	myfs_lsm_sb2mem(&mem->dindex_sb, &disk->dindex_sb);
 }
 
 
@@ -85,6 +109,8 @@ struct __myfs_sb {
 	le64_t check_offs;
 	le64_t backup_check_offs;
 	le64_t root;
+	le32_t features;
+	le32_t version;
 } __attribute__((packed));
 
 struct myfs_sb {
@@ -94,6 +120,8 @@ struct myfs_sb {
 	uint64_t check_offs;
 	uint64_t backup_check_offs;
 	uint64_t root;
+	uint32_t features;
+	uint32_t version;
 };
 
 
@@ -106,6 +134,8 @@ static inline void myfs_sb2disk(struct __myfs_sb *disk,
 	disk->check_offs = htole64(mem->check_offs);
 	disk->backup_check_offs = htole64(mem->backup_check_offs);
 	disk->root = htole64(mem->root);
+	disk->features = htole32(mem->features);
+	disk->version = htole32(mem->version);
 }
 
 static inline void myfs_sb2mem(struct myfs_sb *mem,
@@ -117,6 +147,8 @@ static inline void myfs_sb2mem(struct myfs_sb *mem,
 	mem->check_offs = le64toh(disk->check_offs);
 	mem->backup_check_offs = le64toh(disk->backup_check_offs);
 	mem->root = le64toh(disk->root);
+	mem->features = le32toh(disk->features);
+	mem->version = le32toh(disk->version);
 }
 
 
@@ -129,13 +161,28 @@ struct myfs {
 	struct myfs_inode *root;
 
 	struct myfs_lsm dentry_map;
+	/* empty unless the file system has MYFS_FEATURE_DINDEX */
+	struct myfs_lsm dindex_map;
 	struct myfs_lsm inode_map;
 	struct myfs_icache icache;
+	/* verified ctree nodes, ncache_size bytes (MYFS_NCACHE_SIZE if 0)
+	   checked by a background thread if lazy_csum is set */
+	struct myfs_ncache ncache;
+	size_t ncache_size;
+	int lazy_csum;
 
 	uint64_t page_size;
+	/* chosen by myfs_csum_setup, XXH64 if not set */
+	myfs_csum_t csum;
+	/* ctree parameters of maps that don't have trees yet */
 	size_t fanout;
+	size_t node_pages;
 	int verbose;
 
+	/* memory shared by memtables of all the maps in bytes, set by
+	   mount; without it (mkfs) nothing is flushed in the background */
+	size_t mem_budget;
+
 	atomic_uint_least64_t next_ino;
 
 	/* List of transactions waiting to be applied. */
@@ -153,6 +200,8 @@ struct myfs {
 
 	pthread_t trans_worker;
 	int done;
+	/* the worker should flush memtables, protected by trans_mtx */
+	int flush;
 };
 
 
@@ -186,9 +235,15 @@ static inline void myfs_stamp2timespec(struct timespec *spec, uint64_t stamp)
 
 uint64_t myfs_now(void);
 
-uint64_t myfs_csum(const void *buf, size_t size);
-uint32_t myfs_hash(const void *buf, size_t size);
+/* picks the checksum implementation for the features of the superblock */
+int myfs_csum_setup(struct myfs *myfs);
+uint64_t myfs_csum(const struct myfs *myfs, const void *buf, size_t size);
+uint64_t myfs_hash(const void *buf, size_t size);
 int myfs_mount(struct myfs *myfs, struct bdev *bdev);
+struct myfs_lsm *myfs_flush_target(struct myfs *myfs);
+/* wakes the worker up to flush if memtables are over the budget */
+void myfs_flush_kick(struct myfs *myfs);
+int myfs_flush_maps(struct myfs *myfs);
 void myfs_unmount(struct myfs *myfs);
 int myfs_checkpoint(struct myfs *myfs);
 
@@ -211,18 +266,37 @@ int myfs_rename(struct myfs *myfs, struct myfs_inode *old, const char *oldname,
 int myfs_link(struct myfs *myfs, struct myfs_inode *inode,
 			struct myfs_inode *dir, const char *newname);
 
+/* emit gets an entry and the cookie that continues readdir after it */
 struct myfs_dentry;
 struct myfs_readdir_ctx {
-	int (*emit)(struct myfs_readdir_ctx *ctx, const struct myfs_dentry *);
+	int (*emit)(struct myfs_readdir_ctx *ctx, const struct myfs_dentry *,
+				uint64_t cookie);
 };
 
 int myfs_readdir(struct myfs *myfs, struct myfs_inode *inode,
 			struct myfs_readdir_ctx *ctx, uint64_t cookie);
+
+/* Directory streams read entries in batches and keep the rest of the
+   batch between readdir calls, a call that continues from the cookie the
+   previous one stopped at mostly doesn't search the directory again. The
+   stream takes over the reference to
+   the inode and puts it when it's released. */
+struct myfs_dir;
+
+int myfs_opendir(struct myfs *myfs, struct myfs_inode *inode,
+			struct myfs_dir **dir);
+int myfs_readdir_stream(struct myfs *myfs, struct myfs_dir *dir,
+			struct myfs_readdir_ctx *ctx, uint64_t cookie);
+void myfs_releasedir(struct myfs *myfs, struct myfs_dir *dir);
 long myfs_read(struct myfs *myfs, struct myfs_inode *inode,
 			void *data, size_t size, off_t off);
 long myfs_write(struct myfs *myfs, struct myfs_inode *inode,
 			const void *data, size_t size, off_t off);
 
+int __myfs_block_write(struct myfs *myfs, const void *buf, uint64_t size,
+			uint64_t offs, int prio);
+int __myfs_block_read(struct myfs *myfs, void *buf, uint64_t size,
+			uint64_t offs, int prio);
 int myfs_block_write(struct myfs *myfs, const void *buf, uint64_t size,
 			uint64_t offs);
 int myfs_block_read(struct myfs *myfs, void *buf, uint64_t size, uint64_t offs);
@@ -64,6 +64,11 @@ struct myfs_query {
 	int (*cmp)(struct myfs_query *, const struct myfs_key *);
 	int (*emit)(struct myfs_query *, const struct myfs_key *,
 				const struct myfs_value *);
+	/* optional, the first key cmp doesn't consider less than the query
+	   is the first key not less than this one; allows searches to
+	   compare keys directly without calling cmp and lookups to find
+	   the key in a hash index */
+	const struct myfs_key *key;
 };
 
 
@@ -73,12 +78,20 @@ struct __myfs_ptr {
 	le64_t offs;
 	le64_t csum;
 	le16_t size;
+	/* compressed data starts skip bytes after the beginning of the page
+	   offs and occupies csize bytes, size is the uncompressed size then;
+	   csize is 0 for data stored as is; images without these fields
+	   are of format version 0 and aren't mounted (MYFS_FS_VERSION) */
+	le32_t skip;
+	le32_t csize;
 } __attribute__((packed));
 
 struct myfs_ptr {
 	uint64_t offs;
 	uint64_t csum;
 	uint16_t size;
+	uint32_t skip;
+	uint32_t csize;
 };
 
 
@@ -88,6 +101,8 @@ static inline void myfs_ptr2disk(struct __myfs_ptr *disk,
 	disk->offs = htole64(mem->offs);
 	disk->csum = htole64(mem->csum);
 	disk->size = htole16(mem->size);
+	disk->skip = htole32(mem->skip);
+	disk->csize = htole32(mem->csize);
 }
 
 static inline void myfs_ptr2mem(struct myfs_ptr *mem,
@@ -96,6 +111,8 @@ static inline void myfs_ptr2mem(struct myfs_ptr *mem,
 	mem->offs = le64toh(disk->offs);
 	mem->csum = le64toh(disk->csum);
 	mem->size = le16toh(disk->size);
+	mem->skip = le32toh(disk->skip);
+	mem->csize = le32toh(disk->csize);
 }
 
 
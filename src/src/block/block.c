@@ -19,6 +19,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -102,6 +103,8 @@ void sync_bdev_setup(struct sync_bdev *bdev, int fd)
 {
 	bdev->bdev.handle = &sync_bdev_handle;
 	bdev->bdev.size = &sync_bdev_size;
+	bdev->bdev.limiter = NULL;
+	bdev->bdev.queue = NULL;
 	bdev->fd = fd;
 }
 
@@ -110,6 +113,198 @@ size_t bdev_size(struct bdev *bdev)
 	return bdev->size(bdev);
 }
 
+void bdev_set_limiter(struct bdev *bdev, struct bio_limiter *limiter)
+{
+	bdev->limiter = limiter;
+}
+
+void bdev_set_queue(struct bdev *bdev, struct bio_queue *queue)
+{
+	bdev->queue = queue;
+}
+
+
+static uint64_t bio_now(void)
+{
+	struct timespec spec;
+
+	assert(!clock_gettime(CLOCK_MONOTONIC, &spec));
+	return (uint64_t)spec.tv_sec * 1000000000ull + spec.tv_nsec;
+}
+
+static void bio_limiter_refill(struct bio_limiter *limiter)
+{
+	const uint64_t now = bio_now();
+	const double elapsed = now - limiter->stamp;
+	const double tokens = limiter->tokens +
+				elapsed * limiter->rate / 1000000000.0;
+
+	limiter->stamp = now;
+	if (tokens > (double)limiter->burst)
+		limiter->tokens = limiter->burst;
+	else
+		limiter->tokens = tokens;
+}
+
+static int bio_limiter_preempted(const struct bio_limiter *limiter, int prio)
+{
+	for (int i = BIO_PRIO_BACKGROUND; i < prio; ++i) {
+		if (limiter->waiting[i])
+			return 1;
+	}
+	return 0;
+}
+
+static void bio_limiter_wait(struct bio_limiter *limiter)
+{
+	/* don't oversleep for too long, rate can be changed meanwhile */
+	const double min_wait = 1000000.0;
+	const double max_wait = 100000000.0;
+	double wait = -limiter->tokens * 1000000000.0 / limiter->rate;
+	struct timespec spec;
+
+	if (wait < min_wait)
+		wait = min_wait;
+	if (wait > max_wait)
+		wait = max_wait;
+
+	assert(!clock_gettime(CLOCK_MONOTONIC, &spec));
+	spec.tv_nsec += (long)wait;
+	spec.tv_sec += spec.tv_nsec / 1000000000l;
+	spec.tv_nsec %= 1000000000l;
+	pthread_cond_timedwait(&limiter->cv, &limiter->mtx, &spec);
+}
+
+void bio_limiter_setup(struct bio_limiter *limiter, uint64_t rate)
+{
+	pthread_condattr_t attr;
+
+	memset(limiter, 0, sizeof(*limiter));
+	assert(!pthread_condattr_init(&attr));
+	assert(!pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+	assert(!pthread_mutex_init(&limiter->mtx, NULL));
+	assert(!pthread_cond_init(&limiter->cv, &attr));
+	assert(!pthread_condattr_destroy(&attr));
+	limiter->stamp = bio_now();
+	bio_limiter_set_rate(limiter, rate);
+}
+
+void bio_limiter_release(struct bio_limiter *limiter)
+{
+	assert(!pthread_mutex_destroy(&limiter->mtx));
+	assert(!pthread_cond_destroy(&limiter->cv));
+}
+
+void bio_limiter_set_rate(struct bio_limiter *limiter, uint64_t rate)
+{
+	/* allow bursts of up to 100ms worth of I/O, but at least 1MB so
+	   that a single ctree level write doesn't always have to wait */
+	const uint64_t min_burst = (uint64_t)1024 * 1024;
+	const uint64_t burst = rate / 10;
+
+	assert(!pthread_mutex_lock(&limiter->mtx));
+	if (limiter->rate)
+		bio_limiter_refill(limiter);
+	else
+		limiter->stamp = bio_now();
+	limiter->rate = rate;
+	limiter->burst = burst < min_burst ? min_burst : burst;
+	if (limiter->tokens > (int64_t)limiter->burst)
+		limiter->tokens = limiter->burst;
+	assert(!pthread_cond_broadcast(&limiter->cv));
+	assert(!pthread_mutex_unlock(&limiter->mtx));
+}
+
+void bio_throttle(struct bio_limiter *limiter, int prio, uint64_t bytes)
+{
+	if (prio < BIO_PRIO_BACKGROUND)
+		return;
+
+	assert(prio < BIO_PRIO_MAX);
+	assert(!pthread_mutex_lock(&limiter->mtx));
+	++limiter->waiting[prio];
+	while (limiter->rate) {
+		bio_limiter_refill(limiter);
+		if (limiter->tokens >= 0 &&
+				!bio_limiter_preempted(limiter, prio))
+			break;
+		bio_limiter_wait(limiter);
+	}
+	--limiter->waiting[prio];
+
+	/* tokens may go negative, so large requests are allowed, but
+	   following requests will have to wait until we pay off the debt */
+	if (limiter->rate)
+		limiter->tokens -= bytes;
+	assert(!pthread_cond_broadcast(&limiter->cv));
+	assert(!pthread_mutex_unlock(&limiter->mtx));
+}
+
+
+static void *bio_queue_worker(void *arg)
+{
+	struct bio_queue *queue = arg;
+
+	assert(!pthread_mutex_lock(&queue->mtx));
+	while (1) {
+		struct bio *bio;
+
+		while (!queue->head && !queue->done)
+			assert(!pthread_cond_wait(&queue->cv, &queue->mtx));
+		if (!queue->head)
+			break;
+
+		bio = queue->head;
+		queue->head = bio->next;
+		if (!queue->head)
+			queue->tail = NULL;
+		assert(!pthread_mutex_unlock(&queue->mtx));
+		bio_submit(bio);
+		assert(!pthread_mutex_lock(&queue->mtx));
+	}
+	assert(!pthread_mutex_unlock(&queue->mtx));
+	return NULL;
+}
+
+void bio_queue_setup(struct bio_queue *queue)
+{
+	memset(queue, 0, sizeof(*queue));
+	assert(!pthread_mutex_init(&queue->mtx, NULL));
+	assert(!pthread_cond_init(&queue->cv, NULL));
+}
+
+/* handles all the queued bios before it returns */
+void bio_queue_release(struct bio_queue *queue)
+{
+	assert(!pthread_mutex_lock(&queue->mtx));
+	queue->done = 1;
+	assert(!pthread_cond_signal(&queue->cv));
+	assert(!pthread_mutex_unlock(&queue->mtx));
+	if (queue->started)
+		assert(!pthread_join(queue->thread, NULL));
+	assert(!pthread_mutex_destroy(&queue->mtx));
+	assert(!pthread_cond_destroy(&queue->cv));
+}
+
+static void bio_queue_add(struct bio_queue *queue, struct bio *bio)
+{
+	bio->next = NULL;
+	assert(!pthread_mutex_lock(&queue->mtx));
+	assert(!queue->done);
+	if (!queue->started) {
+		assert(!pthread_create(&queue->thread, NULL,
+					&bio_queue_worker, queue));
+		queue->started = 1;
+	}
+	if (queue->tail)
+		queue->tail->next = bio;
+	else
+		queue->head = bio;
+	queue->tail = bio;
+	assert(!pthread_cond_signal(&queue->cv));
+	assert(!pthread_mutex_unlock(&queue->mtx));
+}
+
 
 void bio_setup(struct bio *bio, struct bdev *bdev)
 {
@@ -142,9 +337,10 @@ void bio_add_vec(struct bio *bio, void *buf, uint64_t offs, uint64_t size)
 		const size_t cap = bio->cap ? bio->cap * resize : init;
 		const size_t size = cap * sizeof(*bio->vec);
 
-		if (bio->vec == bio->_inline)
+		if (bio->vec == bio->_inline) {
 			assert(bio->vec = malloc(size));
-		else
+			memcpy(bio->vec, bio->_inline, sizeof(bio->_inline));
+		} else
 			assert(bio->vec = realloc(bio->vec, size));
 		bio->cap = cap;
 	}
@@ -157,14 +353,37 @@ void bio_add_vec(struct bio *bio, void *buf, uint64_t offs, uint64_t size)
 	++bio->cnt;
 }
 
+static uint64_t bio_size(const struct bio *bio)
+{
+	uint64_t size = 0;
+
+	for (size_t i = 0; i != bio->cnt; ++i)
+		size += bio->vec[i].size;
+	return size;
+}
+
 void bio_submit(struct bio *bio)
 {
 	struct bdev *bdev = bio->bdev;
 
 	assert(bdev);
+	if (bdev->limiter && bio->prio >= BIO_PRIO_BACKGROUND)
+		bio_throttle(bdev->limiter, bio->prio, bio_size(bio));
 	bdev->handle(bio);
 }
 
+void bio_submit_async(struct bio *bio)
+{
+	struct bdev *bdev = bio->bdev;
+
+	assert(bdev);
+	if (!bdev->queue) {
+		bio_submit(bio);
+		return;
+	}
+	bio_queue_add(bdev->queue, bio);
+}
+
 void bio_wait(struct bio *bio)
 {
 	pthread_mutex_lock(&bio->mtx);
@@ -175,11 +394,14 @@ void bio_wait(struct bio *bio)
 
 void bio_complete(struct bio *bio)
 {
+	/* a waiter may release the bio as soon as it sees it handled */
+	void (*complete)(struct bio *) = bio->complete;
+
 	pthread_mutex_lock(&bio->mtx);
 	bio->handled = 1;
 	pthread_cond_broadcast(&bio->cv);
 	pthread_mutex_unlock(&bio->mtx);
 
-	if (bio->complete)
-		bio->complete(bio);
+	if (complete)
+		complete(bio);
 }
@@ -25,7 +25,7 @@ void myfs_dentry_key2disk(struct __myfs_dentry_key *disk,
 			const struct myfs_dentry *mem)
 {
 	disk->parent = htole64(mem->parent);
-	disk->hash = htole32(mem->hash);
+	disk->hash = htole64(mem->hash);
 	disk->size = htole32(mem->size);
 	memcpy(disk->name, mem->name, mem->size);
 }
@@ -41,7 +41,7 @@ void myfs_dentry_key2mem(struct myfs_dentry *mem,
 			const struct __myfs_dentry_key *disk)
 {
 	mem->parent = le64toh(disk->parent);
-	mem->hash = le32toh(disk->hash);
+	mem->hash = le64toh(disk->hash);
 	mem->size = le32toh(disk->size);
 	mem->name = disk->name;
 }
@@ -53,6 +53,25 @@ void myfs_dentry_value2mem(struct myfs_dentry *mem,
 	mem->type = le32toh(disk->type);
 }
 
+void myfs_dindex_key2disk(struct __myfs_dindex_key *disk,
+			const struct myfs_dentry *mem)
+{
+	disk->parent = htole64(mem->parent);
+	disk->inode = htole64(mem->inode);
+	disk->size = htole32(mem->size);
+	memcpy(disk->name, mem->name, mem->size);
+}
+
+void myfs_dindex_key2mem(struct myfs_dentry *mem,
+			const struct __myfs_dindex_key *disk)
+{
+	mem->parent = le64toh(disk->parent);
+	mem->inode = le64toh(disk->inode);
+	mem->hash = 0;
+	mem->size = le32toh(disk->size);
+	mem->name = disk->name;
+}
+
 static int myfs_dentry_cmp(const struct myfs_dentry *l,
 			const struct myfs_dentry *r)
 {
@@ -77,6 +96,25 @@ static int myfs_dentry_key_cmp(const struct myfs_key *l,
 	return myfs_dentry_cmp(&left, &right);
 }
 
+/* the name only tells apart hard links of the inode in the directory */
+static int myfs_dindex_key_cmp(const struct myfs_key *l,
+			const struct myfs_key *r)
+{
+	struct myfs_dentry left, right;
+
+	assert(l->size >= sizeof(struct __myfs_dindex_key));
+	assert(r->size >= sizeof(struct __myfs_dindex_key));
+	myfs_dindex_key2mem(&left, l->data);
+	myfs_dindex_key2mem(&right, r->data);
+	if (left.parent != right.parent)
+		return left.parent < right.parent ? -1 : 1;
+	if (left.inode != right.inode)
+		return left.inode < right.inode ? -1 : 1;
+	if (left.size != right.size)
+		return left.size < right.size ? -1 : 1;
+	return memcmp(left.name, right.name, left.size);
+}
+
 static int myfs_dentry_key_deleted(const struct myfs_key *key,
 			const struct myfs_value *value)
 {
@@ -93,7 +131,8 @@ void myfs_dentry_map_setup(struct myfs_lsm *lsm, struct myfs *myfs,
 {
 	static struct myfs_key_ops kops = {
 		&myfs_dentry_key_cmp,
-		&myfs_dentry_key_deleted
+		&myfs_dentry_key_deleted,
+		MYFS_KEY_PREFIX | MYFS_KEY_HASH
 	};
 
 	myfs_lsm_setup(lsm, myfs, &myfs_lsm_default_policy, &kops, sb);
@@ -104,6 +143,34 @@ void myfs_dentry_map_release(struct myfs_lsm *lsm)
 	myfs_lsm_release(lsm);
 }
 
+void myfs_dindex_map_setup(struct myfs_lsm *lsm, struct myfs *myfs,
+			const struct myfs_lsm_sb *sb)
+{
+	static struct myfs_key_ops kops = {
+		&myfs_dindex_key_cmp,
+		&myfs_dentry_key_deleted,
+		MYFS_KEY_PREFIX
+	};
+
+	myfs_lsm_setup(lsm, myfs, &myfs_lsm_default_policy, &kops, sb);
+}
+
+void myfs_dindex_map_release(struct myfs_lsm *lsm)
+{
+	myfs_lsm_release(lsm);
+}
+
+
+
+union myfs_dentry_key_wrap {
+	struct __myfs_dentry_key key;
+	char buf[sizeof(struct __myfs_dentry_key) + MYFS_FS_NAMEMAX];
+};
+
+union myfs_dindex_key_wrap {
+	struct __myfs_dindex_key key;
+	char buf[sizeof(struct __myfs_dindex_key) + MYFS_FS_NAMEMAX];
+};
 
 
 struct myfs_dentry_query {
@@ -117,11 +184,9 @@ static int myfs_dentry_lookup_cmp(struct myfs_query *q,
 			const struct myfs_key *key)
 {
 	struct myfs_dentry_query *query = (struct myfs_dentry_query *)q;
-	const struct __myfs_dentry_key *__key = key->data;
 	struct myfs_dentry dentry;
 
-	assert(key->size >= sizeof(*__key));
-	myfs_dentry_key2mem(&dentry, __key);
+	myfs_dentry_key2mem(&dentry, key->data);
 	return myfs_dentry_cmp(&dentry, query->key);
 }
 
@@ -130,10 +195,9 @@ static int myfs_dentry_lookup_emit(struct myfs_query *q,
 			const struct myfs_value *value)
 {
 	struct myfs_dentry_query *query = (struct myfs_dentry_query *)q;
-	const struct __myfs_dentry_key *__key = key->data;
 	const struct __myfs_dentry_value *__value = value->data;
 
-	myfs_dentry_key2mem(query->found, __key);
+	myfs_dentry_key2mem(query->found, key->data);
 	myfs_dentry_value2mem(query->found, __value);
 	query->found->name = NULL;
 	return (query->found->type & MYFS_TYPE_DEL) ? 0 : 1;
@@ -152,15 +216,21 @@ int myfs_dentry_read(struct myfs *myfs, struct myfs_inode *dir,
 		.size = size,
 		.name = name
 	};
+	union myfs_dentry_key_wrap __key;
+	const struct myfs_key exact = {
+		sizeof(struct __myfs_dentry_key) + size - 1, &__key.key
+	};
 	struct myfs_dentry_query query = {
 		.query = {
 			.cmp = &myfs_dentry_lookup_cmp,
 			.emit = &myfs_dentry_lookup_emit,
+			.key = &exact,
 		},
 		.key = &key,
 		.found = dentry,
 	};
 
+	myfs_dentry_key2disk(&__key.key, &key);
 	const int ret = myfs_lsm_lookup(&myfs->dentry_map, &query.query);
 
 	if (!ret)
@@ -173,18 +243,14 @@ int myfs_dentry_read(struct myfs *myfs, struct myfs_inode *dir,
 }
 
 
-union myfs_dentry_key_wrap {
-	struct __myfs_dentry_key key;
-	char buf[sizeof(struct __myfs_dentry_key) + MYFS_FS_NAMEMAX];
-};
-
-
 int __myfs_dentry_write(struct myfs *myfs, const struct myfs_dentry *dentry)
 {
 	union myfs_dentry_key_wrap __key;
+	union myfs_dindex_key_wrap __ikey;
 	struct __myfs_dentry_value __value;
 	struct myfs_key key;
 	struct myfs_value value;
+	int ret;
 
 	myfs_dentry_key2disk(&__key.key, dentry);
 	key.data = &__key.key;
@@ -194,5 +260,14 @@ int __myfs_dentry_write(struct myfs *myfs, const struct myfs_dentry *dentry)
 	value.data = &__value;
 	value.size = sizeof(__value);
 
-	return myfs_lsm_insert(&myfs->dentry_map, &key, &value);
+	ret = myfs_lsm_insert(&myfs->dentry_map, &key, &value);
+	if (!ret && (myfs->sb.features & MYFS_FEATURE_DINDEX)) {
+		myfs_dindex_key2disk(&__ikey.key, dentry);
+		key.data = &__ikey.key;
+		key.size = sizeof(struct __myfs_dindex_key) + dentry->size - 1;
+		ret = myfs_lsm_insert(&myfs->dindex_map, &key, &value);
+	}
+	if (!ret)
+		myfs_flush_kick(myfs);
+	return ret;
 }
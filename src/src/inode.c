@@ -201,27 +201,34 @@ static void myfs_inode_value2mem(struct myfs_inode *mem,
 struct myfs_inode_query {
 	struct myfs_query query;
 	struct myfs_inode *inode;
+
+	struct __myfs_inode_key __key;
+	struct myfs_key key;
 };
 
 
-static int myfs_inode_cmp(const struct myfs_inode *l,
-			const struct myfs_inode *r)
+static int myfs_inode_cmp(uint64_t l, uint64_t r)
 {
-	if (l->inode < r->inode)
+	if (l < r)
 		return -1;
-	return l->inode > r->inode;
+	return l > r;
+}
+
+static uint64_t myfs_inode_key(const struct myfs_key *key)
+{
+	struct __myfs_inode_key __key;
+
+	assert(key->size >= sizeof(__key));
+	memcpy(&__key, key->data, sizeof(__key));
+	return le64toh(__key.inode);
 }
 
 static int myfs_inode_lookup_cmp(struct myfs_query *q,
 			const struct myfs_key *key)
 {
 	struct myfs_inode_query *query = (struct myfs_inode_query *)q;
-	const struct __myfs_inode_key *__inode = key->data;
-	struct myfs_inode inode;
 
-	assert(key->size == sizeof(*__inode));
-	myfs_inode_key2mem(&inode, __inode);
-	return myfs_inode_cmp(&inode, query->inode);
+	return myfs_inode_cmp(myfs_inode_key(key), query->inode->inode);
 }
 
 static int myfs_inode_lookup_emit(struct myfs_query *q,
@@ -248,12 +255,13 @@ static int myfs_inode_lookup_emit(struct myfs_query *q,
 }
 
 
+/* key->data must point to a struct __myfs_inode_key, value->data is
+   allocated and has to be freed by the caller */
 static void myfs_inode2entry(struct myfs_key *key, struct myfs_value *value,
 			const struct myfs_inode *inode)
 {
 	const struct myfs_bmap *bmap = &inode->bmap;
 
-	assert(key->data = malloc(sizeof(struct __myfs_inode_key)));
 	myfs_inode_key2disk(key->data, inode);
 	key->size = sizeof(struct __myfs_inode_key);
 
@@ -273,15 +281,50 @@ static void myfs_inode2entry(struct myfs_key *key, struct myfs_value *value,
 
 int __myfs_inode_write(struct myfs *myfs, struct myfs_inode *inode)
 {
+	struct __myfs_inode_key __key;
+	struct myfs_key key = { sizeof(__key), &__key };
 	struct myfs_value value;
-	struct myfs_key key;
 	int err;
 
 	myfs_inode2entry(&key, &value, inode);
 	err = myfs_lsm_insert(&myfs->inode_map, &key, &value);
-	myfs_entry_release(&key, &value);
-	if (!err)
+	free(value.data);
+	if (!err) {
 		inode->flags &= ~MYFS_INODE_NEW;
+		myfs_flush_kick(myfs);
+	}
+	return err;
+}
+
+int __myfs_inode_write_batch(struct myfs *myfs, struct myfs_inode **inode,
+			size_t size)
+{
+	struct __myfs_inode_key *__key;
+	struct myfs_key *key;
+	struct myfs_value *value;
+	int err;
+
+	assert(__key = calloc(size + 1, sizeof(*__key)));
+	assert(key = calloc(size + 1, sizeof(*key)));
+	assert(value = calloc(size + 1, sizeof(*value)));
+
+	for (size_t i = 0; i != size; ++i) {
+		key[i].data = &__key[i];
+		myfs_inode2entry(&key[i], &value[i], inode[i]);
+	}
+
+	err = myfs_lsm_insert_batch(&myfs->inode_map, key, value, size);
+
+	for (size_t i = 0; i != size; ++i) {
+		free(value[i].data);
+		if (!err)
+			inode[i]->flags &= ~MYFS_INODE_NEW;
+	}
+	free(value);
+	free(key);
+	free(__key);
+	if (!err)
+		myfs_flush_kick(myfs);
 	return err;
 }
 
@@ -298,6 +341,11 @@ int __myfs_inode_read(struct myfs *myfs, struct myfs_inode *inode)
 	if (!(inode->flags & MYFS_INODE_NEW))
 		return 0;
 
+	query.__key.inode = htole64(inode->inode);
+	query.key.size = sizeof(query.__key);
+	query.key.data = &query.__key;
+	query.query.key = &query.key;
+
 	const int ret = myfs_lsm_lookup(&myfs->inode_map, &query.query);
 
 	if (!ret)
@@ -329,16 +377,124 @@ int myfs_inode_read(struct myfs *myfs, struct myfs_inode *inode)
 }
 
 
+static int myfs_inode_query_order(const void *l, const void *r)
+{
+	const struct myfs_inode_query *lq = l;
+	const struct myfs_inode_query *rq = r;
+
+	return myfs_inode_cmp(lq->inode->inode, rq->inode->inode);
+}
+
+/* moves the state read from the map to the cached inode */
+static void myfs_inode_move(struct myfs_inode *dst, struct myfs_inode *src)
+{
+	free(dst->bmap.entry);
+	dst->size = src->size;
+	dst->mtime = src->mtime;
+	dst->ctime = src->ctime;
+	dst->links = src->links;
+	dst->type = src->type;
+	dst->uid = src->uid;
+	dst->gid = src->gid;
+	dst->perm = src->perm;
+	dst->bmap = src->bmap;
+	memset(&src->bmap, 0, sizeof(src->bmap));
+}
+
+int myfs_inode_read_batch(struct myfs *myfs, struct myfs_inode **inode,
+			size_t size)
+{
+	struct myfs_inode_query *query;
+	struct myfs_query **q;
+	struct myfs_inode *tmp;
+	size_t count = 0;
+	int *ret;
+	int err;
+
+	assert(query = calloc(size + 1, sizeof(*query)));
+	assert(tmp = calloc(size + 1, sizeof(*tmp)));
+
+	for (size_t i = 0; i != size; ++i) {
+		int toread = 0;
+
+		assert(!pthread_rwlock_rdlock(&inode[i]->rwlock));
+		if (inode[i]->flags & MYFS_INODE_NEW)
+			toread = 1;
+		assert(!pthread_rwlock_unlock(&inode[i]->rwlock));
+
+		if (!toread)
+			continue;
+
+		tmp[count].inode = inode[i]->inode;
+		query[count].inode = &tmp[count];
+		++count;
+	}
+
+	/* multi get wants the queries in the key order */
+	qsort(query, count, sizeof(*query), &myfs_inode_query_order);
+
+	size_t unique = 0;
+
+	for (size_t i = 0; i != count; ++i) {
+		if (unique && query[unique - 1].inode->inode ==
+					query[i].inode->inode)
+			continue;
+		query[unique++] = query[i];
+	}
+
+	assert(q = calloc(unique + 1, sizeof(*q)));
+	assert(ret = calloc(unique + 1, sizeof(*ret)));
+	for (size_t i = 0; i != unique; ++i) {
+		struct myfs_inode_query *iq = &query[i];
+
+		iq->query.cmp = &myfs_inode_lookup_cmp;
+		iq->query.emit = &myfs_inode_lookup_emit;
+		iq->__key.inode = htole64(iq->inode->inode);
+		iq->key.size = sizeof(iq->__key);
+		iq->key.data = &iq->__key;
+		iq->query.key = &iq->key;
+		q[i] = &iq->query;
+	}
+
+	err = myfs_lsm_multi_get(&myfs->inode_map, q, ret, unique);
+
+	for (size_t i = 0; i != size; ++i) {
+		size_t pos = 0;
+
+		for (; pos != unique; ++pos) {
+			if (query[pos].inode->inode == inode[i]->inode)
+				break;
+		}
+
+		if (pos == unique)
+			continue;
+
+		assert(!pthread_rwlock_wrlock(&inode[i]->rwlock));
+		if ((inode[i]->flags & MYFS_INODE_NEW) && !err) {
+			if (ret[pos] == 1) {
+				myfs_inode_move(inode[i], query[pos].inode);
+				inode[i]->flags &= ~MYFS_INODE_NEW;
+			} else {
+				err = ret[pos] ? ret[pos] : -ENOENT;
+			}
+		}
+		assert(!pthread_rwlock_unlock(&inode[i]->rwlock));
+	}
+
+	for (size_t i = 0; i != count; ++i)
+		free(tmp[i].bmap.entry);
+	free(ret);
+	free(q);
+	free(tmp);
+	free(query);
+	return err;
+}
+
+
 static int myfs_inode_key_cmp(const struct myfs_key *l,
 			const struct myfs_key *r)
 {
-	struct myfs_inode left, right;
-
-	assert(l->size >= sizeof(struct __myfs_inode_key));
-	assert(r->size >= sizeof(struct __myfs_inode_key));
-	myfs_inode_key2mem(&left, l->data);
-	myfs_inode_key2mem(&right, r->data);
-	return myfs_inode_cmp(&left, &right);
+	return myfs_inode_cmp(myfs_inode_key(l), myfs_inode_key(r));
 }
 
 static int myfs_inode_key_deleted(const struct myfs_key *key,
@@ -357,7 +513,8 @@ void myfs_inode_map_setup(struct myfs_lsm *lsm, struct myfs *myfs,
 {
 	static struct myfs_key_ops kops = {
 		&myfs_inode_key_cmp,
-		&myfs_inode_key_deleted
+		&myfs_inode_key_deleted,
+		MYFS_KEY_LE64 | MYFS_KEY_HASH
 	};
 
 	myfs_lsm_setup(lsm, myfs, &myfs_lsm_default_policy, &kops, sb);
@@ -0,0 +1,816 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <lsm/btree.h>
+
+#include <stdatomic.h>
+#include <string.h>
+#include <assert.h>
+#include <sched.h>
+#include <errno.h>
+
+
+/* position lookups return it when they notice a concurrent change */
+#define MYFS_BTREE_RESTART	((size_t)-1)
+
+
+static struct myfs_btree_node *myfs_btree_node_create(
+			struct myfs_btree *tree, int leaf)
+{
+	const size_t size = sizeof(struct myfs_btree_node) + (leaf ? 0 :
+			(MYFS_BTREE_FANOUT + 1) * sizeof(struct myfs_btree_node *));
+	struct myfs_btree_node *node = myfs_arena_alloc(&tree->arena, size);
+
+	node->leaf = leaf;
+	return node;
+}
+
+static struct myfs_btree_entry *myfs_btree_entry_create(
+			struct myfs_btree *tree, const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	struct myfs_btree_entry *entry = myfs_arena_alloc(&tree->arena,
+				sizeof(*entry) + key->size + value->size);
+	char *buf = (char *)(entry + 1);
+
+	if (key->size)
+		memcpy(buf, key->data, key->size);
+	entry->key.data = buf;
+	entry->key.size = key->size;
+	buf += key->size;
+
+	if (value->size)
+		memcpy(buf, value->data, value->size);
+	entry->value.data = buf;
+	entry->value.size = value->size;
+	return entry;
+}
+
+
+static int mtree_btree_insert(struct myfs_mtree *mtree,
+			const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	struct myfs_btree *tree = (struct myfs_btree *)mtree;
+
+	return myfs_btree_insert(tree, key, value);
+}
+
+static int mtree_btree_insert_batch(struct myfs_mtree *mtree,
+			const struct myfs_key *key,
+			const struct myfs_value *value, size_t size)
+{
+	struct myfs_btree *tree = (struct myfs_btree *)mtree;
+
+	return myfs_btree_insert_batch(tree, key, value, size);
+}
+
+static int mtree_btree_lookup(struct myfs_mtree *mtree,
+			struct myfs_query *query)
+{
+	struct myfs_btree *tree = (struct myfs_btree *)mtree;
+
+	return myfs_btree_lookup(tree, query);
+}
+
+static int mtree_btree_range(struct myfs_mtree *mtree,
+			struct myfs_query *query)
+{
+	struct myfs_btree *tree = (struct myfs_btree *)mtree;
+
+	return myfs_btree_range(tree, query);
+}
+
+static int mtree_btree_scan(struct myfs_mtree *mtree, struct myfs_query *query)
+{
+	struct myfs_btree *tree = (struct myfs_btree *)mtree;
+
+	return myfs_btree_scan(tree, query);
+}
+
+static size_t mtree_btree_size(const struct myfs_mtree *mtree)
+{
+	const struct myfs_btree *tree = (const struct myfs_btree *)mtree;
+
+	return myfs_btree_size(tree);
+}
+
+static size_t mtree_btree_bytes(const struct myfs_mtree *mtree)
+{
+	const struct myfs_btree *tree = (const struct myfs_btree *)mtree;
+
+	return myfs_btree_bytes(tree);
+}
+
+
+void myfs_btree_setup(struct myfs_btree *tree, myfs_cmp_t cmp,
+			unsigned long flags)
+{
+	memset(tree, 0, sizeof(*tree));
+	myfs_arena_setup(&tree->arena);
+	atomic_init(&tree->root, myfs_btree_node_create(tree, 1));
+	atomic_init(&tree->size, 0);
+	tree->cmp = cmp;
+	tree->le64 = (flags & MYFS_KEY_LE64) != 0;
+	tree->hash = (flags & MYFS_KEY_HASH) != 0;
+	if (tree->hash)
+		myfs_hindex_setup(&tree->index, &tree->arena);
+
+	tree->mtree.insert = &mtree_btree_insert;
+	tree->mtree.insert_batch = &mtree_btree_insert_batch;
+	tree->mtree.lookup = &mtree_btree_lookup;
+	tree->mtree.range = &mtree_btree_range;
+	tree->mtree.scan = &mtree_btree_scan;
+	tree->mtree.size = &mtree_btree_size;
+	tree->mtree.bytes = &mtree_btree_bytes;
+}
+
+void myfs_btree_release(struct myfs_btree *tree)
+{
+	if (tree->hash)
+		myfs_hindex_release(&tree->index);
+	myfs_arena_release(&tree->arena);
+	memset(tree, 0, sizeof(*tree));
+}
+
+
+static int myfs_btree_read_lock(struct myfs_btree_node *node, uint64_t *v)
+{
+	*v = atomic_load_explicit(&node->version, memory_order_acquire);
+	return !(*v & 1);
+}
+
+static int myfs_btree_validate(struct myfs_btree_node *node, uint64_t v)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&node->version, memory_order_relaxed) == v;
+}
+
+static int myfs_btree_upgrade(struct myfs_btree_node *node, uint64_t v)
+{
+	return atomic_compare_exchange_strong_explicit(&node->version,
+				&v, v + 1, memory_order_acquire,
+				memory_order_relaxed);
+}
+
+static void myfs_btree_unlock(struct myfs_btree_node *node)
+{
+	atomic_fetch_add_explicit(&node->version, 1, memory_order_release);
+}
+
+
+static size_t myfs_btree_node_size(struct myfs_btree_node *node)
+{
+	return atomic_load_explicit(&node->size, memory_order_relaxed);
+}
+
+static uint64_t myfs_btree_ikey(struct myfs_btree_node *node, size_t i)
+{
+	return atomic_load_explicit(&node->ikey[i], memory_order_relaxed);
+}
+
+static struct myfs_btree_entry *myfs_btree_entry(
+			struct myfs_btree_node *node, size_t i)
+{
+	return atomic_load_explicit(&node->entry[i], memory_order_consume);
+}
+
+static struct myfs_btree_node *myfs_btree_child(
+			struct myfs_btree_node *node, size_t i)
+{
+	return atomic_load_explicit(&node->child[i], memory_order_consume);
+}
+
+static void myfs_btree_set(struct myfs_btree_node *node, size_t i,
+			struct myfs_btree_entry *entry, uint64_t ikey)
+{
+	atomic_store_explicit(&node->ikey[i], ikey, memory_order_relaxed);
+	atomic_store_explicit(&node->entry[i], entry, memory_order_release);
+}
+
+static void myfs_btree_set_child(struct myfs_btree_node *node, size_t i,
+			struct myfs_btree_node *child)
+{
+	atomic_store_explicit(&node->child[i], child, memory_order_release);
+}
+
+static void myfs_btree_set_size(struct myfs_btree_node *node, size_t size)
+{
+	atomic_store_explicit(&node->size, size, memory_order_relaxed);
+}
+
+static struct myfs_btree_entry *myfs_btree_high(struct myfs_btree_node *node)
+{
+	return atomic_load_explicit(&node->high, memory_order_consume);
+}
+
+static uint64_t myfs_btree_ihigh(struct myfs_btree_node *node)
+{
+	return atomic_load_explicit(&node->ihigh, memory_order_relaxed);
+}
+
+static void myfs_btree_set_high(struct myfs_btree_node *node,
+			struct myfs_btree_entry *high, uint64_t ihigh)
+{
+	atomic_store_explicit(&node->ihigh, ihigh, memory_order_relaxed);
+	atomic_store_explicit(&node->high, high, memory_order_release);
+}
+
+
+static uint64_t myfs_btree_key2int(const struct myfs_key *key)
+{
+	le64_t v;
+
+	memcpy(&v, key->data, sizeof(v));
+	return le64toh(v);
+}
+
+static int myfs_btree_int_cmp(uint64_t l, uint64_t r)
+{
+	if (l != r)
+		return l < r ? -1 : 1;
+	return 0;
+}
+
+static int myfs_btree_cmp(const struct myfs_btree *tree,
+			const struct myfs_key *l, const struct myfs_key *r)
+{
+	if (tree->le64)
+		return myfs_btree_int_cmp(myfs_btree_key2int(l),
+					myfs_btree_key2int(r));
+	return tree->cmp(l, r);
+}
+
+/* compares key i of the node with the key, MYFS_BTREE_RESTART is returned
+   when the node has been changed under us */
+static int myfs_btree_node_cmp(const struct myfs_btree *tree,
+			struct myfs_btree_node *node, size_t i,
+			const struct myfs_key *key, uint64_t ikey, int *res)
+{
+	if (tree->le64) {
+		*res = myfs_btree_int_cmp(myfs_btree_ikey(node, i), ikey);
+		return 0;
+	}
+
+	const struct myfs_btree_entry *entry = myfs_btree_entry(node, i);
+
+	if (!entry)
+		return -EAGAIN;
+	*res = tree->cmp(&entry->key, key);
+	return 0;
+}
+
+static int myfs_btree_node_query_cmp(const struct myfs_btree *tree,
+			struct myfs_btree_node *node, size_t i,
+			struct myfs_query *query, int *res)
+{
+	if (tree->le64 && query->key) {
+		*res = myfs_btree_int_cmp(myfs_btree_ikey(node, i),
+					myfs_btree_key2int(query->key));
+		return 0;
+	}
+
+	const struct myfs_btree_entry *entry = myfs_btree_entry(node, i);
+
+	if (!entry)
+		return -EAGAIN;
+	*res = query->cmp(query, &entry->key);
+	return 0;
+}
+
+/* the number of keys in the node less than the key */
+static size_t myfs_btree_key_pos(const struct myfs_btree *tree,
+			struct myfs_btree_node *node, size_t size,
+			const struct myfs_key *key, uint64_t ikey)
+{
+	size_t l = 0, r = size;
+
+	while (l < r) {
+		const size_t m = l + (r - l) / 2;
+		int res;
+
+		if (myfs_btree_node_cmp(tree, node, m, key, ikey, &res))
+			return MYFS_BTREE_RESTART;
+
+		if (res < 0)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return l;
+}
+
+/* the number of keys in the node less than the query */
+static size_t myfs_btree_query_pos(const struct myfs_btree *tree,
+			struct myfs_btree_node *node, size_t size,
+			struct myfs_query *query)
+{
+	size_t l = 0, r = size;
+
+	while (l < r) {
+		const size_t m = l + (r - l) / 2;
+		int res;
+
+		if (myfs_btree_node_query_cmp(tree, node, m, query, &res))
+			return MYFS_BTREE_RESTART;
+
+		if (res < 0)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return l;
+}
+
+
+/* Splits the full node in two halves, both the node and the parent must
+   be locked, parent is NULL if the node is the root. */
+static void myfs_btree_split(struct myfs_btree *tree,
+			struct myfs_btree_node *parent,
+			struct myfs_btree_node *node)
+{
+	struct myfs_btree_node *right = myfs_btree_node_create(tree,
+				node->leaf);
+	const size_t size = myfs_btree_node_size(node);
+	const size_t half = size / 2;
+	struct myfs_btree_entry *sep;
+	uint64_t isep;
+
+	if (node->leaf) {
+		for (size_t i = half; i != size; ++i)
+			myfs_btree_set(right, i - half,
+					myfs_btree_entry(node, i),
+					myfs_btree_ikey(node, i));
+		myfs_btree_set_size(right, size - half);
+		atomic_store_explicit(&right->next, atomic_load_explicit(
+					&node->next, memory_order_relaxed),
+					memory_order_relaxed);
+		atomic_store_explicit(&node->next, right, memory_order_release);
+		sep = myfs_btree_entry(node, half - 1);
+		isep = myfs_btree_ikey(node, half - 1);
+		myfs_btree_set_high(right, myfs_btree_high(node),
+					myfs_btree_ihigh(node));
+		myfs_btree_set_high(node, sep, isep);
+		myfs_btree_set_size(node, half);
+	} else {
+		for (size_t i = half + 1; i != size; ++i)
+			myfs_btree_set(right, i - half - 1,
+					myfs_btree_entry(node, i),
+					myfs_btree_ikey(node, i));
+		for (size_t i = half + 1; i != size + 1; ++i)
+			myfs_btree_set_child(right, i - half - 1,
+					myfs_btree_child(node, i));
+		myfs_btree_set_size(right, size - half - 1);
+		sep = myfs_btree_entry(node, half);
+		isep = myfs_btree_ikey(node, half);
+		myfs_btree_set_size(node, half);
+	}
+
+	if (!parent) {
+		struct myfs_btree_node *root = myfs_btree_node_create(tree, 0);
+
+		myfs_btree_set(root, 0, sep, isep);
+		myfs_btree_set_child(root, 0, node);
+		myfs_btree_set_child(root, 1, right);
+		myfs_btree_set_size(root, 1);
+		atomic_store_explicit(&tree->root, root, memory_order_release);
+		return;
+	}
+
+	const size_t psize = myfs_btree_node_size(parent);
+	size_t pos = 0;
+
+	while (myfs_btree_child(parent, pos) != node)
+		++pos;
+
+	for (size_t i = psize; i != pos; --i)
+		myfs_btree_set(parent, i, myfs_btree_entry(parent, i - 1),
+					myfs_btree_ikey(parent, i - 1));
+	for (size_t i = psize + 1; i != pos + 1; --i)
+		myfs_btree_set_child(parent, i, myfs_btree_child(parent, i - 1));
+	myfs_btree_set(parent, pos, sep, isep);
+	myfs_btree_set_child(parent, pos + 1, right);
+	myfs_btree_set_size(parent, psize + 1);
+}
+
+/* Inserts the entry into the leaf read locked with version v, the leaf
+   must have room for one more entry. */
+static int myfs_btree_leaf_insert(struct myfs_btree *tree,
+			struct myfs_btree_node *node, uint64_t v,
+			struct myfs_btree_entry *entry, uint64_t ikey)
+{
+	const size_t size = myfs_btree_node_size(node);
+	const size_t pos = myfs_btree_key_pos(tree, node, size,
+				&entry->key, ikey);
+	int res = 1;
+
+	if (pos == MYFS_BTREE_RESTART || size == MYFS_BTREE_FANOUT)
+		return -EAGAIN;
+
+	if (pos != size && myfs_btree_node_cmp(tree, node, pos,
+				&entry->key, ikey, &res))
+		return -EAGAIN;
+
+	if (!myfs_btree_upgrade(node, v))
+		return -EAGAIN;
+
+	/* the leaf lock serializes index updates of the key */
+	if (tree->hash)
+		myfs_hindex_insert(&tree->index, &tree->arena,
+					&entry->key, entry);
+
+	if (!res) {
+		myfs_btree_set(node, pos, entry, ikey);
+		myfs_btree_unlock(node);
+		return 0;
+	}
+
+	for (size_t i = size; i != pos; --i)
+		myfs_btree_set(node, i, myfs_btree_entry(node, i - 1),
+					myfs_btree_ikey(node, i - 1));
+	myfs_btree_set(node, pos, entry, ikey);
+	myfs_btree_set_size(node, size + 1);
+	myfs_btree_unlock(node);
+
+	atomic_fetch_add_explicit(&tree->size, 1, memory_order_relaxed);
+	return 0;
+}
+
+/* Full nodes are split on the way down, so the parent of a node always
+   has room for one more separator. Returns -EAGAIN if the insert has to
+   be restarted from the root, otherwise leaf is the leaf of the key. */
+static int __myfs_btree_insert(struct myfs_btree *tree,
+			struct myfs_btree_entry *entry, uint64_t ikey,
+			struct myfs_btree_node **leaf)
+{
+	struct myfs_btree_node *parent = NULL;
+	struct myfs_btree_node *node;
+	uint64_t pv = 0, v;
+
+	node = atomic_load_explicit(&tree->root, memory_order_consume);
+	if (!myfs_btree_read_lock(node, &v))
+		return -EAGAIN;
+	if (node != atomic_load_explicit(&tree->root, memory_order_relaxed))
+		return -EAGAIN;
+
+	while (1) {
+		const size_t size = myfs_btree_node_size(node);
+
+		if (size == MYFS_BTREE_FANOUT) {
+			if (parent && !myfs_btree_upgrade(parent, pv))
+				return -EAGAIN;
+
+			if (!myfs_btree_upgrade(node, v)) {
+				if (parent)
+					myfs_btree_unlock(parent);
+				return -EAGAIN;
+			}
+
+			/* the root might have been split after we read it */
+			if (parent || node == atomic_load_explicit(&tree->root,
+						memory_order_relaxed))
+				myfs_btree_split(tree, parent, node);
+
+			myfs_btree_unlock(node);
+			if (parent)
+				myfs_btree_unlock(parent);
+			return -EAGAIN;
+		}
+
+		if (node->leaf)
+			break;
+
+		const size_t pos = myfs_btree_key_pos(tree, node, size,
+					&entry->key, ikey);
+
+		if (pos == MYFS_BTREE_RESTART)
+			return -EAGAIN;
+
+		struct myfs_btree_node *child = myfs_btree_child(node, pos);
+
+		if (!child || !myfs_btree_validate(node, v))
+			return -EAGAIN;
+
+		parent = node;
+		pv = v;
+		node = child;
+		if (!myfs_btree_read_lock(node, &v))
+			return -EAGAIN;
+		if (!myfs_btree_validate(parent, pv))
+			return -EAGAIN;
+	}
+
+	*leaf = node;
+	return myfs_btree_leaf_insert(tree, node, v, entry, ikey);
+}
+
+static int myfs_btree_high_cmp(const struct myfs_btree *tree,
+			const struct myfs_btree_entry *high, uint64_t ihigh,
+			const struct myfs_key *key, uint64_t ikey)
+{
+	if (!high)
+		return 1;
+	if (tree->le64)
+		return myfs_btree_int_cmp(ihigh, ikey);
+	return tree->cmp(&high->key, key);
+}
+
+/* Finger insert: the key goes to the leaf without a descent from the root
+   if it's between the first key and the high key of the leaf. Keys never
+   leave a leaf to the left, so the first key of a leaf is greater than
+   the high key of its left sibling. */
+static int myfs_btree_finger_insert(struct myfs_btree *tree,
+			struct myfs_btree_node *leaf,
+			struct myfs_btree_entry *entry, uint64_t ikey)
+{
+	uint64_t v;
+	int first;
+
+	if (!myfs_btree_read_lock(leaf, &v))
+		return -EAGAIN;
+
+	const size_t size = myfs_btree_node_size(leaf);
+	const struct myfs_btree_entry *high = myfs_btree_high(leaf);
+	const uint64_t ihigh = myfs_btree_ihigh(leaf);
+
+	if (!size || size == MYFS_BTREE_FANOUT)
+		return -EAGAIN;
+
+	if (myfs_btree_node_cmp(tree, leaf, 0, &entry->key, ikey, &first))
+		return -EAGAIN;
+
+	if (first > 0 || myfs_btree_high_cmp(tree, high, ihigh,
+				&entry->key, ikey) < 0)
+		return -EAGAIN;
+	return myfs_btree_leaf_insert(tree, leaf, v, entry, ikey);
+}
+
+static int myfs_btree_insert_entry(struct myfs_btree *tree,
+			struct myfs_btree_entry *entry,
+			struct myfs_btree_node **leaf)
+{
+	const uint64_t ikey = tree->le64 ? myfs_btree_key2int(&entry->key) : 0;
+	int err;
+
+	if (*leaf && !myfs_btree_finger_insert(tree, *leaf, entry, ikey))
+		return 0;
+
+	while ((err = __myfs_btree_insert(tree, entry, ikey, leaf)) == -EAGAIN)
+		sched_yield();
+	return err;
+}
+
+int myfs_btree_insert(struct myfs_btree *tree, const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	struct myfs_btree_node *leaf = NULL;
+
+	return myfs_btree_insert_entry(tree,
+				myfs_btree_entry_create(tree, key, value),
+				&leaf);
+}
+
+int myfs_btree_insert_batch(struct myfs_btree *tree,
+			const struct myfs_key *key,
+			const struct myfs_value *value, size_t size)
+{
+	struct myfs_btree_node *leaf = NULL;
+	int err = 0;
+
+	for (size_t i = 0; !err && i != size; ++i)
+		err = myfs_btree_insert_entry(tree,
+					myfs_btree_entry_create(tree,
+						&key[i], &value[i]),
+					&leaf);
+	return err;
+}
+
+
+/* Returns the leaf that contains the first key not less than the query or
+   the leftmost leaf if query is NULL. Keys only move to the right when a
+   node is split, so the leaf may be used after it has been changed as
+   long as its right siblings are visited. */
+static struct myfs_btree_node *__myfs_btree_leaf(struct myfs_btree *tree,
+			struct myfs_query *query)
+{
+	struct myfs_btree_node *node;
+	uint64_t v;
+
+	node = atomic_load_explicit(&tree->root, memory_order_consume);
+	if (!myfs_btree_read_lock(node, &v))
+		return NULL;
+	if (node != atomic_load_explicit(&tree->root, memory_order_relaxed))
+		return NULL;
+
+	while (!node->leaf) {
+		const size_t size = myfs_btree_node_size(node);
+		const size_t pos = query
+			? myfs_btree_query_pos(tree, node, size, query) : 0;
+
+		if (pos == MYFS_BTREE_RESTART)
+			return NULL;
+
+		struct myfs_btree_node *child = myfs_btree_child(node, pos);
+
+		if (!child || !myfs_btree_validate(node, v))
+			return NULL;
+
+		struct myfs_btree_node *parent = node;
+		const uint64_t pv = v;
+
+		node = child;
+		if (!myfs_btree_read_lock(node, &v))
+			return NULL;
+		if (!myfs_btree_validate(parent, pv))
+			return NULL;
+	}
+	return node;
+}
+
+static struct myfs_btree_node *myfs_btree_leaf(struct myfs_btree *tree,
+			struct myfs_query *query)
+{
+	struct myfs_btree_node *leaf;
+
+	while (!(leaf = __myfs_btree_leaf(tree, query)))
+		sched_yield();
+	return leaf;
+}
+
+
+struct myfs_btree_snap {
+	struct myfs_btree_entry *entry[MYFS_BTREE_FANOUT];
+	uint64_t ikey[MYFS_BTREE_FANOUT];
+	struct myfs_btree_node *next;
+	size_t size;
+};
+
+/* consistent copy of the leaf content */
+static void myfs_btree_snap(struct myfs_btree_node *leaf,
+			struct myfs_btree_snap *snap)
+{
+	while (1) {
+		uint64_t v;
+		int valid = 1;
+
+		if (!myfs_btree_read_lock(leaf, &v)) {
+			sched_yield();
+			continue;
+		}
+
+		snap->size = myfs_btree_node_size(leaf);
+		for (size_t i = 0; i != snap->size; ++i) {
+			snap->entry[i] = myfs_btree_entry(leaf, i);
+			snap->ikey[i] = myfs_btree_ikey(leaf, i);
+			if (!snap->entry[i])
+				valid = 0;
+		}
+		snap->next = atomic_load_explicit(&leaf->next,
+					memory_order_consume);
+		if (valid && myfs_btree_validate(leaf, v))
+			return;
+	}
+}
+
+static int myfs_btree_snap_cmp(const struct myfs_btree *tree,
+			const struct myfs_btree_snap *snap, size_t i,
+			struct myfs_query *query)
+{
+	if (tree->le64 && query->key)
+		return myfs_btree_int_cmp(snap->ikey[i],
+					myfs_btree_key2int(query->key));
+	return query->cmp(query, &snap->entry[i]->key);
+}
+
+/* the position of the first key not less than the query */
+static size_t myfs_btree_snap_pos(const struct myfs_btree *tree,
+			const struct myfs_btree_snap *snap,
+			struct myfs_query *query)
+{
+	size_t l = 0, r = snap->size;
+
+	while (l < r) {
+		const size_t m = l + (r - l) / 2;
+
+		if (myfs_btree_snap_cmp(tree, snap, m, query) < 0)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return l;
+}
+
+
+/* every key of the tree is in the index, so a miss is final */
+static int myfs_btree_hash_lookup(struct myfs_btree *tree,
+			struct myfs_query *query)
+{
+	const struct myfs_btree_entry *entry = myfs_hindex_lookup(
+				&tree->index, query->key);
+
+	if (!entry || query->cmp(query, &entry->key))
+		return 0;
+	return query->emit(query, &entry->key, &entry->value);
+}
+
+int myfs_btree_lookup(struct myfs_btree *tree, struct myfs_query *query)
+{
+	if (tree->hash && query->key)
+		return myfs_btree_hash_lookup(tree, query);
+
+	struct myfs_btree_node *leaf = myfs_btree_leaf(tree, query);
+	struct myfs_btree_snap snap;
+
+	while (leaf) {
+		myfs_btree_snap(leaf, &snap);
+
+		const size_t pos = myfs_btree_snap_pos(tree, &snap, query);
+
+		if (pos != snap.size) {
+			const struct myfs_btree_entry *entry = snap.entry[pos];
+
+			if (myfs_btree_snap_cmp(tree, &snap, pos, query))
+				return 0;
+			return query->emit(query, &entry->key, &entry->value);
+		}
+
+		/* the leaf has been split, the key is to the right */
+		leaf = snap.next;
+	}
+	return 0;
+}
+
+/* emits matching entries starting from the leaf, stops at the first
+   entry greater than the query if range is set */
+static int myfs_btree_walk(struct myfs_btree *tree,
+			struct myfs_btree_node *leaf,
+			struct myfs_query *query, int range)
+{
+	const struct myfs_key *last = NULL;
+	struct myfs_btree_snap snap;
+
+	while (leaf) {
+		size_t pos = 0;
+
+		myfs_btree_snap(leaf, &snap);
+		if (range && !last)
+			pos = myfs_btree_snap_pos(tree, &snap, query);
+
+		for (size_t i = pos; i != snap.size; ++i) {
+			const struct myfs_btree_entry *entry = snap.entry[i];
+
+			/* the leaf was split and we've seen the entry */
+			if (last && myfs_btree_cmp(tree, &entry->key, last) <= 0)
+				continue;
+			last = &entry->key;
+
+			const int res = query->cmp(query, &entry->key);
+
+			if (range && res > 0)
+				return 0;
+			if (res)
+				continue;
+
+			const int err = query->emit(query, &entry->key,
+						&entry->value);
+
+			if (err)
+				return err;
+		}
+		leaf = snap.next;
+	}
+	return 0;
+}
+
+int myfs_btree_range(struct myfs_btree *tree, struct myfs_query *query)
+{
+	return myfs_btree_walk(tree, myfs_btree_leaf(tree, query), query, 1);
+}
+
+int myfs_btree_scan(struct myfs_btree *tree, struct myfs_query *query)
+{
+	return myfs_btree_walk(tree, myfs_btree_leaf(tree, NULL), query, 0);
+}
+
+size_t myfs_btree_size(const struct myfs_btree *tree)
+{
+	return atomic_load_explicit(&tree->size, memory_order_relaxed);
+}
+
+size_t myfs_btree_bytes(const struct myfs_btree *tree)
+{
+	return myfs_arena_used(&tree->arena);
+}
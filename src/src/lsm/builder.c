@@ -15,13 +15,17 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <alloc/alloc.h>
+#include <block/block.h>
 #include <lsm/ctree.h>
+#include <misc/lz.h>
 #include <myfs.h>
 
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <assert.h>
+#include <errno.h>
 
 
 static void myfs_level_setup(struct myfs_ctree_level *level)
@@ -31,14 +35,30 @@ static void myfs_level_setup(struct myfs_ctree_level *level)
 
 static void myfs_level_release(struct myfs_ctree_level *level)
 {
+	struct myfs_ctree_flush *flush = level->flush;
+
+	if (flush) {
+		flush->level.flush = NULL;
+		myfs_level_release(&flush->level);
+		free(flush->ptr);
+		free(flush->lz);
+		free(flush);
+	}
 	free(level->node);
 	free(level->buf);
+	free(level->key);
+	free(level->keys);
+	free(level->restart);
+	free(level->fixed);
+	free(level->zbuf);
 }
 
 static void myfs_level_reset(struct myfs_ctree_level *level)
 {
 	level->size = 0;
 	level->buf_size = 0;
+	level->keys_size = 0;
+	level->zbuf_size = 0;
 }
 
 
@@ -47,10 +67,22 @@ void myfs_builder_setup(struct myfs_ctree_builder *builder)
 	for (int i = 0; i <= MYFS_MAX_CTREE_HIGHT; ++i)
 		myfs_level_setup(&builder->level[i]);
 	memset(&builder->sb, 0, sizeof(builder->sb));
+	builder->writer = NULL;
+	builder->prio = BIO_PRIO_FLUSH;
+	builder->io_prio = NULL;
+	builder->io_prio_arg = NULL;
+	builder->format = MYFS_CTREE_PLAIN;
+	builder->compress = 0;
+	builder->fanout = MYFS_MIN_FANOUT;
+	builder->node_pages = MYFS_CTREE_NODE_PAGES;
 }
 
+static void myfs_writer_stop(struct myfs_ctree_builder *builder);
+
 void myfs_builder_release(struct myfs_ctree_builder *builder)
 {
+	/* buffers still queued are written before the writer exits */
+	myfs_writer_stop(builder);
 	for (int i = 0; i <= MYFS_MAX_CTREE_HIGHT; ++i)
 		myfs_level_release(&builder->level[i]);
 	memset(&builder->sb, 0, sizeof(builder->sb));
@@ -90,20 +122,78 @@ static void myfs_level_fill(struct myfs *myfs, struct myfs_ctree_level *level,
 	level->buf_size += size;
 }
 
+static void myfs_level_set_key(struct myfs_ctree_level *level,
+			const struct myfs_key *key)
+{
+	if (key->size > level->key_cap) {
+		assert(level->key = realloc(level->key, key->size));
+		level->key_cap = key->size;
+	}
+	memcpy(level->key, key->data, key->size);
+	level->key_size = key->size;
+}
+
+static void myfs_level_add_restart(struct myfs_ctree_level *level,
+			struct myfs_ctree_buffer *buffer)
+{
+	if (buffer->restarts == level->restart_cap) {
+		const size_t cap = level->restart_cap
+					? level->restart_cap * 2 : 64;
+
+		assert(level->restart = realloc(level->restart,
+					cap * sizeof(*level->restart)));
+		level->restart_cap = cap;
+	}
+	level->restart[buffer->restarts++] = buffer->buf_size;
+	buffer->trailer += sizeof(le32_t);
+}
+
+static void myfs_level_add_fixed(struct myfs_ctree_level *level,
+			struct myfs_ctree_buffer *buffer,
+			const struct myfs_key *key)
+{
+	if (buffer->size == level->fixed_cap) {
+		const size_t cap = level->fixed_cap
+					? level->fixed_cap * 2 : 256;
+
+		assert(level->fixed = realloc(level->fixed,
+					cap * sizeof(*level->fixed)));
+		level->fixed_cap = cap;
+	}
+	memcpy(&level->fixed[buffer->size], key->data, sizeof(le64_t));
+	buffer->trailer += sizeof(le64_t);
+}
+
+static size_t myfs_level_shared(const struct myfs_ctree_level *level,
+			const struct myfs_key *key)
+{
+	const size_t max = key->size < level->key_size
+				? key->size : level->key_size;
+	const char *l = level->key;
+	const char *r = key->data;
+	size_t shared = 0;
+
+	while (shared < max && l[shared] == r[shared])
+		++shared;
+	return shared;
+}
+
 static int myfs_buffer_full(const struct myfs *myfs,
+			const struct myfs_ctree_builder *builder,
 			const struct myfs_ctree_buffer *buffer,
 			size_t size)
 {
-	if (buffer->size < myfs->fanout)
+	if (buffer->size < builder->fanout)
 		return 0;
 
+	/* a node that outgrew node_pages may still fill its last page */
 	const size_t page_size = myfs->page_size;
-	const size_t aligned = myfs_align_up(buffer->buf_size, page_size);
-
-	if (aligned - buffer->buf_size >= size)
-		return 0;
+	const size_t used = buffer->buf_size + buffer->trailer;
+	const size_t node = builder->node_pages * page_size;
+	const size_t limit = used > node
+				? myfs_align_up(used, page_size) : node;
 
-	return 1;
+	return used + size > limit;
 }
 
 static void myfs_buffer_finish(struct myfs *myfs,
@@ -112,13 +202,47 @@ static void myfs_buffer_finish(struct myfs *myfs,
 	struct myfs_ctree_level *level = &builder->level[lvl];
 	struct myfs_ctree_buffer *last = &level->node[level->size - 1];
 
+	if (builder->format == MYFS_CTREE_FIXED) {
+		const size_t bytes = last->size * sizeof(le64_t);
+
+		/* the last offset marks the end of the last value */
+		myfs_level_add_restart(level, last);
+		myfs_level_add(myfs, level, level->fixed, bytes);
+		last->buf_size += bytes;
+	}
+
+	for (size_t i = 0; i != last->restarts; ++i) {
+		const le32_t restart = htole32(level->restart[i]);
+
+		myfs_level_add(myfs, level, &restart, sizeof(restart));
+		last->buf_size += sizeof(restart);
+	}
+
 	const size_t page_size = myfs->page_size;
 	const size_t aligned = myfs_align_up(last->buf_size, page_size);
-	const struct myfs_ctree_node_sb sb = { last->size, last->buf_size };
+	const struct myfs_ctree_node_sb sb = {
+		.items = last->size,
+		.size = last->buf_size,
+		.format = builder->format,
+		.restarts = builder->format == MYFS_CTREE_PREFIX
+					? last->restarts : 0
+	};
 
 	struct __myfs_ctree_node_sb __sb;
 
 
+	while (level->keys_size + level->key_size > level->keys_cap) {
+		const size_t cap = level->keys_cap ? level->keys_cap * 2 : 4096;
+
+		assert(level->keys = realloc(level->keys, cap));
+		level->keys_cap = cap;
+	}
+	memcpy((char *)level->keys + level->keys_size, level->key,
+				level->key_size);
+	last->key_offs = level->keys_size;
+	last->key_size = level->key_size;
+	level->keys_size += level->key_size;
+
 	myfs_level_fill(myfs, level, 0, aligned - last->buf_size);
 	myfs_ctree_node_sb2disk(&__sb, &sb);
 	memcpy((char *)level->buf + last->buf_offs, &__sb, sizeof(__sb));
@@ -130,62 +254,281 @@ static int myfs_level_append(struct myfs *myfs,
 			const struct myfs_key *key,
 			const struct myfs_value *value);
 
-static int myfs_level_flush(struct myfs *myfs,
-			struct myfs_ctree_builder *builder, size_t lvl)
+/* Compresses all nodes of the level into zbuf. Nodes that don't compress
+   are stored as is, the reader tells them apart by the compressed size
+   equal to the node size. */
+static void myfs_level_compress(struct myfs *myfs, struct myfs_lz *lz,
+			struct myfs_ctree_level *level)
 {
-	struct myfs_ctree_level *level = &builder->level[lvl];
+	const size_t page_size = myfs->page_size;
+	const size_t cap = myfs_align_up(level->buf_size, page_size);
 
-	if (!level->size)
-		return 0;
+	if (level->zbuf_cap < cap) {
+		assert(level->zbuf = realloc(level->zbuf, cap));
+		level->zbuf_cap = cap;
+	}
+
+	level->zbuf_size = 0;
+	for (size_t i = 0; i != level->size; ++i) {
+		struct myfs_ctree_buffer *buffer = &level->node[i];
+		const char *buf = (const char *)level->buf + buffer->buf_offs;
+		char *zbuf = (char *)level->zbuf + level->zbuf_size;
+		size_t zsize = myfs_lz_compress(lz, buf,
+					buffer->buf_size, zbuf,
+					buffer->buf_size - 1);
+
+		if (!zsize) {
+			memcpy(zbuf, buf, buffer->buf_size);
+			zsize = buffer->buf_size;
+		}
+
+		buffer->zoffs = level->zbuf_size;
+		buffer->zsize = zsize;
+		level->zbuf_size += zsize;
+	}
+
+	memset((char *)level->zbuf + level->zbuf_size, 0,
+				cap - level->zbuf_size);
+}
+
+/* compresses, checksums and writes the nodes, runs in the writer */
+static void myfs_level_write(struct myfs_ctree_flush *flush)
+{
+	struct myfs_ctree_level *level = &flush->level;
+	struct myfs *myfs = flush->myfs;
+
+	if (flush->compress)
+		myfs_level_compress(myfs, flush->lz, level);
 
 	const uint64_t page_size = myfs->page_size;
-	const uint64_t bytes = level->buf_size;
+	const uint64_t bytes = flush->compress
+				? myfs_align_up(level->zbuf_size, page_size)
+				: level->buf_size;
 	const uint64_t pages = bytes / page_size;
+	const void *data = flush->compress ? level->zbuf : level->buf;
 
 	uint64_t offs;
 	int ret = myfs_reserve(myfs, pages, &offs);
 
-	if (ret)
-		return ret;
+	if (!ret)
+		ret = __myfs_block_write(myfs, data, bytes, offs * page_size,
+					flush->prio);
+	if (ret) {
+		flush->err = ret;
+		return;
+	}
 
-	ret = myfs_block_write(myfs, level->buf, bytes, offs * page_size);
-	if (ret)
-		return ret;
+	if (flush->ptr_cap < level->size) {
+		assert(flush->ptr = realloc(flush->ptr,
+					level->size * sizeof(*flush->ptr)));
+		flush->ptr_cap = level->size;
+	}
 
 	for (size_t i = 0; i != level->size; ++i) {
 		const struct myfs_ctree_buffer *buffer = &level->node[i];
-		const void *buf = (const char *)level->buf + buffer->buf_offs;
-		const size_t bytes = buffer->buf_size;
-		const size_t pages = bytes / page_size;
-		const uint64_t csum = myfs_csum(buf, bytes);
-		const struct myfs_ptr ptr = {
-			.offs = offs,
-			.csum = csum,
-			.size = pages
-		};
+		const size_t size = buffer->buf_size / page_size;
+		struct myfs_ptr *ptr = &flush->ptr[i];
+
+		memset(ptr, 0, sizeof(*ptr));
+		ptr->offs = offs;
+		ptr->size = size;
+		if (flush->compress) {
+			const void *buf = (const char *)level->zbuf +
+						buffer->zoffs;
+
+			ptr->offs += buffer->zoffs / page_size;
+			ptr->skip = buffer->zoffs % page_size;
+			ptr->csize = buffer->zsize;
+			ptr->csum = myfs_csum(myfs, buf, buffer->zsize);
+		} else {
+			const void *buf = (const char *)level->buf +
+						buffer->buf_offs;
+
+			ptr->csum = myfs_csum(myfs, buf, buffer->buf_size);
+			offs += size;
+		}
+	}
+	flush->pages = pages;
+	flush->err = 0;
+}
+
+static void myfs_writer_run(struct myfs_ctree_writer *writer)
+{
+	assert(!pthread_mutex_lock(&writer->mtx));
+	while (1) {
+		struct myfs_ctree_flush *flush;
+
+		while (!writer->head && !writer->done)
+			assert(!pthread_cond_wait(&writer->cv, &writer->mtx));
+		if (!writer->head)
+			break;
+
+		flush = writer->head;
+		writer->head = flush->next;
+		if (!writer->head)
+			writer->tail = &writer->head;
+		assert(!pthread_mutex_unlock(&writer->mtx));
+
+		myfs_level_write(flush);
+
+		assert(!pthread_mutex_lock(&writer->mtx));
+		flush->written = 1;
+		assert(!pthread_cond_broadcast(&writer->cv));
+	}
+	assert(!pthread_mutex_unlock(&writer->mtx));
+}
+
+static void *myfs_writer(void *arg)
+{
+	myfs_writer_run(arg);
+	return NULL;
+}
 
+static void myfs_writer_submit(struct myfs_ctree_builder *builder,
+			struct myfs_ctree_flush *flush)
+{
+	struct myfs_ctree_writer *writer = builder->writer;
+
+	if (!writer) {
+		assert(writer = builder->writer = calloc(1, sizeof(*writer)));
+		assert(!pthread_mutex_init(&writer->mtx, NULL));
+		assert(!pthread_cond_init(&writer->cv, NULL));
+		writer->tail = &writer->head;
+		assert(!pthread_create(&writer->thread, NULL, &myfs_writer,
+					writer));
+	}
+
+	flush->busy = 1;
+	flush->written = 0;
+	flush->next = NULL;
+	assert(!pthread_mutex_lock(&writer->mtx));
+	*writer->tail = flush;
+	writer->tail = &flush->next;
+	assert(!pthread_cond_broadcast(&writer->cv));
+	assert(!pthread_mutex_unlock(&writer->mtx));
+}
+
+static void myfs_writer_wait(struct myfs_ctree_builder *builder,
+			struct myfs_ctree_flush *flush)
+{
+	struct myfs_ctree_writer *writer = builder->writer;
+
+	assert(!pthread_mutex_lock(&writer->mtx));
+	while (!flush->written)
+		assert(!pthread_cond_wait(&writer->cv, &writer->mtx));
+	assert(!pthread_mutex_unlock(&writer->mtx));
+	flush->busy = 0;
+}
+
+static void myfs_writer_stop(struct myfs_ctree_builder *builder)
+{
+	struct myfs_ctree_writer *writer = builder->writer;
+
+	if (!writer)
+		return;
+
+	assert(!pthread_mutex_lock(&writer->mtx));
+	writer->done = 1;
+	assert(!pthread_cond_broadcast(&writer->cv));
+	assert(!pthread_mutex_unlock(&writer->mtx));
+	assert(!pthread_join(writer->thread, NULL));
+	assert(!pthread_cond_destroy(&writer->cv));
+	assert(!pthread_mutex_destroy(&writer->mtx));
+	free(writer);
+	builder->writer = NULL;
+}
+
+/* waits for the write of the previous buffer of the level and appends
+   pointers to the written nodes to the parent level */
+static int myfs_level_wait(struct myfs *myfs,
+			struct myfs_ctree_builder *builder, size_t lvl)
+{
+	struct myfs_ctree_flush *flush = builder->level[lvl].flush;
+	struct myfs_ctree_level *level;
+
+	if (!flush || !flush->busy)
+		return 0;
+
+	myfs_writer_wait(builder, flush);
+	if (flush->err)
+		return flush->err;
+
+	level = &flush->level;
+	for (size_t i = 0; i != level->size; ++i) {
+		const struct myfs_ctree_buffer *buffer = &level->node[i];
 		struct __myfs_ptr __ptr;
 		struct myfs_key key;
 		struct myfs_value value;
 
-
-		offs += pages;
-
 		key.size = buffer->key_size;
-		key.data = (char *)level->buf + buffer->buf_offs +
-					buffer->key_offs;
+		key.data = (char *)level->keys + buffer->key_offs;
 
-		myfs_ptr2disk(&__ptr, &ptr);
+		myfs_ptr2disk(&__ptr, &flush->ptr[i]);
 		value.size = sizeof(__ptr);
 		value.data = &__ptr;
 
-		ret = myfs_level_append(myfs, builder, lvl + 1,
+		const int ret = myfs_level_append(myfs, builder, lvl + 1,
 					&key, &value);
+
 		if (ret)
 			return ret;
 	}
+	builder->sb.size += flush->pages;
 	myfs_level_reset(level);
-	builder->sb.size += pages;
+	return 0;
+}
+
+/* exchanges the finished nodes of the level with the empty buffers of
+   the previous flush */
+static void myfs_level_swap(struct myfs_ctree_level *l,
+			struct myfs_ctree_level *r)
+{
+	#define SWAP(a, b) do { __typeof__(a) t = a; a = b; b = t; } while (0)
+	SWAP(l->node, r->node);
+	SWAP(l->size, r->size);
+	SWAP(l->cap, r->cap);
+	SWAP(l->buf, r->buf);
+	SWAP(l->buf_size, r->buf_size);
+	SWAP(l->buf_cap, r->buf_cap);
+	SWAP(l->keys, r->keys);
+	SWAP(l->keys_size, r->keys_size);
+	SWAP(l->keys_cap, r->keys_cap);
+	SWAP(l->zbuf, r->zbuf);
+	SWAP(l->zbuf_size, r->zbuf_size);
+	SWAP(l->zbuf_cap, r->zbuf_cap);
+	#undef SWAP
+}
+
+static int myfs_level_flush(struct myfs *myfs,
+			struct myfs_ctree_builder *builder, size_t lvl)
+{
+	struct myfs_ctree_level *level = &builder->level[lvl];
+	struct myfs_ctree_flush *flush;
+
+	if (!level->size)
+		return 0;
+
+	const int ret = myfs_level_wait(myfs, builder, lvl);
+
+	if (ret)
+		return ret;
+
+	if (!(flush = level->flush)) {
+		assert(flush = level->flush = calloc(1, sizeof(*flush)));
+		myfs_level_setup(&flush->level);
+	}
+	if (builder->compress && !flush->lz)
+		assert(flush->lz = malloc(sizeof(*flush->lz)));
+
+	flush->myfs = myfs;
+	if (builder->io_prio)
+		builder->prio = builder->io_prio(builder->io_prio_arg);
+	flush->prio = builder->prio;
+	flush->compress = builder->compress;
+	myfs_level_swap(level, &flush->level);
+	myfs_level_reset(level);
+
+	myfs_writer_submit(builder, flush);
 	return 0;
 }
 
@@ -220,44 +563,103 @@ static int myfs_buffer_add(struct myfs *myfs,
 	memset(buffer, 0, sizeof(*buffer));
 	buffer->buf_offs = level->buf_size;
 	buffer->buf_size = sizeof(struct __myfs_ctree_node_sb);
+	if (builder->format == MYFS_CTREE_FIXED)
+		buffer->trailer = sizeof(le32_t);
 	myfs_level_fill(myfs, level, 0, sizeof(struct __myfs_ctree_node_sb));
 	return 0;
 }
 
+static size_t myfs_item_size(const struct myfs_ctree_builder *builder,
+			const struct myfs_key *key,
+			const struct myfs_value *value,
+			int restart, size_t shared)
+{
+	switch (builder->format) {
+	case MYFS_CTREE_PREFIX:
+		return sizeof(struct __myfs_ctree_prefix_item)
+			+ key->size - shared + value->size
+			+ (restart ? sizeof(le32_t) : 0);
+	case MYFS_CTREE_INDEXED:
+		return sizeof(struct __myfs_ctree_item)
+			+ key->size + value->size + sizeof(le32_t);
+	case MYFS_CTREE_FIXED:
+		return sizeof(le64_t) + value->size + sizeof(le32_t);
+	default:
+		return sizeof(struct __myfs_ctree_item)
+			+ key->size + value->size;
+	}
+}
+
 static int myfs_level_append(struct myfs *myfs,
 			struct myfs_ctree_builder *builder, size_t lvl,
 			const struct myfs_key *key,
 			const struct myfs_value *value)
 {
-	const size_t size = sizeof(struct __myfs_ctree_item)
-				+ key->size + value->size;
+	const int prefix = builder->format == MYFS_CTREE_PREFIX;
+	const int indexed = builder->format == MYFS_CTREE_INDEXED;
+	const int fixed = builder->format == MYFS_CTREE_FIXED;
 
 	struct myfs_ctree_level *level = &builder->level[lvl];
 	struct myfs_ctree_buffer *buffer = &level->node[level->size - 1];
 
-	if (!level->size || myfs_buffer_full(myfs, buffer, size)) {
+	int restart = !level->size || !(buffer->size % MYFS_CTREE_RESTART);
+	size_t shared = 0;
+
+	if (prefix && key->size > UINT16_MAX)
+		return -EINVAL;
+
+	if (fixed && key->size != sizeof(le64_t))
+		return -EINVAL;
+
+	if (prefix && !restart)
+		shared = myfs_level_shared(level, key);
+
+	if (!level->size || myfs_buffer_full(myfs, builder, buffer,
+			myfs_item_size(builder, key, value, restart, shared))) {
 		const int ret = myfs_buffer_add(myfs, builder, lvl);
 
 		if (ret)
 			return ret;
+		restart = 1;
+		shared = 0;
 	}
 
-	const struct myfs_ctree_item item = { key->size, value->size };
-	struct __myfs_ctree_item __item;
-
-	myfs_ctree_item2disk(&__item, &item);
-	myfs_level_add(myfs, level, &__item, sizeof(__item));
-
 	buffer = &level->node[level->size - 1];
-	buffer->buf_size += sizeof(__item);
-	buffer->key_offs = buffer->buf_size;
-	buffer->key_size = key->size;
-	buffer->value_offs = buffer->key_offs + buffer->key_size;
+	if (prefix) {
+		const struct myfs_ctree_prefix_item item = {
+			shared, key->size - shared, value->size
+		};
+		struct __myfs_ctree_prefix_item __item;
+
+		if (restart)
+			myfs_level_add_restart(level, buffer);
+		myfs_ctree_prefix_item2disk(&__item, &item);
+		myfs_level_add(myfs, level, &__item, sizeof(__item));
+		buffer->buf_size += sizeof(__item);
+	} else if (fixed) {
+		/* keys go to the array at the end of the node */
+		myfs_level_add_restart(level, buffer);
+		myfs_level_add_fixed(level, buffer, key);
+		shared = key->size;
+	} else {
+		const struct myfs_ctree_item item = { key->size, value->size };
+		struct __myfs_ctree_item __item;
+
+		if (indexed)
+			myfs_level_add_restart(level, buffer);
+		myfs_ctree_item2disk(&__item, &item);
+		myfs_level_add(myfs, level, &__item, sizeof(__item));
+		buffer->buf_size += sizeof(__item);
+	}
+
+	buffer->value_offs = buffer->buf_size + key->size - shared;
 	buffer->value_size = value->size;
 
-	myfs_level_add(myfs, level, key->data, key->size);
+	myfs_level_add(myfs, level, (const char *)key->data + shared,
+				key->size - shared);
 	myfs_level_add(myfs, level, value->data, value->size);
-	buffer->buf_size += key->size + value->size;
+	myfs_level_set_key(level, key);
+	buffer->buf_size += key->size - shared + value->size;
 	++buffer->size;
 	if (builder->sb.hight < lvl)
 		builder->sb.hight = lvl;
@@ -275,25 +677,35 @@ int myfs_builder_finish(struct myfs *myfs, struct myfs_ctree_builder *builder)
 {
 	struct myfs_ctree_sb *sb = &builder->sb;
 
+	sb->fanout = builder->fanout;
+	sb->node_pages = builder->node_pages;
 	if (!sb->hight && !builder->level[0].size)
 		return 0;
 
 	for (size_t i = 0; i <= sb->hight; ++i) {
-		const size_t h = sb->hight;
 		const struct myfs_ctree_level *level = &builder->level[i];
 		const struct myfs_ctree_buffer *buffer = level->node;
 
+		/* nodes written earlier must reach the parent before we can
+		   tell whether the level is the root */
+		int ret = myfs_level_wait(myfs, builder, i);
+
+		if (ret)
+			return ret;
+
+		const size_t h = sb->hight;
+
 		if (h && i == h && level->size == 1 && buffer->size == 1)
 			break;
 
 		if (level->size) {
 			myfs_buffer_finish(myfs, builder, i);
-
-			const int ret = myfs_level_flush(myfs, builder, i);
-
-			if (ret)
-				return ret;
+			ret = myfs_level_flush(myfs, builder, i);
 		}
+		if (!ret)
+			ret = myfs_level_wait(myfs, builder, i);
+		if (ret)
+			return ret;
 	}
 
 	const int hight = sb->hight;
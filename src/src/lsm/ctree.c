@@ -16,6 +16,8 @@
 */
 #include <alloc/alloc.h>
 #include <lsm/ctree.h>
+#include <misc/lz.h>
+#include <misc/search.h>
 #include <myfs.h>
 
 #include <endian.h>
@@ -25,38 +27,31 @@
 #include <errno.h>
 
 
-static int myfs_node_read(struct myfs *myfs,
-			struct myfs_ctree_node *node,
-			const struct myfs_ptr *ptr)
+static void myfs_node_reset(struct myfs_ctree_node *node)
 {
-	if (!memcmp(&node->ptr, ptr, sizeof(*ptr)))
-		return 0;
-
-	const uint64_t page_size = myfs->page_size;
-	const uint64_t offs = ptr->offs * page_size;
-	const uint64_t size = ptr->size * page_size;
-	int err = 0;
-
-
-	assert(node->buf = realloc(node->buf, size));
-	err = myfs_block_read(myfs, node->buf, size, offs);
-	if (err)
-		return err;
-
-	if (myfs_csum(node->buf, size) != ptr->csum)
-		return -EIO;
+	memset(&node->ptr, 0, sizeof(node->ptr));
+}
 
-	struct __myfs_ctree_node_sb *__sb = node->buf;
-	char *pos = (char *)(__sb + 1);
+/* forgets the buffers of a pinned node, so the node can be read into */
+static void myfs_node_unpin(struct myfs_ctree_node *node)
+{
+	if (!node->pinned)
+		return;
+	memset(node, 0, sizeof(*node));
+}
 
+static void myfs_node_alloc(struct myfs_ctree_node *node, size_t items)
+{
+	assert(node->key = realloc(node->key, items * sizeof(*node->key)));
+	assert(node->value = realloc(node->value,
+				items * sizeof(*node->value)));
+}
 
-	myfs_ctree_node_sb2mem(&node->sb, __sb);
-	node->ptr = *ptr;
+static void myfs_node_decode_plain(struct myfs_ctree_node *node)
+{
+	char *pos = (char *)node->buf + sizeof(struct __myfs_ctree_node_sb);
 
-	assert(node->key = realloc(node->key,
-				node->sb.items * sizeof(*node->key)));
-	assert(node->value = realloc(node->value,
-				node->sb.items * sizeof(*node->value)));
+	myfs_node_alloc(node, node->sb.items);
 
 	for (size_t i = 0; i != node->sb.items; ++i) {
 		struct __myfs_ctree_item *__item =
@@ -74,22 +69,807 @@ static int myfs_node_read(struct myfs *myfs,
 		node->value[i].data = pos;
 		pos += item.value_size;
 	}
+}
+
+/* offset of the r-th restart point of a prefix node */
+static uint32_t myfs_node_restart(const struct myfs_ctree_node *node,
+			size_t r)
+{
+	/* the restart array isn't aligned, it follows the last item */
+	const char *restart = (const char *)node->buf + node->sb.size
+				- node->sb.restarts * sizeof(le32_t);
+	le32_t offs;
+
+	memcpy(&offs, restart + r * sizeof(offs), sizeof(offs));
+	return le32toh(offs);
+}
+
+/* the key at a restart point is stored in full and is used in place */
+static void myfs_node_restart_key(const struct myfs_ctree_node *node,
+			size_t r, struct myfs_key *key)
+{
+	char *pos = (char *)node->buf + myfs_node_restart(node, r);
+	struct __myfs_ctree_prefix_item __item;
+	struct myfs_ctree_prefix_item item;
+
+	memcpy(&__item, pos, sizeof(__item));
+	myfs_ctree_prefix_item2mem(&item, &__item);
+	key->size = item.unshared;
+	key->data = pos + sizeof(__item);
+}
+
+/**
+ * Restores keys of count items of a prefix node starting from the first
+ * one, which must be a restart point. Readers decode one interval between
+ * restart points at a time, when they need an item of it, into arrays of
+ * MYFS_CTREE_RESTART items allocated once. Pinned nodes are shared and
+ * are decoded whole once.
+ **/
+static void myfs_node_decode_prefix(struct myfs_ctree_node *node,
+			size_t first, size_t count)
+{
+	char *begin = (char *)node->buf;
+	char *start = begin + myfs_node_restart(node,
+				first / MYFS_CTREE_RESTART);
+	char *pos = start;
+	size_t bytes = 0;
+
+	/* restored keys need a storage, count how much is needed first */
+	for (size_t i = 0; i != count; ++i) {
+		struct __myfs_ctree_prefix_item *__item =
+				(struct __myfs_ctree_prefix_item *)pos;
+		struct myfs_ctree_prefix_item item;
+
+		myfs_ctree_prefix_item2mem(&item, __item);
+		pos += sizeof(*__item) + item.unshared + item.value_size;
+		if (item.shared)
+			bytes += item.shared + item.unshared;
+	}
+
+	if (count > MYFS_CTREE_RESTART)
+		myfs_node_alloc(node, count);
+	else if (!node->key)
+		myfs_node_alloc(node, MYFS_CTREE_RESTART);
+	if (bytes > node->kcap) {
+		assert(node->kbuf = realloc(node->kbuf, bytes));
+		node->kcap = bytes;
+	}
+
+	char *kbuf = node->kbuf;
+
+	pos = start;
+	for (size_t i = 0; i != count; ++i) {
+		struct __myfs_ctree_prefix_item *__item =
+				(struct __myfs_ctree_prefix_item *)pos;
+		struct myfs_ctree_prefix_item item;
+
+		myfs_ctree_prefix_item2mem(&item, __item);
+		pos += sizeof(*__item);
+
+		/* the node is verified or checked, shared keys fit */
+		if (item.shared) {
+			memcpy(kbuf, node->key[i - 1].data, item.shared);
+			memcpy(kbuf + item.shared, pos, item.unshared);
+			node->key[i].data = kbuf;
+			kbuf += item.shared + item.unshared;
+		} else {
+			node->key[i].data = pos;
+		}
+		node->key[i].size = item.shared + item.unshared;
+		pos += item.unshared;
+
+		node->value[i].size = item.value_size;
+		node->value[i].data = pos;
+		pos += item.value_size;
+	}
+	node->first = first;
+}
+
+/**
+ * Checks that every item of a node lies within sb.size bytes. Nodes that
+ * weren't checksummed yet (lazy verification) go through it before they
+ * are decoded, so a corrupted node is reported as -EIO instead of being
+ * read out of bounds. Verified nodes skip it.
+ **/
+static int myfs_node_check(const struct myfs_ctree_node *node)
+{
+	const uint64_t header = sizeof(struct __myfs_ctree_node_sb);
+	const uint64_t items = node->sb.items;
+	const char *buf = node->buf;
+	uint64_t end = node->sb.size;
+	uint64_t pos = header;
+
+	if (end < header)
+		return -EIO;
+
+	switch (node->sb.format) {
+	case MYFS_CTREE_PLAIN:
+		for (uint64_t i = 0; i != items; ++i) {
+			struct __myfs_ctree_item __item;
+			struct myfs_ctree_item item;
+
+			if (end - pos < sizeof(__item))
+				return -EIO;
+			memcpy(&__item, buf + pos, sizeof(__item));
+			myfs_ctree_item2mem(&item, &__item);
+			pos += sizeof(__item);
+			if (end - pos < (uint64_t)item.key_size +
+						item.value_size)
+				return -EIO;
+			pos += (uint64_t)item.key_size + item.value_size;
+		}
+		return 0;
+	case MYFS_CTREE_PREFIX:
+		if (end - pos < node->sb.restarts * sizeof(le32_t))
+			return -EIO;
+		end -= node->sb.restarts * sizeof(le32_t);
+		for (uint64_t i = 0, key_size = 0; i != items; ++i) {
+			struct __myfs_ctree_prefix_item __item;
+			struct myfs_ctree_prefix_item item;
+
+			/* keys are restored from the restart points */
+			if (!(i % MYFS_CTREE_RESTART) && myfs_node_restart(node,
+						i / MYFS_CTREE_RESTART) != pos)
+				return -EIO;
+			if (end - pos < sizeof(__item))
+				return -EIO;
+			memcpy(&__item, buf + pos, sizeof(__item));
+			myfs_ctree_prefix_item2mem(&item, &__item);
+			if (item.shared > key_size || (item.shared &&
+						!(i % MYFS_CTREE_RESTART)))
+				return -EIO;
+			key_size = item.shared + item.unshared;
+			pos += sizeof(__item);
+			if (end - pos < (uint64_t)item.unshared +
+						item.value_size)
+				return -EIO;
+			pos += (uint64_t)item.unshared + item.value_size;
+		}
+		return 0;
+	case MYFS_CTREE_INDEXED:
+		if (end - pos < items * sizeof(le32_t))
+			return -EIO;
+		end -= items * sizeof(le32_t);
+		for (uint64_t i = 0; i != items; ++i) {
+			struct __myfs_ctree_item __item;
+			struct myfs_ctree_item item;
+			le32_t offs;
+
+			memcpy(&offs, buf + end + i * sizeof(offs),
+						sizeof(offs));
+			pos = le32toh(offs);
+			if (pos < header || pos > end ||
+					end - pos < sizeof(__item))
+				return -EIO;
+			memcpy(&__item, buf + pos, sizeof(__item));
+			myfs_ctree_item2mem(&item, &__item);
+			pos += sizeof(__item);
+			if (end - pos < (uint64_t)item.key_size +
+						item.value_size)
+				return -EIO;
+		}
+		return 0;
+	case MYFS_CTREE_FIXED:
+		if (end - pos < items * sizeof(le64_t) +
+					(items + 1) * sizeof(le32_t))
+			return -EIO;
+		end -= (items + 1) * sizeof(le32_t);
+		for (uint64_t i = 0; i != items + 1; ++i) {
+			le32_t offs;
+
+			memcpy(&offs, buf + end + i * sizeof(offs),
+						sizeof(offs));
+			if (le32toh(offs) < pos ||
+					le32toh(offs) > end - items * sizeof(le64_t))
+				return -EIO;
+			pos = le32toh(offs);
+		}
+		return 0;
+	}
+	return -EIO;
+}
+
+/* compressed nodes are not page aligned, but the block layer works with
+   whole pages (sectors actually), so all pages the node touches are read */
+static uint64_t myfs_node_bytes(const struct myfs *myfs,
+			const struct myfs_ptr *ptr)
+{
+	const uint64_t page_size = myfs->page_size;
+
+	if (ptr->csize)
+		return myfs_align_up(ptr->skip + ptr->csize, page_size);
+	return ptr->size * page_size;
+}
+
+/* raw (if not NULL) holds the pages of the node already read from disk,
+   returns 1 if the node wasn't verified */
+static int myfs_node_read_compressed(struct myfs *myfs,
+			struct myfs_ctree_node *node,
+			const struct myfs_ptr *ptr, const void *raw, int verify)
+{
+	const uint64_t page_size = myfs->page_size;
+	const uint64_t offs = ptr->offs * page_size;
+	const uint64_t size = ptr->size * page_size;
+	const uint64_t bytes = myfs_node_bytes(myfs, ptr);
+	int err = 0;
+
+	if (!raw) {
+		assert(node->zbuf = realloc(node->zbuf, bytes));
+		err = myfs_block_read(myfs, node->zbuf, bytes, offs);
+		raw = node->zbuf;
+	}
+
+	const char *data = (const char *)raw + ptr->skip;
+
+	if (err)
+		return err;
+
+	if (verify && myfs_csum(myfs, data, ptr->csize) != ptr->csum)
+		return -EIO;
+
+	/* nodes that don't compress are stored as is */
+	if (ptr->csize == size)
+		memcpy(node->buf, data, size);
+	else if (myfs_lz_decompress(data, ptr->csize, node->buf, size)
+				!= (long)size)
+		return -EIO;
+
+	myfs_ncache_insert(&myfs->ncache, ptr, node->buf, data, verify);
+	return !verify;
+}
+
+/* reads the node from disk (or raw) into node->buf, with lazy
+   verification the node cache checks the node later and 1 is returned,
+   a node the cache can't hold or one that must be verified is checked
+   right away */
+static int myfs_node_fetch(struct myfs *myfs, struct myfs_ctree_node *node,
+			const struct myfs_ptr *ptr, const void *raw, int verify)
+{
+	const uint64_t page_size = myfs->page_size;
+	const uint64_t offs = ptr->offs * page_size;
+	const uint64_t size = ptr->size * page_size;
+
+	verify = verify || !myfs_ncache_lazy(&myfs->ncache, size);
+	int err = 0;
+
+	if (ptr->csize)
+		return myfs_node_read_compressed(myfs, node, ptr, raw, verify);
+
+	if (raw)
+		memcpy(node->buf, raw, size);
+	else
+		err = myfs_block_read(myfs, node->buf, size, offs);
+	if (err)
+		return err;
+
+	if (verify && myfs_csum(myfs, node->buf, size) != ptr->csum)
+		return -EIO;
+
+	myfs_ncache_insert(&myfs->ncache, ptr, node->buf, NULL, verify);
+	return !verify;
+}
+
+/* nodes kept after the read (pinned ones) are read with verify, the
+   lazy check of the cache may find them bad when they are in use */
+static int __myfs_node_read(struct myfs *myfs,
+			struct myfs_ctree_node *node,
+			const struct myfs_ptr *ptr, const void *raw, int verify)
+{
+	if (!memcmp(&node->ptr, ptr, sizeof(*ptr)))
+		return 0;
+
+	const uint64_t size = ptr->size * myfs->page_size;
+	const uint16_t format = node->sb.format;
+	int err;
+
+
+	myfs_node_unpin(node);
+	myfs_node_reset(node);
+	myfs_ncache_put(node->buf);
+	node->buf = NULL;
+
+	/* a cached node is shared with the cache, not copied */
+	err = myfs_ncache_get(&myfs->ncache, ptr, size, &node->buf);
+	/* the cached copy isn't checked yet, check one of our own */
+	if (err == 1 && verify) {
+		myfs_ncache_put(node->buf);
+		err = -ENOENT;
+	}
+	if (err == -ENOENT) {
+		node->buf = myfs_ncache_alloc(size);
+		err = myfs_node_fetch(myfs, node, ptr, raw, verify);
+	}
+	if (err < 0)
+		return err;
+
+	const int unverified = err;
+
+	myfs_ctree_node_sb2mem(&node->sb, node->buf);
+	/* the item arrays of a prefix node hold an interval at least */
+	if (node->sb.format != format) {
+		free(node->key);
+		free(node->value);
+		node->key = NULL;
+		node->value = NULL;
+	}
+	if (node->sb.size > size)
+		return -EIO;
+
+	const uint64_t restarts = (node->sb.items + MYFS_CTREE_RESTART - 1)
+				/ MYFS_CTREE_RESTART;
+
+	/* lookups rely on a restart point every MYFS_CTREE_RESTART items */
+	if (node->sb.format == MYFS_CTREE_PREFIX &&
+				node->sb.restarts != restarts)
+		return -EIO;
+
+	/* the node wasn't checksummed yet, don't trust its layout */
+	if (unverified && myfs_node_check(node))
+		return -EIO;
+	err = 0;
+
+	switch (node->sb.format) {
+	case MYFS_CTREE_PLAIN:
+		myfs_node_decode_plain(node);
+		break;
+	case MYFS_CTREE_PREFIX:
+		/* intervals between restart points are decoded on demand */
+		if (node->sb.size < sizeof(struct __myfs_ctree_node_sb) +
+					node->sb.restarts * sizeof(le32_t))
+			err = -EIO;
+		node->first = UINT32_MAX;
+		break;
+	case MYFS_CTREE_INDEXED:
+		/* items are accessed in place through the offset table */
+		if (node->sb.size < sizeof(struct __myfs_ctree_node_sb) +
+					node->sb.items * sizeof(le32_t))
+			err = -EIO;
+		break;
+	case MYFS_CTREE_FIXED:
+		if (node->sb.size < sizeof(struct __myfs_ctree_node_sb) +
+					node->sb.items * sizeof(le64_t) +
+					(node->sb.items + 1) * sizeof(le32_t))
+			err = -EIO;
+		break;
+	default:
+		err = -EIO;
+		break;
+	}
+
+	if (err) {
+		myfs_node_reset(node);
+		return err;
+	}
+	node->ptr = *ptr;
 	return 0;
 }
 
-static void myfs_node_reset(struct myfs_ctree_node *node)
+static int myfs_node_read(struct myfs *myfs,
+			struct myfs_ctree_node *node,
+			const struct myfs_ptr *ptr)
 {
-	memset(&node->ptr, 0, sizeof(node->ptr));
+	return __myfs_node_read(myfs, node, ptr, NULL, 0);
 }
 
 static void myfs_node_release(struct myfs_ctree_node *node)
 {
-	free(node->buf);
+	if (node->pinned) {
+		myfs_node_unpin(node);
+		return;
+	}
+	myfs_ncache_put(node->buf);
 	free(node->key);
 	free(node->value);
+	free(node->kbuf);
+	free(node->zbuf);
 	memset(node, 0, sizeof(*node));
 }
 
+static uint32_t myfs_node_offs(const struct myfs_ctree_node *node, size_t i)
+{
+	const size_t entries = node->sb.format == MYFS_CTREE_FIXED
+				? node->sb.items + 1 : node->sb.items;
+	const char *index = (const char *)node->buf + node->sb.size
+				- entries * sizeof(le32_t);
+	le32_t offs;
+
+	memcpy(&offs, index + i * sizeof(offs), sizeof(offs));
+	return le32toh(offs);
+}
+
+static const void *myfs_node_fixed_keys(const struct myfs_ctree_node *node)
+{
+	return (const char *)node->buf + node->sb.size
+				- (node->sb.items + 1) * sizeof(le32_t)
+				- node->sb.items * sizeof(le64_t);
+}
+
+/* items of prefix nodes are decoded an interval at a time, so a key or
+   value is valid until an item of another interval is taken */
+static void myfs_node_item(struct myfs_ctree_node *node, size_t i,
+			struct myfs_key *key, struct myfs_value *value)
+{
+	if (node->sb.format == MYFS_CTREE_FIXED) {
+		char *buf = node->buf;
+		const uint32_t offs = myfs_node_offs(node, i);
+
+		if (key) {
+			key->size = sizeof(le64_t);
+			key->data = (char *)myfs_node_fixed_keys(node)
+						+ i * sizeof(le64_t);
+		}
+		if (value) {
+			value->size = myfs_node_offs(node, i + 1) - offs;
+			value->data = buf + offs;
+		}
+		return;
+	}
+
+	if (node->sb.format == MYFS_CTREE_PREFIX && !node->pinned) {
+		const size_t first = i - i % MYFS_CTREE_RESTART;
+		const size_t count = node->sb.items - first;
+
+		if (first != node->first)
+			myfs_node_decode_prefix(node, first,
+						count < MYFS_CTREE_RESTART
+						? count : MYFS_CTREE_RESTART);
+		i -= first;
+	}
+
+	if (node->sb.format != MYFS_CTREE_INDEXED) {
+		if (key)
+			*key = node->key[i];
+		if (value)
+			*value = node->value[i];
+		return;
+	}
+
+	char *buf = node->buf;
+	const uint32_t offs = myfs_node_offs(node, i);
+	struct __myfs_ctree_item __item;
+	struct myfs_ctree_item item;
+
+	memcpy(&__item, buf + offs, sizeof(__item));
+	myfs_ctree_item2mem(&item, &__item);
+
+	char *data = buf + offs + sizeof(__item);
+
+	if (key) {
+		key->size = item.key_size;
+		key->data = data;
+	}
+	if (value) {
+		value->size = item.value_size;
+		value->data = data + item.key_size;
+	}
+}
+
+static int myfs_node_cmp(struct myfs_ctree_node *node, size_t i,
+			struct myfs_query *query)
+{
+	struct myfs_key key;
+
+	myfs_node_item(node, i, &key, NULL);
+	return query->cmp(query, &key);
+}
+
+
+static void myfs_node_child(struct myfs_ctree_node *node, size_t i,
+			struct myfs_ptr *ptr)
+{
+	const struct __myfs_ptr *__ptr;
+	struct myfs_value value;
+
+	myfs_node_item(node, i, NULL, &value);
+	__ptr = value.data;
+
+	assert(value.size == sizeof(*__ptr));
+	memset(ptr, 0, sizeof(*ptr));
+	myfs_ptr2mem(ptr, __ptr);
+}
+
+static int myfs_ptr_equal(const struct myfs_ptr *l, const struct myfs_ptr *r)
+{
+	return l->offs == r->offs && l->csum == r->csum &&
+		l->size == r->size && l->skip == r->skip &&
+		l->csize == r->csize;
+}
+
+
+static int myfs_pin_cmp(const struct myfs_ptr *l, const struct myfs_ptr *r)
+{
+	if (l->offs != r->offs)
+		return l->offs < r->offs ? -1 : 1;
+	if (l->skip != r->skip)
+		return l->skip < r->skip ? -1 : 1;
+	return 0;
+}
+
+static int myfs_pin_node_cmp(const void *l, const void *r)
+{
+	const struct myfs_ctree_node *ln = l;
+	const struct myfs_ctree_node *rn = r;
+
+	return myfs_pin_cmp(&ln->ptr, &rn->ptr);
+}
+
+static void myfs_pin_release(struct myfs_ctree_pin *pin)
+{
+	for (size_t i = 0; i != pin->size; ++i)
+		myfs_node_release(&pin->node[i]);
+	free(pin->node);
+	free(pin);
+}
+
+void myfs_ctree_pin(struct myfs *myfs, struct myfs_ctree_sb *sb)
+{
+	struct myfs_ctree_pin *pin;
+	struct myfs_ptr *ptr, *next = NULL;
+	size_t size = 1, cap = 1, next_cap = 0;
+	int err = 0;
+
+	sb->pin = NULL;
+	if (sb->hight < 2)
+		return;
+
+	assert(pin = calloc(1, sizeof(*pin)));
+	atomic_init(&pin->refcnt, 1);
+	assert(ptr = malloc(sizeof(*ptr)));
+	*ptr = sb->root;
+
+	/* level by level, children of a level are the next level */
+	for (size_t h = sb->hight; !err && h > 1; --h) {
+		size_t count = 0;
+
+		assert(pin->node = realloc(pin->node,
+				(pin->size + size) * sizeof(*pin->node)));
+		for (size_t i = 0; i != size; ++i) {
+			struct myfs_ctree_node *node = &pin->node[pin->size];
+
+			memset(node, 0, sizeof(*node));
+			if ((err = __myfs_node_read(myfs, node, &ptr[i],
+						NULL, 1))) {
+				myfs_node_release(node);
+				break;
+			}
+
+			/* the raw copy of a compressed node isn't needed */
+			free(node->zbuf);
+			node->zbuf = NULL;
+			++pin->size;
+
+			if (h != 2 && count + node->sb.items > next_cap) {
+				next_cap = 2 * (count + node->sb.items);
+				assert(next = realloc(next,
+						next_cap * sizeof(*next)));
+			}
+			for (size_t j = 0; h != 2 && j != node->sb.items; ++j)
+				myfs_node_child(node, j, &next[count++]);
+
+			/* readers share the node and only access it through
+			   pinned copies, so it's decoded whole and never again */
+			if (node->sb.format == MYFS_CTREE_PREFIX)
+				myfs_node_decode_prefix(node, 0,
+							node->sb.items);
+		}
+
+		#define SWAP(a, b) do { __typeof__(a) t = a; a = b; b = t; } while (0)
+		SWAP(ptr, next);
+		SWAP(cap, next_cap);
+		#undef SWAP
+		size = count;
+	}
+	free(ptr);
+	free(next);
+
+	if (err) {
+		myfs_pin_release(pin);
+		return;
+	}
+
+	qsort(pin->node, pin->size, sizeof(*pin->node), &myfs_pin_node_cmp);
+	sb->pin = pin;
+}
+
+void myfs_ctree_pin_get(struct myfs_ctree_pin *pin)
+{
+	if (pin)
+		atomic_fetch_add_explicit(&pin->refcnt, 1,
+					memory_order_relaxed);
+}
+
+void myfs_ctree_pin_put(struct myfs_ctree_pin *pin)
+{
+	if (!pin)
+		return;
+	if (atomic_fetch_sub_explicit(&pin->refcnt, 1,
+				memory_order_acq_rel) == 1)
+		myfs_pin_release(pin);
+}
+
+static const struct myfs_ctree_node *myfs_pin_find(
+			const struct myfs_ctree_pin *pin,
+			const struct myfs_ptr *ptr)
+{
+	size_t l = 0, r = pin->size;
+
+	while (l < r) {
+		const size_t m = l + (r - l) / 2;
+		const int cmp = myfs_pin_cmp(&pin->node[m].ptr, ptr);
+
+		if (!cmp)
+			return &pin->node[m];
+		if (cmp < 0)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return NULL;
+}
+
+/* reads a non-leaf node of the iterator path, pinned nodes are shared */
+static int myfs_ctree_it_read_inner(struct myfs *myfs,
+			struct myfs_ctree_it *it, size_t lvl,
+			const struct myfs_ptr *ptr)
+{
+	struct myfs_ctree_node *node = &it->node[lvl];
+	const struct myfs_ctree_node *pinned = NULL;
+
+	if (it->sb.pin)
+		pinned = myfs_pin_find(it->sb.pin, ptr);
+
+	if (!pinned)
+		return myfs_node_read(myfs, node, ptr);
+
+	myfs_node_release(node);
+	*node = *pinned;
+	node->pinned = 1;
+	return 0;
+}
+
+static int myfs_ctree_ra_wait(struct myfs_ctree_ra *ra)
+{
+	int err;
+
+	if (!ra->pending)
+		return 0;
+
+	bio_wait(&ra->bio);
+	err = ra->bio.err;
+	bio_release(&ra->bio);
+	ra->pending = 0;
+	if (err)
+		ra->size = 0;
+	return err;
+}
+
+/* forgets about the leaves read ahead, e.g. when the iterator seeks */
+static void myfs_ctree_ra_reset(struct myfs_ctree_it *it)
+{
+	struct myfs_ctree_ra *ra = it->ra;
+
+	if (!ra)
+		return;
+	myfs_ctree_ra_wait(ra);
+	ra->size = 0;
+}
+
+/* reads the i-th child of the grandparent of the current leaf, if any */
+static int myfs_ctree_ra_parent(struct myfs *myfs,
+			struct myfs_ctree_it *it, size_t i,
+			struct myfs_ctree_node *node)
+{
+	struct myfs_ctree_node *grand = &it->node[2];
+	const struct myfs_ctree_node *pinned = NULL;
+	struct myfs_ptr ptr;
+
+	if (it->sb.hight < 3 || i >= grand->sb.items)
+		return -ENOENT;
+
+	myfs_node_child(grand, i, &ptr);
+	if (it->sb.pin)
+		pinned = myfs_pin_find(it->sb.pin, &ptr);
+	if (!pinned)
+		return myfs_node_read(myfs, node, &ptr);
+
+	myfs_node_release(node);
+	*node = *pinned;
+	node->pinned = 1;
+	return 0;
+}
+
+/**
+ * Submits a read of the leaves following the pos-th child of the current
+ * parent. When the parent runs out of children the window goes on with
+ * the following parents under the same grandparent, so a scan doesn't
+ * stall on every parent boundary. Those parents are usually pinned or
+ * cached, otherwise they are read synchronously here.
+ **/
+static void myfs_ctree_ra_submit(struct myfs *myfs, struct myfs_ctree_it *it,
+			size_t pos)
+{
+	struct myfs_ctree_ra *ra = it->ra;
+	struct myfs_ctree_node next;
+	struct myfs_ctree_node *parent = &it->node[1];
+	size_t size = 0, bytes = 0, sibling = it->pos[2] + 1;
+
+	assert(!ra->pending);
+	memset(&next, 0, sizeof(next));
+	while (size != ra->window) {
+		if (pos == parent->sb.items) {
+			if (myfs_ctree_ra_parent(myfs, it, sibling++, &next))
+				break;
+			parent = &next;
+			pos = 0;
+			continue;
+		}
+
+		myfs_node_child(parent, pos++, &ra->ptr[size]);
+		ra->offs[size] = bytes;
+		bytes += myfs_node_bytes(myfs, &ra->ptr[size]);
+		++size;
+	}
+	myfs_node_release(&next);
+
+	ra->size = size;
+	if (!size)
+		return;
+
+	if (bytes > ra->cap) {
+		assert(ra->buf = realloc(ra->buf, bytes));
+		ra->cap = bytes;
+	}
+
+	bio_setup(&ra->bio, myfs->bdev);
+	ra->bio.flags = BIO_READ;
+	ra->bio.prio = BIO_PRIO_READ;
+	for (size_t i = 0; i != size; ++i)
+		bio_add_vec(&ra->bio, (char *)ra->buf + ra->offs[i],
+					ra->ptr[i].offs * myfs->page_size,
+					myfs_node_bytes(myfs, &ra->ptr[i]));
+	ra->pending = 1;
+	bio_submit_async(&ra->bio);
+}
+
+/* reads the leaf the parent points to at pos[1] through the readahead */
+static int myfs_ctree_it_read_leaf(struct myfs *myfs, struct myfs_ctree_it *it,
+			const struct myfs_ptr *ptr)
+{
+	struct myfs_ctree_ra *ra = it->ra;
+	size_t i = 0;
+	int err;
+
+	if (!ra) {
+		assert(ra = it->ra = calloc(1, sizeof(*ra)));
+		ra->window = MYFS_CTREE_RA_MIN;
+	}
+
+	if ((err = myfs_ctree_ra_wait(ra)))
+		return err;
+
+	while (i != ra->size && !myfs_ptr_equal(&ra->ptr[i], ptr))
+		++i;
+
+	if (i == ra->size) {
+		/* not read ahead, read it along with the next window */
+		ra->window = MYFS_CTREE_RA_MIN;
+		myfs_ctree_ra_submit(myfs, it, it->pos[1]);
+		if ((err = myfs_ctree_ra_wait(ra)))
+			return err;
+		i = 0;
+	}
+
+	err = __myfs_node_read(myfs, &it->node[0], ptr,
+				(const char *)ra->buf + ra->offs[i], 0);
+	if (err || i + 1 != ra->size)
+		return err;
+
+	/* the whole window was consumed sequentially, grow it */
+	if (ra->window < MYFS_CTREE_RA_MAX)
+		ra->window *= 2;
+	myfs_ctree_ra_submit(myfs, it, it->pos[1] + 1);
+	return 0;
+}
 
 void myfs_ctree_it_setup(struct myfs_ctree_it *it,
 			const struct myfs_ctree_sb *sb)
@@ -102,6 +882,11 @@ void myfs_ctree_it_release(struct myfs_ctree_it *it)
 {
 	for (size_t i = 0; i != MYFS_MAX_CTREE_HIGHT; ++i)
 		myfs_node_release(&it->node[i]);
+	if (it->ra) {
+		myfs_ctree_ra_wait(it->ra);
+		free(it->ra->buf);
+		free(it->ra);
+	}
 	memset(it, 0, sizeof(*it));
 }
 
@@ -136,22 +921,86 @@ static int myfs_ctree_it_advance(struct myfs *myfs, struct myfs_ctree_it *it)
 
 	++it->pos[top];
 	for (size_t i = top; i; --i) {
-		const size_t pos = it->pos[i];
-		const struct myfs_value value = it->node[i].value[pos];
-		const struct __myfs_ptr *__ptr = value.data;
 		struct myfs_ptr ptr;
+		int err;
 
-		assert(value.size == sizeof(*__ptr));
-		myfs_ptr2mem(&ptr, __ptr);
+		myfs_node_child(&it->node[i], it->pos[i], &ptr);
+		if (i == 1)
+			err = myfs_ctree_it_read_leaf(myfs, it, &ptr);
+		else
+			err = myfs_ctree_it_read_inner(myfs, it, i - 1, &ptr);
+
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+static int myfs_ctree_it_retreat(struct myfs *myfs, struct myfs_ctree_it *it)
+{
+	const size_t hight = it->sb.hight;
+
+	size_t top = 0;
+
+	if (it->pos[0]) {
+		--it->pos[0];
+		return 0;
+	}
+
+	for (size_t i = 1; i < hight; ++i) {
+		if (it->pos[i]) {
+			top = i;
+			break;
+		}
+	}
+
+	/* stepped back from the first item */
+	if (!top) {
+		it->pos[0] = it->node[0].sb.items;
+		return 0;
+	}
+
+	for (size_t i = 0; i != top; ++i)
+		myfs_node_reset(&it->node[i]);
+
+	--it->pos[top];
+	for (size_t i = top; i; --i) {
+		struct myfs_ptr ptr;
+		int err;
 
-		const int err = myfs_node_read(myfs, &it->node[i - 1], &ptr);
+		myfs_node_child(&it->node[i], it->pos[i], &ptr);
+		if (i == 1)
+			err = myfs_node_read(myfs, &it->node[0], &ptr);
+		else
+			err = myfs_ctree_it_read_inner(myfs, it, i - 1, &ptr);
 
 		if (err)
 			return err;
+		it->pos[i - 1] = it->node[i - 1].sb.items - 1;
 	}
 	return 0;
 }
 
+int myfs_ctree_it_prev(struct myfs *myfs, struct myfs_ctree_it *it)
+{
+	if (!it->sb.hight)
+		return 0;
+
+	const int err = myfs_ctree_it_retreat(myfs, it);
+
+	if (err)
+		return err;
+
+	if (!myfs_ctree_it_valid(it)) {
+		memset(&it->key, 0, sizeof(it->key));
+		memset(&it->value, 0, sizeof(it->value));
+		return 0;
+	}
+
+	myfs_node_item(&it->node[0], it->pos[0], &it->key, &it->value);
+	return 0;
+}
+
 int myfs_ctree_it_next(struct myfs *myfs, struct myfs_ctree_it *it)
 {
 	if (!myfs_ctree_it_valid(it))
@@ -168,21 +1017,67 @@ int myfs_ctree_it_next(struct myfs *myfs, struct myfs_ctree_it *it)
 		return 0;
 	}
 
-	it->key = it->node[0].key[it->pos[0]];
-	it->value = it->node[0].value[it->pos[0]];
+	myfs_node_item(&it->node[0], it->pos[0], &it->key, &it->value);
 	return 0;
 }
 
 
-static size_t myfs_node_lookup(const struct myfs_ctree_node *node,
+static int myfs_node_restart_cmp(const struct myfs_ctree_node *node,
+			size_t r, struct myfs_query *query)
+{
+	struct myfs_key key;
+
+	myfs_node_restart_key(node, r, &key);
+	return query->cmp(query, &key);
+}
+
+static size_t myfs_node_lookup_prefix(struct myfs_ctree_node *node,
+			struct myfs_query *query)
+{
+	size_t l = 0, r = node->sb.restarts;
+
+	/* find the first restart point with key not less than the query,
+	   the answer lies between it and the previous restart point, only
+	   that interval is decoded */
+	while (l < r) {
+		const size_t m = l + (r - l) / 2;
+
+		if (myfs_node_restart_cmp(node, m, query) >= 0)
+			r = m;
+		else
+			l = m + 1;
+	}
+
+	const size_t end = l != node->sb.restarts
+				? l * MYFS_CTREE_RESTART : node->sb.items;
+	size_t pos = l ? (l - 1) * MYFS_CTREE_RESTART + 1 : 0;
+
+	while (pos < end && myfs_node_cmp(node, pos, query) < 0)
+		++pos;
+	return pos;
+}
+
+static size_t myfs_node_lookup(struct myfs_ctree_node *node,
 			struct myfs_query *query)
 {
 	size_t l = 0, r = node->sb.items;
 
+	if (node->sb.format == MYFS_CTREE_PREFIX)
+		return myfs_node_lookup_prefix(node, query);
+
+	if (node->sb.format == MYFS_CTREE_FIXED && query->key &&
+				query->key->size == sizeof(le64_t)) {
+		le64_t key;
+
+		memcpy(&key, query->key->data, sizeof(key));
+		return myfs_search_le64(myfs_node_fixed_keys(node),
+					node->sb.items, le64toh(key));
+	}
+
 	while (l < r) {
 		const size_t m = l + (r - l) / 2;
 
-		if (query->cmp(query, &node->key[m]) >= 0)
+		if (myfs_node_cmp(node, m, query) >= 0)
 			r = m;
 		else
 			l = m + 1;
@@ -199,10 +1094,12 @@ int myfs_ctree_it_find(struct myfs *myfs, struct myfs_ctree_it *it,
 	if (!hight)
 		return 0;
 
+	myfs_ctree_ra_reset(it);
+
 	for (size_t i = hight; i > 1; --i) {
 		struct __myfs_ptr __ptr;
 		struct myfs_ctree_node *node = &it->node[i - 1];
-		const int err = myfs_node_read(myfs, node, &ptr);
+		const int err = myfs_ctree_it_read_inner(myfs, it, i - 1, &ptr);
 
 		if (err)
 			return err;
@@ -212,9 +1109,12 @@ int myfs_ctree_it_find(struct myfs *myfs, struct myfs_ctree_it *it,
 					node->sb.items - 1);
 		#undef MIN
 
+		struct myfs_value value;
+
 		it->pos[i - 1] = pos;
-		assert(node->value[pos].size == sizeof(__ptr));
-		memcpy(&__ptr, node->value[pos].data, sizeof(__ptr));
+		myfs_node_item(node, pos, NULL, &value);
+		assert(value.size == sizeof(__ptr));
+		memcpy(&__ptr, value.data, sizeof(__ptr));
 		myfs_ptr2mem(&ptr, &__ptr);
 	}
 
@@ -226,8 +1126,7 @@ int myfs_ctree_it_find(struct myfs *myfs, struct myfs_ctree_it *it,
 
 	it->pos[0] = myfs_node_lookup(node, query);
 	if (myfs_ctree_it_valid(it)) {
-		it->key = it->node[0].key[it->pos[0]];
-		it->value = it->node[0].value[it->pos[0]];
+		myfs_node_item(node, it->pos[0], &it->key, &it->value);
 	} else {
 		memset(&it->key, 0, sizeof(it->key));
 		memset(&it->value, 0, sizeof(it->value));
@@ -246,7 +1145,7 @@ static int myfs_ctree_reset_cmp(struct myfs_query *query,
 
 int myfs_ctree_it_reset(struct myfs *myfs, struct myfs_ctree_it *it)
 {
-	struct myfs_query q = { &myfs_ctree_reset_cmp, NULL };
+	struct myfs_query q = { &myfs_ctree_reset_cmp, NULL, NULL };
 
 	return myfs_ctree_it_find(myfs, it, &q);
 }
@@ -274,6 +1173,48 @@ out:
 	return err;
 }
 
+/* the current leaf of the iterator contains the answer for the query if
+   its first key isn't greater and its last key isn't less than the query */
+static int myfs_ctree_it_covers(struct myfs_ctree_it *it,
+			struct myfs_query *query)
+{
+	struct myfs_ctree_node *leaf = &it->node[0];
+
+	if (!it->sb.hight || !leaf->buf || !leaf->sb.items)
+		return 0;
+
+	return myfs_node_cmp(leaf, 0, query) <= 0 &&
+		myfs_node_cmp(leaf, leaf->sb.items - 1, query) >= 0;
+}
+
+int myfs_ctree_multi_lookup(struct myfs *myfs, const struct myfs_ctree_sb *sb,
+			struct myfs_query **query, size_t size)
+{
+	struct myfs_ctree_it it;
+	int err = 0;
+
+	myfs_ctree_it_setup(&it, sb);
+	for (size_t i = 0; !err && i != size; ++i) {
+		struct myfs_query *q = query[i];
+
+		if (myfs_ctree_it_covers(&it, q)) {
+			it.pos[0] = myfs_node_lookup(&it.node[0], q);
+			myfs_node_item(&it.node[0], it.pos[0],
+						&it.key, &it.value);
+		} else if ((err = myfs_ctree_it_find(myfs, &it, q))) {
+			break;
+		}
+
+		if (!myfs_ctree_it_valid(&it))
+			continue;
+
+		if (!q->cmp(q, &it.key))
+			err = q->emit(q, &it.key, &it.value);
+	}
+	myfs_ctree_it_release(&it);
+	return err;
+}
+
 int myfs_ctree_range(struct myfs *myfs, const struct myfs_ctree_sb *sb,
 			struct myfs_query *query)
 {
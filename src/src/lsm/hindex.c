@@ -0,0 +1,195 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <lsm/hindex.h>
+#include <misc/xxhash.h>
+
+#include <string.h>
+#include <assert.h>
+
+
+static struct myfs_hindex_table *myfs_hindex_table_create(
+			struct myfs_arena *arena, size_t bits)
+{
+	struct myfs_hindex_table *table = myfs_arena_alloc(arena,
+				sizeof(*table) +
+				(sizeof(table->cell[0]) << bits));
+
+	table->mask = ((size_t)1 << bits) - 1;
+	return table;
+}
+
+void myfs_hindex_setup(struct myfs_hindex *index, struct myfs_arena *arena)
+{
+	atomic_init(&index->table, myfs_hindex_table_create(arena,
+				MYFS_HINDEX_MIN_BITS));
+	atomic_init(&index->size, 0);
+	assert(!pthread_rwlock_init(&index->lock, NULL));
+}
+
+void myfs_hindex_release(struct myfs_hindex *index)
+{
+	assert(!pthread_rwlock_destroy(&index->lock));
+}
+
+static uint64_t myfs_hindex_hash(const struct myfs_key *key)
+{
+	const uint64_t hash = XXH64(key->data, key->size, 0);
+
+	return hash ? hash : 1;
+}
+
+static int myfs_hindex_equal(const struct myfs_key *l,
+			const struct myfs_key *r)
+{
+	return l->size == r->size && !memcmp(l->data, r->data, l->size);
+}
+
+/* Returns the slot of the key or NULL if the key was added to the table,
+   the new slot is stored in the empty cell the key hashes to. */
+static struct myfs_hindex_slot *myfs_hindex_table_insert(
+			struct myfs_hindex_table *table, uint64_t hash,
+			struct myfs_hindex_slot *slot)
+{
+	for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+		struct myfs_hindex_cell *cell = &table->cell[i];
+		uint64_t h = atomic_load_explicit(&cell->hash,
+					memory_order_acquire);
+
+		if (!h && atomic_compare_exchange_strong_explicit(&cell->hash,
+					&h, hash, memory_order_acq_rel,
+					memory_order_acquire)) {
+			atomic_store_explicit(&cell->slot, slot,
+						memory_order_release);
+			return NULL;
+		}
+
+		if (h != hash)
+			continue;
+
+		struct myfs_hindex_slot *other;
+
+		/* a different key with the same hash is being added */
+		while (!(other = atomic_load_explicit(&cell->slot,
+					memory_order_acquire)));
+
+		if (myfs_hindex_equal(other->key, slot->key))
+			return other;
+	}
+}
+
+static void myfs_hindex_grow(struct myfs_hindex *index,
+			struct myfs_arena *arena)
+{
+	struct myfs_hindex_table *old, *new;
+	size_t bits = 0;
+
+	assert(!pthread_rwlock_wrlock(&index->lock));
+	old = atomic_load_explicit(&index->table, memory_order_relaxed);
+	if (2 * atomic_load_explicit(&index->size, memory_order_relaxed) <=
+				old->mask + 1) {
+		assert(!pthread_rwlock_unlock(&index->lock));
+		return;
+	}
+
+	while (((size_t)1 << bits) <= old->mask)
+		++bits;
+	new = myfs_hindex_table_create(arena, bits + 1);
+
+	for (size_t i = 0; i != old->mask + 1; ++i) {
+		struct myfs_hindex_cell *cell = &old->cell[i];
+		struct myfs_hindex_slot *slot = atomic_load_explicit(
+					&cell->slot, memory_order_relaxed);
+
+		if (slot)
+			myfs_hindex_table_insert(new, atomic_load_explicit(
+					&cell->hash, memory_order_relaxed),
+					slot);
+	}
+	atomic_store_explicit(&index->table, new, memory_order_release);
+	assert(!pthread_rwlock_unlock(&index->lock));
+}
+
+static void *__myfs_hindex_insert(struct myfs_hindex *index,
+			struct myfs_arena *arena, const struct myfs_key *key,
+			void *value, int replace)
+{
+	const uint64_t hash = myfs_hindex_hash(key);
+	struct myfs_hindex_slot *slot = myfs_arena_alloc(arena, sizeof(*slot));
+	struct myfs_hindex_slot *old;
+	void *prev = NULL;
+	size_t size = 0;
+
+	slot->key = key;
+	atomic_init(&slot->value, value);
+
+	assert(!pthread_rwlock_rdlock(&index->lock));
+	struct myfs_hindex_table *table = atomic_load_explicit(&index->table,
+				memory_order_relaxed);
+
+	old = myfs_hindex_table_insert(table, hash, slot);
+	if (old && replace)
+		atomic_store_explicit(&old->value, value, memory_order_release);
+	else if (old)
+		prev = atomic_load_explicit(&old->value, memory_order_acquire);
+	else
+		size = atomic_fetch_add_explicit(&index->size, 1,
+					memory_order_relaxed) + 1;
+	assert(!pthread_rwlock_unlock(&index->lock));
+
+	if (2 * size > table->mask + 1)
+		myfs_hindex_grow(index, arena);
+	return prev;
+}
+
+void myfs_hindex_insert(struct myfs_hindex *index, struct myfs_arena *arena,
+			const struct myfs_key *key, void *value)
+{
+	__myfs_hindex_insert(index, arena, key, value, 1);
+}
+
+void *myfs_hindex_add(struct myfs_hindex *index, struct myfs_arena *arena,
+			const struct myfs_key *key, void *value)
+{
+	return __myfs_hindex_insert(index, arena, key, value, 0);
+}
+
+void *myfs_hindex_lookup(struct myfs_hindex *index,
+			const struct myfs_key *key)
+{
+	const uint64_t hash = myfs_hindex_hash(key);
+	struct myfs_hindex_table *table = atomic_load_explicit(&index->table,
+				memory_order_acquire);
+
+	for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+		struct myfs_hindex_cell *cell = &table->cell[i];
+		const uint64_t h = atomic_load_explicit(&cell->hash,
+					memory_order_acquire);
+
+		if (!h)
+			return NULL;
+		if (h != hash)
+			continue;
+
+		struct myfs_hindex_slot *slot = atomic_load_explicit(
+					&cell->slot, memory_order_acquire);
+
+		/* the key isn't completely added yet, if it's ours */
+		if (slot && myfs_hindex_equal(slot->key, key))
+			return atomic_load_explicit(&slot->value,
+						memory_order_acquire);
+	}
+}
@@ -14,9 +14,12 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <block/block.h>
 #include <lsm/lsm.h>
 #include <lsm/ctree.h>
+#include <lsm/btree.h>
 #include <lsm/skip.h>
+#include <misc/epoch.h>
 #include <myfs.h>
 
 #include <stdlib.h>
@@ -32,26 +35,162 @@ const struct myfs_lsm_policy myfs_lsm_default_policy = {
 	.flush = &myfs_lsm_flush_default,
 	.merge = &myfs_lsm_merge_default,
 	.insert = &myfs_lsm_insert_default,
+	.insert_batch = &myfs_lsm_insert_batch_default,
 	.lookup = &myfs_lsm_lookup_default,
+	.multi_get = &myfs_lsm_multi_get_default,
 	.range = &myfs_lsm_range_default
 };
 
+const struct myfs_lsm_policy myfs_lsm_btree_policy = {
+	.create = &myfs_lsm_create_btree,
+	.destroy = &myfs_lsm_destroy_btree,
+	.flush = &myfs_lsm_flush_default,
+	.merge = &myfs_lsm_merge_default,
+	.insert = &myfs_lsm_insert_default,
+	.insert_batch = &myfs_lsm_insert_batch_default,
+	.lookup = &myfs_lsm_lookup_default,
+	.multi_get = &myfs_lsm_multi_get_default,
+	.range = &myfs_lsm_range_default
+};
 
 
-struct myfs_item {
-	size_t item_offs;
-	size_t key_size;
-	size_t value_size;
-};
+static struct myfs_mtree *myfs_lsm_mtree_create(struct myfs_lsm *lsm)
+{
+	struct myfs_mtree *mtree = lsm->policy->create(lsm);
+
+	assert(mtree);
+	atomic_init(&mtree->refcnt, 1);
+	return mtree;
+}
+
+static void myfs_lsm_mtree_get(struct myfs_mtree *mtree)
+{
+	if (mtree)
+		atomic_fetch_add_explicit(&mtree->refcnt, 1,
+					memory_order_relaxed);
+}
 
+static void myfs_lsm_mtree_put(struct myfs_lsm *lsm, struct myfs_mtree *mtree)
+{
+	if (!mtree)
+		return;
+	if (atomic_fetch_sub_explicit(&mtree->refcnt, 1,
+				memory_order_acq_rel) == 1)
+		lsm->policy->destroy(lsm, mtree);
+}
 
-struct myfs_items {
-	void *buf;
-	size_t buf_size, buf_cap;
+/* drops retired views no reader can see anymore, with wait set waits
+   for the readers instead; retire_mtx must be held */
+static void __myfs_lsm_reclaim(struct myfs_lsm *lsm, int wait)
+{
+	struct myfs_lsm_view **pos = &lsm->retired;
+
+	while (*pos) {
+		struct myfs_lsm_view *view = *pos;
+
+		if (wait)
+			myfs_epoch_wait(view->epoch);
+
+		if (!myfs_epoch_safe(view->epoch)) {
+			pos = &view->next;
+			continue;
+		}
+
+		*pos = view->next;
+		myfs_lsm_view_put(lsm, view);
+		atomic_fetch_sub_explicit(&lsm->nretired, 1,
+					memory_order_relaxed);
+	}
+}
+
+static void myfs_lsm_reclaim(struct myfs_lsm *lsm, int wait)
+{
+	assert(!pthread_mutex_lock(&lsm->retire_mtx));
+	__myfs_lsm_reclaim(lsm, wait);
+	assert(!pthread_mutex_unlock(&lsm->retire_mtx));
+}
+
+/* Called by flushes and merges once they replaced the view and dropped
+   their locks: waits for the read sections that might still see retired
+   views and drops them, otherwise retired views would keep memtables and
+   pinned nodes until the next view is published, and that might never
+   happen on an idle tree. Read sections are short and never wait for
+   writers, so the wait is bounded by the slowest lookup in flight. */
+static void myfs_lsm_drain(struct myfs_lsm *lsm)
+{
+	if (!atomic_load_explicit(&lsm->nretired, memory_order_relaxed))
+		return;
+	myfs_epoch_wait(myfs_epoch_advance());
+	myfs_lsm_reclaim(lsm, 0);
+}
+
+/* replaces the current view, sblock must be held for write */
+static void myfs_lsm_publish(struct myfs_lsm *lsm)
+{
+	struct myfs_lsm_view *view, *old;
+
+	assert(view = malloc(sizeof(*view)));
+	atomic_init(&view->refcnt, 1);
+	view->c0 = lsm->c0;
+	view->c1 = lsm->c1;
+	memcpy(view->tree, lsm->sb.tree, sizeof(view->tree));
+	view->next = NULL;
+	view->epoch = 0;
+	myfs_lsm_mtree_get(view->c0);
+	myfs_lsm_mtree_get(view->c1);
+	for (size_t i = 0; i != MYFS_MAX_TREES; ++i)
+		myfs_ctree_pin_get(view->tree[i].pin);
+
+	old = atomic_exchange(&lsm->view, view);
+	assert(!pthread_mutex_lock(&lsm->retire_mtx));
+	if (old) {
+		old->epoch = myfs_epoch_advance();
+		old->next = lsm->retired;
+		lsm->retired = old;
+		atomic_fetch_add_explicit(&lsm->nretired, 1,
+					memory_order_relaxed);
+	}
+	__myfs_lsm_reclaim(lsm, 0);
+	assert(!pthread_mutex_unlock(&lsm->retire_mtx));
+}
+
+/* the view returned stays valid until myfs_lsm_view_exit */
+static struct myfs_lsm_view *myfs_lsm_view_enter(struct myfs_lsm *lsm)
+{
+	myfs_epoch_enter();
+	return atomic_load_explicit(&lsm->view, memory_order_acquire);
+}
+
+/* readers don't touch the retired list, the writer that replaced the
+   view drops it with myfs_lsm_drain */
+static void myfs_lsm_view_exit(struct myfs_lsm *lsm)
+{
+	(void) lsm;
+	myfs_epoch_exit();
+}
+
+struct myfs_lsm_view *myfs_lsm_view_get(struct myfs_lsm *lsm)
+{
+	struct myfs_lsm_view *view = myfs_lsm_view_enter(lsm);
+
+	atomic_fetch_add_explicit(&view->refcnt, 1, memory_order_relaxed);
+	myfs_lsm_view_exit(lsm);
+	return view;
+}
+
+void myfs_lsm_view_put(struct myfs_lsm *lsm, struct myfs_lsm_view *view)
+{
+	if (atomic_fetch_sub_explicit(&view->refcnt, 1,
+				memory_order_acq_rel) != 1)
+		return;
+
+	myfs_lsm_mtree_put(lsm, view->c0);
+	myfs_lsm_mtree_put(lsm, view->c1);
+	for (size_t i = 0; i != MYFS_MAX_TREES; ++i)
+		myfs_ctree_pin_put(view->tree[i].pin);
+	free(view);
+}
 
-	struct myfs_item *item;
-	size_t size, cap;
-};
 
 
 static void myfs_items_setup(struct myfs_items *items)
@@ -182,7 +321,7 @@ static void __myfs_merge_setup(struct myfs_merge_ctx *ctx, struct myfs_lsm *lsm)
 }
 
 static int myfs_prepare_range(struct myfs_merge_ctx *ctx, struct myfs_lsm *lsm,
-			struct myfs_query *query)
+			struct myfs_lsm_view *view, struct myfs_query *query)
 {
 	struct myfs_range_query proxy[2];
 	struct myfs *myfs = lsm->myfs;
@@ -194,19 +333,15 @@ static int myfs_prepare_range(struct myfs_merge_ctx *ctx, struct myfs_lsm *lsm,
 	myfs_range_setup(&proxy[0], query, &ctx->m[0]);
 	myfs_range_setup(&proxy[1], query, &ctx->m[1]);
 
-	assert(!pthread_rwlock_rdlock(&lsm->mtlock));
-	err = lsm->c0->range(lsm->c0, &proxy[0].proxy);
-	if (!err && lsm->c1)
-		err = lsm->c1->range(lsm->c1, &proxy[1].proxy);
-	assert(!pthread_rwlock_unlock(&lsm->mtlock));
+	err = view->c0->range(view->c0, &proxy[0].proxy);
+	if (!err && view->c1)
+		err = view->c1->range(view->c1, &proxy[1].proxy);
 
 	if (err)
 		return err;
 
-	assert(!pthread_rwlock_rdlock(&lsm->sblock));
 	for (int i = 0; i != MYFS_MAX_TREES; ++i)
-		myfs_ctree_it_setup(&ctx->it[i], &lsm->sb.tree[i]);
-	assert(!pthread_rwlock_unlock(&lsm->sblock));
+		myfs_ctree_it_setup(&ctx->it[i], &view->tree[i]);
 
 	for (int i = 0; i != MYFS_MAX_TREES; ++i) {
 		err = myfs_ctree_it_find(myfs, &ctx->it[i], query);
@@ -374,6 +509,7 @@ struct myfs_lookup_query {
 	struct myfs_query proxy;
 	struct myfs_query *orig;
 	int found;
+	int ret;
 };
 
 
@@ -393,38 +529,99 @@ static int myfs_lookup_emit(struct myfs_query *p, const struct myfs_key *key,
 	return proxy->orig->emit(proxy->orig, key, value);
 }
 
-int myfs_lsm_lookup_default(struct myfs_lsm *lsm, struct myfs_query *query)
+static int __myfs_lsm_lookup(struct myfs_lsm *lsm, struct myfs_lsm_view *view,
+			struct myfs_query *query)
 {
 	struct myfs_lookup_query proxy = {
-		{ &myfs_lookup_cmp, &myfs_lookup_emit },
-		query, 0
+		{ &myfs_lookup_cmp, &myfs_lookup_emit, query->key },
+		query, 0, 0
 	};
 	struct myfs *myfs = lsm->myfs;
 	int err = 0;
 
-	assert(!pthread_rwlock_rdlock(&lsm->mtlock));
-	err = lsm->c0->lookup(lsm->c0, &proxy.proxy);
-	if (!proxy.found && !err && lsm->c1)
-		err = lsm->c1->lookup(lsm->c1, &proxy.proxy);
-	assert(!pthread_rwlock_unlock(&lsm->mtlock));
+	err = view->c0->lookup(view->c0, &proxy.proxy);
+	if (!proxy.found && !err && view->c1)
+		err = view->c1->lookup(view->c1, &proxy.proxy);
 
 	if (proxy.found || err)
 		return err;
 
 	for (int i = 0; i != MYFS_MAX_TREES; ++i) {
-		struct myfs_ctree_sb sb;
-
-		assert(!pthread_rwlock_rdlock(&lsm->sblock));
-		sb = lsm->sb.tree[i];
-		assert(!pthread_rwlock_unlock(&lsm->sblock));
-
-		err = myfs_ctree_lookup(myfs, &sb, &proxy.proxy);
+		err = myfs_ctree_lookup(myfs, &view->tree[i], &proxy.proxy);
 		if (err || proxy.found)
 			break;
 	}
 	return err;
 }
 
+int myfs_lsm_lookup_default(struct myfs_lsm *lsm, struct myfs_query *query)
+{
+	struct myfs_lsm_view *view = myfs_lsm_view_enter(lsm);
+	const int err = __myfs_lsm_lookup(lsm, view, query);
+
+	myfs_lsm_view_exit(lsm);
+	return err;
+}
+
+
+/* multi get keeps the emit result for the caller, so a found key doesn't
+   stop lookups of the other keys */
+static int myfs_multi_get_emit(struct myfs_query *p, const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	struct myfs_lookup_query *proxy = (struct myfs_lookup_query *)p;
+	const int ret = myfs_lookup_emit(p, key, value);
+
+	proxy->ret = ret;
+	return ret < 0 ? ret : 0;
+}
+
+int myfs_lsm_multi_get_default(struct myfs_lsm *lsm, struct myfs_query **query,
+			int *ret, size_t size)
+{
+	struct myfs *myfs = lsm->myfs;
+	struct myfs_lsm_view *view = myfs_lsm_view_enter(lsm);
+	struct myfs_lookup_query *proxy;
+	struct myfs_query **pending;
+	int err = 0;
+
+	assert(proxy = calloc(size + 1, sizeof(*proxy)));
+	assert(pending = calloc(size + 1, sizeof(*pending)));
+	for (size_t i = 0; i != size; ++i) {
+		proxy[i].proxy.cmp = &myfs_lookup_cmp;
+		proxy[i].proxy.emit = &myfs_multi_get_emit;
+		proxy[i].proxy.key = query[i]->key;
+		proxy[i].orig = query[i];
+	}
+
+	for (size_t i = 0; !err && i != size; ++i) {
+		err = view->c0->lookup(view->c0, &proxy[i].proxy);
+		if (!proxy[i].found && !err && view->c1)
+			err = view->c1->lookup(view->c1, &proxy[i].proxy);
+	}
+
+	for (int i = 0; !err && i != MYFS_MAX_TREES; ++i) {
+		size_t count = 0;
+
+		for (size_t j = 0; j != size; ++j) {
+			if (!proxy[j].found)
+				pending[count++] = &proxy[j].proxy;
+		}
+
+		if (!count)
+			break;
+
+		err = myfs_ctree_multi_lookup(myfs, &view->tree[i],
+					pending, count);
+	}
+	myfs_lsm_view_exit(lsm);
+
+	for (size_t i = 0; i != size; ++i)
+		ret[i] = proxy[i].ret;
+	free(pending);
+	free(proxy);
+	return err;
+}
 
 
 int myfs_lsm_insert_default(struct myfs_lsm *lsm, const struct myfs_key *key,
@@ -440,13 +637,77 @@ int myfs_lsm_insert_default(struct myfs_lsm *lsm, const struct myfs_key *key,
 }
 
 
+struct myfs_batch_sort {
+	const struct myfs_key *key;
+	myfs_cmp_t cmp;
+};
 
-int myfs_lsm_range_default(struct myfs_lsm *lsm, struct myfs_query *query)
+/* ties are broken by position, so the last value of a key wins */
+static int myfs_batch_cmp(const void *l, const void *r, void *arg)
+{
+	const struct myfs_batch_sort *sort = arg;
+	const size_t lpos = *(const size_t *)l;
+	const size_t rpos = *(const size_t *)r;
+	const int res = sort->cmp(&sort->key[lpos], &sort->key[rpos]);
+
+	if (res)
+		return res;
+	if (lpos != rpos)
+		return lpos < rpos ? -1 : 1;
+	return 0;
+}
+
+int myfs_lsm_insert_batch_default(struct myfs_lsm *lsm,
+			const struct myfs_key *key,
+			const struct myfs_value *value, size_t size)
+{
+	struct myfs_batch_sort sort = { key, lsm->key_ops->cmp };
+	struct myfs_key *skey;
+	struct myfs_value *svalue;
+	size_t *pos;
+	int err = 0;
+
+	assert(pos = calloc(size + 1, sizeof(*pos)));
+	assert(skey = calloc(size + 1, sizeof(*skey)));
+	assert(svalue = calloc(size + 1, sizeof(*svalue)));
+
+	for (size_t i = 0; i != size; ++i)
+		pos[i] = i;
+	qsort_r(pos, size, sizeof(*pos), &myfs_batch_cmp, &sort);
+	for (size_t i = 0; i != size; ++i) {
+		skey[i] = key[pos[i]];
+		svalue[i] = value[pos[i]];
+	}
+
+	assert(!pthread_rwlock_rdlock(&lsm->mtlock));
+	if (lsm->c0->insert_batch) {
+		err = lsm->c0->insert_batch(lsm->c0, skey, svalue, size);
+	} else {
+		for (size_t i = 0; !err && i != size; ++i)
+			err = lsm->c0->insert(lsm->c0, &skey[i], &svalue[i]);
+	}
+	assert(!pthread_rwlock_unlock(&lsm->mtlock));
+
+	free(svalue);
+	free(skey);
+	free(pos);
+	return err;
+}
+
+
+
+static int __myfs_lsm_range(struct myfs_lsm *lsm, struct myfs_lsm_view *view,
+			struct myfs_query *query)
 {
 	struct myfs_merge_ctx ctx;
-	int err = myfs_prepare_range(&ctx, lsm, query);
+	int err = myfs_prepare_range(&ctx, lsm, view, query);
 
 	while ((err = myfs_merge_next(&ctx)) == 1) {
+		/* trees aren't bounded by the query, the smallest key past
+		   the range means there is nothing left in it */
+		if (query->cmp(query, &ctx.key))
+			break;
+
 		if (lsm->key_ops->deleted(&ctx.key, &ctx.value))
 			continue;
 
@@ -458,6 +719,398 @@ int myfs_lsm_range_default(struct myfs_lsm *lsm, struct myfs_query *query)
 	return err;
 }
 
+int myfs_lsm_range_default(struct myfs_lsm *lsm, struct myfs_query *query)
+{
+	struct myfs_lsm_view *view = myfs_lsm_view_get(lsm);
+	const int err = __myfs_lsm_range(lsm, view, query);
+
+	myfs_lsm_view_put(lsm, view);
+	return err;
+}
+
+
+
+/* sources of a cursor: two memtables followed by the trees, newer first */
+#define MYFS_CURSOR_SOURCES	(2 + MYFS_MAX_TREES)
+
+struct myfs_cursor_query {
+	struct myfs_query query;
+	myfs_cmp_t cmp;
+	struct myfs_query *range;
+};
+
+
+static int myfs_cursor_all_cmp(struct myfs_query *q, const struct myfs_key *key)
+{
+	(void) q;
+	(void) key;
+	return 0;
+}
+
+static int myfs_cursor_key_cmp(struct myfs_query *q, const struct myfs_key *key)
+{
+	struct myfs_cursor_query *query = (struct myfs_cursor_query *)q;
+
+	return query->cmp(key, q->key);
+}
+
+/* the first key not less than the query is the first key past the range */
+static int myfs_cursor_upper_cmp(struct myfs_query *q,
+			const struct myfs_key *key)
+{
+	struct myfs_cursor_query *query = (struct myfs_cursor_query *)q;
+	struct myfs_query *range = query->range;
+
+	if (!range || range->cmp(range, key) <= 0)
+		return -1;
+	return 0;
+}
+
+static int myfs_cursor_valid(struct myfs_lsm_cursor *cur, int i)
+{
+	if (i < 2)
+		return cur->mpos[i] < cur->m[i].size;
+
+	struct myfs_ctree_it *it = &cur->it[i - 2];
+
+	if (!myfs_ctree_it_valid(it))
+		return 0;
+	return !cur->range || !cur->range->cmp(cur->range, &it->key);
+}
+
+static void myfs_cursor_entry(struct myfs_lsm_cursor *cur, int i,
+			struct myfs_key *key, struct myfs_value *value)
+{
+	if (i < 2) {
+		myfs_items_get(&cur->m[i], cur->mpos[i], key, value);
+		return;
+	}
+	*key = cur->it[i - 2].key;
+	*value = cur->it[i - 2].value;
+}
+
+/* positions the source at the first key not less than the query */
+static int myfs_cursor_seek_source(struct myfs_lsm_cursor *cur, int i,
+			struct myfs_query *query)
+{
+	struct myfs *myfs = cur->lsm->myfs;
+
+	if (i < 2) {
+		const struct myfs_items *items = &cur->m[i];
+		size_t l = 0, r = items->size;
+
+		while (l < r) {
+			const size_t m = l + (r - l) / 2;
+			struct myfs_value v;
+			struct myfs_key k;
+
+			myfs_items_get(items, m, &k, &v);
+			if (query->cmp(query, &k) < 0)
+				l = m + 1;
+			else
+				r = m;
+		}
+		cur->mpos[i] = l;
+		return 0;
+	}
+
+	struct myfs_ctree_it *it = &cur->it[i - 2];
+	struct myfs_query *range = cur->range;
+	int err = myfs_ctree_it_find(myfs, it, query);
+
+	/* memtables hold only the range, trees may have keys before it */
+	if (!err && range && myfs_ctree_it_valid(it) &&
+				range->cmp(range, &it->key) < 0)
+		err = myfs_ctree_it_find(myfs, it, range);
+	return err;
+}
+
+/* stepping back from the end gives the last entry and stepping back from
+   the first entry leaves the source exhausted */
+static int myfs_cursor_move_source(struct myfs_lsm_cursor *cur, int i,
+			int dir)
+{
+	struct myfs *myfs = cur->lsm->myfs;
+
+	if (i >= 2 && dir > 0)
+		return myfs_ctree_it_next(myfs, &cur->it[i - 2]);
+	if (i >= 2)
+		return myfs_ctree_it_prev(myfs, &cur->it[i - 2]);
+
+	if (dir > 0 && cur->mpos[i] < cur->m[i].size)
+		++cur->mpos[i];
+	else if (dir < 0)
+		cur->mpos[i] = cur->mpos[i] ? cur->mpos[i] - 1 : cur->m[i].size;
+	return 0;
+}
+
+/* makes the smallest (dir > 0) or the largest (dir < 0) key of all the
+   sources current, among equal keys the newest wins */
+static int myfs_cursor_pick(struct myfs_lsm_cursor *cur, int dir)
+{
+	const myfs_cmp_t cmp = cur->lsm->key_ops->cmp;
+	struct myfs_key key = { 0, NULL };
+	struct myfs_value value = { 0, NULL };
+	int index = -1;
+
+	for (int i = 0; i != MYFS_CURSOR_SOURCES; ++i) {
+		struct myfs_value v;
+		struct myfs_key k;
+
+		if (!myfs_cursor_valid(cur, i))
+			continue;
+
+		myfs_cursor_entry(cur, i, &k, &v);
+		if (index < 0 || dir * cmp(&k, &key) < 0) {
+			key = k;
+			value = v;
+			index = i;
+		}
+	}
+
+	cur->key = key;
+	cur->value = value;
+	cur->index = index;
+	return index >= 0;
+}
+
+/* moves the current source and the sources holding older versions of the
+   current key, the current source goes last as it owns the key */
+static int myfs_cursor_step(struct myfs_lsm_cursor *cur, int dir)
+{
+	const myfs_cmp_t cmp = cur->lsm->key_ops->cmp;
+
+	for (int i = 0; i != MYFS_CURSOR_SOURCES; ++i) {
+		struct myfs_value v;
+		struct myfs_key k;
+		int err;
+
+		if (i == cur->index || !myfs_cursor_valid(cur, i))
+			continue;
+
+		myfs_cursor_entry(cur, i, &k, &v);
+		if (cmp(&k, &cur->key))
+			continue;
+
+		if ((err = myfs_cursor_move_source(cur, i, dir)))
+			return err;
+	}
+	return myfs_cursor_move_source(cur, cur->index, dir);
+}
+
+/* Moving forward all the sources but the current one are at the keys not
+   less than the current key, moving backward they are before it. When
+   the direction changes the sources are positioned around the key again. */
+static int myfs_cursor_turn(struct myfs_lsm_cursor *cur, int dir)
+{
+	struct myfs_cursor_query query = {
+		{ &myfs_cursor_key_cmp, NULL, &cur->key },
+		cur->lsm->key_ops->cmp, NULL
+	};
+
+	for (int i = 0; i != MYFS_CURSOR_SOURCES; ++i) {
+		int err;
+
+		if (i == cur->index)
+			continue;
+
+		err = myfs_cursor_seek_source(cur, i, &query.query);
+		if (!err && dir < 0)
+			err = myfs_cursor_move_source(cur, i, dir);
+		if (err)
+			return err;
+	}
+	cur->dir = dir;
+	return 0;
+}
+
+/* picks the current entry skipping deleted ones */
+static int myfs_cursor_settle(struct myfs_lsm_cursor *cur, int dir)
+{
+	const myfs_del_t deleted = cur->lsm->key_ops->deleted;
+
+	cur->dir = dir;
+	if (!myfs_cursor_pick(cur, dir))
+		return 0;
+
+	while (deleted(&cur->key, &cur->value)) {
+		const int err = myfs_cursor_step(cur, dir);
+
+		if (err)
+			return err;
+		if (!myfs_cursor_pick(cur, dir))
+			return 0;
+	}
+	return 1;
+}
+
+static int myfs_cursor_move(struct myfs_lsm_cursor *cur, int dir)
+{
+	int err;
+
+	if (cur->index < 0)
+		return 0;
+
+	if (cur->dir != dir && (err = myfs_cursor_turn(cur, dir)))
+		return err;
+
+	if ((err = myfs_cursor_step(cur, dir)))
+		return err;
+	return myfs_cursor_settle(cur, dir);
+}
+
+int myfs_lsm_cursor_setup(struct myfs_lsm_cursor *cur, struct myfs_lsm *lsm,
+			struct myfs_query *range)
+{
+	struct myfs_range_query proxy[2];
+	struct myfs_lsm_view *view;
+	int err;
+
+	memset(cur, 0, sizeof(*cur));
+	cur->lsm = lsm;
+	cur->range = range;
+	cur->index = -1;
+	cur->dir = 1;
+	myfs_items_setup(&cur->m[0]);
+	myfs_items_setup(&cur->m[1]);
+
+	view = cur->view = myfs_lsm_view_get(lsm);
+	for (int i = 0; i != MYFS_MAX_TREES; ++i)
+		myfs_ctree_it_setup(&cur->it[i], &view->tree[i]);
+
+	myfs_range_setup(&proxy[0], range, &cur->m[0]);
+	myfs_range_setup(&proxy[1], range, &cur->m[1]);
+
+	err = view->c0->range(view->c0, &proxy[0].proxy);
+	if (!err && view->c1)
+		err = view->c1->range(view->c1, &proxy[1].proxy);
+	return err;
+}
+
+void myfs_lsm_cursor_release(struct myfs_lsm_cursor *cur)
+{
+	for (int i = 0; i != MYFS_MAX_TREES; ++i)
+		myfs_ctree_it_release(&cur->it[i]);
+	myfs_items_release(&cur->m[1]);
+	myfs_items_release(&cur->m[0]);
+	myfs_lsm_view_put(cur->lsm, cur->view);
+	memset(cur, 0, sizeof(*cur));
+}
+
+int myfs_lsm_cursor_seek(struct myfs_lsm_cursor *cur, struct myfs_query *query)
+{
+	struct myfs_query all = { &myfs_cursor_all_cmp, NULL, NULL };
+
+	if (!query)
+		query = cur->range ? cur->range : &all;
+
+	for (int i = 0; i != MYFS_CURSOR_SOURCES; ++i) {
+		const int err = myfs_cursor_seek_source(cur, i, query);
+
+		if (err)
+			return err;
+	}
+	return myfs_cursor_settle(cur, 1);
+}
+
+int myfs_lsm_cursor_last(struct myfs_lsm_cursor *cur)
+{
+	struct myfs_cursor_query query = {
+		{ &myfs_cursor_upper_cmp, NULL, NULL },
+		NULL, cur->range
+	};
+
+	for (int i = 0; i != MYFS_CURSOR_SOURCES; ++i) {
+		int err = myfs_cursor_seek_source(cur, i, &query.query);
+
+		if (!err)
+			err = myfs_cursor_move_source(cur, i, -1);
+		if (err)
+			return err;
+	}
+	return myfs_cursor_settle(cur, -1);
+}
+
+int myfs_lsm_cursor_next(struct myfs_lsm_cursor *cur)
+{
+	return myfs_cursor_move(cur, 1);
+}
+
+int myfs_lsm_cursor_prev(struct myfs_lsm_cursor *cur)
+{
+	return myfs_cursor_move(cur, -1);
+}
+
+int myfs_lsm_cursor_valid(const struct myfs_lsm_cursor *cur)
+{
+	return cur->index >= 0;
+}
+
+const struct myfs_key *myfs_lsm_cursor_key(const struct myfs_lsm_cursor *cur)
+{
+	return &cur->key;
+}
+
+const struct myfs_value *myfs_lsm_cursor_value(
+			const struct myfs_lsm_cursor *cur)
+{
+	return &cur->value;
+}
+
+
+/**
+ * Only the merge of level 0 into level 1 drains level 0, so when level 0
+ * is backlogged that merge is promoted to the flush class, otherwise
+ * throttled merges would let level 0 grow without bound and lookups would
+ * have to go through more and more data. The promotion never goes above
+ * the lowest throttled class, so it doesn't compete with foreground I/O.
+ * The class is picked again before every level write, so it follows the
+ * backlog while the merge is running.
+ **/
+static int myfs_lsm_drain_prio(void *arg)
+{
+	const uint64_t backlog = (uint64_t)MYFS_C0_SIZE * MYFS_C0_BACKLOG;
+	struct myfs_lsm *lsm = arg;
+	struct myfs *myfs = lsm->myfs;
+	uint64_t size;
+
+	assert(!pthread_rwlock_rdlock(&lsm->sblock));
+	size = lsm->sb.tree[0].size;
+	assert(!pthread_rwlock_unlock(&lsm->sblock));
+
+	if (size * myfs->page_size >= backlog)
+		return BIO_PRIO_BACKGROUND;
+	return BIO_PRIO_MERGE;
+}
+
+/* the builder is too large to keep it on the stack along with the merge
+   context, so it's allocated dynamically */
+static struct myfs_ctree_builder *myfs_lsm_builder_create(
+			struct myfs_lsm *lsm, int prio)
+{
+	struct myfs_ctree_builder *build;
+
+	assert(build = malloc(sizeof(*build)));
+	myfs_builder_setup(build);
+	build->prio = prio;
+	if (lsm->key_ops->flags & MYFS_KEY_PREFIX)
+		build->format = MYFS_CTREE_PREFIX;
+	else if (lsm->key_ops->flags & MYFS_KEY_LE64)
+		build->format = MYFS_CTREE_FIXED;
+	else
+		build->format = MYFS_CTREE_INDEXED;
+	if (lsm->myfs->sb.features & MYFS_FEATURE_COMPRESS)
+		build->compress = 1;
+	build->fanout = lsm->fanout;
+	build->node_pages = lsm->node_pages;
+	return build;
+}
+
+static void myfs_lsm_builder_destroy(struct myfs_ctree_builder *build)
+{
+	myfs_builder_release(build);
+	free(build);
+}
 
 int myfs_lsm_flush_default(struct myfs_lsm *lsm, int drop_deleted,
 			struct myfs_mtree *new,
@@ -470,30 +1123,31 @@ int myfs_lsm_flush_default(struct myfs_lsm *lsm, int drop_deleted,
 
 	err = myfs_prepare_flush(&ctx, lsm, new, old);
 	if (!err) {
-		struct myfs_ctree_builder build;
+		struct myfs_ctree_builder *build =
+			myfs_lsm_builder_create(lsm, BIO_PRIO_FLUSH);
 
-		myfs_builder_setup(&build);
 		while ((err = myfs_merge_next(&ctx)) == 1) {
 			struct myfs_key *key = &ctx.key;
 			struct myfs_value *value = &ctx.value;
 
 			if (drop_deleted && lsm->key_ops->deleted(key, value))
 				continue;
-			err = myfs_builder_append(myfs, &build, key, value);
+			err = myfs_builder_append(myfs, build, key, value);
 			if (err)
 				break;
 		}
 		if (!err)
-			err = myfs_builder_finish(myfs, &build);
+			err = myfs_builder_finish(myfs, build);
 		if (!err)
-			*res = build.sb;
-		myfs_builder_release(&build);
+			*res = build->sb;
+		myfs_lsm_builder_destroy(build);
 	}
 	myfs_merge_release(&ctx);
 	return err;
 }
 
-int myfs_lsm_merge_default(struct myfs_lsm *lsm, int drop_deleted,
+int myfs_lsm_merge_default(struct myfs_lsm *lsm, size_t level,
+			int drop_deleted,
 			const struct myfs_ctree_sb *new,
 			const struct myfs_ctree_sb *old,
 			struct myfs_ctree_sb *res)
@@ -504,24 +1158,29 @@ int myfs_lsm_merge_default(struct myfs_lsm *lsm, int drop_deleted,
 
 	err = myfs_prepare_merge(&ctx, lsm, new, old);
 	if (!err) {
-		struct myfs_ctree_builder build;
+		struct myfs_ctree_builder *build =
+			myfs_lsm_builder_create(lsm, BIO_PRIO_MERGE);
+
+		if (!level) {
+			build->io_prio = &myfs_lsm_drain_prio;
+			build->io_prio_arg = lsm;
+		}
 
-		myfs_builder_setup(&build);
 		while ((err = myfs_merge_next(&ctx)) == 1) {
 			struct myfs_key *key = &ctx.key;
 			struct myfs_value *value = &ctx.value;
 
 			if (drop_deleted && lsm->key_ops->deleted(key, value))
 				continue;
-			err = myfs_builder_append(myfs, &build, key, value);
+			err = myfs_builder_append(myfs, build, key, value);
 			if (err)
 				break;
 		}
 		if (!err)
-			err = myfs_builder_finish(myfs, &build);
+			err = myfs_builder_finish(myfs, build);
 		if (!err)
-			*res = build.sb;
-		myfs_builder_release(&build);
+			*res = build->sb;
+		myfs_lsm_builder_destroy(build);
 	}
 	myfs_merge_release(&ctx);
 	return err;
@@ -539,12 +1198,17 @@ void myfs_lsm_setup(struct myfs_lsm *lsm, struct myfs *myfs,
 	lsm->myfs = myfs;
 	lsm->policy = lops;
 	lsm->key_ops = kops;
+	lsm->budget = MYFS_MTREE_BYTES;
+	lsm->fanout = myfs->fanout ? myfs->fanout : MYFS_MIN_FANOUT;
+	lsm->node_pages = myfs->node_pages
+				? myfs->node_pages : MYFS_CTREE_NODE_PAGES;
 
 	assert(!pthread_rwlock_init(&lsm->sblock, NULL));
 	assert(!pthread_rwlock_init(&lsm->mtlock, NULL));
 	assert(!pthread_mutex_init(&lsm->mtx, NULL));
+	assert(!pthread_mutex_init(&lsm->retire_mtx, NULL));
 	assert(!pthread_cond_init(&lsm->cv, NULL));
-	assert(lsm->c0 = lops->create(lsm));
+	lsm->c0 = myfs_lsm_mtree_create(lsm);
 
 	for (size_t i = MYFS_MAX_TREES; i; --i) {
 		if (sb->tree[i - 1].hight) {
@@ -552,16 +1216,33 @@ void myfs_lsm_setup(struct myfs_lsm *lsm, struct myfs *myfs,
 			break;
 		}
 	}
+
+	/* keep building trees the way the existing ones were built */
+	for (size_t i = 0; i != MYFS_MAX_TREES; ++i) {
+		if (sb->tree[i].node_pages) {
+			lsm->fanout = sb->tree[i].fanout;
+			lsm->node_pages = sb->tree[i].node_pages;
+			break;
+		}
+	}
+
+	for (size_t i = 0; i != MYFS_MAX_TREES; ++i)
+		myfs_ctree_pin(myfs, &lsm->sb.tree[i]);
+	myfs_lsm_publish(lsm);
 }
 
 void myfs_lsm_release(struct myfs_lsm *lsm)
 {
-	lsm->policy->destroy(lsm, lsm->c0);
-	if (lsm->c1)
-		lsm->policy->destroy(lsm, lsm->c1);
+	myfs_lsm_reclaim(lsm, 1);
+	myfs_lsm_view_put(lsm, lsm->view);
+	myfs_lsm_mtree_put(lsm, lsm->c0);
+	myfs_lsm_mtree_put(lsm, lsm->c1);
+	for (size_t i = 0; i != MYFS_MAX_TREES; ++i)
+		myfs_ctree_pin_put(lsm->sb.tree[i].pin);
 	assert(!pthread_rwlock_destroy(&lsm->sblock));
 	assert(!pthread_rwlock_destroy(&lsm->mtlock));
 	assert(!pthread_mutex_destroy(&lsm->mtx));
+	assert(!pthread_mutex_destroy(&lsm->retire_mtx));
 	assert(!pthread_cond_destroy(&lsm->cv));
 	memset(lsm, 0, sizeof(*lsm));
 }
@@ -571,6 +1252,10 @@ void myfs_lsm_get_root(struct myfs_lsm_sb *sb, struct myfs_lsm *lsm)
 	assert(!pthread_rwlock_rdlock(&lsm->sblock));
 	*sb = lsm->sb;
 	assert(!pthread_rwlock_unlock(&lsm->sblock));
+
+	/* the copy doesn't hold references to the pinned nodes */
+	for (size_t i = 0; i != MYFS_MAX_TREES; ++i)
+		sb->tree[i].pin = NULL;
 }
 
 
@@ -581,16 +1266,40 @@ int myfs_lsm_insert(struct myfs_lsm *lsm, const struct myfs_key *key,
 	return lsm->policy->insert(lsm, key, value);
 }
 
+int myfs_lsm_insert_batch(struct myfs_lsm *lsm, const struct myfs_key *key,
+			const struct myfs_value *value, size_t size)
+{
+	return lsm->policy->insert_batch(lsm, key, value, size);
+}
+
 int myfs_lsm_lookup(struct myfs_lsm *lsm, struct myfs_query *query)
 {
 	return lsm->policy->lookup(lsm, query);
 }
 
+int myfs_lsm_multi_get(struct myfs_lsm *lsm, struct myfs_query **query,
+			int *ret, size_t size)
+{
+	return lsm->policy->multi_get(lsm, query, ret, size);
+}
+
 int myfs_lsm_range(struct myfs_lsm *lsm, struct myfs_query *query)
 {
 	return lsm->policy->range(lsm, query);
 }
 
+int myfs_lsm_view_lookup(struct myfs_lsm *lsm, struct myfs_lsm_view *view,
+			struct myfs_query *query)
+{
+	return __myfs_lsm_lookup(lsm, view, query);
+}
+
+int myfs_lsm_view_range(struct myfs_lsm *lsm, struct myfs_lsm_view *view,
+			struct myfs_query *query)
+{
+	return __myfs_lsm_range(lsm, view, query);
+}
+
 
 
 static void myfs_lsm_start_merge(struct myfs_lsm *lsm, int from, int to)
@@ -637,13 +1346,16 @@ static int __myfs_lsm_merge(struct myfs_lsm *lsm, size_t i)
 		return 0;
 
 	if (from[1].hight) {
-		const int err = lsm->policy->merge(lsm, lsm->size <= i + 2,
-					&from[0], &from[1], &sb);
+		const int err = lsm->policy->merge(lsm, i,
+					lsm->size <= i + 2, &from[0], &from[1], &sb);
 
 		if (err)
 			return err;
+		myfs_ctree_pin(lsm->myfs, &sb);
 	} else {
+		/* the tree moves along with its pinned nodes */
 		sb = from[0];
+		from[0].pin = NULL;
 	}
 
 	assert(!pthread_rwlock_wrlock(&lsm->sblock));
@@ -651,8 +1363,13 @@ static int __myfs_lsm_merge(struct myfs_lsm *lsm, size_t i)
 	memset(&lsm->sb.tree[i], 0, sizeof(lsm->sb.tree[i]));
 	if (i + 2 > lsm->size)
 		lsm->size = i + 2;
+	myfs_lsm_publish(lsm);
 	assert(!pthread_rwlock_unlock(&lsm->sblock));
 
+	/* views that still use the old trees hold their own references */
+	myfs_ctree_pin_put(from[0].pin);
+	myfs_ctree_pin_put(from[1].pin);
+
 	return 0;
 }
 
@@ -666,17 +1383,32 @@ int myfs_lsm_merge(struct myfs_lsm *lsm, size_t i)
 	myfs_lsm_start_merge(lsm, i, i + 1);
 	err = __myfs_lsm_merge(lsm, i);
 	myfs_lsm_finish_merge(lsm, i, i + 1);
+	myfs_lsm_drain(lsm);
 	return err;
 }
 
-int myfs_lsm_need_flush(struct myfs_lsm *lsm)
+/* memory used by both memtables, c0 (if not NULL) receives c0 part */
+size_t myfs_lsm_bytes(struct myfs_lsm *lsm, size_t *c0)
 {
-	size_t size;
+	size_t bytes0, bytes1 = 0;
 
 	assert(!pthread_rwlock_rdlock(&lsm->mtlock));
-	size = lsm->c0->size(lsm->c0);
+	bytes0 = lsm->c0->bytes(lsm->c0);
+	if (lsm->c1)
+		bytes1 = lsm->c1->bytes(lsm->c1);
 	assert(!pthread_rwlock_unlock(&lsm->mtlock));
-	return size >= MYFS_MTREE_SIZE; 
+
+	if (c0)
+		*c0 = bytes0;
+	return bytes0 + bytes1;
+}
+
+int myfs_lsm_need_flush(struct myfs_lsm *lsm)
+{
+	size_t bytes;
+
+	myfs_lsm_bytes(lsm, &bytes);
+	return bytes >= lsm->budget;
 }
 
 int myfs_lsm_need_merge(struct myfs_lsm *lsm, size_t i)
@@ -696,16 +1428,21 @@ int myfs_lsm_need_merge(struct myfs_lsm *lsm, size_t i)
 
 static int __myfs_lsm_flush_start(struct myfs_lsm *lsm)
 {
+	int err = 0;
+
+	assert(!pthread_rwlock_wrlock(&lsm->sblock));
 	assert(!pthread_rwlock_wrlock(&lsm->mtlock));
 	if (lsm->c1) {
-		assert(!pthread_rwlock_unlock(&lsm->mtlock));
-		return -EBUSY;
+		err = -EBUSY;
+	} else {
+		lsm->c1 = lsm->c0;
+		lsm->c0 = myfs_lsm_mtree_create(lsm);
 	}
-
-	lsm->c1 = lsm->c0;
-	assert(lsm->c0 = lsm->policy->create(lsm));
 	assert(!pthread_rwlock_unlock(&lsm->mtlock));
-	return 0;
+	if (!err)
+		myfs_lsm_publish(lsm);
+	assert(!pthread_rwlock_unlock(&lsm->sblock));
+	return err;
 }
 
 static int __myfs_lsm_flush_finish(struct myfs_lsm *lsm)
@@ -717,11 +1454,20 @@ static int __myfs_lsm_flush_finish(struct myfs_lsm *lsm)
 	old = lsm->sb.tree[0];
 	assert(!pthread_rwlock_unlock(&lsm->sblock));
 
-	if (lsm->c1->size(lsm->c1))
+	if (lsm->c1->size(lsm->c1)) {
 		err = lsm->policy->flush(lsm, lsm->size <= 1,
 					lsm->c1, &old, &res);
-	else
+		if (!err)
+			myfs_ctree_pin(lsm->myfs, &res);
+	} else {
 		res = old;
+	}
+
+	/* an empty map remembers the parameters of its future trees too */
+	if (!err && !res.node_pages) {
+		res.fanout = lsm->fanout;
+		res.node_pages = lsm->node_pages;
+	}
 
 	assert(!pthread_rwlock_wrlock(&lsm->sblock));
 	if (!err) {
@@ -736,7 +1482,11 @@ static int __myfs_lsm_flush_finish(struct myfs_lsm *lsm)
 		lsm->c1 = NULL;
 		assert(!pthread_rwlock_unlock(&lsm->mtlock));
 
-		lsm->policy->destroy(lsm, c1);
+		/* readers holding older views still see c1 and the old tree */
+		myfs_lsm_publish(lsm);
+		myfs_lsm_mtree_put(lsm, c1);
+		if (res.pin != old.pin)
+			myfs_ctree_pin_put(old.pin);
 	}
 	assert(!pthread_rwlock_unlock(&lsm->sblock));
 	return err;
@@ -749,6 +1499,7 @@ int myfs_lsm_flush_start(struct myfs_lsm *lsm)
 	myfs_lsm_start_merge(lsm, 0, 0);
 	if ((err = __myfs_lsm_flush_start(lsm)))
 		myfs_lsm_finish_merge(lsm, 0, 0);
+	myfs_lsm_drain(lsm);
 	return err;
 }
 
@@ -757,6 +1508,7 @@ int myfs_lsm_flush_finish(struct myfs_lsm *lsm)
 	const int err = __myfs_lsm_flush_finish(lsm);
 
 	myfs_lsm_finish_merge(lsm, 0, 0);
+	myfs_lsm_drain(lsm);
 	return err;
 }
 
@@ -769,6 +1521,7 @@ int myfs_lsm_flush(struct myfs_lsm *lsm)
 	if (!err)
 		err = __myfs_lsm_flush_finish(lsm);
 	myfs_lsm_finish_merge(lsm, 0, 0);
+	myfs_lsm_drain(lsm);
 	return err;
 }
 
@@ -779,7 +1532,9 @@ struct myfs_mtree *myfs_lsm_create_default(struct myfs_lsm *lsm)
 	struct myfs_skiplist *skip = malloc(sizeof(*skip));
 
 	assert(skip);
-	myfs_skiplist_setup(skip, lsm->key_ops->cmp);
+	myfs_skiplist_setup(skip, lsm->key_ops->cmp, lsm->key_ops->flags);
+	/* only the latest version of a key is ever read from c0 */
+	skip->inplace = 1;
 	return &skip->mtree;
 }
 
@@ -792,3 +1547,22 @@ void myfs_lsm_destroy_default(struct myfs_lsm *lsm, struct myfs_mtree *mtree)
 	myfs_skiplist_release(skip);
 	free(skip);
 }
+
+struct myfs_mtree *myfs_lsm_create_btree(struct myfs_lsm *lsm)
+{
+	struct myfs_btree *tree = malloc(sizeof(*tree));
+
+	assert(tree);
+	myfs_btree_setup(tree, lsm->key_ops->cmp, lsm->key_ops->flags);
+	return &tree->mtree;
+}
+
+void myfs_lsm_destroy_btree(struct myfs_lsm *lsm, struct myfs_mtree *mtree)
+{
+	(void) lsm;
+
+	struct myfs_btree *tree = (struct myfs_btree *)mtree;
+
+	myfs_btree_release(tree);
+	free(tree);
+}
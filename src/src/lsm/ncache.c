@@ -0,0 +1,347 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <lsm/ncache.h>
+#include <myfs.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+
+static int myfs_ncache_ptr_equal(const struct myfs_ptr *l,
+			const struct myfs_ptr *r)
+{
+	return l->offs == r->offs && l->csum == r->csum &&
+		l->size == r->size && l->skip == r->skip &&
+		l->csize == r->csize;
+}
+
+static uint64_t myfs_ncache_hash(const struct myfs_ptr *ptr)
+{
+	return (ptr->offs ^ ((uint64_t)ptr->skip << 40)) *
+				0x9e3779b97f4a7c15ull;
+}
+
+/* the top bits pick a bucket, the bits below them pick a shard */
+static size_t myfs_ncache_index(const struct myfs_ncache *cache,
+			const struct myfs_ptr *ptr)
+{
+	return myfs_ncache_hash(ptr) >> (64 - cache->bits);
+}
+
+static struct myfs_ncache_shard *myfs_ncache_shard(
+			const struct myfs_ncache *cache,
+			const struct myfs_ptr *ptr)
+{
+	const uint64_t x = myfs_ncache_hash(ptr) >> (64 - cache->bits -
+				MYFS_NCACHE_SHARD_BITS);
+
+	return &cache->shard[x & (MYFS_NCACHE_SHARDS - 1)];
+}
+
+static struct myfs_ncache_node *myfs_ncache_node(void *buf)
+{
+	return (struct myfs_ncache_node *)((char *)buf -
+				offsetof(struct myfs_ncache_node, data));
+}
+
+static void myfs_ncache_node_put(struct myfs_ncache_node *node)
+{
+	if (atomic_fetch_sub_explicit(&node->refcnt, 1,
+				memory_order_acq_rel) != 1)
+		return;
+	free(node->raw);
+	free(node);
+}
+
+void *myfs_ncache_alloc(size_t size)
+{
+	struct myfs_ncache_node *node;
+
+	assert((node = malloc(sizeof(*node) + size)));
+	memset(node, 0, sizeof(*node));
+	atomic_init(&node->refcnt, 1);
+	node->size = size;
+	return node->data;
+}
+
+void myfs_ncache_put(void *buf)
+{
+	if (buf)
+		myfs_ncache_node_put(myfs_ncache_node(buf));
+}
+
+static struct myfs_ncache_node **myfs_ncache_find(
+			const struct myfs_ncache *cache,
+			struct myfs_ncache_shard *shard,
+			const struct myfs_ptr *ptr)
+{
+	struct myfs_ncache_node **pos =
+				&shard->head[myfs_ncache_index(cache, ptr)];
+
+	while (*pos && !myfs_ncache_ptr_equal(&(*pos)->ptr, ptr))
+		pos = &(*pos)->next;
+	return pos;
+}
+
+static void myfs_ncache_evict(const struct myfs_ncache *cache,
+			struct myfs_ncache_shard *shard)
+{
+	struct myfs_ncache_node *node =
+				(struct myfs_ncache_node *)shard->lru.next;
+	struct myfs_ncache_node **pos = myfs_ncache_find(cache, shard,
+				&node->ptr);
+
+	assert(*pos == node);
+	*pos = node->next;
+	list_del(&node->lru);
+	shard->size -= node->size;
+	myfs_ncache_node_put(node);
+}
+
+static void myfs_ncache_verify(struct myfs_ncache *cache)
+{
+	assert(!pthread_mutex_lock(&cache->mtx));
+	while (1) {
+		struct myfs_ncache_node *node;
+
+		while (!cache->vhead && !cache->done)
+			assert(!pthread_cond_wait(&cache->cv, &cache->mtx));
+		if (cache->done)
+			break;
+
+		node = cache->vhead;
+		cache->vhead = node->vnext;
+		if (!cache->vhead)
+			cache->vtail = &cache->vhead;
+		assert(!pthread_mutex_unlock(&cache->mtx));
+
+		/* data of a node doesn't change once it's cached */
+		const void *data = node->raw ? node->raw : node->data;
+		const size_t size = node->raw ? node->ptr.csize : node->size;
+		const int ok = myfs_csum(cache->myfs, data, size) ==
+					node->ptr.csum;
+		struct myfs_ncache_shard *shard =
+					myfs_ncache_shard(cache, &node->ptr);
+
+		assert(!pthread_mutex_lock(&shard->mtx));
+		node->state = ok ? MYFS_NCACHE_VERIFIED : MYFS_NCACHE_BAD;
+		if (!ok)
+			++shard->errors;
+		assert(!pthread_mutex_unlock(&shard->mtx));
+		myfs_ncache_node_put(node);
+
+		assert(!pthread_mutex_lock(&cache->mtx));
+	}
+	assert(!pthread_mutex_unlock(&cache->mtx));
+}
+
+static void *myfs_ncache_verifier(void *arg)
+{
+	myfs_ncache_verify(arg);
+	return NULL;
+}
+
+void myfs_ncache_setup(struct myfs_ncache *cache, struct myfs *myfs,
+			size_t cap, int lazy)
+{
+	const size_t shard_cap = cap / MYFS_NCACHE_SHARDS;
+	size_t bits = 6;
+
+	memset(cache, 0, sizeof(*cache));
+	if (!cap)
+		return;
+
+	/* a bucket per smallest node on average */
+	while ((1ul << bits) < shard_cap / myfs->page_size && bits < 32)
+		++bits;
+
+	cache->myfs = myfs;
+	cache->cap = cap;
+	cache->bits = bits;
+	assert((cache->shard = aligned_alloc(_Alignof(struct myfs_ncache_shard),
+				MYFS_NCACHE_SHARDS * sizeof(*cache->shard))));
+	memset(cache->shard, 0, MYFS_NCACHE_SHARDS * sizeof(*cache->shard));
+	for (size_t i = 0; i != MYFS_NCACHE_SHARDS; ++i) {
+		struct myfs_ncache_shard *shard = &cache->shard[i];
+
+		assert((shard->head = calloc(1ul << bits,
+					sizeof(*shard->head))));
+		assert(!pthread_mutex_init(&shard->mtx, NULL));
+		list_setup(&shard->lru);
+		shard->cap = shard_cap;
+	}
+
+	cache->lazy = lazy;
+	cache->vtail = &cache->vhead;
+	if (!lazy)
+		return;
+
+	assert(!pthread_mutex_init(&cache->mtx, NULL));
+	assert(!pthread_cond_init(&cache->cv, NULL));
+	assert(!pthread_create(&cache->thread, NULL,
+				&myfs_ncache_verifier, cache));
+}
+
+void myfs_ncache_release(struct myfs_ncache *cache)
+{
+	if (!cache->cap)
+		return;
+
+	if (cache->lazy) {
+		assert(!pthread_mutex_lock(&cache->mtx));
+		cache->done = 1;
+		assert(!pthread_cond_signal(&cache->cv));
+		assert(!pthread_mutex_unlock(&cache->mtx));
+		assert(!pthread_join(cache->thread, NULL));
+		assert(!pthread_cond_destroy(&cache->cv));
+		assert(!pthread_mutex_destroy(&cache->mtx));
+
+		while (cache->vhead) {
+			struct myfs_ncache_node *node = cache->vhead;
+
+			cache->vhead = node->vnext;
+			myfs_ncache_node_put(node);
+		}
+	}
+
+	for (size_t i = 0; i != MYFS_NCACHE_SHARDS; ++i) {
+		struct myfs_ncache_shard *shard = &cache->shard[i];
+
+		while (!list_empty(&shard->lru))
+			myfs_ncache_evict(cache, shard);
+		assert(!pthread_mutex_destroy(&shard->mtx));
+		free(shard->head);
+	}
+	free(cache->shard);
+	memset(cache, 0, sizeof(*cache));
+}
+
+void myfs_ncache_stats(struct myfs_ncache *cache,
+			struct myfs_ncache_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (!cache->cap)
+		return;
+
+	for (size_t i = 0; i != MYFS_NCACHE_SHARDS; ++i) {
+		struct myfs_ncache_shard *shard = &cache->shard[i];
+
+		assert(!pthread_mutex_lock(&shard->mtx));
+		stats->size += shard->size;
+		stats->cap += shard->cap;
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->errors += shard->errors;
+		assert(!pthread_mutex_unlock(&shard->mtx));
+	}
+}
+
+int myfs_ncache_lazy(const struct myfs_ncache *cache, size_t size)
+{
+	return cache->lazy && size <= cache->cap / MYFS_NCACHE_SHARDS;
+}
+
+int myfs_ncache_get(struct myfs_ncache *cache, const struct myfs_ptr *ptr,
+			size_t size, void **buf)
+{
+	struct myfs_ncache_shard *shard;
+	struct myfs_ncache_node *node;
+
+	if (!cache->cap)
+		return -ENOENT;
+
+	shard = myfs_ncache_shard(cache, ptr);
+	assert(!pthread_mutex_lock(&shard->mtx));
+	node = *myfs_ncache_find(cache, shard, ptr);
+	if (!node || node->size < size) {
+		++shard->misses;
+		assert(!pthread_mutex_unlock(&shard->mtx));
+		return -ENOENT;
+	}
+
+	if (node->state == MYFS_NCACHE_BAD) {
+		assert(!pthread_mutex_unlock(&shard->mtx));
+		return -EIO;
+	}
+
+	const int verified = node->state == MYFS_NCACHE_VERIFIED;
+
+	++shard->hits;
+	list_del(&node->lru);
+	list_append(&shard->lru, &node->lru);
+	/* the node may be evicted meanwhile, but not freed */
+	atomic_fetch_add_explicit(&node->refcnt, 1, memory_order_relaxed);
+	assert(!pthread_mutex_unlock(&shard->mtx));
+
+	*buf = node->data;
+	return verified ? 0 : 1;
+}
+
+void myfs_ncache_insert(struct myfs_ncache *cache, const struct myfs_ptr *ptr,
+			void *buf, const void *raw, int verified)
+{
+	struct myfs_ncache_node *node = myfs_ncache_node(buf);
+	struct myfs_ncache_shard *shard;
+	struct myfs_ncache_node **pos;
+	const size_t size = node->size;
+	void *copy = NULL;
+
+	assert(verified || cache->lazy);
+	if (!cache->cap || size > cache->cap / MYFS_NCACHE_SHARDS)
+		return;
+
+	if (!verified && ptr->csize) {
+		assert((copy = malloc(ptr->csize)));
+		memcpy(copy, raw, ptr->csize);
+	}
+
+	shard = myfs_ncache_shard(cache, ptr);
+	assert(!pthread_mutex_lock(&shard->mtx));
+	pos = myfs_ncache_find(cache, shard, ptr);
+	if (*pos) {
+		/* somebody else read the same node concurrently */
+		assert(!pthread_mutex_unlock(&shard->mtx));
+		free(copy);
+		return;
+	}
+
+	node->ptr = *ptr;
+	node->raw = copy;
+	node->state = verified ? MYFS_NCACHE_VERIFIED : MYFS_NCACHE_UNVERIFIED;
+	/* the cache and the verifier hold references of their own */
+	atomic_fetch_add_explicit(&node->refcnt, verified ? 1 : 2,
+				memory_order_relaxed);
+
+	while (shard->size + size > shard->cap)
+		myfs_ncache_evict(cache, shard);
+	/* eviction might have changed the chain */
+	pos = myfs_ncache_find(cache, shard, ptr);
+	*pos = node;
+	list_append(&shard->lru, &node->lru);
+	shard->size += size;
+	assert(!pthread_mutex_unlock(&shard->mtx));
+
+	if (!verified) {
+		assert(!pthread_mutex_lock(&cache->mtx));
+		*cache->vtail = node;
+		cache->vtail = &node->vnext;
+		assert(!pthread_cond_signal(&cache->cv));
+		assert(!pthread_mutex_unlock(&cache->mtx));
+	}
+}
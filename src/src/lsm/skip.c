@@ -15,6 +15,7 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <lsm/skip.h>
+#include <misc/epoch.h>
 
 #include <stdatomic.h>
 #include <stdlib.h>
@@ -22,37 +23,122 @@
 #include <assert.h>
 
 
-static struct myfs_skip_node *myfs_skip_node_create(size_t hight,
-			const struct myfs_key *key,
+static size_t myfs_skip_entry_size(const struct myfs_key *key,
 			const struct myfs_value *value)
 {
-	const size_t size = sizeof(struct myfs_skip_node) +
-				(hight - 1) * sizeof(struct myfs_mtree_node *) +
-				key->size + value->size;
-	struct myfs_skip_node *node = malloc(size);
-	char *buf;
+	return sizeof(struct myfs_skip_entry) + key->size + value->size;
+}
 
-	assert(node);
-	memset(node, 0, size);
-	buf = (char *)(node->next + hight);
+static void myfs_skip_entry_fill(struct myfs_skip_entry *entry,
+			const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	char *buf = (char *)(entry + 1);
 
 	if (key->size)
 		memcpy(buf, key->data, key->size);
-	node->key.data = buf;
-	node->key.size = key->size;
+	entry->key.data = buf;
+	entry->key.size = key->size;
 	buf += key->size;
 
 	if (value->size)
 		memcpy(buf, value->data, value->size);
-	node->value.data = buf;
-	node->value.size = value->size;
+	entry->value.data = buf;
+	entry->value.size = value->size;
+}
+
+static struct myfs_skip_node *myfs_skip_node_create(
+			struct myfs_skiplist *tree, size_t hight,
+			const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	const size_t size = sizeof(struct myfs_skip_node) +
+				(hight - 1) * sizeof(struct myfs_skip_node *) +
+				myfs_skip_entry_size(key, value);
+	struct myfs_skip_node *node = myfs_arena_alloc(&tree->arena, size);
+	struct myfs_skip_entry *entry;
+
+	entry = (struct myfs_skip_entry *)(node->next + hight);
+	myfs_skip_entry_fill(entry, key, value);
+	atomic_store_explicit(&node->entry, entry, memory_order_relaxed);
 
 	return node;
 }
 
-static void myfs_skip_node_destroy(struct myfs_skip_node *node)
+static const struct myfs_skip_entry *myfs_skip_entry(
+			struct myfs_skip_node *node)
+{
+	return atomic_load_explicit(&node->entry, memory_order_consume);
+}
+
+static const struct myfs_key *myfs_skip_key(struct myfs_skip_node *node)
 {
-	free(node);
+	return &myfs_skip_entry(node)->key;
+}
+
+/* reuses the oldest replaced entry of the size if no reader can see it */
+static struct myfs_skip_entry *myfs_skip_entry_alloc(
+			struct myfs_skiplist *tree, size_t size)
+{
+	const size_t class = size / MYFS_SKIP_ALIGN;
+	struct myfs_skip_entry *entry = NULL;
+
+	if (class < MYFS_SKIP_CLASSES) {
+		assert(!pthread_mutex_lock(&tree->free_mtx));
+		entry = tree->free[class];
+		if (entry && myfs_epoch_safe(entry->epoch)) {
+			tree->free[class] = entry->next;
+			if (!entry->next)
+				tree->free_tail[class] = NULL;
+			atomic_fetch_sub_explicit(&tree->free_bytes, size,
+						memory_order_relaxed);
+		} else {
+			entry = NULL;
+		}
+		assert(!pthread_mutex_unlock(&tree->free_mtx));
+	}
+
+	if (!entry) {
+		entry = myfs_arena_alloc(&tree->arena, size);
+		entry->size = size;
+	}
+	return entry;
+}
+
+/* the entry must be unpublished already */
+static void myfs_skip_entry_retire(struct myfs_skiplist *tree,
+			struct myfs_skip_entry *entry)
+{
+	const size_t class = entry->size / MYFS_SKIP_ALIGN;
+
+	if (!entry->size || class >= MYFS_SKIP_CLASSES)
+		return;
+
+	entry->next = NULL;
+	assert(!pthread_mutex_lock(&tree->free_mtx));
+	entry->epoch = myfs_epoch_advance();
+	if (tree->free_tail[class])
+		tree->free_tail[class]->next = entry;
+	else
+		tree->free[class] = entry;
+	tree->free_tail[class] = entry;
+	atomic_fetch_add_explicit(&tree->free_bytes, entry->size,
+				memory_order_relaxed);
+	assert(!pthread_mutex_unlock(&tree->free_mtx));
+}
+
+static int myfs_skip_replace(struct myfs_skiplist *tree,
+			struct myfs_skip_node *node,
+			const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	const size_t size = (myfs_skip_entry_size(key, value) +
+				MYFS_SKIP_ALIGN - 1) & ~(MYFS_SKIP_ALIGN - 1);
+	struct myfs_skip_entry *entry = myfs_skip_entry_alloc(tree, size);
+
+	myfs_skip_entry_fill(entry, key, value);
+	myfs_skip_entry_retire(tree, atomic_exchange(&node->entry, entry));
+	return 0;
 }
 
 
@@ -65,6 +151,15 @@ static int mtree_skip_insert(struct myfs_mtree *mtree,
 	return myfs_skip_insert(skip, key, value);
 }
 
+static int mtree_skip_insert_batch(struct myfs_mtree *mtree,
+			const struct myfs_key *key,
+			const struct myfs_value *value, size_t size)
+{
+	struct myfs_skiplist *skip = (struct myfs_skiplist *)mtree;
+
+	return myfs_skip_insert_batch(skip, key, value, size);
+}
+
 static int mtree_skip_lookup(struct myfs_mtree *mtree, struct myfs_query *query)
 {
 	struct myfs_skiplist *skip = (struct myfs_skiplist *)mtree;
@@ -93,81 +188,215 @@ static size_t mtree_skip_size(const struct myfs_mtree *mtree)
 	return myfs_skip_size(skip);
 }
 
+static size_t mtree_skip_bytes(const struct myfs_mtree *mtree)
+{
+	const struct myfs_skiplist *skip = (const struct myfs_skiplist *)mtree;
+
+	return myfs_skip_bytes(skip);
+}
+
 
-void myfs_skiplist_setup(struct myfs_skiplist *tree, myfs_cmp_t cmp)
+void myfs_skiplist_setup(struct myfs_skiplist *tree, myfs_cmp_t cmp,
+			unsigned long flags)
 {
 	const struct myfs_key key = { 0, 0 };
 	const struct myfs_value value = { 0, 0 };
 
 	memset(tree, 0, sizeof(*tree));
-	tree->head = myfs_skip_node_create(MYFS_MAX_MTREE_HIGHT,
+	myfs_arena_setup(&tree->arena);
+	tree->head = myfs_skip_node_create(tree, MYFS_MAX_MTREE_HIGHT,
 				&key, &value);
 	tree->cmp = cmp;
+	atomic_init(&tree->free_bytes, 0);
+	assert(!pthread_mutex_init(&tree->free_mtx, NULL));
+	tree->le64 = (flags & MYFS_KEY_LE64) != 0;
+	tree->hash = (flags & MYFS_KEY_HASH) != 0;
+	if (tree->hash) {
+		myfs_hindex_setup(&tree->index, &tree->arena);
+		tree->inplace = 1;
+	}
 
 	tree->mtree.insert = &mtree_skip_insert;
+	tree->mtree.insert_batch = &mtree_skip_insert_batch;
 	tree->mtree.lookup = &mtree_skip_lookup;
 	tree->mtree.range = &mtree_skip_range;
 	tree->mtree.scan = &mtree_skip_scan;
 	tree->mtree.size = &mtree_skip_size;
+	tree->mtree.bytes = &mtree_skip_bytes;
 }
 
 void myfs_skiplist_release(struct myfs_skiplist *tree)
 {
-	struct myfs_skip_node *ptr = tree->head;
+	if (tree->hash)
+		myfs_hindex_release(&tree->index);
+	assert(!pthread_mutex_destroy(&tree->free_mtx));
+	myfs_arena_release(&tree->arena);
+	memset(tree, 0, sizeof(*tree));
+}
 
-	while (ptr) {
-		struct myfs_skip_node *node = ptr;
 
-		ptr = atomic_load_explicit(node->next, memory_order_relaxed);
-		myfs_skip_node_destroy(node);
-	}
-	memset(tree, 0, sizeof(*tree));
+static int myfs_skip_le64_cmp(const struct myfs_key *l,
+			const struct myfs_key *r)
+{
+	le64_t lv, rv;
+
+	memcpy(&lv, l->data, sizeof(lv));
+	memcpy(&rv, r->data, sizeof(rv));
+	lv = le64toh(lv);
+	rv = le64toh(rv);
+	if (lv != rv)
+		return lv < rv ? -1 : 1;
+	return 0;
+}
+
+static int myfs_skip_cmp(const struct myfs_skiplist *tree,
+			const struct myfs_key *l, const struct myfs_key *r)
+{
+	if (tree->le64)
+		return myfs_skip_le64_cmp(l, r);
+	return tree->cmp(l, r);
 }
 
+static int myfs_skip_query_cmp(const struct myfs_skiplist *tree,
+			struct myfs_query *query, const struct myfs_key *key)
+{
+	if (tree->le64 && query->key)
+		return myfs_skip_le64_cmp(key, query->key);
+	return query->cmp(query, key);
+}
+
+/* per thread splitmix64 state, rand() takes a global lock */
+static _Thread_local uint64_t myfs_skip_seed;
+static atomic_uint_fast64_t myfs_skip_seeds;
+
+static uint64_t myfs_skip_rand(void)
+{
+	if (!myfs_skip_seed)
+		myfs_skip_seed = atomic_fetch_add_explicit(&myfs_skip_seeds, 1,
+					memory_order_relaxed) + 1;
 
+	uint64_t z = (myfs_skip_seed += 0x9e3779b97f4a7c15ull);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+/* the number of trailing zeros of a random word is geometrically
+   distributed with p = 1/2, the same as flipping a coin per level */
 static size_t myfs_skip_node_hight(size_t maxh)
 {
-	for (size_t h = 0; h != maxh; ++h) {
-		if (rand() % 2)
-			return h + 1;
+	const uint64_t r = myfs_skip_rand() | (1ull << (maxh - 1));
+
+	return __builtin_ctzll(r) + 1;
+}
+
+/* the node goes before the key with the sequence number seq: smaller keys
+   and newer versions of the key, res gets the result of the comparison */
+static int myfs_skip_before(const struct myfs_skiplist *tree,
+			const struct myfs_key *key, size_t seq,
+			struct myfs_skip_node *n, int *res)
+{
+	*res = myfs_skip_cmp(tree, key, myfs_skip_key(n));
+	return *res > 0 || (!*res && !tree->inplace && seq < n->seq);
+}
+
+/* Finger search: tower holds the predecessors of the previous key, which
+   isn't greater than the key. If the next node at a level goes after the
+   key, the predecessors at this level and all the levels above stay the
+   same, so the search climbs to the first such level and descends from
+   there. Nodes are never removed, so a stale tower still points before
+   the key. */
+static size_t myfs_skip_climb(const struct myfs_skiplist *tree,
+			struct myfs_skip_node **tower,
+			const struct myfs_key *key, size_t seq)
+{
+	size_t top = 0;
+
+	while (top != MYFS_MAX_MTREE_HIGHT) {
+		struct myfs_skip_node *n = atomic_load_explicit(
+					&tower[top]->next[top],
+					memory_order_consume);
+		int res;
+
+		if (!n || !myfs_skip_before(tree, key, seq, n, &res))
+			break;
+		++top;
 	}
-	return maxh;
+	return top;
 }
 
-int myfs_skip_insert(struct myfs_skiplist *tree, const struct myfs_key *key,
+/* Levels below top are searched starting from the nodes in tower, which
+   must not be after the predecessors of the key, tower receives the
+   predecessors of the key. */
+static int __myfs_skip_insert(struct myfs_skiplist *tree,
+			struct myfs_skip_node **tower, int finger,
+			const struct myfs_key *key,
 			const struct myfs_value *value)
 {
-	const size_t size = atomic_fetch_add_explicit(&tree->size, 1,
+	const size_t seq = atomic_fetch_add_explicit(&tree->seq, 1,
 				memory_order_relaxed);
-	const size_t hight = myfs_skip_node_hight(MYFS_MAX_MTREE_HIGHT);
-	struct myfs_skip_node *node = myfs_skip_node_create(hight,
-				key, value);
-	struct myfs_skip_node *ptr = tree->head;
-	struct myfs_skip_node *tower[MYFS_MAX_MTREE_HIGHT];
+	int moved = 0;
 
-	node->seq = size;
+	if (tree->hash) {
+		struct myfs_skip_node *node = myfs_hindex_lookup(&tree->index,
+					key);
+
+		if (node)
+			return myfs_skip_replace(tree, node, key, value);
+	}
+
+	const size_t top = finger ? myfs_skip_climb(tree, tower, key, seq)
+				: MYFS_MAX_MTREE_HIGHT;
+
+	for (size_t h = top; h--;) {
+		/* the predecessor at the level above is before the one in
+		   tower, unless it has moved past the previous key */
+		struct myfs_skip_node *ptr = moved ? tower[h + 1] : tower[h];
+		struct myfs_skip_node *start = ptr;
 
-	for (size_t h = MYFS_MAX_MTREE_HIGHT; h; --h) {
 		while (1) {
 			struct myfs_skip_node *n = atomic_load_explicit(
-						&ptr->next[h - 1],
+						&ptr->next[h],
 						memory_order_consume);
+			int res;
 
-			if (!n) {
-				tower[h - 1] = ptr;
+			if (!n)
 				break;
-			}
-
-			const int res = tree->cmp(key, &n->key);
 
-			if ((res > 0) || (!res && node->seq < n->seq)) {
+			if (myfs_skip_before(tree, key, seq, n, &res)) {
 				ptr = n;
-				continue; 
+				continue;
 			}
 
-			tower[h - 1] = ptr;
+			if (!res && tree->inplace) {
+				for (size_t i = 0; i <= h; ++i)
+					tower[i] = ptr;
+				return myfs_skip_replace(tree, n, key, value);
+			}
 			break;
 		}
+		moved = moved || ptr != start;
+		tower[h] = ptr;
+	}
+
+	const size_t hight = myfs_skip_node_hight(MYFS_MAX_MTREE_HIGHT);
+	struct myfs_skip_node *node = myfs_skip_node_create(tree, hight,
+				key, value);
+
+	node->seq = seq;
+
+	/* the node that gets into the index first owns the key and only the
+	   owner is linked, so the loser is just left in the arena; lookups
+	   may find the owner in the index before it's linked. The index
+	   keeps the key of the entry embedded in the node, that one is
+	   never reused. */
+	if (tree->hash) {
+		struct myfs_skip_node *owner = myfs_hindex_add(&tree->index,
+					&tree->arena, myfs_skip_key(node), node);
+
+		if (owner)
+			return myfs_skip_replace(tree, owner, key, value);
 	}
 
 	for (size_t h = 0; h != hight; ++h) {
@@ -190,7 +419,15 @@ int myfs_skip_insert(struct myfs_skiplist *tree, const struct myfs_key *key,
 					continue;
 			}
 
-			const int res = tree->cmp(key, &n->key);
+			const int res = myfs_skip_cmp(tree, key,
+						myfs_skip_key(n));
+
+			/* a concurrent insert of the same key won the race, the
+			   node isn't linked yet and is just left in the arena */
+			if (!res && tree->inplace) {
+				assert(!h);
+				return myfs_skip_replace(tree, n, key, value);
+			}
 
 			if ((res > 0) || (!res && node->seq < n->seq)) {
 				tower[h] = n;
@@ -207,9 +444,44 @@ int myfs_skip_insert(struct myfs_skiplist *tree, const struct myfs_key *key,
 				continue;
 		}
 	}
+	atomic_fetch_add_explicit(&tree->size, 1, memory_order_relaxed);
 	return 0;
 }
 
+int myfs_skip_insert(struct myfs_skiplist *tree, const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	struct myfs_skip_node *tower[MYFS_MAX_MTREE_HIGHT];
+
+	int err;
+
+	for (size_t h = 0; h != MYFS_MAX_MTREE_HIGHT; ++h)
+		tower[h] = tree->head;
+	myfs_epoch_enter();
+	err = __myfs_skip_insert(tree, tower, 0, key, value);
+	myfs_epoch_exit();
+	return err;
+}
+
+int myfs_skip_insert_batch(struct myfs_skiplist *tree,
+			const struct myfs_key *key,
+			const struct myfs_value *value, size_t size)
+{
+	struct myfs_skip_node *tower[MYFS_MAX_MTREE_HIGHT];
+	int err = 0;
+
+	for (size_t h = 0; h != MYFS_MAX_MTREE_HIGHT; ++h)
+		tower[h] = tree->head;
+	/* a section per key, so entries replaced by the batch may be
+	   reused by the rest of it */
+	for (size_t i = 0; !err && i != size; ++i) {
+		myfs_epoch_enter();
+		err = __myfs_skip_insert(tree, tower, 1, &key[i], &value[i]);
+		myfs_epoch_exit();
+	}
+	return err;
+}
+
 
 static struct myfs_skip_node *myfs_skip_query(struct myfs_skiplist *tree,
 			struct myfs_query *query)
@@ -225,63 +497,95 @@ static struct myfs_skip_node *myfs_skip_query(struct myfs_skiplist *tree,
 			if (!n)
 				break;
 
-			if (query->cmp(query, &n->key) >= 0)
+			if (myfs_skip_query_cmp(tree, query,
+						myfs_skip_key(n)) >= 0)
 				break;
 			ptr = n;
 		}
 	}
 
 	ptr = atomic_load_explicit(&ptr->next[0], memory_order_consume);
-	while (ptr && query->cmp(query, &ptr->key) < 0)
+	while (ptr && myfs_skip_query_cmp(tree, query, myfs_skip_key(ptr)) < 0)
 		ptr = atomic_load_explicit(&ptr->next[0], memory_order_consume);
 	return ptr;
 }
 
 
-int myfs_skip_lookup(struct myfs_skiplist *skip, struct myfs_query *query)
+/* every key of the list is in the index, so a miss is final */
+static int myfs_skip_hash_lookup(struct myfs_skiplist *skip,
+			struct myfs_query *query)
+{
+	struct myfs_skip_node *node = myfs_hindex_lookup(&skip->index,
+				query->key);
+
+	if (!node)
+		return 0;
+
+	const struct myfs_skip_entry *entry = myfs_skip_entry(node);
+
+	if (query->cmp(query, &entry->key))
+		return 0;
+	return query->emit(query, &entry->key, &entry->value);
+}
+
+static int __myfs_skip_lookup(struct myfs_skiplist *skip,
+			struct myfs_query *query)
 {
+	if (skip->hash && query->key)
+		return myfs_skip_hash_lookup(skip, query);
+
 	struct myfs_skip_node *node = myfs_skip_query(skip, query);
 
 	if (!node)
 		return 0;
 
-	if (query->cmp(query, &node->key))
+	const struct myfs_skip_entry *entry = myfs_skip_entry(node);
+
+	if (query->cmp(query, &entry->key))
 		return 0;
-	return query->emit(query, &node->key, &node->value);
+	return query->emit(query, &entry->key, &entry->value);
 }
 
-int myfs_skip_range(struct myfs_skiplist *skip, struct myfs_query *query)
+static int __myfs_skip_range(struct myfs_skiplist *skip,
+			struct myfs_query *query)
 {
 	struct myfs_skip_node *node = myfs_skip_query(skip, query);
 	int err = 0;
 
-	while (node && !query->cmp(query, &node->key)) {
+	while (node) {
+		const struct myfs_skip_entry *entry = myfs_skip_entry(node);
 		struct myfs_skip_node *n = node;
 
-		err = query->emit(query, &node->key, &node->value);
+		if (query->cmp(query, &entry->key))
+			break;
+
+		err = query->emit(query, &entry->key, &entry->value);
 		if (err)
 			break;
 
 		do {
 			n = atomic_load_explicit(&n->next[0],
 						memory_order_consume);
-		} while (n && !skip->cmp(&n->key, &node->key));
+		} while (n && !myfs_skip_cmp(skip, myfs_skip_key(n),
+					&entry->key));
 		node = n;
 	}
 	return err;
 }
 
-int myfs_skip_scan(struct myfs_skiplist *skip, struct myfs_query *query)
+static int __myfs_skip_scan(struct myfs_skiplist *skip,
+			struct myfs_query *query)
 {
 	struct myfs_skip_node *node = atomic_load_explicit(&skip->head->next[0],
 				memory_order_consume);
 	int err = 0;
 
 	while (node) {
+		const struct myfs_skip_entry *entry = myfs_skip_entry(node);
 		struct myfs_skip_node *n = node;
 
-		if (!query->cmp(query, &node->key)) {
-			err = query->emit(query, &node->key, &node->value);
+		if (!query->cmp(query, &entry->key)) {
+			err = query->emit(query, &entry->key, &entry->value);
 			if (err)
 				break;
 		}
@@ -289,13 +593,52 @@ int myfs_skip_scan(struct myfs_skiplist *skip, struct myfs_query *query)
 		do {
 			n = atomic_load_explicit(&n->next[0],
 						memory_order_consume);
-		} while (n && !skip->cmp(&n->key, &node->key));
+		} while (n && !myfs_skip_cmp(skip, myfs_skip_key(n),
+					&entry->key));
 		node = n;
 	}
 	return err;
 }
 
+/* entries stay valid until the reader leaves the read section, emit
+   copies what it needs */
+int myfs_skip_lookup(struct myfs_skiplist *skip, struct myfs_query *query)
+{
+	int err;
+
+	myfs_epoch_enter();
+	err = __myfs_skip_lookup(skip, query);
+	myfs_epoch_exit();
+	return err;
+}
+
+int myfs_skip_range(struct myfs_skiplist *skip, struct myfs_query *query)
+{
+	int err;
+
+	myfs_epoch_enter();
+	err = __myfs_skip_range(skip, query);
+	myfs_epoch_exit();
+	return err;
+}
+
+int myfs_skip_scan(struct myfs_skiplist *skip, struct myfs_query *query)
+{
+	int err;
+
+	myfs_epoch_enter();
+	err = __myfs_skip_scan(skip, query);
+	myfs_epoch_exit();
+	return err;
+}
+
 size_t myfs_skip_size(const struct myfs_skiplist *skip)
 {
 	return atomic_load_explicit(&skip->size, memory_order_relaxed);
 }
+
+size_t myfs_skip_bytes(const struct myfs_skiplist *skip)
+{
+	return myfs_arena_used(&skip->arena) - atomic_load_explicit(
+				&skip->free_bytes, memory_order_relaxed);
+}
@@ -0,0 +1,111 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <misc/arena.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+
+#define MYFS_ARENA_ALIGN	_Alignof(max_align_t)
+
+
+static struct myfs_arena_chunk *myfs_arena_chunk_create(
+			struct myfs_arena *arena, size_t size)
+{
+	struct myfs_arena_chunk *chunk;
+
+	assert(chunk = calloc(1, sizeof(*chunk) + size));
+	chunk->size = size;
+	atomic_init(&chunk->offs, 0);
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	atomic_fetch_add_explicit(&arena->size, size, memory_order_relaxed);
+	return chunk;
+}
+
+void myfs_arena_setup(struct myfs_arena *arena)
+{
+	memset(arena, 0, sizeof(*arena));
+	assert(!pthread_mutex_init(&arena->mtx, NULL));
+	atomic_init(&arena->used, 0);
+	atomic_init(&arena->size, 0);
+	atomic_init(&arena->chunk, myfs_arena_chunk_create(arena,
+				MYFS_ARENA_CHUNK));
+}
+
+void myfs_arena_release(struct myfs_arena *arena)
+{
+	struct myfs_arena_chunk *chunk = arena->chunks;
+
+	while (chunk) {
+		struct myfs_arena_chunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+	assert(!pthread_mutex_destroy(&arena->mtx));
+	memset(arena, 0, sizeof(*arena));
+}
+
+void *myfs_arena_alloc(struct myfs_arena *arena, size_t size)
+{
+	size = (size + MYFS_ARENA_ALIGN - 1) & ~(MYFS_ARENA_ALIGN - 1);
+	atomic_fetch_add_explicit(&arena->used, size, memory_order_relaxed);
+
+	/* large objects get a chunk of their own, so they don't waste the
+	   rest of the current chunk */
+	if (size > MYFS_ARENA_CHUNK / 4) {
+		struct myfs_arena_chunk *chunk;
+
+		assert(!pthread_mutex_lock(&arena->mtx));
+		chunk = myfs_arena_chunk_create(arena, size);
+		assert(!pthread_mutex_unlock(&arena->mtx));
+		return chunk->data;
+	}
+
+	while (1) {
+		struct myfs_arena_chunk *chunk = atomic_load_explicit(
+					&arena->chunk, memory_order_acquire);
+		const size_t offs = atomic_fetch_add_explicit(&chunk->offs,
+					size, memory_order_relaxed);
+
+		if (offs + size <= chunk->size)
+			return chunk->data + offs;
+
+		/* the chunk is exhausted, the first thread to get here
+		   installs a new one, others just retry */
+		assert(!pthread_mutex_lock(&arena->mtx));
+		if (atomic_load_explicit(&arena->chunk,
+					memory_order_relaxed) == chunk)
+			atomic_store_explicit(&arena->chunk,
+					myfs_arena_chunk_create(arena,
+						MYFS_ARENA_CHUNK),
+					memory_order_release);
+		assert(!pthread_mutex_unlock(&arena->mtx));
+	}
+}
+
+size_t myfs_arena_used(const struct myfs_arena *arena)
+{
+	return atomic_load_explicit(&arena->used, memory_order_relaxed);
+}
+
+size_t myfs_arena_size(const struct myfs_arena *arena)
+{
+	return atomic_load_explicit(&arena->size, memory_order_relaxed);
+}
@@ -0,0 +1,166 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <misc/csum.h>
+
+#include <endian.h>
+#include <pthread.h>
+#include <assert.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MYFS_CSUM_X86
+/* makes xxhash build the AVX2 stripe loops next to the default ones */
+#define XXH_X86DISPATCH
+#define XXH_DISPATCH_AVX2 1
+#define XXH_TARGET_SSE2 __attribute__((target("sse2")))
+#define XXH_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#define XXH_INLINE_ALL
+#include <misc/xxhash.h>
+
+
+#define MYFS_CRC32C_POLY	0x82f63b78u
+
+static uint32_t myfs_crc32c_table[8][256];
+static pthread_once_t myfs_crc32c_once = PTHREAD_ONCE_INIT;
+
+
+uint64_t myfs_xxh64(const void *buf, size_t size, uint64_t seed)
+{
+	return XXH64(buf, size, seed);
+}
+
+/* SSE2 stripe loops on x86-64, scalar or NEON elsewhere */
+uint64_t myfs_xxh3(const void *buf, size_t size, uint64_t seed)
+{
+	return XXH3_64bits_withSeed(buf, size, seed);
+}
+
+#ifdef MYFS_CSUM_X86
+__attribute__((target("avx2")))
+static uint64_t myfs_xxh3_long_avx2(const void *buf, size_t size,
+			uint64_t seed)
+{
+	return XXH3_hashLong_64b_withSeed_internal(buf, size, seed,
+				XXH3_accumulate_avx2, XXH3_scrambleAcc_avx2,
+				XXH3_initCustomSecret_avx2);
+}
+
+uint64_t myfs_xxh3_avx2(const void *buf, size_t size, uint64_t seed)
+{
+	/* short inputs don't use stripe loops at all */
+	if (size <= XXH3_MIDSIZE_MAX)
+		return XXH3_64bits_withSeed(buf, size, seed);
+	return myfs_xxh3_long_avx2(buf, size, seed);
+}
+#endif
+
+
+static void myfs_crc32c_init(void)
+{
+	for (uint32_t i = 0; i != 256; ++i) {
+		uint32_t crc = i;
+
+		for (int j = 0; j != 8; ++j)
+			crc = (crc >> 1) ^ (MYFS_CRC32C_POLY & -(crc & 1));
+		myfs_crc32c_table[0][i] = crc;
+	}
+
+	for (uint32_t i = 0; i != 256; ++i) {
+		for (int j = 1; j != 8; ++j) {
+			const uint32_t crc = myfs_crc32c_table[j - 1][i];
+
+			myfs_crc32c_table[j][i] = (crc >> 8) ^
+					myfs_crc32c_table[0][crc & 0xff];
+		}
+	}
+}
+
+/* slicing-by-8: a table per byte of a 64 bit word */
+uint64_t myfs_crc32c(const void *buf, size_t size, uint64_t seed)
+{
+	uint32_t (*table)[256] = myfs_crc32c_table;
+	const unsigned char *ptr = buf;
+	uint32_t crc = ~(uint32_t)seed;
+
+	assert(!pthread_once(&myfs_crc32c_once, &myfs_crc32c_init));
+	for (; size >= 8; ptr += 8, size -= 8) {
+		uint64_t word;
+
+		memcpy(&word, ptr, sizeof(word));
+		word = le64toh(word) ^ crc;
+		crc = table[7][word & 0xff] ^
+			table[6][(word >> 8) & 0xff] ^
+			table[5][(word >> 16) & 0xff] ^
+			table[4][(word >> 24) & 0xff] ^
+			table[3][(word >> 32) & 0xff] ^
+			table[2][(word >> 40) & 0xff] ^
+			table[1][(word >> 48) & 0xff] ^
+			table[0][word >> 56];
+	}
+
+	for (; size; ++ptr, --size)
+		crc = (crc >> 8) ^ table[0][(crc ^ *ptr) & 0xff];
+	return ~crc;
+}
+
+#ifdef MYFS_CSUM_X86
+__attribute__((target("sse4.2")))
+uint64_t myfs_crc32c_sse42(const void *buf, size_t size, uint64_t seed)
+{
+	const unsigned char *ptr = buf;
+	uint32_t crc = ~(uint32_t)seed;
+
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+
+	for (; size >= 8; ptr += 8, size -= 8) {
+		uint64_t word;
+
+		memcpy(&word, ptr, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (uint32_t)crc64;
+#endif
+	for (; size; ++ptr, --size)
+		crc = _mm_crc32_u8(crc, *ptr);
+	return ~crc;
+}
+#endif
+
+
+myfs_csum_t myfs_csum_select(int algo)
+{
+	switch (algo) {
+	case MYFS_CSUM_XXH3:
+#ifdef MYFS_CSUM_X86
+		if (__builtin_cpu_supports("avx2"))
+			return &myfs_xxh3_avx2;
+#endif
+		return &myfs_xxh3;
+	case MYFS_CSUM_CRC32C:
+#ifdef MYFS_CSUM_X86
+		if (__builtin_cpu_supports("sse4.2"))
+			return &myfs_crc32c_sse42;
+#endif
+		return &myfs_crc32c;
+	default:
+		return &myfs_xxh64;
+	}
+}
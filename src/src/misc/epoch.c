@@ -0,0 +1,172 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <misc/epoch.h>
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sched.h>
+#include <stddef.h>
+
+
+/* every slot takes a cache line of its own, so readers never write to
+   a cache line shared with other threads */
+struct myfs_epoch_slot {
+	_Alignas(64) uint64_t _Atomic epoch;
+	int _Atomic used;
+};
+
+struct myfs_epoch_thread {
+	struct myfs_epoch_slot *slot;
+	unsigned long depth;
+};
+
+
+static struct myfs_epoch_slot myfs_epoch_slot[MYFS_EPOCH_SLOTS];
+/* threads that found no free slot share this one, it keeps the epoch of
+   the oldest of them until the last one leaves, that delays reclamation
+   but never makes it unsafe */
+static struct myfs_epoch_slot myfs_epoch_shared;
+static unsigned long myfs_epoch_shared_readers;
+static pthread_mutex_t myfs_epoch_shared_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* 0 in a slot means that the thread is outside of a read section */
+static _Alignas(64) uint64_t _Atomic myfs_epoch = 1;
+
+static _Thread_local struct myfs_epoch_thread myfs_epoch_thread;
+static pthread_once_t myfs_epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t myfs_epoch_key;
+
+
+static void myfs_epoch_thread_exit(void *arg)
+{
+	struct myfs_epoch_slot *slot = arg;
+
+	atomic_store_explicit(&slot->epoch, 0, memory_order_release);
+	atomic_store_explicit(&slot->used, 0, memory_order_release);
+}
+
+static void myfs_epoch_key_create(void)
+{
+	assert(!pthread_key_create(&myfs_epoch_key, &myfs_epoch_thread_exit));
+}
+
+static struct myfs_epoch_slot *myfs_epoch_slot_get(void)
+{
+	struct myfs_epoch_thread *thread = &myfs_epoch_thread;
+
+	if (thread->slot)
+		return thread->slot;
+
+	assert(!pthread_once(&myfs_epoch_once, &myfs_epoch_key_create));
+	for (size_t i = 0; i != MYFS_EPOCH_SLOTS; ++i) {
+		struct myfs_epoch_slot *slot = &myfs_epoch_slot[i];
+		int unused = 0;
+
+		if (!atomic_compare_exchange_strong(&slot->used, &unused, 1))
+			continue;
+
+		thread->slot = slot;
+		assert(!pthread_setspecific(myfs_epoch_key, slot));
+		return slot;
+	}
+	return NULL;
+}
+
+static void myfs_epoch_shared_enter(void)
+{
+	assert(!pthread_mutex_lock(&myfs_epoch_shared_mtx));
+	if (!myfs_epoch_shared_readers++) {
+		const uint64_t epoch = atomic_load_explicit(&myfs_epoch,
+					memory_order_acquire);
+
+		atomic_store_explicit(&myfs_epoch_shared.epoch, epoch,
+					memory_order_relaxed);
+	}
+	assert(!pthread_mutex_unlock(&myfs_epoch_shared_mtx));
+}
+
+static void myfs_epoch_shared_exit(void)
+{
+	assert(!pthread_mutex_lock(&myfs_epoch_shared_mtx));
+	if (!--myfs_epoch_shared_readers)
+		atomic_store_explicit(&myfs_epoch_shared.epoch, 0,
+					memory_order_release);
+	assert(!pthread_mutex_unlock(&myfs_epoch_shared_mtx));
+}
+
+void myfs_epoch_enter(void)
+{
+	struct myfs_epoch_thread *thread = &myfs_epoch_thread;
+
+	if (thread->depth++)
+		return;
+
+	struct myfs_epoch_slot *slot = myfs_epoch_slot_get();
+
+	if (slot) {
+		const uint64_t epoch = atomic_load_explicit(&myfs_epoch,
+					memory_order_acquire);
+
+		atomic_store_explicit(&slot->epoch, epoch,
+					memory_order_relaxed);
+	} else {
+		myfs_epoch_shared_enter();
+	}
+	/* the slot must be visible before any shared object is read */
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+void myfs_epoch_exit(void)
+{
+	struct myfs_epoch_thread *thread = &myfs_epoch_thread;
+
+	assert(thread->depth);
+	if (--thread->depth)
+		return;
+	if (thread->slot)
+		atomic_store_explicit(&thread->slot->epoch, 0,
+					memory_order_release);
+	else
+		myfs_epoch_shared_exit();
+}
+
+uint64_t myfs_epoch_advance(void)
+{
+	return atomic_fetch_add(&myfs_epoch, 1);
+}
+
+/* readers that entered at epoch or before might have seen objects that
+   were unpublished before the epoch was advanced */
+int myfs_epoch_safe(uint64_t epoch)
+{
+	for (size_t i = 0; i != MYFS_EPOCH_SLOTS; ++i) {
+		const uint64_t slot = atomic_load(&myfs_epoch_slot[i].epoch);
+
+		if (slot && slot <= epoch)
+			return 0;
+	}
+
+	const uint64_t shared = atomic_load(&myfs_epoch_shared.epoch);
+
+	return !shared || shared > epoch;
+}
+
+void myfs_epoch_wait(uint64_t epoch)
+{
+	while (!myfs_epoch_safe(epoch))
+		sched_yield();
+}
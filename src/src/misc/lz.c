@@ -0,0 +1,213 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <misc/lz.h>
+
+#include <string.h>
+#include <errno.h>
+
+
+#define MYFS_LZ_MIN_MATCH	4
+#define MYFS_LZ_MAX_OFFS	65535
+/* the tail of the input is always encoded as literals, so the decoder
+   never needs to handle a match at the very end of the block */
+#define MYFS_LZ_LAST_LITERALS	5
+#define MYFS_LZ_MIN_INPUT	12
+
+
+static uint32_t myfs_lz_read32(const uint8_t *ptr)
+{
+	uint32_t x;
+
+	memcpy(&x, ptr, sizeof(x));
+	return x;
+}
+
+static uint32_t myfs_lz_hash(uint32_t x)
+{
+	return (x * 2654435761u) >> (32 - MYFS_LZ_HASH_BITS);
+}
+
+static uint8_t *myfs_lz_put_len(uint8_t *op, const uint8_t *oend, size_t len)
+{
+	while (len >= 255) {
+		if (op == oend)
+			return NULL;
+		*op++ = 255;
+		len -= 255;
+	}
+
+	if (op == oend)
+		return NULL;
+	*op++ = len;
+	return op;
+}
+
+static uint8_t *myfs_lz_emit(uint8_t *op, const uint8_t *oend,
+			const uint8_t *lit, size_t lit_len,
+			size_t offs, size_t match_len)
+{
+	const size_t mlen = match_len ? match_len - MYFS_LZ_MIN_MATCH : 0;
+	if (op == oend)
+		return NULL;
+
+	*op++ = ((lit_len < 15 ? lit_len : 15) << 4) | (mlen < 15 ? mlen : 15);
+	if (lit_len >= 15 && !(op = myfs_lz_put_len(op, oend, lit_len - 15)))
+		return NULL;
+
+	if ((size_t)(oend - op) < lit_len)
+		return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (!match_len)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = offs & 0xff;
+	*op++ = offs >> 8;
+
+	if (mlen >= 15 && !(op = myfs_lz_put_len(op, oend, mlen - 15)))
+		return NULL;
+
+	return op;
+}
+
+size_t myfs_lz_compress(struct myfs_lz *lz, const void *src, size_t size,
+			void *dst, size_t cap)
+{
+	const uint8_t *const begin = src;
+	const uint8_t *const end = begin + size;
+	const uint8_t *ip = begin;
+	const uint8_t *anchor = begin;
+
+	uint8_t *op = dst;
+	uint8_t *const oend = op + cap;
+
+
+	memset(lz->table, 0, sizeof(lz->table));
+	if (size >= MYFS_LZ_MIN_INPUT) {
+		const uint8_t *const limit = end - MYFS_LZ_MIN_INPUT;
+		const uint8_t *const mlimit = end - MYFS_LZ_LAST_LITERALS;
+
+		while (ip < limit) {
+			const uint32_t seq = myfs_lz_read32(ip);
+			const uint32_t h = myfs_lz_hash(seq);
+			const uint8_t *ref = begin + lz->table[h];
+
+			lz->table[h] = ip - begin;
+			if (ref >= ip || ip - ref > MYFS_LZ_MAX_OFFS ||
+						myfs_lz_read32(ref) != seq) {
+				++ip;
+				continue;
+			}
+
+			size_t len = MYFS_LZ_MIN_MATCH;
+
+			while (ip + len < mlimit && ip[len] == ref[len])
+				++len;
+
+			while (ip > anchor && ref > begin && ip[-1] == ref[-1]) {
+				--ip;
+				--ref;
+				++len;
+			}
+
+			op = myfs_lz_emit(op, oend, anchor, ip - anchor,
+						ip - ref, len);
+			if (!op)
+				return 0;
+			ip += len;
+			anchor = ip;
+		}
+	}
+
+	op = myfs_lz_emit(op, oend, anchor, end - anchor, 0, 0);
+	if (!op)
+		return 0;
+	return op - (uint8_t *)dst;
+}
+
+static int myfs_lz_get_len(const uint8_t **ip, const uint8_t *iend,
+			size_t *len)
+{
+	const uint8_t *pos = *ip;
+	uint8_t byte;
+
+	do {
+		if (pos == iend)
+			return -EIO;
+		byte = *pos++;
+		*len += byte;
+	} while (byte == 255);
+	*ip = pos;
+	return 0;
+}
+
+long myfs_lz_decompress(const void *src, size_t size, void *dst, size_t cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *const iend = ip + size;
+
+	uint8_t *const begin = dst;
+	uint8_t *op = begin;
+	uint8_t *const oend = op + cap;
+
+	while (ip != iend) {
+		const uint8_t token = *ip++;
+		size_t lit_len = token >> 4;
+		size_t match_len = token & 15;
+
+		if (lit_len == 15 && myfs_lz_get_len(&ip, iend, &lit_len))
+			return -EIO;
+
+		if ((size_t)(iend - ip) < lit_len ||
+					(size_t)(oend - op) < lit_len)
+			return -EIO;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		/* the last sequence has no match part */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -EIO;
+
+		const size_t offs = ip[0] | ((size_t)ip[1] << 8);
+
+		ip += 2;
+		if (!offs || offs > (size_t)(op - begin))
+			return -EIO;
+
+		if (match_len == 15 && myfs_lz_get_len(&ip, iend, &match_len))
+			return -EIO;
+		match_len += MYFS_LZ_MIN_MATCH;
+
+		if ((size_t)(oend - op) < match_len)
+			return -EIO;
+
+		/* source and destination may overlap, copy byte by byte */
+		const uint8_t *ref = op - offs;
+
+		for (size_t i = 0; i != match_len; ++i)
+			op[i] = ref[i];
+		op += match_len;
+	}
+	return op - begin;
+}
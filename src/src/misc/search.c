@@ -0,0 +1,93 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <misc/search.h>
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MYFS_SEARCH_AVX2
+#endif
+
+
+/* binary search narrows the range down to this many keys, the rest is
+   done with a linear (vectorized) count */
+#define MYFS_SEARCH_LINEAR	16
+
+
+static uint64_t myfs_load_le64(const void *keys, size_t i)
+{
+	le64_t key;
+
+	memcpy(&key, (const char *)keys + i * sizeof(key), sizeof(key));
+	return le64toh(key);
+}
+
+static size_t myfs_count_less(const void *keys, size_t n, uint64_t key)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i != n; ++i)
+		count += myfs_load_le64(keys, i) < key;
+	return count;
+}
+
+#ifdef MYFS_SEARCH_AVX2
+__attribute__((target("avx2,popcnt")))
+static size_t myfs_count_less_avx2(const void *keys, size_t n, uint64_t key)
+{
+	/* AVX2 has only signed 64 bit comparison, flipping the sign bit of
+	   both sides turns it into the unsigned one */
+	const __m256i sign = _mm256_set1_epi64x((long long)(1ull << 63));
+	const __m256i k = _mm256_xor_si256(
+				_mm256_set1_epi64x((long long)key), sign);
+	const char *ptr = keys;
+	size_t count = 0;
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		const __m256i v = _mm256_xor_si256(_mm256_loadu_si256(
+					(const __m256i *)(ptr + i * 8)), sign);
+		const __m256i lt = _mm256_cmpgt_epi64(k, v);
+
+		count += _mm_popcnt_u32(_mm256_movemask_pd(
+					_mm256_castsi256_pd(lt)));
+	}
+	return count + myfs_count_less(ptr + i * 8, n - i, key);
+}
+#endif
+
+size_t myfs_search_le64(const void *keys, size_t n, uint64_t key)
+{
+	size_t base = 0;
+
+	/* invariant: the answer lies in [base, base + n] */
+	while (n > MYFS_SEARCH_LINEAR) {
+		const size_t half = n / 2;
+
+		base = myfs_load_le64(keys, base + half - 1) < key
+					? base + half : base;
+		n -= half;
+	}
+
+	keys = (const char *)keys + base * sizeof(le64_t);
+#ifdef MYFS_SEARCH_AVX2
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+		return base + myfs_count_less_avx2(keys, n, key);
+#endif
+	return base + myfs_count_less(keys, n, key);
+}
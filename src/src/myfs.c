@@ -17,7 +17,6 @@
 #include <alloc/alloc.h>
 #include <block/block.h>
 #include <lsm/lsm.h>
-#include <misc/xxhash.h>
 #include <inode.h>
 #include <dentry.h>
 #include <myfs.h>
@@ -35,14 +34,37 @@
 #include <stdio.h>
 
 
-uint64_t myfs_csum(const void *buf, size_t size)
+int myfs_csum_setup(struct myfs *myfs)
 {
-	return XXH64(buf, size, MYFS_FS_MAGIC);
+	const uint32_t features = myfs->sb.features;
+	const uint32_t algo = features &
+				(MYFS_FEATURE_XXH3 | MYFS_FEATURE_CRC32C);
+
+	switch (algo) {
+	case 0:
+		myfs->csum = myfs_csum_select(MYFS_CSUM_XXH64);
+		return 0;
+	case MYFS_FEATURE_XXH3:
+		myfs->csum = myfs_csum_select(MYFS_CSUM_XXH3);
+		return 0;
+	case MYFS_FEATURE_CRC32C:
+		myfs->csum = myfs_csum_select(MYFS_CSUM_CRC32C);
+		return 0;
+	default:
+		return -EINVAL;
+	}
 }
 
-uint32_t myfs_hash(const void *buf, size_t size)
+uint64_t myfs_csum(const struct myfs *myfs, const void *buf, size_t size)
 {
-	return XXH32(buf, size, MYFS_FS_MAGIC);
+	if (!myfs->csum)
+		return myfs_xxh64(buf, size, MYFS_FS_MAGIC);
+	return myfs->csum(buf, size, MYFS_FS_MAGIC);
+}
+
+uint64_t myfs_hash(const void *buf, size_t size)
+{
+	return myfs_xxh3(buf, size, MYFS_FS_MAGIC);
 }
 
 uint64_t myfs_now(void)
@@ -72,7 +94,7 @@ static int myfs_check_read(struct myfs *myfs, struct __myfs_check *check,
 	const uint64_t csum = le64toh(check->csum);
 
 	check->csum = 0;
-	if (csum != myfs_csum(check, size))
+	if (csum != myfs_csum(myfs, check, size))
 		ret = -EIO;
 	check->csum = htole64(csum);
 	return ret;
@@ -90,8 +112,11 @@ static void __myfs_umount(struct myfs *myfs)
 	assert(!pthread_mutex_destroy(&myfs->trans_mtx));
 	assert(!pthread_cond_destroy(&myfs->trans_cv));
 	myfs_icache_release(&myfs->icache);
+	if (myfs->sb.features & MYFS_FEATURE_DINDEX)
+		myfs_dindex_map_release(&myfs->dindex_map);
 	myfs_dentry_map_release(&myfs->dentry_map);
 	myfs_inode_map_release(&myfs->inode_map);
+	myfs_ncache_release(&myfs->ncache);
 }
 
 int myfs_mount(struct myfs *myfs, struct bdev *bdev)
@@ -108,6 +133,15 @@ int myfs_mount(struct myfs *myfs, struct bdev *bdev)
 	if (myfs->sb.magic != MYFS_FS_MAGIC)
 		return -EIO;
 
+	if (myfs->sb.features & ~MYFS_FEATURES)
+		return -EINVAL;
+
+	if (myfs->sb.version != MYFS_FS_VERSION)
+		return -EPROTONOSUPPORT;
+
+	if ((ret = myfs_csum_setup(myfs)))
+		return ret;
+
 	const size_t page_size = myfs->sb.page_size;
 	const size_t size = myfs_align_up(bdev_size(bdev), page_size);
 
@@ -131,21 +165,40 @@ int myfs_mount(struct myfs *myfs, struct bdev *bdev)
 	free(check);
 
 	myfs->page_size = page_size;
-	myfs->fanout = MYFS_MIN_FANOUT;
+	if (!myfs->fanout)
+		myfs->fanout = MYFS_MIN_FANOUT;
+	if (!myfs->node_pages)
+		myfs->node_pages = MYFS_CTREE_NODE_PAGES;
 	atomic_store_explicit(&myfs->next_offs, size / page_size,
 				memory_order_relaxed);
 	atomic_store_explicit(&myfs->next_ino, myfs->check.ino,
 				memory_order_relaxed);
 
+	/* maps read (and pin) their trees through the cache on setup */
+	if (!myfs->ncache_size)
+		myfs->ncache_size = MYFS_NCACHE_SIZE;
+	myfs_ncache_setup(&myfs->ncache, myfs, myfs->ncache_size,
+				myfs->lazy_csum);
 	myfs_inode_map_setup(&myfs->inode_map, myfs, &myfs->check.inode_sb);
 	myfs_dentry_map_setup(&myfs->dentry_map, myfs, &myfs->check.dentry_sb);
+	if (myfs->sb.features & MYFS_FEATURE_DINDEX)
+		myfs_dindex_map_setup(&myfs->dindex_map, myfs,
+					&myfs->check.dindex_sb);
 	myfs_icache_setup(&myfs->icache);
 
+	/* a single busy map may take up to a half of the budget */
+	if (!myfs->mem_budget)
+		myfs->mem_budget = MYFS_MEM_BUDGET;
+	myfs->inode_map.budget = myfs->mem_budget / 2;
+	myfs->dentry_map.budget = myfs->mem_budget / 2;
+	myfs->dindex_map.budget = myfs->mem_budget / 2;
+
 	assert((myfs->log_data = malloc(MYFS_MAX_WAL_SIZE)));
 	assert(!pthread_mutex_init(&myfs->trans_mtx, NULL));
 	assert(!pthread_cond_init(&myfs->trans_cv, NULL));
 	list_setup(&myfs->trans);
 	myfs->done = 0;
+	myfs->flush = 0;
 
 	myfs->root = myfs_inode_get(myfs, MYFS_FS_ROOT);
 	ret = __myfs_inode_read(myfs, myfs->root);
@@ -172,10 +225,65 @@ void myfs_unmount(struct myfs *myfs)
 	memset(myfs, 0, sizeof(*myfs));
 }
 
+/**
+ * Memtables of all the maps share mem_budget bytes. A map whose c0 is
+ * over its own budget is returned first, otherwise when they use more
+ * than mem_budget together the map with the largest c0 is returned, so
+ * the flush frees as much memory as possible. Returns NULL if nothing
+ * needs to be flushed.
+ **/
+struct myfs_lsm *myfs_flush_target(struct myfs *myfs)
+{
+	struct myfs_lsm *map[] = {
+		&myfs->inode_map, &myfs->dentry_map, &myfs->dindex_map
+	};
+	const size_t maps = (myfs->sb.features & MYFS_FEATURE_DINDEX) ? 3 : 2;
+	struct myfs_lsm *target = NULL;
+	size_t total = 0, max = 0;
+
+	for (size_t i = 0; i != maps; ++i) {
+		size_t c0;
+
+		total += myfs_lsm_bytes(map[i], &c0);
+		if (c0 >= map[i]->budget)
+			return map[i];
+		if (c0 > max) {
+			max = c0;
+			target = map[i];
+		}
+	}
+	return total >= myfs->mem_budget ? target : NULL;
+}
+
+void myfs_flush_kick(struct myfs *myfs)
+{
+	if (!myfs->mem_budget || !myfs_flush_target(myfs))
+		return;
+
+	assert(!pthread_mutex_lock(&myfs->trans_mtx));
+	myfs->flush = 1;
+	assert(!pthread_cond_signal(&myfs->trans_cv));
+	assert(!pthread_mutex_unlock(&myfs->trans_mtx));
+}
+
+/* flushes memtables until they fit into the budget, called by the worker */
+int myfs_flush_maps(struct myfs *myfs)
+{
+	struct myfs_lsm *lsm;
+	int err;
+
+	while ((lsm = myfs_flush_target(myfs))) {
+		if ((err = myfs_lsm_flush(lsm)))
+			return err;
+	}
+	return 0;
+}
+
 static void myfs_dump_ctree(const struct myfs_ctree_sb *sb)
 {
-	printf("\tctree size %lu, hight %lu\n",
-		(unsigned long)sb->size, (unsigned long)sb->hight);
+	printf("\tctree size %lu, hight %lu, fanout %lu, node pages %lu\n",
+		(unsigned long)sb->size, (unsigned long)sb->hight,
+		(unsigned long)sb->fanout, (unsigned long)sb->node_pages);
 }
 
 static void myfs_dump_lsm(const struct myfs_lsm_sb *sb)
@@ -184,12 +292,29 @@ static void myfs_dump_lsm(const struct myfs_lsm_sb *sb)
 		myfs_dump_ctree(&sb->tree[i]);
 }
 
-static void myfs_dump_check(const struct myfs_check *check)
+static void myfs_dump_check(const struct myfs *myfs)
 {
+	const struct myfs_check *check = &myfs->check;
+
 	printf("gen %llu\n", (unsigned long long)check->gen);
 	printf("next ino %llu\n", (unsigned long long)check->ino);
 	printf("inode sb:\n"); myfs_dump_lsm(&check->inode_sb);
 	printf("dentry sb:\n"); myfs_dump_lsm(&check->dentry_sb);
+	if (myfs->sb.features & MYFS_FEATURE_DINDEX) {
+		printf("dindex sb:\n");
+		myfs_dump_lsm(&check->dindex_sb);
+	}
+}
+
+static void myfs_dump_ncache(struct myfs_ncache *cache)
+{
+	struct myfs_ncache_stats stats;
+
+	myfs_ncache_stats(cache, &stats);
+	printf("node cache %lu/%lu bytes, hits %llu, misses %llu, "
+		"bad nodes %llu\n",
+		(unsigned long)stats.size, (unsigned long)stats.cap,
+		stats.hits, stats.misses, stats.errors);
 }
 
 int myfs_checkpoint(struct myfs *myfs)
@@ -206,16 +331,20 @@ int myfs_checkpoint(struct myfs *myfs)
 
 	myfs_lsm_get_root(&myfs->check.inode_sb, &myfs->inode_map);
 	myfs_lsm_get_root(&myfs->check.dentry_sb, &myfs->dentry_map);
+	if (myfs->sb.features & MYFS_FEATURE_DINDEX)
+		myfs_lsm_get_root(&myfs->check.dindex_sb, &myfs->dindex_map);
 	++myfs->check.gen;
 	myfs->check.ino = atomic_load_explicit(&myfs->next_ino,
 				memory_order_relaxed);
 
-	if (myfs->verbose)
-		myfs_dump_check(&myfs->check);
+	if (myfs->verbose) {
+		myfs_dump_check(myfs);
+		myfs_dump_ncache(&myfs->ncache);
+	}
 
 	myfs_check2disk(check, &myfs->check);
 
-	const uint64_t csum = myfs_csum(check, check_size);
+	const uint64_t csum = myfs_csum(myfs, check, check_size);
 	int ret;
 
 	check->csum = htole64(csum);
@@ -288,19 +417,16 @@ static int __myfs_create(struct myfs *myfs,
 	child->gid = gid;
 	child->perm = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
 
-	ret = __myfs_inode_write(myfs, child);
-	if (ret) {
-		myfs_inode_put(myfs, child);
-		return ret;
-	}
-
 	++dir->size;
 	dir->mtime = myfs_now();
-	ret = __myfs_inode_write(myfs, dir);
+
+	struct myfs_inode *inodes[] = { child, dir };
+
+	ret = __myfs_inode_write_batch(myfs, inodes, 2);
 	if (ret) {
 		myfs_inode_put(myfs, child);
 		return ret;
-	}	
+	}
 
 	dentry.parent = dir->inode;
 	dentry.inode = ino;
@@ -360,18 +486,17 @@ static int __myfs_unlink(struct myfs *myfs, struct myfs_inode *dir,
 		inode->type |= MYFS_TYPE_DEL;
 
 	inode->mtime = myfs_now();
-	ret = __myfs_inode_write(myfs, inode);
+	--dir->size;
+	dir->mtime = myfs_now();
+
+	struct myfs_inode *inodes[] = { inode, dir };
+
+	ret = __myfs_inode_write_batch(myfs, inodes, 2);
 	if (ret)
 		return ret;
 
 	dentry->type |= MYFS_TYPE_DEL;
 	ret = __myfs_dentry_write(myfs, dentry);
-	if (ret)
-		return ret;
-
-	--dir->size;
-	dir->mtime = myfs_now();
-	ret = __myfs_inode_write(myfs, dir);
 	return ret;
 }
 
@@ -461,13 +586,12 @@ static int __myfs_link(struct myfs *myfs, struct myfs_inode *inode,
 
 	++inode->links;
 	inode->mtime = myfs_now();
-	ret = __myfs_inode_write(myfs, inode);
-	if (ret)
-		return ret;
-
 	++dir->size;
 	dir->mtime = myfs_now();
-	ret = __myfs_inode_write(myfs, dir);
+
+	struct myfs_inode *inodes[] = { inode, dir };
+
+	ret = __myfs_inode_write_batch(myfs, inodes, 2);
 	if (ret)
 		return ret;
 
@@ -534,17 +658,17 @@ static int __myfs_rename(struct myfs *myfs, struct myfs_inode *old,
 	if (err && err != -ENOENT)
 		return err;
 
+	struct myfs_inode *read[2];
+	size_t count = 0;
+
+	link = myfs_inode_get(myfs, oldentry.inode);
+	read[count++] = link;
 	if (!err) {
 		unlink = myfs_inode_get(myfs, newentry.inode);
-		err = myfs_inode_read(myfs, unlink);
-		if (err) {
-			myfs_inode_put(myfs, unlink);
-			return err;
-		}
+		read[count++] = unlink;
 	}
 
-	link = myfs_inode_get(myfs, oldentry.inode);
-	err = myfs_inode_read(myfs, link);
+	err = myfs_inode_read_batch(myfs, read, count);
 	if (err) {
 		myfs_inode_put(myfs, unlink);
 		myfs_inode_put(myfs, link);
@@ -622,61 +746,300 @@ int myfs_rename(struct myfs *myfs, struct myfs_inode *old, const char *oldname,
 }
 
 
+/**
+ * Readdir cookies: the order key of the last emitted entry and its
+ * position among the entries sharing the key, so entries with colliding
+ * keys still have distinct cookies. The key is the top bits of the name
+ * hash, or the inode number if the directory index is used. Cookies fit
+ * into 63 bits for the sake of off_t, the cookie 0 is the start. An entry
+ * that doesn't get a cookie of its own (more than MYFS_COOKIE_SEQ_MAX
+ * entries share the key, or the inode number is too large) fails readdir
+ * with -EOVERFLOW rather than making resumption ambiguous.
+ **/
+#define MYFS_COOKIE_SEQ_BITS	16
+#define MYFS_COOKIE_SEQ_MAX	((1ull << MYFS_COOKIE_SEQ_BITS) - 1)
+#define MYFS_COOKIE_KEY_BITS	(63 - MYFS_COOKIE_SEQ_BITS)
+
+static int myfs_readdir_dindex(const struct myfs *myfs)
+{
+	return (myfs->sb.features & MYFS_FEATURE_DINDEX) != 0;
+}
+
+static struct myfs_lsm *myfs_readdir_map(struct myfs *myfs)
+{
+	if (myfs_readdir_dindex(myfs))
+		return &myfs->dindex_map;
+	return &myfs->dentry_map;
+}
+
+static void myfs_readdir_key2mem(const struct myfs *myfs,
+			struct myfs_dentry *dentry, const struct myfs_key *key)
+{
+	if (myfs_readdir_dindex(myfs))
+		myfs_dindex_key2mem(dentry, key->data);
+	else
+		myfs_dentry_key2mem(dentry, key->data);
+}
+
+static uint64_t myfs_cookie_prefix(const struct myfs *myfs,
+			const struct myfs_dentry *dentry)
+{
+	if (myfs_readdir_dindex(myfs))
+		return dentry->inode;
+	return dentry->hash >> (64 - MYFS_COOKIE_KEY_BITS);
+}
+
+/* the cookie of the entry following the entry with the cookie */
+static int myfs_cookie_next(const struct myfs *myfs, uint64_t cookie,
+			const struct myfs_dentry *dentry, uint64_t *next)
+{
+	const uint64_t prefix = myfs_cookie_prefix(myfs, dentry);
+
+	if (prefix >> MYFS_COOKIE_KEY_BITS)
+		return -EOVERFLOW;
+	if (prefix != cookie >> MYFS_COOKIE_SEQ_BITS) {
+		*next = (prefix << MYFS_COOKIE_SEQ_BITS) | 1;
+		return 0;
+	}
+	if ((cookie & MYFS_COOKIE_SEQ_MAX) == MYFS_COOKIE_SEQ_MAX)
+		return -EOVERFLOW;
+	*next = cookie + 1;
+	return 0;
+}
+
+
 struct myfs_readdir_query {
 	struct myfs_query query;
-	struct myfs_readdir_ctx *ctx;
+	const struct myfs *myfs;
 	uint64_t parent;
-	uint64_t cookie;
+	uint64_t prefix;
 };
 
 
-static int myfs_readdir_emit(struct myfs_query *q, const struct myfs_key *key,
-			const struct myfs_value *value)
+/* entries of the directory */
+static int myfs_readdir_range_cmp(struct myfs_query *q,
+			const struct myfs_key *key)
 {
 	struct myfs_readdir_query *query = (struct myfs_readdir_query *)q;
 	struct myfs_dentry dentry;
 
-	myfs_dentry_key2mem(&dentry, key->data);
-	myfs_dentry_value2mem(&dentry, value->data);
-	assert(dentry.parent == query->parent);
-	if (dentry.type & MYFS_TYPE_DEL)
-		return 0;
-	return query->ctx->emit(query->ctx, &dentry);
+	myfs_readdir_key2mem(query->myfs, &dentry, key);
+	if (dentry.parent != query->parent)
+		return dentry.parent < query->parent ? -1 : 1;
+	return 0;
 }
 
+/* entries of the directory starting from the cookie prefix */
 static int myfs_readdir_cmp(struct myfs_query *q, const struct myfs_key *key)
 {
 	struct myfs_readdir_query *query = (struct myfs_readdir_query *)q;
 	struct myfs_dentry dentry;
 
-	myfs_dentry_key2mem(&dentry, key->data);
+	myfs_readdir_key2mem(query->myfs, &dentry, key);
 	if (dentry.parent != query->parent)
 		return dentry.parent < query->parent ? -1 : 1;
-	if (dentry.hash <= query->cookie)
+	if (myfs_cookie_prefix(query->myfs, &dentry) < query->prefix)
 		return -1;
 	return 0;
 }
 
-int myfs_readdir(struct myfs *myfs, struct myfs_inode *inode,
-			struct myfs_readdir_ctx *ctx, uint64_t cookie)
+/**
+ * Directory stream: entries are read in batches and the rest of a batch
+ * is kept between readdir calls, so a readdir that continues from where
+ * the previous one stopped mostly emits entries without searching the
+ * map. The cursor is only set up while a batch is read, the stream
+ * doesn't hold a view of the map between calls. Once the stream reaches
+ * the end it stays there until it's rewound to the start.
+ **/
+#define MYFS_DIR_BATCH	64
+
+struct myfs_dir_entry {
+	struct myfs_dentry dentry;
+	/* the cookie following the entry */
+	uint64_t cookie;
+	char name[MYFS_FS_NAMEMAX];
+};
+
+struct myfs_dir {
+	struct myfs_inode *inode;
+	struct myfs_readdir_query range;
+	struct myfs_lsm_cursor cur;
+
+	/* entries following the cookie */
+	int valid;
+	uint64_t cookie;
+	struct myfs_dir_entry entry[MYFS_DIR_BATCH];
+	size_t pos;
+	size_t count;
+	/* what follows the batch: 1 - more entries, 0 - the end, or an
+	   error */
+	int tail;
+
+	/* fuse may read the same handle concurrently */
+	pthread_mutex_t mtx;
+};
+
+
+static int myfs_dir_fill(struct myfs *myfs, struct myfs_dir *dir,
+			uint64_t cookie)
 {
 	struct myfs_readdir_query query = {
-		.query = {
-			.emit = &myfs_readdir_emit,
-			.cmp = &myfs_readdir_cmp,
-		},
-		.ctx = ctx,
-		.parent = inode->inode,
-		.cookie = cookie
+		.query = { .cmp = &myfs_readdir_cmp },
+		.myfs = myfs,
+		.parent = dir->inode->inode,
+		.prefix = cookie >> MYFS_COOKIE_SEQ_BITS
 	};
+	struct myfs_lsm_cursor *cur = &dir->cur;
+	uint64_t seq = cookie & MYFS_COOKIE_SEQ_MAX;
+	size_t count = 0;
+	int err;
+
+	err = myfs_lsm_cursor_setup(cur, myfs_readdir_map(myfs),
+				&dir->range.query);
+	if (err) {
+		myfs_lsm_cursor_release(cur);
+		return err;
+	}
+
+	/* skip the entries of the prefix emitted before the cookie */
+	err = myfs_lsm_cursor_seek(cur, &query.query);
+	for (; err == 1 && seq; --seq) {
+		const struct myfs_key *key = myfs_lsm_cursor_key(cur);
+		struct myfs_dentry dentry;
+
+		myfs_readdir_key2mem(myfs, &dentry, key);
+		if (myfs_cookie_prefix(myfs, &dentry) != query.prefix)
+			break;
+		err = myfs_lsm_cursor_next(cur);
+	}
+
+	while (err == 1 && count != MYFS_DIR_BATCH) {
+		const struct myfs_key *key = myfs_lsm_cursor_key(cur);
+		const struct myfs_value *value = myfs_lsm_cursor_value(cur);
+		struct myfs_dir_entry *entry = &dir->entry[count];
+		struct myfs_dentry *dentry = &entry->dentry;
+
+		myfs_readdir_key2mem(myfs, dentry, key);
+		myfs_dentry_value2mem(dentry, value->data);
+		assert(dentry->parent == dir->inode->inode);
+		assert(dentry->size <= MYFS_FS_NAMEMAX);
+
+		if ((err = myfs_cookie_next(myfs, cookie, dentry, &cookie)))
+			break;
+		memcpy(entry->name, dentry->name, dentry->size);
+		dentry->name = entry->name;
+		entry->cookie = cookie;
+
+		++count;
+		err = myfs_lsm_cursor_next(cur);
+	}
+	myfs_lsm_cursor_release(cur);
+
+	dir->pos = 0;
+	dir->count = count;
+	dir->tail = err;
+	return 0;
+}
+
+static int __myfs_readdir(struct myfs *myfs, struct myfs_dir *dir,
+			struct myfs_readdir_ctx *ctx, uint64_t cookie)
+{
 	int err;
 
+	/* rewind, entries created since the stream was read appear */
+	if (!cookie)
+		dir->valid = 0;
+
+	while (1) {
+		if (!dir->valid || dir->cookie != cookie) {
+			dir->valid = 0;
+			if ((err = myfs_dir_fill(myfs, dir, cookie)))
+				return err;
+			dir->valid = 1;
+			dir->cookie = cookie;
+		}
+
+		for (; dir->pos != dir->count; ++dir->pos) {
+			const struct myfs_dir_entry *entry =
+						&dir->entry[dir->pos];
+
+			if ((err = ctx->emit(ctx, &entry->dentry,
+						entry->cookie)))
+				return err;
+			dir->cookie = cookie = entry->cookie;
+		}
+
+		if (dir->tail == 1) {
+			dir->valid = 0;
+			continue;
+		}
+
+		/* the next call tries again after an error */
+		if (dir->tail < 0)
+			dir->valid = 0;
+		return dir->tail;
+	}
+}
+
+static void myfs_dir_setup(struct myfs *myfs, struct myfs_dir *dir,
+			struct myfs_inode *inode)
+{
+	memset(dir, 0, sizeof(*dir));
+	dir->inode = inode;
+	dir->range.query.cmp = &myfs_readdir_range_cmp;
+	dir->range.myfs = myfs;
+	dir->range.parent = inode->inode;
+	assert(!pthread_mutex_init(&dir->mtx, NULL));
+}
+
+static void myfs_dir_release(struct myfs_dir *dir)
+{
+	assert(!pthread_mutex_destroy(&dir->mtx));
+}
+
+int myfs_opendir(struct myfs *myfs, struct myfs_inode *inode,
+			struct myfs_dir **dir)
+{
+	assert((*dir = malloc(sizeof(**dir))));
+	myfs_dir_setup(myfs, *dir, inode);
+	return 0;
+}
+
+int myfs_readdir_stream(struct myfs *myfs, struct myfs_dir *dir,
+			struct myfs_readdir_ctx *ctx, uint64_t cookie)
+{
+	struct myfs_inode *inode = dir->inode;
+	int err;
+
+	assert(!pthread_mutex_lock(&dir->mtx));
 	assert(!pthread_rwlock_rdlock(&inode->rwlock));
 	if (inode->type & MYFS_TYPE_DEL)
 		err = -ENOENT;
 	else
-		err = myfs_lsm_range(&myfs->dentry_map, &query.query);
+		err = __myfs_readdir(myfs, dir, ctx, cookie);
 	assert(!pthread_rwlock_unlock(&inode->rwlock));
+	assert(!pthread_mutex_unlock(&dir->mtx));
+	return err;
+}
+
+void myfs_releasedir(struct myfs *myfs, struct myfs_dir *dir)
+{
+	myfs_dir_release(dir);
+	myfs_inode_put(myfs, dir->inode);
+	free(dir);
+}
+
+int myfs_readdir(struct myfs *myfs, struct myfs_inode *inode,
+			struct myfs_readdir_ctx *ctx, uint64_t cookie)
+{
+	struct myfs_dir *dir;
+	int err;
+
+	assert((dir = malloc(sizeof(*dir))));
+	myfs_dir_setup(myfs, dir, inode);
+	err = myfs_readdir_stream(myfs, dir, ctx, cookie);
+	myfs_dir_release(dir);
+	free(dir);
 	return err;
 }
 
@@ -871,14 +1234,15 @@ long myfs_write(struct myfs *myfs, struct myfs_inode *inode,
 }
 
 
-int myfs_block_write(struct myfs *myfs, const void *buf, uint64_t size,
-			uint64_t offs)
+int __myfs_block_write(struct myfs *myfs, const void *buf, uint64_t size,
+			uint64_t offs, int prio)
 {
 	struct bio bio;
 	int err;
 
 	bio_setup(&bio, myfs->bdev);
 	bio.flags = BIO_WRITE;
+	bio.prio = prio;
 	bio_add_vec(&bio, (void *)buf, offs, size);
 	bio_submit(&bio);
 	bio_wait(&bio);
@@ -887,13 +1251,15 @@ int myfs_block_write(struct myfs *myfs, const void *buf, uint64_t size,
 	return err;
 }
 
-int myfs_block_read(struct myfs *myfs, void *buf, uint64_t size, uint64_t offs)
+int __myfs_block_read(struct myfs *myfs, void *buf, uint64_t size,
+			uint64_t offs, int prio)
 {
 	struct bio bio;
 	int err;
 
 	bio_setup(&bio, myfs->bdev);
 	bio.flags = BIO_READ;
+	bio.prio = prio;
 	bio_add_vec(&bio, buf, offs, size);
 	bio_submit(&bio);
 	bio_wait(&bio);
@@ -902,6 +1268,17 @@ int myfs_block_read(struct myfs *myfs, void *buf, uint64_t size, uint64_t offs)
 	return err;
 }
 
+int myfs_block_write(struct myfs *myfs, const void *buf, uint64_t size,
+			uint64_t offs)
+{
+	return __myfs_block_write(myfs, buf, size, offs, BIO_PRIO_WAL);
+}
+
+int myfs_block_read(struct myfs *myfs, void *buf, uint64_t size, uint64_t offs)
+{
+	return __myfs_block_read(myfs, buf, size, offs, BIO_PRIO_READ);
+}
+
 int myfs_block_sync(struct myfs *myfs)
 {
 	struct bio bio;
@@ -909,6 +1286,7 @@ int myfs_block_sync(struct myfs *myfs)
 
 	bio_setup(&bio, myfs->bdev);
 	bio.flags = BIO_WRITE | BIO_SYNC;
+	bio.prio = BIO_PRIO_WAL;
 	bio_submit(&bio);
 	bio_wait(&bio);
 	err = bio.err;
@@ -96,13 +96,14 @@ void myfs_trans_append(struct myfs_trans *trans, uint32_t type,
 	trans->size += size;
 }
 
-static void myfs_trans_finalize(struct myfs_trans *trans)
+static void myfs_trans_finalize(struct myfs *myfs,
+			struct myfs_trans *trans)
 {
 	assert(trans->size <= MYFS_MAX_TRANS_SIZE);
 	trans->hdr->type = htole8(MYFS_TRANS_ENTRY);
 	trans->hdr->size = htole32(trans->size);
 	trans->hdr->csum = htole64(0);
-	trans->hdr->csum = htole64(myfs_csum(trans->data, trans->size));
+	trans->hdr->csum = htole64(myfs_csum(myfs, trans->data, trans->size));
 }
 
 static void myfs_trans_notify(struct myfs_trans *trans, int status)
@@ -120,7 +121,7 @@ void myfs_trans_submit(struct myfs *myfs, struct myfs_trans *trans)
 		return;
 	}
 
-	myfs_trans_finalize(trans);
+	myfs_trans_finalize(myfs, trans);
 
 	assert(!pthread_mutex_lock(&myfs->trans_mtx));
 	int empty = list_empty(&myfs->trans);
@@ -192,7 +193,8 @@ static int myfs_tx_has_space(const struct myfs_tx *tx, struct myfs_trans *trans)
 	return trans->size + sizeof(struct __myfs_tx_jump) <= tx->remain;
 }
 
-static void myfs_tx_jump(struct myfs_tx *tx, uint64_t offs)
+static void myfs_tx_jump(struct myfs *myfs, struct myfs_tx *tx,
+			uint64_t offs)
 {
 	struct __myfs_tx_jump jump;
 
@@ -200,7 +202,7 @@ static void myfs_tx_jump(struct myfs_tx *tx, uint64_t offs)
 	jump.hdr.size = htole32(sizeof(jump));
 	jump.hdr.csum = htole64(0);
 	jump.offs = htole64(offs);
-	jump.hdr.csum = htole64(myfs_csum(&jump, sizeof(jump)));
+	jump.hdr.csum = htole64(myfs_csum(myfs, &jump, sizeof(jump)));
 	myfs_tx_append(tx, &jump, sizeof(jump));
 }
 
@@ -219,7 +221,7 @@ static int myfs_tx_commit(struct myfs *myfs, struct myfs_tx *tx, int force_next)
 		if (err)
 			return err;
 
-		myfs_tx_jump(tx, offs);
+		myfs_tx_jump(myfs, tx, offs);
 	}
 
 	err = myfs_block_write(myfs, tx->data,
@@ -282,7 +284,7 @@ static int myfs_tx_apply(struct myfs *myfs, struct myfs_tx *tx)
 		myfs_trans_hdr2mem(&hdr, __hdr);
 		__hdr->csum = htole64(0);
 
-		if (hdr.csum != myfs_csum(__hdr, hdr.size))
+		if (hdr.csum != myfs_csum(myfs, __hdr, hdr.size))
 			return -1;
 
 		if (hdr.type == MYFS_TRANS_JUMP)
@@ -350,23 +352,32 @@ void myfs_trans_worker(struct myfs *myfs)
 
 	while (1) {
 		struct list_head list;
+		int flush;
 
 		list_setup(&list);
 		assert(!pthread_mutex_lock(&myfs->trans_mtx));
 		while (1) {
 			if (!list_empty(&myfs->trans))
 				break;
+			if (myfs->flush)
+				break;
 			if (myfs->done)
 				break;
 			assert(!pthread_cond_wait(&myfs->trans_cv,
 						&myfs->trans_mtx));
 		}
 		list_splice(&myfs->trans, &list);
+		flush = myfs->flush;
+		myfs->flush = 0;
 		assert(!pthread_mutex_unlock(&myfs->trans_mtx));
 
-		if (list_empty(&list))
+		if (list_empty(&list) && !flush)
 			break;
 
-		myfs_trans_batch(myfs, &list);
+		if (!list_empty(&list))
+			myfs_trans_batch(myfs, &list);
+		/* a failed flush is retried on the next kick */
+		if (flush)
+			myfs_flush_maps(myfs);
 	}
 }
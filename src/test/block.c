@@ -0,0 +1,155 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <block/block.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+
+#define SECTOR		512
+/* more than the inline vectors of a bio, so it has to grow twice */
+#define VECS		40
+
+
+static const char *TEST_NAME = "test.bin";
+
+
+struct block_test {
+	int (*test)(struct bdev *);
+	const char *name;
+};
+
+
+/* writes VECS sectors in reverse order with one bio and reads them back
+   with another, every sector is filled with its own index */
+static int block_io(struct bdev *bdev, int async)
+{
+	unsigned char *buf;
+	struct bio bio;
+	int err;
+
+	assert((buf = malloc(VECS * SECTOR)));
+	for (size_t i = 0; i != VECS; ++i)
+		memset(buf + i * SECTOR, (int)i + 1, SECTOR);
+
+	bio_setup(&bio, bdev);
+	bio.flags = BIO_WRITE;
+	for (size_t i = VECS; i; --i)
+		bio_add_vec(&bio, buf + (i - 1) * SECTOR,
+					(i - 1) * SECTOR, SECTOR);
+	bio_submit(&bio);
+	bio_wait(&bio);
+	err = bio.err;
+	bio_release(&bio);
+
+	if (err) {
+		free(buf);
+		return err;
+	}
+
+	memset(buf, 0, VECS * SECTOR);
+	bio_setup(&bio, bdev);
+	bio.flags = BIO_READ;
+	for (size_t i = 0; i != VECS; ++i)
+		bio_add_vec(&bio, buf + i * SECTOR, i * SECTOR, SECTOR);
+	if (async)
+		bio_submit_async(&bio);
+	else
+		bio_submit(&bio);
+	bio_wait(&bio);
+	err = bio.err;
+	bio_release(&bio);
+
+	for (size_t i = 0; i != VECS * SECTOR && !err; ++i) {
+		if (buf[i] != i / SECTOR + 1) {
+			fprintf(stderr, "sector %zu wasn't read back\n",
+						i / SECTOR);
+			err = -1;
+		}
+	}
+	free(buf);
+	return err;
+}
+
+static int block_vec_test(struct bdev *bdev)
+{
+	return block_io(bdev, 0);
+}
+
+static int block_async_test(struct bdev *bdev)
+{
+	struct bio_queue queue;
+	int err;
+
+	bio_queue_setup(&queue);
+	bdev_set_queue(bdev, &queue);
+	err = block_io(bdev, 1);
+	bdev_set_queue(bdev, NULL);
+	bio_queue_release(&queue);
+	return err;
+}
+
+static int run_tests(struct bdev *bdev)
+{
+	const struct block_test test[] = {
+		{ &block_vec_test, "block_vec_test" },
+		{ &block_async_test, "block_async_test" },
+	};
+
+	for (int i = 0; i != sizeof(test)/sizeof(test[0]); ++i) {
+		const int err = test[i].test(bdev);
+
+		if (!err)
+			continue;
+
+		fprintf(stderr, "test %s failed (%d)\n", test[i].name, err);
+		return err;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	const int fd = open(TEST_NAME, O_RDWR | O_CREAT | O_TRUNC,
+				S_IRUSR | S_IWUSR);
+
+	if (fd < 0) {
+		perror("failed to create test file");
+		return 1;
+	}
+
+	struct sync_bdev bdev;
+
+	sync_bdev_setup(&bdev, fd);
+
+	const int ret = run_tests(&bdev.bdev);
+
+	if (ret)
+		fprintf(stderr, "tests failed\n");
+	else
+		unlink(TEST_NAME);
+	close(fd);
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,543 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <lsm/btree.h>
+#include <lsm/skip.h>
+
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+
+struct myfs_btree_test {
+	int (*test)(void);
+	const char *name;
+};
+
+
+static uint64_t btree_hash(uint64_t key)
+{
+	return ((key + 13) * 188748146801ull) % 2549536629329ull;
+}
+
+static uint64_t btree_value(uint64_t key)
+{
+	return key * 2 + 1;
+}
+
+static int btree_key_cmp(const struct myfs_key *l, const struct myfs_key *r)
+{
+	le64_t lv, rv;
+
+	memcpy(&lv, l->data, sizeof(lv));
+	memcpy(&rv, r->data, sizeof(rv));
+	lv = le64toh(lv);
+	rv = le64toh(rv);
+
+	if (lv != rv)
+		return lv < rv ? -1 : 1;
+	return 0;
+}
+
+
+struct btree_query {
+	struct myfs_query query;
+	le64_t key;
+	uint64_t value;
+};
+
+struct btree_range_query {
+	struct myfs_query query;
+	uint64_t from;
+	uint64_t to;
+	uint64_t prev;
+	size_t count;
+};
+
+
+static int btree_query_cmp(struct myfs_query *q, const struct myfs_key *key)
+{
+	struct btree_query *query = (struct btree_query *)q;
+	const struct myfs_key k = { sizeof(query->key), &query->key };
+
+	return btree_key_cmp(key, &k);
+}
+
+static int btree_query_emit(struct myfs_query *q, const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	struct btree_query *query = (struct btree_query *)q;
+	uint64_t v;
+
+	(void) key;
+	if (value->size != sizeof(v)) {
+		fprintf(stderr, "wrong value size\n");
+		return -EINVAL;
+	}
+
+	memcpy(&v, value->data, sizeof(v));
+	if (v != query->value) {
+		fprintf(stderr, "wrong value\n");
+		return -EINVAL;
+	}
+	return 1;
+}
+
+static int btree_range_cmp(struct myfs_query *q, const struct myfs_key *key)
+{
+	struct btree_range_query *query = (struct btree_range_query *)q;
+	le64_t k;
+
+	memcpy(&k, key->data, sizeof(k));
+	if (le64toh(k) < query->from)
+		return -1;
+	if (le64toh(k) >= query->to)
+		return 1;
+	return 0;
+}
+
+static int btree_range_emit(struct myfs_query *q, const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	struct btree_range_query *query = (struct btree_range_query *)q;
+	le64_t k;
+
+	(void) value;
+	memcpy(&k, key->data, sizeof(k));
+	if (query->count && le64toh(k) <= query->prev) {
+		fprintf(stderr, "keys are out of order\n");
+		return -EINVAL;
+	}
+	query->prev = le64toh(k);
+	++query->count;
+	return 0;
+}
+
+
+static int btree_insert(struct myfs_mtree *tree, uint64_t k, uint64_t v)
+{
+	const le64_t key = htole64(k);
+	const struct myfs_key __key = { sizeof(key), (void *)&key };
+	const struct myfs_value value = { sizeof(v), &v };
+
+	return tree->insert(tree, &__key, &value);
+}
+
+static int btree_lookup(struct myfs_mtree *tree, uint64_t k, uint64_t v,
+			int le64)
+{
+	struct btree_query query = {
+		{ &btree_query_cmp, &btree_query_emit, NULL },
+		htole64(k), v
+	};
+	const struct myfs_key key = { sizeof(query.key), &query.key };
+	int err;
+
+	if (le64)
+		query.query.key = &key;
+
+	err = tree->lookup(tree, &query.query);
+	if (!err)
+		return -ENOENT;
+	return err < 0 ? err : 0;
+}
+
+static int btree_range(struct myfs_mtree *tree, uint64_t from, uint64_t to,
+			size_t *count)
+{
+	struct btree_range_query query = {
+		{ &btree_range_cmp, &btree_range_emit, NULL },
+		from, to, 0, 0
+	};
+	const int err = tree->range(tree, &query.query);
+
+	*count = query.count;
+	return err;
+}
+
+
+static int btree_insert_test(void)
+{
+	const size_t ENTRIES = 1000000;
+	const unsigned long FLAGS[] = {
+		0, MYFS_KEY_LE64, MYFS_KEY_LE64 | MYFS_KEY_HASH
+	};
+
+	struct myfs_btree tree;
+	int err = 0;
+
+	for (size_t f = 0; !err && f != sizeof(FLAGS)/sizeof(FLAGS[0]); ++f) {
+		const int le64 = (FLAGS[f] & MYFS_KEY_LE64) != 0;
+
+		myfs_btree_setup(&tree, &btree_key_cmp, FLAGS[f]);
+		for (size_t i = 0; !err && i != ENTRIES; ++i) {
+			const uint64_t key = btree_hash(i);
+
+			err = btree_insert(&tree.mtree, key, btree_value(key));
+		}
+
+		for (size_t i = 0; !err && i != ENTRIES; ++i) {
+			const uint64_t key = btree_hash(i);
+
+			err = btree_lookup(&tree.mtree, key, btree_value(key),
+						le64);
+		}
+
+		/* keys that aren't in the tree, all keys are below 2^42 */
+		for (size_t i = 0; !err && i != ENTRIES; i += 1000) {
+			const uint64_t key = btree_hash(i) + (1ull << 42);
+
+			if (btree_lookup(&tree.mtree, key, 0, le64) != -ENOENT)
+				err = -EINVAL;
+		}
+
+		if (!err && myfs_btree_size(&tree) != ENTRIES) {
+			fprintf(stderr, "wrong btree size\n");
+			err = -EINVAL;
+		}
+		myfs_btree_release(&tree);
+	}
+	return err;
+}
+
+static int btree_update_test(void)
+{
+	const size_t ROUND = 1000;
+	const size_t ROUNDS = 1000;
+
+	struct myfs_btree tree;
+	int err = 0;
+
+	myfs_btree_setup(&tree, &btree_key_cmp, MYFS_KEY_HASH);
+	for (size_t i = 0; !err && i != ROUNDS; ++i) {
+		for (size_t j = 0; !err && j != ROUND; ++j)
+			err = btree_insert(&tree.mtree, btree_hash(j), i);
+
+		for (size_t j = 0; !err && j != ROUND; ++j)
+			err = btree_lookup(&tree.mtree, btree_hash(j), i,
+						j % 2);
+	}
+
+	if (!err && myfs_btree_size(&tree) != ROUND) {
+		fprintf(stderr, "wrong btree size\n");
+		err = -EINVAL;
+	}
+	myfs_btree_release(&tree);
+	return err;
+}
+
+static double btree_bench_now(void);
+
+/* batches in random order with repeated keys, the last value wins */
+static int btree_batch_test(void)
+{
+	const size_t ENTRIES = 500000;
+	const size_t BATCH = 1000;
+
+	struct myfs_key *key = calloc(BATCH, sizeof(*key));
+	struct myfs_value *value = calloc(BATCH, sizeof(*value));
+	le64_t *k = calloc(BATCH, sizeof(*k));
+	uint64_t *v = calloc(BATCH, sizeof(*v));
+	struct myfs_btree tree;
+	int err = 0;
+
+	assert(key && value && k && v);
+	myfs_btree_setup(&tree, &btree_key_cmp, MYFS_KEY_LE64 | MYFS_KEY_HASH);
+	for (size_t i = 0; !err && i != ENTRIES; i += BATCH / 2) {
+		for (size_t j = 0; j != BATCH; ++j) {
+			const uint64_t x = btree_hash(i + j % (BATCH / 2));
+
+			k[j] = htole64(x);
+			v[j] = j < BATCH / 2 ? 0 : btree_value(x);
+			key[j].size = sizeof(k[j]);
+			key[j].data = &k[j];
+			value[j].size = sizeof(v[j]);
+			value[j].data = &v[j];
+		}
+		err = myfs_btree_insert_batch(&tree, key, value, BATCH);
+	}
+
+	for (size_t i = 0; !err && i != ENTRIES; ++i) {
+		const uint64_t x = btree_hash(i);
+
+		err = btree_lookup(&tree.mtree, x, btree_value(x), i % 2);
+	}
+
+	if (!err && myfs_btree_size(&tree) != ENTRIES) {
+		fprintf(stderr, "wrong btree size\n");
+		err = -EINVAL;
+	}
+	myfs_btree_release(&tree);
+
+	/* sorted batches against separate inserts of the same keys */
+	for (int batch = 0; !err && batch != 2; ++batch) {
+		const double start = btree_bench_now();
+
+		myfs_btree_setup(&tree, &btree_key_cmp, MYFS_KEY_LE64);
+		for (size_t i = 0; !err && i != ENTRIES; i += BATCH) {
+			for (size_t j = 0; j != BATCH; ++j) {
+				k[j] = htole64((i + j) * 1000);
+				v[j] = i + j;
+				key[j].size = sizeof(k[j]);
+				key[j].data = &k[j];
+				value[j].size = sizeof(v[j]);
+				value[j].data = &v[j];
+			}
+
+			if (batch) {
+				err = myfs_btree_insert_batch(&tree, key,
+							value, BATCH);
+				continue;
+			}
+
+			for (size_t j = 0; !err && j != BATCH; ++j)
+				err = myfs_btree_insert(&tree, &key[j],
+							&value[j]);
+		}
+		myfs_btree_release(&tree);
+
+		const double time = btree_bench_now() - start;
+
+		printf("%s: %zu inserts in %.3fs, %.0f ops/s\n",
+					batch ? "batch" : "single", ENTRIES,
+					time, ENTRIES / time);
+	}
+
+	free(v);
+	free(k);
+	free(value);
+	free(key);
+	return err;
+}
+
+static int btree_range_test(void)
+{
+	const size_t ENTRIES = 100000;
+	const size_t STEP = 1000;
+
+	struct myfs_btree tree;
+	size_t count;
+	int err = 0;
+
+	myfs_btree_setup(&tree, &btree_key_cmp, MYFS_KEY_LE64);
+	/* even keys only, so ranges start and end between keys too */
+	for (size_t i = 0; !err && i != ENTRIES; ++i) {
+		const uint64_t key = i * 7919 % ENTRIES * 2;
+
+		err = btree_insert(&tree.mtree, key, btree_value(key));
+	}
+
+	for (size_t i = 0; !err && i + STEP <= 2 * ENTRIES; i += STEP + 1) {
+		err = btree_range(&tree.mtree, i, i + STEP, &count);
+		if (!err && count != (i + STEP + 1) / 2 - (i + 1) / 2) {
+			fprintf(stderr, "wrong range size %zu\n", count);
+			err = -EINVAL;
+		}
+	}
+
+	if (!err) {
+		struct btree_range_query query = {
+			{ &btree_range_cmp, &btree_range_emit, NULL },
+			0, 2 * ENTRIES, 0, 0
+		};
+
+		err = myfs_btree_scan(&tree, &query.query);
+		if (!err && query.count != ENTRIES) {
+			fprintf(stderr, "wrong scan size %zu\n", query.count);
+			err = -EINVAL;
+		}
+	}
+	myfs_btree_release(&tree);
+	return err;
+}
+
+
+struct btree_bench {
+	pthread_t thread;
+	struct myfs_mtree *tree;
+	int (*op)(struct btree_bench *, size_t);
+	size_t from;
+	size_t to;
+	int err;
+};
+
+static const size_t BENCH_ENTRIES = 500000;
+static const size_t BENCH_RANGE = 100;
+
+
+static int btree_bench_insert(struct btree_bench *ctx, size_t i)
+{
+	const uint64_t key = btree_hash(i);
+
+	return btree_insert(ctx->tree, key, btree_value(key));
+}
+
+static int btree_bench_lookup(struct btree_bench *ctx, size_t i)
+{
+	const uint64_t key = btree_hash(i);
+
+	return btree_lookup(ctx->tree, key, btree_value(key), 1);
+}
+
+static int btree_bench_range(struct btree_bench *ctx, size_t i)
+{
+	const uint64_t from = btree_hash(i);
+	size_t count;
+
+	/* keys are sparse, only ordering and termination are checked */
+	return btree_range(ctx->tree, from, from + BENCH_RANGE * 5099999ull,
+				&count);
+}
+
+static void *btree_bench_run(void *arg)
+{
+	struct btree_bench *ctx = arg;
+
+	for (size_t i = ctx->from; !ctx->err && i != ctx->to; ++i)
+		ctx->err = ctx->op(ctx, i);
+	return NULL;
+}
+
+static double btree_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int btree_bench_op(struct myfs_mtree *tree, size_t threads,
+			int (*op)(struct btree_bench *, size_t),
+			size_t ops, const char *name, const char *what)
+{
+	struct btree_bench ctx[16];
+	int err = 0;
+
+	assert(threads <= sizeof(ctx)/sizeof(ctx[0]));
+
+	const double start = btree_bench_now();
+
+	for (size_t i = 0; i != threads; ++i) {
+		ctx[i].tree = tree;
+		ctx[i].op = op;
+		ctx[i].from = ops * i / threads;
+		ctx[i].to = ops * (i + 1) / threads;
+		ctx[i].err = 0;
+		assert(!pthread_create(&ctx[i].thread, NULL,
+					&btree_bench_run, &ctx[i]));
+	}
+
+	for (size_t i = 0; i != threads; ++i) {
+		assert(!pthread_join(ctx[i].thread, NULL));
+		if (ctx[i].err)
+			err = ctx[i].err;
+	}
+
+	const double time = btree_bench_now() - start;
+
+	printf("%s %zu threads: %zu %s in %.3fs, %.0f ops/s\n",
+				name, threads, ops, what, time, ops / time);
+	return err;
+}
+
+static int btree_bench(struct myfs_mtree *tree, size_t threads,
+			const char *name)
+{
+	int err;
+
+	err = btree_bench_op(tree, threads, &btree_bench_insert,
+				BENCH_ENTRIES, name, "inserts");
+	if (!err)
+		err = btree_bench_op(tree, threads, &btree_bench_lookup,
+					BENCH_ENTRIES, name, "lookups");
+	if (!err)
+		err = btree_bench_op(tree, threads, &btree_bench_range,
+					BENCH_ENTRIES / 10, name, "ranges");
+	if (!err && tree->size(tree) != BENCH_ENTRIES) {
+		fprintf(stderr, "wrong %s size\n", name);
+		err = -EINVAL;
+	}
+	return err;
+}
+
+/* Compares the B+tree with the skiplist, both use le64 keys and in place
+   updates like LSM memtables do. */
+static int btree_concurrent_test(void)
+{
+	const size_t THREADS[] = { 1, 4, 16 };
+
+	int err = 0;
+
+	for (size_t i = 0; !err && i != sizeof(THREADS)/sizeof(THREADS[0]);
+				++i) {
+		struct myfs_skiplist skip;
+		struct myfs_btree tree;
+
+		myfs_skiplist_setup(&skip, &btree_key_cmp, MYFS_KEY_LE64);
+		skip.inplace = 1;
+		err = btree_bench(&skip.mtree, THREADS[i], "skiplist");
+		myfs_skiplist_release(&skip);
+
+		if (err)
+			break;
+
+		myfs_btree_setup(&tree, &btree_key_cmp, MYFS_KEY_LE64);
+		err = btree_bench(&tree.mtree, THREADS[i], "btree");
+		myfs_btree_release(&tree);
+
+		if (err)
+			break;
+
+		myfs_btree_setup(&tree, &btree_key_cmp,
+					MYFS_KEY_LE64 | MYFS_KEY_HASH);
+		err = btree_bench(&tree.mtree, THREADS[i], "btree+hash");
+		myfs_btree_release(&tree);
+	}
+	return err;
+}
+
+static int run_tests(void)
+{
+	const struct myfs_btree_test test[] = {
+		{ &btree_insert_test, "btree_insert_test" },
+		{ &btree_update_test, "btree_update_test" },
+		{ &btree_range_test, "btree_range_test" },
+		{ &btree_batch_test, "btree_batch_test" },
+		{ &btree_concurrent_test, "btree_concurrent_test" },
+	};
+
+	for (int i = 0; i != sizeof(test)/sizeof(test[0]); ++i) {
+		const int err = test[i].test();
+
+		if (!err)
+			continue;
+
+		fprintf(stderr, "test %s failed (%d)\n", test[i].name, err);
+		return err;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	const int ret = run_tests();
+
+	return ret ? 1 : 0;
+}
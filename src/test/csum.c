@@ -0,0 +1,175 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <misc/csum.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+
+#define BUF_SIZE	(64 * 1024)
+#define BENCH_BYTES	(1024ul * 1024 * 1024)
+
+
+struct myfs_csum_test {
+	int (*test)(void);
+	const char *name;
+};
+
+
+static const char *csum_name[] = { "xxh64", "xxh3", "crc32c" };
+
+static const myfs_csum_t csum_generic[] = {
+	&myfs_xxh64,
+	&myfs_xxh3,
+	&myfs_crc32c,
+};
+
+
+static unsigned long long csum_ms(const struct timespec *begin,
+			const struct timespec *end)
+{
+	return (end->tv_sec - begin->tv_sec) * 1000ull +
+		(end->tv_nsec - begin->tv_nsec) / 1000000;
+}
+
+static void *csum_buf(size_t size)
+{
+	unsigned char *buf;
+
+	assert((buf = malloc(size)));
+	for (size_t i = 0; i != size; ++i)
+		buf[i] = rand();
+	return buf;
+}
+
+
+static int csum_known_test(void)
+{
+	static const char check[] = "123456789";
+
+	if (myfs_crc32c(check, sizeof(check) - 1, 0) != 0xe3069283ull)
+		return -1;
+	if (myfs_xxh3(NULL, 0, 0) != 0x2d06800538d394c2ull)
+		return -1;
+	if (myfs_xxh64(NULL, 0, 0) != 0xef46db3751d8e999ull)
+		return -1;
+
+	for (int algo = 0; algo != 3; ++algo) {
+		const myfs_csum_t csum = myfs_csum_select(algo);
+
+		if (csum(check, sizeof(check) - 1, 0) !=
+				csum_generic[algo](check, sizeof(check) - 1, 0))
+			return -1;
+	}
+	return 0;
+}
+
+/* dispatched implementations must agree with the generic ones for any
+   size and alignment, otherwise a disk written on one CPU doesn't pass
+   the checks on another */
+static int csum_dispatch_test(void)
+{
+	unsigned char *buf = csum_buf(BUF_SIZE + 8);
+	int err = 0;
+
+	for (int algo = 0; algo != 3 && !err; ++algo) {
+		const myfs_csum_t csum = myfs_csum_select(algo);
+
+		for (size_t size = 0; size <= BUF_SIZE && !err;
+					size += size < 2048 ? 1 : 997) {
+			const size_t offs = size % 8;
+			const uint64_t seed = size * 0x9e3779b97f4a7c15ull;
+
+			if (csum(buf + offs, size, seed) !=
+					csum_generic[algo](buf + offs, size, seed)) {
+				fprintf(stderr, "%s mismatch at size %zu\n",
+							csum_name[algo], size);
+				err = -1;
+			}
+		}
+	}
+	free(buf);
+	return err;
+}
+
+static int csum_bench(void)
+{
+	static const size_t size[] = { 4096, BUF_SIZE };
+	unsigned char *buf = csum_buf(BUF_SIZE);
+
+	for (int algo = 0; algo != 3; ++algo) {
+		const myfs_csum_t fn[] = {
+			csum_generic[algo],
+			myfs_csum_select(algo)
+		};
+
+		for (int s = 0; s != sizeof(size)/sizeof(size[0]); ++s) {
+			unsigned long long ms[2];
+
+			for (int f = 0; f != 2; ++f) {
+				const size_t iters = BENCH_BYTES / size[s];
+				struct timespec begin, end;
+				volatile uint64_t sum = 0;
+
+				clock_gettime(CLOCK_MONOTONIC, &begin);
+				for (size_t i = 0; i != iters; ++i)
+					sum += fn[f](buf, size[s], i);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				ms[f] = csum_ms(&begin, &end);
+				(void)sum;
+			}
+
+			printf("%s %zu bytes: generic %llu MB/s, "
+				"dispatched %llu MB/s\n",
+				csum_name[algo], size[s],
+				(BENCH_BYTES >> 20) * 1000 / (ms[0] ? ms[0] : 1),
+				(BENCH_BYTES >> 20) * 1000 / (ms[1] ? ms[1] : 1));
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+static int run_tests(void)
+{
+	const struct myfs_csum_test test[] = {
+		{ &csum_known_test, "csum_known_test" },
+		{ &csum_dispatch_test, "csum_dispatch_test" },
+		{ &csum_bench, "csum_bench" },
+	};
+
+	for (int i = 0; i != sizeof(test)/sizeof(test[0]); ++i) {
+		const int err = test[i].test();
+
+		if (!err)
+			continue;
+
+		fprintf(stderr, "test %s failed (%d)\n", test[i].name, err);
+		return err;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	const int ret = run_tests();
+
+	return ret ? 1 : 0;
+}
@@ -28,9 +28,21 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
+
+
+#define NCACHE_THREADS	4
 
 
 static const size_t ENTRIES = 100000000;
+static const size_t BENCH_ENTRIES = 1000000;
+static const size_t BENCH_LOOKUPS = 200000;
+/* enough for a tree of two levels with any node size */
+static const size_t PIN_ENTRIES = 100000;
+static int FORMAT = MYFS_CTREE_PLAIN;
+static int COMPRESS;
+static size_t FANOUT = MYFS_MIN_FANOUT;
+static size_t NODE_PAGES = MYFS_CTREE_NODE_PAGES;
 
 
 struct myfs_ctree_test {
@@ -38,13 +50,18 @@ struct myfs_ctree_test {
 	const char *name;
 };
 
-static int ctree_write_test(struct myfs *myfs, struct myfs_ctree_sb *sb)
+static int ctree_build(struct myfs *myfs, struct myfs_ctree_sb *sb,
+			size_t entries, size_t node_pages)
 {
 	struct myfs_ctree_builder b;
 	int err = 0;
 
 	myfs_builder_setup(&b);
-	for (size_t i = 0; i != ENTRIES; ++i) {
+	b.format = FORMAT;
+	b.compress = COMPRESS;
+	b.fanout = FANOUT;
+	b.node_pages = node_pages;
+	for (size_t i = 0; i != entries; ++i) {
 		const uint64_t value = 2 * i + 1;
 		const uint64_t key = 2 * i;
 
@@ -56,20 +73,27 @@ static int ctree_write_test(struct myfs *myfs, struct myfs_ctree_sb *sb)
 			break;
 	}
 
-	err = myfs_builder_finish(myfs, &b);
+	if (!err)
+		err = myfs_builder_finish(myfs, &b);
 	*sb = b.sb;
 	myfs_builder_release(&b);
 	return err;
 }
 
-static int ctree_read_test(struct myfs *myfs, struct myfs_ctree_sb *sb)
+static int ctree_write_test(struct myfs *myfs, struct myfs_ctree_sb *sb)
+{
+	return ctree_build(myfs, sb, ENTRIES, NODE_PAGES);
+}
+
+static int ctree_scan(struct myfs *myfs, const struct myfs_ctree_sb *sb,
+			size_t entries)
 {
 	struct myfs_ctree_it it;
 	int err = 0;
 
 	myfs_ctree_it_setup(&it, sb);
 	err = myfs_ctree_it_reset(myfs, &it);
-	for (size_t i = 0; !err && i != ENTRIES; ++i, err = 0) {
+	for (size_t i = 0; !err && i != entries; ++i, err = 0) {
 		const uint64_t value = 2 * i + 1;
 		const uint64_t key = 2 * i;
 
@@ -113,6 +137,11 @@ static int ctree_read_test(struct myfs *myfs, struct myfs_ctree_sb *sb)
 	return err;
 }
 
+static int ctree_read_test(struct myfs *myfs, struct myfs_ctree_sb *sb)
+{
+	return ctree_scan(myfs, sb, ENTRIES);
+}
+
 
 struct ctree_key_query {
 	struct myfs_query query;
@@ -171,7 +200,7 @@ static int ctree_lookup(struct myfs *myfs, const struct myfs_ctree_sb *sb,
 			const struct myfs_value *value)
 {
 	struct ctree_key_query query = {
-		{ &ctree_query_cmp, &ctree_query_emit },
+		{ &ctree_query_cmp, &ctree_query_emit, key },
 		key, value
 	};
 
@@ -179,12 +208,202 @@ static int ctree_lookup(struct myfs *myfs, const struct myfs_ctree_sb *sb,
 }
 
 
-static int ctree_lookup_test(struct myfs *myfs, struct myfs_ctree_sb *sb)
+#define SMALL_VALUE	200
+
+/* keys share their low bytes, so prefix nodes have something to strip */
+static uint64_t ctree_small_key(size_t i)
+{
+	return (uint64_t)i << 33;
+}
+
+/* a single item with a value of this size fills a one page node */
+static size_t ctree_full_value(const struct myfs *myfs, int format)
+{
+	const size_t header = sizeof(struct __myfs_ctree_node_sb);
+	const size_t key = sizeof(uint64_t);
+
+	switch (format) {
+	case MYFS_CTREE_PREFIX:
+		return myfs->page_size - header - key - sizeof(le32_t)
+				- sizeof(struct __myfs_ctree_prefix_item);
+	case MYFS_CTREE_INDEXED:
+		return myfs->page_size - header - key - sizeof(le32_t)
+				- sizeof(struct __myfs_ctree_item);
+	case MYFS_CTREE_FIXED:
+		return myfs->page_size - header - key - 2 * sizeof(le32_t);
+	default:
+		return myfs->page_size - header - key
+				- sizeof(struct __myfs_ctree_item);
+	}
+}
+
+/* Values are either small and repetitive (1 to SMALL_VALUE bytes of the
+   same byte) or random and as large as a whole node, so with fanout 1
+   every leaf is a single full page that doesn't compress. */
+static size_t ctree_small_value(const struct myfs *myfs, int format,
+			int random, size_t i, char *buf)
 {
+	const size_t size = random
+				? ctree_full_value(myfs, format)
+				: 1 + i * 7 % SMALL_VALUE;
+	uint64_t x = i * 0x9e3779b97f4a7c15ull + 1;
+
+	for (size_t j = 0; j != size; ++j) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[j] = random ? (char)x : (char)i;
+	}
+	return size;
+}
+
+static int ctree_small_build(struct myfs *myfs, struct myfs_ctree_sb *sb,
+			int format, int compress, int random, size_t entries)
+{
+	struct myfs_ctree_builder b;
+	char *buf;
 	int err = 0;
 
-	for (size_t i = 0; i != ENTRIES; ++i, err = 0) {
-		const uint64_t key = rand() % (2 * ENTRIES);
+	assert((buf = malloc(myfs->page_size)));
+	myfs_builder_setup(&b);
+	b.format = format;
+	b.compress = compress;
+	b.fanout = random ? 1 : MYFS_MIN_FANOUT;
+	b.node_pages = 1;
+	for (size_t i = 0; !err && i != entries; ++i) {
+		const uint64_t key = ctree_small_key(i);
+		const struct myfs_key k = { sizeof(key), (void *)&key };
+		const struct myfs_value v = {
+			ctree_small_value(myfs, format, random, i, buf), buf
+		};
+
+		err = myfs_builder_append(myfs, &b, &k, &v);
+	}
+	if (!err)
+		err = myfs_builder_finish(myfs, &b);
+	*sb = b.sb;
+	myfs_builder_release(&b);
+	free(buf);
+	return err;
+}
+
+/* scans the tree and looks up every key and the keys in between, with
+   compression random leaves must be stored as is and the others must be
+   compressed */
+static int ctree_small_check(struct myfs *myfs, const struct myfs_ctree_sb *sb,
+			int format, int compress, int random, size_t entries)
+{
+	struct myfs_ctree_it it;
+	char *buf;
+	int err;
+
+	assert((buf = malloc(myfs->page_size)));
+	myfs_ctree_it_setup(&it, sb);
+	err = myfs_ctree_it_reset(myfs, &it);
+	for (size_t i = 0; !err && i != entries; ++i) {
+		const uint64_t key = ctree_small_key(i);
+		const size_t size = ctree_small_value(myfs, format, random,
+					i, buf);
+		const struct myfs_ptr *leaf = &it.node[0].ptr;
+		const uint64_t stored = compress && random
+					? leaf->size * myfs->page_size : 0;
+
+		if (!myfs_ctree_it_valid(&it) ||
+				it.key.size != sizeof(key) ||
+				memcmp(it.key.data, &key, sizeof(key)) ||
+				it.value.size != size ||
+				memcmp(it.value.data, buf, size)) {
+			fprintf(stderr, "item %zu of %zu is wrong\n",
+						i, entries);
+			err = -EINVAL;
+			break;
+		}
+
+		if ((compress && !random) ? (!leaf->csize ||
+				leaf->csize >= leaf->size * myfs->page_size)
+					: leaf->csize != stored) {
+			fprintf(stderr, "leaf of item %zu has csize %lu\n",
+						i, (unsigned long)leaf->csize);
+			err = -EINVAL;
+			break;
+		}
+		err = myfs_ctree_it_next(myfs, &it);
+	}
+	if (!err && myfs_ctree_it_valid(&it)) {
+		fprintf(stderr, "more than %zu items\n", entries);
+		err = -EINVAL;
+	}
+	myfs_ctree_it_release(&it);
+
+	for (size_t i = 0; !err && i <= entries; ++i) {
+		const uint64_t key = ctree_small_key(i);
+		const uint64_t miss = key + 1;
+		const struct myfs_key k = { sizeof(key), (void *)&key };
+		const struct myfs_key m = { sizeof(miss), (void *)&miss };
+		struct myfs_value v = { 0, buf };
+
+		v.size = ctree_small_value(myfs, format, random, i, buf);
+		err = ctree_lookup(myfs, sb, &m, &v);
+		if (!err && i != entries)
+			err = ctree_lookup(myfs, sb, &k, &v) == 1 ? 0 : -ENOENT;
+		if (err)
+			fprintf(stderr, "lookup %zu of %zu failed (%d)\n",
+						i, entries, err);
+	}
+	free(buf);
+	return err;
+}
+
+/* Small trees of every node format, with and without compression. The
+   sizes cover an empty tree, a single one item leaf, keys right at the
+   prefix restart points and trees of a few levels. */
+static int ctree_small_test(struct myfs *myfs, struct myfs_ctree_sb *sb)
+{
+	static const int format[] = {
+		MYFS_CTREE_PLAIN, MYFS_CTREE_PREFIX,
+		MYFS_CTREE_INDEXED, MYFS_CTREE_FIXED
+	};
+	static const size_t entries[] = {
+		0, 1, 2,
+		MYFS_CTREE_RESTART - 1, MYFS_CTREE_RESTART,
+		MYFS_CTREE_RESTART + 1, 2 * MYFS_CTREE_RESTART + 1,
+		300, 3000
+	};
+	const size_t formats = sizeof(format)/sizeof(format[0]);
+	const size_t sizes = sizeof(entries)/sizeof(entries[0]);
+	int err = 0;
+
+	(void) sb;
+	for (size_t i = 0; !err && i != formats * 4 * sizes; ++i) {
+		const int f = format[i / (4 * sizes)];
+		const int compress = i / (2 * sizes) % 2;
+		const int random = i / sizes % 2;
+		const size_t e = entries[i % sizes];
+		struct myfs_ctree_sb tree;
+
+		/* a page per item, a few hundred of them is enough */
+		if (random && e > 300)
+			continue;
+
+		err = ctree_small_build(myfs, &tree, f, compress, random, e);
+		if (!err)
+			err = ctree_small_check(myfs, &tree, f, compress,
+						random, e);
+		if (err)
+			fprintf(stderr, "format %d, compress %d, random %d, "
+				"%zu entries: failed (%d)\n",
+				f, compress, random, e, err);
+	}
+	return err;
+}
+
+static int ctree_lookup_rnd(struct myfs *myfs, const struct myfs_ctree_sb *sb,
+			size_t entries, size_t lookups)
+{
+	int err = 0;
+
+	for (size_t i = 0; i != lookups; ++i, err = 0) {
+		const uint64_t key = rand() % (2 * entries);
 		const uint64_t value = key + 1;
 		const struct myfs_key k = { sizeof(key), (void *)&key };
 		const struct myfs_value v = { sizeof(value), (void *)&value };
@@ -209,12 +428,339 @@ static int ctree_lookup_test(struct myfs *myfs, struct myfs_ctree_sb *sb)
 	return err;
 }
 
+static int ctree_lookup_test(struct myfs *myfs, struct myfs_ctree_sb *sb)
+{
+	return ctree_lookup_rnd(myfs, sb, ENTRIES, ENTRIES);
+}
+
+static int ctree_pinned_lookup_test(struct myfs *myfs,
+			struct myfs_ctree_sb *sb)
+{
+	struct myfs_ctree_sb pinned = *sb;
+	int err;
+
+	myfs_ctree_pin(myfs, &pinned);
+	if (sb->hight > 1 && !pinned.pin) {
+		fprintf(stderr, "failed to pin the tree\n");
+		return -EIO;
+	}
+	err = ctree_lookup_rnd(myfs, &pinned, ENTRIES, ENTRIES);
+	myfs_ctree_pin_put(pinned.pin);
+	return err;
+}
+
+static double ctree_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Random lookups through the node cache, the second pass finds all the
+   nodes the first one read in the cache and doesn't checksum them. */
+static int ctree_ncache_lookup_test(struct myfs *myfs,
+			struct myfs_ctree_sb *sb)
+{
+	double start, none;
+	int err;
+
+	start = ctree_bench_now();
+	err = ctree_lookup_rnd(myfs, sb, ENTRIES, BENCH_LOOKUPS);
+	none = ctree_bench_now() - start;
+
+	for (int lazy = 0; !err && lazy != 2; ++lazy) {
+		struct myfs_ncache_stats stats;
+		double cold, warm;
+
+		myfs_ncache_setup(&myfs->ncache, myfs, MYFS_NCACHE_SIZE, lazy);
+		start = ctree_bench_now();
+		err = ctree_lookup_rnd(myfs, sb, ENTRIES, BENCH_LOOKUPS);
+		cold = ctree_bench_now() - start;
+
+		start = ctree_bench_now();
+		if (!err)
+			err = ctree_lookup_rnd(myfs, sb, ENTRIES, BENCH_LOOKUPS);
+		warm = ctree_bench_now() - start;
+
+		myfs_ncache_stats(&myfs->ncache, &stats);
+		printf("%s cache: %zu lookups uncached %.3fs, cold %.3fs, "
+					"warm %.3fs, hits %llu, misses %llu\n",
+					lazy ? "lazy" : "verified",
+					BENCH_LOOKUPS, none, cold, warm,
+					stats.hits, stats.misses);
+		if (!err && stats.errors)
+			err = -EIO;
+		myfs_ncache_release(&myfs->ncache);
+	}
+	return err;
+}
+
+/* flips the last bit of the root, it's covered by the checksum, but
+   usually isn't used by the node */
+static int ctree_corrupt_root(struct myfs *myfs, const struct myfs_ctree_sb *sb)
+{
+	const uint64_t size = sb->root.size * myfs->page_size;
+	const uint64_t offs = sb->root.offs * myfs->page_size;
+	char *page;
+	int err;
+
+	assert((page = malloc(size)));
+	if (!(err = myfs_block_read(myfs, page, size, offs))) {
+		page[size - 1] ^= 1;
+		err = myfs_block_write(myfs, page, size, offs);
+	}
+	free(page);
+	return err;
+}
+
+struct ctree_lookup_thread {
+	pthread_t thread;
+	struct myfs *myfs;
+	const struct myfs_ctree_sb *sb;
+	int err;
+};
+
+static void *ctree_lookup_worker(void *arg)
+{
+	struct ctree_lookup_thread *ctx = arg;
+
+	ctx->err = ctree_lookup_rnd(ctx->myfs, ctx->sb, ENTRIES,
+				BENCH_LOOKUPS / NCACHE_THREADS);
+	return NULL;
+}
+
+/* Readers of different nodes go to different shards of the cache, the
+   lazy check runs along. Every lookup must still find what it should. */
+static int ctree_ncache_threads_test(struct myfs *myfs,
+			struct myfs_ctree_sb *sb)
+{
+	struct ctree_lookup_thread ctx[NCACHE_THREADS];
+	struct myfs_ncache_stats stats;
+	double start;
+	int err = 0;
+
+	myfs_ncache_setup(&myfs->ncache, myfs, MYFS_NCACHE_SIZE, 1);
+	start = ctree_bench_now();
+	for (size_t i = 0; i != NCACHE_THREADS; ++i) {
+		ctx[i].myfs = myfs;
+		ctx[i].sb = sb;
+		assert(!pthread_create(&ctx[i].thread, NULL,
+					&ctree_lookup_worker, &ctx[i]));
+	}
+	for (size_t i = 0; i != NCACHE_THREADS; ++i) {
+		assert(!pthread_join(ctx[i].thread, NULL));
+		if (ctx[i].err)
+			err = ctx[i].err;
+	}
+
+	myfs_ncache_stats(&myfs->ncache, &stats);
+	printf("%d threads: %zu lookups %.3fs, hits %llu, misses %llu\n",
+				NCACHE_THREADS, BENCH_LOOKUPS,
+				ctree_bench_now() - start,
+				stats.hits, stats.misses);
+	if (!err && stats.errors)
+		err = -EIO;
+	myfs_ncache_release(&myfs->ncache);
+	return err;
+}
+
+/* A corrupted node must not be served from the cache: the verified cache
+   never caches it and the lazy one returns -EIO once the check fails. A
+   lazy cache too small for the node checks it on the first read. */
+static int ctree_ncache_corrupt_test(struct myfs *myfs,
+			struct myfs_ctree_sb *sb)
+{
+	const uint64_t key = 0, value = 1;
+	const struct myfs_key k = { sizeof(key), (void *)&key };
+	const struct myfs_value v = { sizeof(value), (void *)&value };
+	struct myfs_ctree_sb tree;
+	int err;
+
+	(void) sb;
+	/* the data checksummed of a compressed node is hard to find */
+	if (COMPRESS)
+		return 0;
+
+	/* a single leaf tree, the root is the leaf */
+	if ((err = ctree_build(myfs, &tree, 2, NODE_PAGES)))
+		return err;
+	if ((err = ctree_corrupt_root(myfs, &tree)))
+		return err;
+
+	const size_t size = tree.root.size * myfs->page_size;
+
+	for (int mode = 0; !err && mode != 3; ++mode) {
+		const size_t cap = mode == 2 ? size / 2 : MYFS_NCACHE_SIZE;
+
+		myfs_ncache_setup(&myfs->ncache, myfs, cap, mode != 0);
+		err = ctree_lookup(myfs, &tree, &k, &v);
+		if (mode == 1) {
+			/* the first reader may get the node unverified */
+			for (int bad = 0; !bad; usleep(1000)) {
+				struct myfs_ncache_stats stats;
+
+				myfs_ncache_stats(&myfs->ncache, &stats);
+				bad = stats.errors != 0;
+			}
+			err = ctree_lookup(myfs, &tree, &k, &v);
+		}
+		myfs_ncache_release(&myfs->ncache);
+
+		if (err != -EIO) {
+			fprintf(stderr, "corrupted node was read (%d)\n", err);
+			return -EINVAL;
+		}
+		err = 0;
+	}
+	return err;
+}
+
+/* Pinned nodes stay in use long after they are read, so the lazy cache
+   can't check them later: a tree with a corrupted root must not be pinned
+   whether the root is in the cache unverified already or not. */
+static int ctree_ncache_pin_test(struct myfs *myfs, struct myfs_ctree_sb *sb)
+{
+	const uint64_t key = 0, value = 1;
+	const struct myfs_key k = { sizeof(key), (void *)&key };
+	const struct myfs_value v = { sizeof(value), (void *)&value };
+	struct myfs_ctree_sb tree;
+	int err;
+
+	(void) sb;
+	if (COMPRESS)
+		return 0;
+
+	if ((err = ctree_build(myfs, &tree, PIN_ENTRIES, NODE_PAGES)))
+		return err;
+	if (tree.hight < 2) {
+		fprintf(stderr, "the tree has a single node\n");
+		return -EINVAL;
+	}
+	if ((err = ctree_corrupt_root(myfs, &tree)))
+		return err;
+
+	myfs_ncache_setup(&myfs->ncache, myfs, MYFS_NCACHE_SIZE, 1);
+	for (int cached = 0; !err && cached != 2; ++cached) {
+		/* the lookup result doesn't matter, it caches the root */
+		if (cached)
+			ctree_lookup(myfs, &tree, &k, &v);
+
+		myfs_ctree_pin(myfs, &tree);
+		if (tree.pin) {
+			fprintf(stderr, "corrupted node was pinned\n");
+			myfs_ctree_pin_put(tree.pin);
+			err = -EINVAL;
+		}
+	}
+	myfs_ncache_release(&myfs->ncache);
+	return err;
+}
+
+/* A node with a broken layout must not be decoded before it's checked:
+   the lazy cache returns it unverified, so the first read itself must
+   fail with -EIO instead of going out of the node bounds. The first item
+   and the last word of the node (the end of the offset table if the node
+   has one) are overwritten. */
+static int ctree_ncache_layout_test(struct myfs *myfs,
+			struct myfs_ctree_sb *sb)
+{
+	const size_t header = sizeof(struct __myfs_ctree_node_sb);
+	const uint64_t key = 0, value = 1;
+	const struct myfs_key k = { sizeof(key), (void *)&key };
+	const struct myfs_value v = { sizeof(value), (void *)&value };
+	struct __myfs_ctree_node_sb __node;
+	struct myfs_ctree_node_sb node;
+	struct myfs_ctree_sb tree;
+	char *page;
+	int err;
+
+	(void) sb;
+	if (COMPRESS)
+		return 0;
+
+	if ((err = ctree_build(myfs, &tree, 2, NODE_PAGES)))
+		return err;
+
+	const uint64_t size = tree.root.size * myfs->page_size;
+	const uint64_t offs = tree.root.offs * myfs->page_size;
+
+	assert((page = malloc(size)));
+	if (!(err = myfs_block_read(myfs, page, size, offs))) {
+		memcpy(&__node, page, sizeof(__node));
+		myfs_ctree_node_sb2mem(&node, &__node);
+		memset(page + header, 0xff, 8);
+		memset(page + node.size - 4, 0xff, 4);
+		err = myfs_block_write(myfs, page, size, offs);
+	}
+	free(page);
+	if (err)
+		return err;
+
+	myfs_ncache_setup(&myfs->ncache, myfs, MYFS_NCACHE_SIZE, 1);
+	err = ctree_lookup(myfs, &tree, &k, &v);
+	myfs_ncache_release(&myfs->ncache);
+
+	if (err != -EIO) {
+		fprintf(stderr, "broken node was decoded (%d)\n", err);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* Builds trees with node sizes from one page up to the maximum and
+   reports the time of a full scan and of random lookups for each. */
+static int ctree_node_size_bench(struct myfs *myfs, struct myfs_ctree_sb *sb)
+{
+	int err = 0;
+
+	(void) sb;
+	for (size_t pages = 1; !err && pages <= MYFS_CTREE_MAX_NODE_PAGES;
+				pages *= 2) {
+		struct myfs_ctree_sb tree;
+		double start, scan, lookup;
+
+		err = ctree_build(myfs, &tree, BENCH_ENTRIES, pages);
+		if (err)
+			break;
+
+		start = ctree_bench_now();
+		err = ctree_scan(myfs, &tree, BENCH_ENTRIES);
+		scan = ctree_bench_now() - start;
+		if (err)
+			break;
+
+		myfs_ctree_pin(myfs, &tree);
+		start = ctree_bench_now();
+		err = ctree_lookup_rnd(myfs, &tree, BENCH_ENTRIES,
+					BENCH_LOOKUPS);
+		lookup = ctree_bench_now() - start;
+		myfs_ctree_pin_put(tree.pin);
+
+		printf("%zuK nodes: %lu pages, scan %.3fs, "
+					"%zu lookups %.3fs (%.0f/s)\n",
+					pages * myfs->page_size / 1024,
+					(unsigned long)tree.size, scan,
+					BENCH_LOOKUPS, lookup,
+					BENCH_LOOKUPS / lookup);
+	}
+	return err;
+}
+
 static int run_tests(struct myfs *myfs)
 {
 	const struct myfs_ctree_test test[] = {
+		{ &ctree_small_test, "ctree_small_test" },
 		{ &ctree_write_test, "ctree_write_test" },
 		{ &ctree_read_test, "ctree_read_test" },
 		{ &ctree_lookup_test, "ctree_lookup_test" },
+		{ &ctree_pinned_lookup_test, "ctree_pinned_lookup_test" },
+		{ &ctree_ncache_lookup_test, "ctree_ncache_lookup_test" },
+		{ &ctree_ncache_threads_test, "ctree_ncache_threads_test" },
+		{ &ctree_ncache_corrupt_test, "ctree_ncache_corrupt_test" },
+		{ &ctree_ncache_pin_test, "ctree_ncache_pin_test" },
+		{ &ctree_ncache_layout_test, "ctree_ncache_layout_test" },
+		{ &ctree_node_size_bench, "ctree_node_size_bench" },
 	};
 	struct myfs_ctree_sb sb;
 
@@ -236,24 +782,50 @@ static const char *TEST_NAME = "test.bin";
 
 static const struct option opts[] = {
 	{"fanout", required_argument, NULL, 'f'},
+	{"node_pages", required_argument, NULL, 'n'},
+	{"format", required_argument, NULL, 'F'},
+	{"compress", no_argument, NULL, 'c'},
 	{NULL, 0, NULL, 0},
 };
 
 int main(int argc, char **argv)
 {
-	size_t fanout = MYFS_MIN_FANOUT;
 	char *endptr;
 	int kind;
 
-	while ((kind = getopt_long(argc, argv, "f:", opts, NULL)) != -1) {
+	while ((kind = getopt_long(argc, argv, "f:n:F:c", opts, NULL)) != -1) {
 		switch (kind) {
 		case 'f':
-			fanout = strtoul(optarg, &endptr, 10);
+			FANOUT = strtoul(optarg, &endptr, 10);
 			if (*endptr != '\0') {
 				fprintf(stderr, "fanout must be a number\n");
 				return -1;
 			}
 			break;
+		case 'n':
+			NODE_PAGES = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0' || !NODE_PAGES) {
+				fprintf(stderr, "node size must be a number of pages\n");
+				return -1;
+			}
+			break;
+		case 'F':
+			if (!strcmp(optarg, "plain")) {
+				FORMAT = MYFS_CTREE_PLAIN;
+			} else if (!strcmp(optarg, "prefix")) {
+				FORMAT = MYFS_CTREE_PREFIX;
+			} else if (!strcmp(optarg, "indexed")) {
+				FORMAT = MYFS_CTREE_INDEXED;
+			} else if (!strcmp(optarg, "fixed")) {
+				FORMAT = MYFS_CTREE_FIXED;
+			} else {
+				fprintf(stderr, "unknown node format\n");
+				return -1;
+			}
+			break;
+		case 'c':
+			COMPRESS = 1;
+			break;
 		default:
 			fprintf(stderr, "unexpected argument\n");
 			return -1;
@@ -272,9 +844,11 @@ int main(int argc, char **argv)
 	struct myfs myfs;
 
 	sync_bdev_setup(&bdev, fd);
+	memset(&myfs, 0, sizeof(myfs));
 	myfs.bdev = &bdev.bdev;
 	myfs.page_size = 4096;
-	myfs.fanout = fanout;
+	myfs.fanout = FANOUT;
+	myfs.node_pages = NODE_PAGES;
 	myfs.next_offs = 0;
 
 	const int ret = run_tests(&myfs);
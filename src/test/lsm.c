@@ -24,10 +24,13 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
 
 static const size_t COUNT = 1000000;
@@ -185,7 +188,7 @@ static int lsm_lookup(struct myfs_lsm *lsm, const struct myfs_key *key,
 			const struct myfs_value *val)
 {
 	struct lsm_query query = {
-		{ &lsm_query_cmp, &lsm_query_emit },
+		{ &lsm_query_cmp, &lsm_query_emit, NULL },
 		key, val
 	};
 
@@ -195,7 +198,7 @@ static int lsm_lookup(struct myfs_lsm *lsm, const struct myfs_key *key,
 static int lsm_range(struct myfs_lsm *lsm, uint64_t from, uint64_t to)
 {
 	struct lsm_range_query query = {
-		{ &lsm_range_cmp, &lsm_range_emit },
+		{ &lsm_range_cmp, &lsm_range_emit, NULL },
 		from, to, from
 	};
 	const int err = myfs_lsm_range(lsm, &query.query);
@@ -324,6 +327,193 @@ static int lsm_lookup_range_test(struct myfs *myfs, struct myfs_lsm_sb *sb)
 	return err;
 }
 
+static int lsm_multi_get_test(struct myfs *myfs, struct myfs_lsm_sb *sb)
+{
+	#define BATCH 32
+	struct myfs_lsm_key k[BATCH];
+	struct myfs_key key[BATCH];
+	struct myfs_value value[BATCH];
+	struct lsm_query query[BATCH];
+	struct myfs_query *q[BATCH];
+	int ret[BATCH];
+
+	struct myfs_lsm lsm;
+	int err = 0;
+
+	memset(k, 0, sizeof(k));
+	lsm_setup(myfs, &lsm, sb);
+	for (size_t i = 0; !err && i <= COUNT; i += COUNT / 100) {
+		/* neighbouring keys mostly share a leaf, the last keys of the
+		   last batch aren't in the tree */
+		for (size_t j = 0; j != BATCH; ++j) {
+			k[j].key = i + j * 3;
+			key[j].size = value[j].size = sizeof(k[j]);
+			key[j].data = value[j].data = &k[j];
+			query[j].query.cmp = &lsm_query_cmp;
+			query[j].query.emit = &lsm_query_emit;
+			query[j].query.key = NULL;
+			query[j].key = &key[j];
+			query[j].value = &value[j];
+			q[j] = &query[j].query;
+		}
+
+		err = myfs_lsm_multi_get(&lsm, q, ret, BATCH);
+		for (size_t j = 0; !err && j != BATCH; ++j) {
+			if (ret[j] < 0)
+				err = ret[j];
+			else if (ret[j] != (k[j].key < COUNT)) {
+				fprintf(stderr, "wrong result for %lu\n",
+					(unsigned long)k[j].key);
+				err = -EINVAL;
+			}
+		}
+	}
+	#undef BATCH
+	lsm_release(&lsm);
+	return err;
+}
+
+static int lsm_cursor_check(struct myfs_lsm_cursor *cur, int ret,
+			uint64_t expected)
+{
+	struct myfs_lsm_key k, v;
+
+	if (ret <= 0) {
+		fprintf(stderr, "cursor stopped before %lu (%d)\n",
+					(unsigned long)expected, ret);
+		return ret ? ret : -ENOENT;
+	}
+
+	memcpy(&k, myfs_lsm_cursor_key(cur)->data, sizeof(k));
+	memcpy(&v, myfs_lsm_cursor_value(cur)->data, sizeof(v));
+	if (k.key != expected || v.key != expected || k.deleted) {
+		fprintf(stderr, "cursor at %lu instead of %lu\n",
+					(unsigned long)k.key,
+					(unsigned long)expected);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* keys deleted by the cursor test in the memtable */
+static int lsm_cursor_deleted(uint64_t key)
+{
+	return key % 7 == 3;
+}
+
+static int lsm_cursor_walk(struct myfs_lsm_cursor *cur, uint64_t from,
+			uint64_t to, int dir)
+{
+	uint64_t key = dir > 0 ? from : to - 1;
+	int ret = dir > 0 ? myfs_lsm_cursor_seek(cur, NULL)
+				: myfs_lsm_cursor_last(cur);
+	int err = 0;
+
+	for (; key >= from && key < to; key += dir) {
+		if (lsm_cursor_deleted(key))
+			continue;
+		if ((err = lsm_cursor_check(cur, ret, key)))
+			return err;
+		ret = dir > 0 ? myfs_lsm_cursor_next(cur)
+					: myfs_lsm_cursor_prev(cur);
+	}
+
+	if (ret) {
+		fprintf(stderr, "cursor went past the range (%d)\n", ret);
+		return ret < 0 ? ret : -EINVAL;
+	}
+	return 0;
+}
+
+static int lsm_cursor_test(struct myfs *myfs, struct myfs_lsm_sb *sb)
+{
+	const uint64_t from = COUNT / 4, to = from + 50000, mid = from + 1004;
+	struct lsm_range_query range = {
+		{ &lsm_range_cmp, NULL, NULL }, from, to, from
+	};
+	struct lsm_range_query seek = {
+		{ &lsm_range_cmp, NULL, NULL }, mid, to, mid
+	};
+	struct myfs_lsm_cursor *cur;
+	struct myfs_lsm_key k;
+	const struct myfs_key key = { sizeof(k), (void *)&k };
+	const struct myfs_value value = { sizeof(k), (void *)&k };
+	struct myfs_lsm lsm;
+	int err = 0;
+
+	memset(&k, 0, sizeof(k));
+	assert((cur = malloc(sizeof(*cur))));
+	lsm_setup(myfs, &lsm, sb);
+
+	/* deleted entries in the memtable hide the entries of the trees,
+	   an entry after all the trees is only in the memtable */
+	for (uint64_t i = from - 100; !err && i != to + 100; ++i) {
+		k.key = i;
+		k.deleted = lsm_cursor_deleted(i);
+		err = myfs_lsm_insert(&lsm, &key, &value);
+	}
+	k.key = COUNT + 5;
+	k.deleted = 0;
+	if (!err)
+		err = myfs_lsm_insert(&lsm, &key, &value);
+	if (err) {
+		lsm_release(&lsm);
+		free(cur);
+		return err;
+	}
+
+	err = myfs_lsm_cursor_setup(cur, &lsm, &range.query);
+	if (!err)
+		err = lsm_cursor_walk(cur, from, to, 1);
+	if (!err)
+		err = lsm_cursor_walk(cur, from, to, -1);
+
+	/* change the direction in the middle */
+	if (!err)
+		err = lsm_cursor_check(cur,
+				myfs_lsm_cursor_seek(cur, &seek.query), mid);
+	if (!err)
+		err = lsm_cursor_check(cur, myfs_lsm_cursor_prev(cur),
+					mid - 1);
+	if (!err)
+		err = lsm_cursor_check(cur, myfs_lsm_cursor_prev(cur),
+					mid - 3);
+	if (!err)
+		err = lsm_cursor_check(cur, myfs_lsm_cursor_next(cur),
+					mid - 1);
+	if (!err)
+		err = lsm_cursor_check(cur, myfs_lsm_cursor_next(cur), mid);
+	if (!err)
+		err = lsm_cursor_check(cur, myfs_lsm_cursor_next(cur),
+					mid + 1);
+	myfs_lsm_cursor_release(cur);
+	if (err) {
+		lsm_release(&lsm);
+		free(cur);
+		return err;
+	}
+
+	/* the whole tree */
+	err = myfs_lsm_cursor_setup(cur, &lsm, NULL);
+	if (!err)
+		err = lsm_cursor_check(cur, myfs_lsm_cursor_last(cur),
+					COUNT + 5);
+	if (!err)
+		err = lsm_cursor_check(cur, myfs_lsm_cursor_prev(cur),
+					COUNT - 1);
+	if (!err)
+		err = lsm_cursor_check(cur, myfs_lsm_cursor_seek(cur, NULL),
+					0);
+	if (!err && myfs_lsm_cursor_prev(cur) != 0) {
+		fprintf(stderr, "cursor went before the first entry\n");
+		err = -EINVAL;
+	}
+	myfs_lsm_cursor_release(cur);
+	lsm_release(&lsm);
+	free(cur);
+	return err;
+}
+
 static int lsm_remove_seq_test(struct myfs *myfs, struct myfs_lsm_sb *sb)
 {
 	struct myfs_lsm_key k;
@@ -355,6 +545,258 @@ static int lsm_remove_seq_test(struct myfs *myfs, struct myfs_lsm_sb *sb)
 	return err;
 }
 
+static int lsm_insert_value(struct myfs_lsm *lsm, uint64_t k, size_t size)
+{
+	char buf[1024];
+	const struct myfs_lsm_key key = { k, 0 };
+	const struct myfs_key __key = { sizeof(key), (void *)&key };
+	const struct myfs_value value = { size, buf };
+
+	assert(size <= sizeof(buf));
+	memset(buf, 0, size);
+	return myfs_lsm_insert(lsm, &__key, &value);
+}
+
+static int lsm_flush_target_test(struct myfs *myfs, struct myfs_lsm_sb *sb)
+{
+	const size_t budget = 1024 * 1024;
+	struct myfs_lsm_sb empty;
+	struct myfs_lsm *target = NULL;
+	int err = 0;
+
+	(void) sb;
+	memset(&empty, 0, sizeof(empty));
+	lsm_setup(myfs, &myfs->inode_map, &empty);
+	lsm_setup(myfs, &myfs->dentry_map, &empty);
+	myfs->mem_budget = budget;
+	myfs->inode_map.budget = budget;
+	myfs->dentry_map.budget = budget;
+
+	/* equal number of entries, but dentry map entries are larger */
+	for (uint64_t i = 0; !err && !target; ++i) {
+		err = lsm_insert_value(&myfs->inode_map, i, 16);
+		if (!err)
+			err = lsm_insert_value(&myfs->dentry_map, i, 512);
+		if (!err)
+			target = myfs_flush_target(myfs);
+	}
+
+	if (!err && target != &myfs->dentry_map) {
+		fprintf(stderr, "wrong map chosen for flush\n");
+		err = -EINVAL;
+	}
+	if (!err && myfs_lsm_bytes(target, NULL) < budget / 2) {
+		fprintf(stderr, "flush requested too early\n");
+		err = -EINVAL;
+	}
+
+	lsm_release(&myfs->dentry_map);
+	lsm_release(&myfs->inode_map);
+	return err;
+}
+
+static int lsm_insert_seq(struct myfs_lsm *lsm, uint64_t from, uint64_t to)
+{
+	struct myfs_lsm_key k;
+	const struct myfs_key key = { sizeof(k), (void *)&k };
+	const struct myfs_value val = { sizeof(k), (void *)&k };
+	int err = 0;
+
+	/* keys are compared with memcmp, so the padding must be zeroed */
+	memset(&k, 0, sizeof(k));
+	for (uint64_t i = from; !err && i != to; ++i) {
+		k.key = i;
+		err = myfs_lsm_insert(lsm, &key, &val);
+	}
+	return err;
+}
+
+static int lsm_view_test(struct myfs *myfs, struct myfs_lsm_sb *sb)
+{
+	const uint64_t count = 10000;
+	struct myfs_lsm_view *view[2];
+	struct myfs_lsm_sb empty;
+	struct myfs_lsm lsm;
+	int err;
+
+	(void) sb;
+	memset(&empty, 0, sizeof(empty));
+	lsm_setup(myfs, &lsm, &empty);
+
+	/* a view keeps the memtables it was taken with even after they are
+	   flushed, so the first view sees the first batch of keys and the
+	   second view sees the first two */
+	err = lsm_insert_seq(&lsm, 0, count);
+	view[0] = myfs_lsm_view_get(&lsm);
+	if (!err)
+		err = myfs_lsm_flush(&lsm);
+	view[1] = myfs_lsm_view_get(&lsm);
+	if (!err)
+		err = lsm_insert_seq(&lsm, count, 2 * count);
+	if (!err)
+		err = myfs_lsm_flush(&lsm);
+	if (!err)
+		err = lsm_insert_seq(&lsm, 2 * count, 3 * count);
+
+	for (int i = 0; !err && i != 2; ++i) {
+		struct lsm_range_query query = {
+			{ &lsm_range_cmp, &lsm_range_emit, NULL },
+			0, 3 * count, 0
+		};
+
+		err = myfs_lsm_view_range(&lsm, view[i], &query.query);
+		if (!err && query.next != count * (i + 1)) {
+			fprintf(stderr, "view %d sees %lu entries\n", i,
+						(unsigned long)query.next);
+			err = -EINVAL;
+		}
+	}
+	myfs_lsm_view_put(&lsm, view[0]);
+	myfs_lsm_view_put(&lsm, view[1]);
+
+	if (!err)
+		err = lsm_range(&lsm, 0, 3 * count);
+	lsm_release(&lsm);
+	return err;
+}
+
+struct lsm_bench_thread {
+	pthread_t thread;
+	struct myfs_lsm *lsm;
+	uint64_t keys;
+	size_t count;
+	unsigned seed;
+	int err;
+};
+
+static void *lsm_bench_lookup(void *arg)
+{
+	struct lsm_bench_thread *ctx = arg;
+	struct myfs_lsm_key k;
+	const struct myfs_key key = { sizeof(k), (void *)&k };
+	const struct myfs_value val = { sizeof(k), (void *)&k };
+
+	memset(&k, 0, sizeof(k));
+	for (size_t i = 0; !ctx->err && i != ctx->count; ++i) {
+		k.key = rand_r(&ctx->seed) % ctx->keys;
+
+		const int ret = lsm_lookup(ctx->lsm, &key, &val);
+
+		if (ret != 1)
+			ctx->err = ret < 0 ? ret : -ENOENT;
+	}
+	return NULL;
+}
+
+static double lsm_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Concurrent lookups of keys in the memtable, where the cost of the
+   synchronization is the largest part of a lookup, reports lookup
+   throughput for different number of threads. */
+static int lsm_concurrent_lookup_test(struct myfs *myfs,
+			struct myfs_lsm_sb *sb)
+{
+	const uint64_t KEYS = 100000;
+	const size_t LOOKUPS = 2000000;
+	const size_t THREADS[] = { 1, 2, 4, 8, 16, 32 };
+
+	struct lsm_bench_thread ctx[32];
+	struct myfs_lsm_sb empty;
+	struct myfs_lsm lsm;
+	int err;
+
+	(void) sb;
+	memset(&empty, 0, sizeof(empty));
+	lsm_setup(myfs, &lsm, &empty);
+	err = lsm_insert_seq(&lsm, 0, KEYS);
+
+	for (size_t t = 0; !err && t != sizeof(THREADS)/sizeof(THREADS[0]);
+				++t) {
+		const size_t threads = THREADS[t];
+		const double start = lsm_bench_now();
+
+		for (size_t i = 0; i != threads; ++i) {
+			ctx[i].lsm = &lsm;
+			ctx[i].keys = KEYS;
+			ctx[i].count = LOOKUPS / threads;
+			ctx[i].seed = i + 1;
+			ctx[i].err = 0;
+			assert(!pthread_create(&ctx[i].thread, NULL,
+						&lsm_bench_lookup, &ctx[i]));
+		}
+
+		for (size_t i = 0; i != threads; ++i) {
+			assert(!pthread_join(ctx[i].thread, NULL));
+			if (ctx[i].err)
+				err = ctx[i].err;
+		}
+
+		const double time = lsm_bench_now() - start;
+
+		printf("%zu threads: %zu lookups in %.3fs, %.0f lookups/s\n",
+					threads, LOOKUPS, time, LOOKUPS / time);
+	}
+	lsm_release(&lsm);
+	return err;
+}
+
+/* Readers never reclaim retired views, a flush drops the views it
+   replaced before it returns even while lookups keep going. */
+static int lsm_retire_test(struct myfs *myfs, struct myfs_lsm_sb *sb)
+{
+	const uint64_t KEYS = 10000;
+	const size_t THREADS = 4;
+	const size_t ROUNDS = 20;
+
+	struct lsm_bench_thread ctx[4];
+	struct myfs_lsm_sb empty;
+	struct myfs_lsm lsm;
+	int err;
+
+	(void) sb;
+	memset(&empty, 0, sizeof(empty));
+	lsm_setup(myfs, &lsm, &empty);
+	err = lsm_insert_seq(&lsm, 0, KEYS);
+
+	for (size_t i = 0; i != THREADS; ++i) {
+		ctx[i].lsm = &lsm;
+		ctx[i].keys = KEYS;
+		ctx[i].count = 100000;
+		ctx[i].seed = i + 1;
+		ctx[i].err = 0;
+		assert(!pthread_create(&ctx[i].thread, NULL,
+					&lsm_bench_lookup, &ctx[i]));
+	}
+
+	for (size_t i = 1; !err && i != ROUNDS; ++i) {
+		err = lsm_insert_seq(&lsm, i * KEYS, (i + 1) * KEYS);
+		if (!err)
+			err = myfs_lsm_flush(&lsm);
+		if (!err && atomic_load(&lsm.nretired)) {
+			fprintf(stderr, "%lu views left after a flush\n",
+					(unsigned long)atomic_load(&lsm.nretired));
+			err = -EINVAL;
+		}
+	}
+
+	for (size_t i = 0; i != THREADS; ++i) {
+		assert(!pthread_join(ctx[i].thread, NULL));
+		if (ctx[i].err)
+			err = ctx[i].err;
+	}
+
+	if (!err)
+		err = lsm_range(&lsm, 0, ROUNDS * KEYS);
+	lsm_release(&lsm);
+	return err;
+}
+
 static int run_tests(struct myfs *myfs)
 {
 	const struct myfs_lsm_test test[] = {
@@ -362,7 +804,13 @@ static int run_tests(struct myfs *myfs)
 		{ &lsm_lookup_seq_test, "lsm_lookup sequential" },
 		{ &lsm_lookup_rnd_test, "lsm_lookup random" },
 		{ &lsm_lookup_range_test, "lsm_lookup_range" },
+		{ &lsm_multi_get_test, "lsm_multi_get" },
+		{ &lsm_cursor_test, "lsm_cursor" },
 		{ &lsm_remove_seq_test, "lsm_remove sequential" },
+		{ &lsm_flush_target_test, "lsm_flush_target" },
+		{ &lsm_view_test, "lsm_view" },
+		{ &lsm_retire_test, "lsm_retire" },
+		{ &lsm_concurrent_lookup_test, "lsm_concurrent_lookup" },
 	};
 	struct myfs_lsm_sb sb;
 
@@ -415,10 +863,14 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	struct bio_queue queue;
 	struct sync_bdev bdev;
 	struct myfs myfs;
 
 	sync_bdev_setup(&bdev, fd);
+	bio_queue_setup(&queue);
+	bdev_set_queue(&bdev.bdev, &queue);
+	memset(&myfs, 0, sizeof(myfs));
 	myfs.bdev = &bdev.bdev;
 	myfs.page_size = 4096;
 	myfs.fanout = fanout;
@@ -426,6 +878,7 @@ int main(int argc, char **argv)
 
 	const int ret = run_tests(&myfs);
 
+	bio_queue_release(&queue);
 	if (ret)
 		fprintf(stderr, "tests failed\n");
 	else
@@ -0,0 +1,249 @@
+/*
+   Copyright 2017, Mike Krinkin <krinkin.m.u@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <misc/lz.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+
+#define BUF_SIZE	(256 * 1024)
+/* incompressible data grows a little, LZ4 has the same bound */
+#define LZ_BOUND(size)	((size) + (size) / 255 + 16)
+
+
+/* the hash table is too large for the stack */
+static struct myfs_lz lz;
+
+
+struct lz_test {
+	int (*test)(void);
+	const char *name;
+};
+
+
+static unsigned char *lz_random(size_t size)
+{
+	unsigned char *buf;
+
+	assert((buf = malloc(size ? size : 1)));
+	for (size_t i = 0; i != size; ++i)
+		buf[i] = rand();
+	return buf;
+}
+
+/* text like data: words from a small dictionary, matches at all sorts
+   of distances including ones out of the window */
+static unsigned char *lz_text(size_t size)
+{
+	static const char *word[] = {
+		"ctree ", "node ", "myfs ", "lsm ", "merge ", "flush ",
+		"dentry ", "inode ", "checkpoint ", "\n"
+	};
+	unsigned char *buf;
+
+	assert((buf = malloc(size ? size : 1)));
+	for (size_t i = 0; i != size;) {
+		const char *w = word[rand() % (sizeof(word)/sizeof(word[0]))];
+
+		for (; *w && i != size; ++w)
+			buf[i++] = *w;
+	}
+	return buf;
+}
+
+static int lz_roundtrip(const unsigned char *data, size_t size)
+{
+	const size_t cap = LZ_BOUND(size);
+	unsigned char *out = malloc(size ? size : 1);
+	unsigned char *z = malloc(cap);
+	int err = 0;
+
+	assert(out && z);
+	const size_t zsize = myfs_lz_compress(&lz, data, size, z, cap);
+
+	if (size && !zsize) {
+		fprintf(stderr, "%zu bytes didn't fit in %zu\n", size, cap);
+		err = -1;
+	} else if (myfs_lz_decompress(z, zsize, out, size) != (long)size ||
+				memcmp(out, data, size)) {
+		fprintf(stderr, "%zu bytes round trip mismatch\n", size);
+		err = -1;
+	}
+	free(out);
+	free(z);
+	return err;
+}
+
+
+static int lz_small_test(void)
+{
+	static const char *data[] = {
+		"", "a", "aaaa", "abcdabcdabcd", "abcdabcdabcda",
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+	};
+
+	for (size_t i = 0; i != sizeof(data)/sizeof(data[0]); ++i) {
+		if (lz_roundtrip((const unsigned char *)data[i],
+					strlen(data[i])))
+			return -1;
+	}
+	return 0;
+}
+
+static int lz_random_test(void)
+{
+	unsigned char *data = lz_random(BUF_SIZE);
+	unsigned char z[1024];
+	int err = 0;
+
+	for (size_t size = 0; size <= BUF_SIZE && !err;
+				size = size < 64 ? size + 1 : size * 2)
+		err = lz_roundtrip(data, size);
+
+	/* the builder stores nodes that don't shrink as is */
+	if (!err && myfs_lz_compress(&lz, data, sizeof(z), z, sizeof(z))) {
+		fprintf(stderr, "random data was compressed\n");
+		err = -1;
+	}
+	free(data);
+	return err;
+}
+
+static int lz_repetitive_test(void)
+{
+	unsigned char *zero, *text;
+	int err = 0;
+
+	assert((zero = calloc(1, BUF_SIZE)));
+	text = lz_text(BUF_SIZE);
+	for (size_t size = 1; size <= BUF_SIZE && !err; size *= 2) {
+		err = lz_roundtrip(zero, size);
+		if (!err)
+			err = lz_roundtrip(text, size);
+	}
+
+	if (!err) {
+		const size_t cap = LZ_BOUND(BUF_SIZE);
+		unsigned char *z = malloc(cap);
+
+		assert(z);
+		if (myfs_lz_compress(&lz, zero, BUF_SIZE, z, cap) >
+					BUF_SIZE / 100) {
+			fprintf(stderr, "zeros weren't compressed\n");
+			err = -1;
+		}
+		free(z);
+	}
+	free(zero);
+	free(text);
+	return err;
+}
+
+/* every prefix of a valid block and a too small output buffer must be
+   rejected, and corrupted blocks must never write past the output */
+static int lz_corrupt_test(void)
+{
+	const size_t size = 64 * 1024;
+	const size_t cap = LZ_BOUND(size);
+	unsigned char *data = lz_text(size);
+	unsigned char *out = malloc(size);
+	unsigned char *z = malloc(cap);
+	int err = 0;
+
+	assert(out && z);
+	const size_t zsize = myfs_lz_compress(&lz, data, size, z, cap);
+
+	for (size_t len = 0; len != zsize && !err; ++len) {
+		if (myfs_lz_decompress(z, len, out, size) == (long)size) {
+			fprintf(stderr, "%zu byte prefix was accepted\n", len);
+			err = -1;
+		}
+	}
+
+	if (!err && myfs_lz_decompress(z, zsize, out, size - 1) != -EIO) {
+		fprintf(stderr, "output overflow wasn't detected\n");
+		err = -1;
+	}
+
+	for (size_t i = 0; i != 10000 && !err; ++i) {
+		unsigned char *bad = malloc(zsize);
+		long ret;
+
+		assert(bad);
+		memcpy(bad, z, zsize);
+		for (int j = 0; j != 4; ++j)
+			bad[rand() % zsize] = rand();
+		ret = myfs_lz_decompress(bad, zsize, out, size);
+		if (ret != -EIO && (ret < 0 || ret > (long)size)) {
+			fprintf(stderr, "unexpected result %ld\n", ret);
+			err = -1;
+		}
+		free(bad);
+	}
+
+	/* a zero offset and an offset before the beginning of the output */
+	static const unsigned char zero_offs[] = { 0x00, 0x00, 0x00 };
+	static const unsigned char far_offs[] = { 0x10, 'a', 0x02, 0x00 };
+	/* a literal length that never ends */
+	static const unsigned char long_len[] = { 0xf0, 0xff, 0xff };
+
+	if (!err && (myfs_lz_decompress(zero_offs, sizeof(zero_offs),
+					out, size) != -EIO ||
+			myfs_lz_decompress(far_offs, sizeof(far_offs),
+					out, size) != -EIO ||
+			myfs_lz_decompress(long_len, sizeof(long_len),
+					out, size) != -EIO)) {
+		fprintf(stderr, "malformed block was accepted\n");
+		err = -1;
+	}
+
+	free(data);
+	free(out);
+	free(z);
+	return err;
+}
+
+static int run_tests(void)
+{
+	const struct lz_test test[] = {
+		{ &lz_small_test, "lz_small_test" },
+		{ &lz_random_test, "lz_random_test" },
+		{ &lz_repetitive_test, "lz_repetitive_test" },
+		{ &lz_corrupt_test, "lz_corrupt_test" },
+	};
+
+	for (int i = 0; i != sizeof(test)/sizeof(test[0]); ++i) {
+		const int err = test[i].test();
+
+		if (!err)
+			continue;
+
+		fprintf(stderr, "test %s failed (%d)\n", test[i].name, err);
+		return err;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	const int ret = run_tests();
+
+	return ret ? 1 : 0;
+}
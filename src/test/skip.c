@@ -16,10 +16,14 @@
 */
 #include <lsm/skip.h>
 
+#include <sched.h>
+#include <pthread.h>
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
 
 struct myfs_skip_test {
@@ -97,7 +101,7 @@ static int skip_lookup(struct myfs_skiplist *tree, const struct myfs_key *key,
 			const struct myfs_value *value)
 {
 	struct skip_query query = {
-		{ &skip_query_cmp, &skip_query_emit },
+		{ &skip_query_cmp, &skip_query_emit, key },
 		key, value
 	};
 
@@ -150,7 +154,7 @@ static int skip_insert_test(void)
 	struct myfs_skiplist tree;
 	int err = 0;
 
-	myfs_skiplist_setup(&tree, &skip_key_cmp);
+	myfs_skiplist_setup(&tree, &skip_key_cmp, 0);
 	err = skip_create(&tree, ENTRIES);
 	if (!err)
 		err = skip_check_content(&tree, ENTRIES);
@@ -159,7 +163,7 @@ static int skip_insert_test(void)
 	return err;
 }
 
-static int skip_update_test(void)
+static int __skip_update_test(int inplace)
 {
 	const size_t ROUND = 1000;
 	const size_t ROUNDS = 1000;
@@ -167,8 +171,16 @@ static int skip_update_test(void)
 	struct myfs_skiplist tree;
 	int err = 0;
 
-	myfs_skiplist_setup(&tree, &skip_key_cmp);
+	size_t bytes = 0, used = 0;
+
+	myfs_skiplist_setup(&tree, &skip_key_cmp, 0);
+	tree.inplace = inplace;
 	for (size_t i = 0; !err && i != ROUNDS; ++i) {
+		/* the first round adds nodes, the second one entries */
+		if (i == 2) {
+			bytes = myfs_skip_bytes(&tree);
+			used = myfs_arena_used(&tree.arena);
+		}
 
 		for (size_t j = 0; j != ROUND; ++j) {
 			const uint64_t k = skip_hash(j);
@@ -206,16 +218,464 @@ static int skip_update_test(void)
 			}
 		}
 	}
+
+	const size_t size = myfs_skip_size(&tree);
+
+	if (!err && size != (inplace ? ROUND : ROUND * ROUNDS)) {
+		fprintf(stderr, "unexpected number of nodes %zu\n", size);
+		err = -EINVAL;
+	}
+
+	/* replaced entries are reused, so updates don't take memory */
+	if (!err && inplace && (myfs_skip_bytes(&tree) != bytes ||
+				myfs_arena_used(&tree.arena) > used + 1024)) {
+		fprintf(stderr, "%zu bytes in use, %zu taken after %zu updates, "
+					"%zu and %zu after the second round\n",
+					myfs_skip_bytes(&tree),
+					myfs_arena_used(&tree.arena),
+					ROUND * ROUNDS, bytes, used);
+		err = -EINVAL;
+	}
 	myfs_skiplist_release(&tree);
 
 	return err;
 }
 
+static int skip_update_test(void)
+{
+	return __skip_update_test(0);
+}
+
+static int skip_inplace_update_test(void)
+{
+	return __skip_update_test(1);
+}
+
+struct skip_bench_thread {
+	pthread_t thread;
+	struct myfs_skiplist *tree;
+	size_t from;
+	size_t to;
+	int err;
+};
+
+static void *skip_bench_insert(void *arg)
+{
+	struct skip_bench_thread *ctx = arg;
+
+	for (size_t i = ctx->from; i != ctx->to; ++i) {
+		const uint64_t k = skip_hash(i);
+		const uint64_t v = skip_value(k);
+		const struct myfs_key key = { sizeof(k), (void *)&k };
+		const struct myfs_value value = { sizeof(v), (void *)&v };
+
+		ctx->err = myfs_skip_insert(ctx->tree, &key, &value);
+		if (ctx->err)
+			break;
+	}
+	return NULL;
+}
+
+static double skip_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Concurrent inserts of disjoint keys, reports insert throughput for
+   different number of threads and checks the result. */
+static int skip_concurrent_insert_test(void)
+{
+	const size_t ENTRIES = 1000000;
+	const size_t THREADS[] = { 1, 2, 4, 8 };
+
+	struct skip_bench_thread ctx[8];
+	int err = 0;
+
+	for (size_t t = 0; !err && t != sizeof(THREADS)/sizeof(THREADS[0]);
+				++t) {
+		const size_t threads = THREADS[t];
+		struct myfs_skiplist tree;
+
+		myfs_skiplist_setup(&tree, &skip_key_cmp, 0);
+
+		const double start = skip_bench_now();
+
+		for (size_t i = 0; i != threads; ++i) {
+			ctx[i].tree = &tree;
+			ctx[i].from = ENTRIES * i / threads;
+			ctx[i].to = ENTRIES * (i + 1) / threads;
+			ctx[i].err = 0;
+			assert(!pthread_create(&ctx[i].thread, NULL,
+						&skip_bench_insert, &ctx[i]));
+		}
+
+		for (size_t i = 0; i != threads; ++i) {
+			assert(!pthread_join(ctx[i].thread, NULL));
+			if (ctx[i].err)
+				err = ctx[i].err;
+		}
+
+		const double time = skip_bench_now() - start;
+
+		printf("%zu threads: %zu inserts in %.3fs, %.0f inserts/s\n",
+					threads, ENTRIES, time, ENTRIES / time);
+
+		if (!err)
+			err = skip_check_content(&tree, ENTRIES);
+		myfs_skiplist_release(&tree);
+	}
+	return err;
+}
+
+struct skip_reuse_ctx {
+	pthread_t thread;
+	struct myfs_skiplist *tree;
+	size_t keys;
+	int _Atomic done;
+	int err;
+};
+
+/* every value holds its key and a check word, a reader that got a
+   reused entry would see one of them wrong or see the value change
+   while it holds it */
+static int skip_reuse_emit(struct myfs_query *q, const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	struct skip_query *query = (struct skip_query *)q;
+	uint64_t k, v[3], w[3];
+
+	(void) query;
+	if (value->size != sizeof(v))
+		return -EINVAL;
+	memcpy(&k, key->data, sizeof(k));
+	memcpy(v, value->data, sizeof(v));
+	if (v[0] != k || v[2] != (k ^ v[1]))
+		return -EINVAL;
+	sched_yield();
+	memcpy(w, value->data, sizeof(w));
+	if (memcmp(v, w, sizeof(v)))
+		return -EINVAL;
+	return 1;
+}
+
+static void *skip_reuse_reader(void *arg)
+{
+	struct skip_reuse_ctx *ctx = arg;
+
+	for (size_t i = 0; !atomic_load(&ctx->done); ++i) {
+		const uint64_t k = skip_hash(i % ctx->keys);
+		const struct myfs_key key = { sizeof(k), (void *)&k };
+		struct skip_query query = {
+			{ &skip_query_cmp, &skip_reuse_emit, &key }, &key, NULL
+		};
+		const int ret = myfs_skip_lookup(ctx->tree, &query.query);
+
+		if (ret < 0) {
+			fprintf(stderr, "key %llu has a wrong value\n",
+						(unsigned long long)k);
+			ctx->err = ret;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Readers look up keys while they are updated over and over, replaced
+   entries must not be reused under them. */
+static int skip_reuse_test(void)
+{
+	const size_t KEYS = 100;
+	const size_t ROUNDS = 20000;
+	const size_t THREADS = 3;
+
+	struct skip_reuse_ctx ctx[3];
+	struct myfs_skiplist tree;
+	int err = 0;
+
+	myfs_skiplist_setup(&tree, &skip_key_cmp,
+				MYFS_KEY_LE64 | MYFS_KEY_HASH);
+	for (size_t i = 0; i != ROUNDS; ++i) {
+		for (size_t j = 0; j != KEYS; ++j) {
+			const uint64_t k = skip_hash(j);
+			const uint64_t v[3] = { k, i, k ^ i };
+			const struct myfs_key key = { sizeof(k), (void *)&k };
+			const struct myfs_value value = { sizeof(v), (void *)v };
+
+			assert(!myfs_skip_insert(&tree, &key, &value));
+		}
+
+		if (i)
+			continue;
+
+		for (size_t j = 0; j != THREADS; ++j) {
+			ctx[j].tree = &tree;
+			ctx[j].keys = KEYS;
+			ctx[j].done = 0;
+			ctx[j].err = 0;
+			assert(!pthread_create(&ctx[j].thread, NULL,
+						&skip_reuse_reader, &ctx[j]));
+		}
+	}
+
+	for (size_t j = 0; j != THREADS; ++j) {
+		atomic_store(&ctx[j].done, 1);
+		assert(!pthread_join(ctx[j].thread, NULL));
+		if (ctx[j].err)
+			err = ctx[j].err;
+	}
+
+	printf("%zu updates of %zu keys took %zu bytes, %zu in use\n",
+				KEYS * ROUNDS, KEYS,
+				myfs_arena_used(&tree.arena),
+				myfs_skip_bytes(&tree));
+	myfs_skiplist_release(&tree);
+	return err;
+}
+
+struct skip_count_query {
+	struct myfs_query query;
+	size_t count;
+};
+
+static int skip_count_cmp(struct myfs_query *q, const struct myfs_key *key)
+{
+	(void) q;
+	(void) key;
+	return 0;
+}
+
+static int skip_count_emit(struct myfs_query *q, const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	struct skip_count_query *query = (struct skip_count_query *)q;
+
+	(void) key;
+	(void) value;
+	++query->count;
+	return 0;
+}
+
+static int skip_deleted(const struct myfs_key *key,
+			const struct myfs_value *value)
+{
+	(void) key;
+	(void) value;
+	return 0;
+}
+
+/* Memtables of the inode and dentry maps: concurrent inserts of the same
+   keys must leave one node per key and every key must be in the index. */
+static int skip_memtable_test(void)
+{
+	const size_t ENTRIES = 100000;
+	const size_t THREADS = 4;
+
+	static const struct myfs_key_ops kops = {
+		&skip_key_cmp, &skip_deleted, MYFS_KEY_LE64 | MYFS_KEY_HASH
+	};
+	struct myfs_lsm lsm = { .key_ops = &kops };
+	struct skip_count_query count = {
+		{ &skip_count_cmp, &skip_count_emit, NULL }, 0
+	};
+	struct skip_bench_thread ctx[4];
+	struct myfs_skiplist *tree;
+	int err = 0;
+
+	tree = (struct myfs_skiplist *)myfs_lsm_create_default(&lsm);
+	if (!tree->hash) {
+		fprintf(stderr, "the memtable has no hash index\n");
+		err = -EINVAL;
+	}
+
+	for (size_t i = 0; !err && i != THREADS; ++i) {
+		ctx[i].tree = tree;
+		ctx[i].from = 0;
+		ctx[i].to = ENTRIES;
+		ctx[i].err = 0;
+		assert(!pthread_create(&ctx[i].thread, NULL,
+					&skip_bench_insert, &ctx[i]));
+	}
+
+	for (size_t i = 0; !err && i != THREADS; ++i) {
+		assert(!pthread_join(ctx[i].thread, NULL));
+		if (ctx[i].err)
+			err = ctx[i].err;
+	}
+
+	for (size_t i = 0; !err && i != ENTRIES; ++i) {
+		const uint64_t k = skip_hash(i);
+		const struct myfs_key key = { sizeof(k), (void *)&k };
+
+		if (!myfs_hindex_lookup(&tree->index, &key)) {
+			fprintf(stderr, "key %zu isn't in the index\n", i);
+			err = -ENOENT;
+		}
+	}
+
+	if (!err)
+		err = skip_check_content(tree, ENTRIES);
+
+	if (!err) {
+		const uint64_t k = skip_hash(ENTRIES);
+		const uint64_t v = skip_value(k);
+		const struct myfs_key key = { sizeof(k), (void *)&k };
+		const struct myfs_value value = { sizeof(v), (void *)&v };
+
+		if (skip_lookup(tree, &key, &value)) {
+			fprintf(stderr, "found a key that wasn't inserted\n");
+			err = -EINVAL;
+		}
+	}
+
+	if (!err)
+		err = myfs_skip_scan(tree, &count.query);
+	if (!err && (count.count != ENTRIES ||
+				myfs_skip_size(tree) != ENTRIES)) {
+		fprintf(stderr, "%zu nodes for %zu keys\n", count.count,
+					ENTRIES);
+		err = -EINVAL;
+	}
+	myfs_lsm_destroy_default(&lsm, &tree->mtree);
+	return err;
+}
+
+static unsigned long skip_cmps;
+
+static int skip_count_key_cmp(const struct myfs_key *l,
+			const struct myfs_key *r)
+{
+	++skip_cmps;
+	return skip_key_cmp(l, r);
+}
+
+static int skip_value_cmp(const void *l, const void *r)
+{
+	const uint64_t lv = *(const uint64_t *)l;
+	const uint64_t rv = *(const uint64_t *)r;
+
+	if (lv != rv)
+		return lv < rv ? -1 : 1;
+	return 0;
+}
+
+/* Sorted batches of close keys at random places of the list, like keys
+   of a directory or of an inode, batches overlap with each other, every
+   batch updates a key of an earlier batch and has a repeated key, the
+   last value of a repeated key wins. Batches must find the same places
+   as single inserts do with much fewer comparisons. */
+static int __skip_batch_test(unsigned long flags, int inplace)
+{
+	const size_t BATCHES = 100;
+	const size_t BATCH = 1000;
+
+	struct myfs_skiplist tree, ref;
+	struct myfs_key *key;
+	struct myfs_value *value;
+	uint64_t *k, *v;
+	unsigned long single = 0, batch = 0;
+	int err = 0;
+
+	assert((key = calloc(BATCH, sizeof(*key))));
+	assert((value = calloc(BATCH, sizeof(*value))));
+	assert((k = calloc(BATCH, sizeof(*k))));
+	assert((v = calloc(BATCH, sizeof(*v))));
+
+	myfs_skiplist_setup(&tree, &skip_count_key_cmp, flags);
+	myfs_skiplist_setup(&ref, &skip_count_key_cmp, flags);
+	tree.inplace = ref.inplace = tree.inplace || inplace;
+
+	for (size_t i = 0; !err && i != BATCHES; ++i) {
+		const uint64_t base = skip_hash(i) % (BATCHES * BATCH * 4);
+
+		for (size_t j = 0; j != BATCH; ++j)
+			k[j] = base + j * 3;
+		/* repeat a key and update a key of an earlier batch */
+		k[BATCH - 1] = k[0];
+		if (i)
+			k[1] = skip_hash(i - 1) % (BATCHES * BATCH * 4) + 3;
+		qsort(k, BATCH, sizeof(*k), &skip_value_cmp);
+
+		for (size_t j = 0; j != BATCH; ++j) {
+			v[j] = skip_value(k[j]) + i * BATCH + j;
+			key[j].size = sizeof(k[j]);
+			key[j].data = &k[j];
+			value[j].size = sizeof(v[j]);
+			value[j].data = &v[j];
+		}
+
+		skip_cmps = 0;
+		for (size_t j = 0; !err && j != BATCH; ++j)
+			err = myfs_skip_insert(&ref, &key[j], &value[j]);
+		single += skip_cmps;
+
+		skip_cmps = 0;
+		if (!err)
+			err = myfs_skip_insert_batch(&tree, key, value, BATCH);
+		batch += skip_cmps;
+
+		/* the last version of every key is the newest one */
+		for (size_t j = 0; !err && j != BATCH; ++j, err = 0) {
+			if (j + 1 != BATCH && k[j] == k[j + 1])
+				continue;
+
+			err = skip_lookup(&tree, &key[j], &value[j]);
+			if (!err) {
+				fprintf(stderr, "key %llu wasn't found\n",
+						(unsigned long long)k[j]);
+				err = -ENOENT;
+			}
+			if (err < 0)
+				break;
+		}
+	}
+
+	if (!err && myfs_skip_size(&tree) != myfs_skip_size(&ref)) {
+		fprintf(stderr, "%zu nodes after batches, %zu expected\n",
+					myfs_skip_size(&tree),
+					myfs_skip_size(&ref));
+		err = -EINVAL;
+	}
+
+	printf("%lu comparisons for single inserts, %lu for batches\n",
+				single, batch);
+	if (!err && batch * 2 > single) {
+		fprintf(stderr, "batches don't save comparisons\n");
+		err = -EINVAL;
+	}
+
+	myfs_skiplist_release(&ref);
+	myfs_skiplist_release(&tree);
+	free(v);
+	free(k);
+	free(value);
+	free(key);
+	return err;
+}
+
+static int skip_batch_test(void)
+{
+	int err = __skip_batch_test(0, 0);
+
+	if (!err)
+		err = __skip_batch_test(0, 1);
+	if (!err)
+		err = __skip_batch_test(MYFS_KEY_HASH, 1);
+	return err;
+}
+
 static int run_tests(void)
 {
 	const struct myfs_skip_test test[] = {
 		{ &skip_insert_test, "skip_insert_test" },
 		{ &skip_update_test, "skip_update_test" },
+		{ &skip_inplace_update_test, "skip_inplace_update_test" },
+		{ &skip_concurrent_insert_test, "skip_concurrent_insert_test" },
+		{ &skip_memtable_test, "skip_memtable_test" },
+		{ &skip_batch_test, "skip_batch_test" },
+		{ &skip_reuse_test, "skip_reuse_test" },
 	};
 
 	for (int i = 0; i != sizeof(test)/sizeof(test[0]); ++i) {
@@ -143,12 +143,11 @@ int main(int argc, char **argv)
 	struct myfs myfs;
 
 	sync_bdev_setup(&bdev, fd);
+	memset(&myfs, 0, sizeof(myfs));
 	myfs.bdev = &bdev.bdev;
 	myfs.page_size = 4096;
 	myfs.next_offs = 0;
 
-	memset(&myfs.log, 0, sizeof(myfs.log));
-
 	start_trans_worker(&myfs);
 	run_test(&myfs);
 	stop_trans_worker(&myfs);
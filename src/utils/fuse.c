@@ -331,7 +331,7 @@ struct fuse_readdir_ctx {
 };
 
 static int fuse_readdir_emit(struct myfs_readdir_ctx *c,
-			const struct myfs_dentry *dentry)
+			const struct myfs_dentry *dentry, uint64_t cookie)
 {
 	char name[MYFS_FS_NAMEMAX + 1];
 	struct fuse_readdir_ctx *ctx = (struct fuse_readdir_ctx *)c;
@@ -347,7 +347,7 @@ static int fuse_readdir_emit(struct myfs_readdir_ctx *c,
 	name[dentry->size] = '\0';
 
 	const size_t req = fuse_add_direntry(ctx->req, buf, rem,
-				name, &attr, dentry->hash);
+				name, &attr, cookie);
 
 	if (req > rem)
 		return 1;
@@ -355,6 +355,34 @@ static int fuse_readdir_emit(struct myfs_readdir_ctx *c,
 	return 0;
 }
 
+static void fuse_opendir(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	struct myfs *myfs = fuse_req_userdata(req);
+	struct myfs_inode *dir = myfs_inode_get(myfs, ino);
+	struct myfs_dir *stream;
+	const int err = myfs_opendir(myfs, dir, &stream);
+
+	if (err) {
+		myfs_inode_put(myfs, dir);
+		fuse_reply_err(req, -err);
+		return;
+	}
+	fi->fh = (uintptr_t)stream;
+	fuse_reply_open(req, fi);
+}
+
+static void fuse_releasedir(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	struct myfs *myfs = fuse_req_userdata(req);
+
+	(void) ino;
+
+	myfs_releasedir(myfs, (struct myfs_dir *)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
 static void fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 			struct fuse_file_info *fi)
 {
@@ -366,16 +394,16 @@ static void fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 		.size = 0
 	};
 	struct myfs *myfs = fuse_req_userdata(req);
-	struct myfs_inode *dir = myfs_inode_get(myfs, ino);
+	struct myfs_dir *stream = (struct myfs_dir *)(uintptr_t)fi->fh;
 	int err;
 
-	(void) fi;
+	(void) ino;
 
 	assert(ctx.buf);
-	err = myfs_readdir(myfs, dir, &ctx.ctx, off);
-	myfs_inode_put(myfs, dir);
+	err = myfs_readdir_stream(myfs, stream, &ctx.ctx, off);
 	if (err < 0) {
 		fuse_reply_err(req, -err);
+		free(ctx.buf);
 		return;
 	}
 	fuse_reply_buf(req, ctx.buf, ctx.size);
@@ -468,7 +496,9 @@ static const struct fuse_lowlevel_ops myfs_ops = {
 	.rmdir = &fuse_rmdir,
 	.rename = &fuse_rename,
 	.link = &fuse_link,
+	.opendir = &fuse_opendir,
 	.readdir = &fuse_readdir,
+	.releasedir = &fuse_releasedir,
 	.read = &fuse_read,
 	.write = &fuse_write,
 	.fsync = &fuse_fsync,
@@ -478,12 +508,20 @@ static const struct fuse_lowlevel_ops myfs_ops = {
 
 struct myfs_config {
 	const char *path;
+	unsigned long rate;
+	unsigned long memory;
+	unsigned long cache;
+	int lazy_csum;
 	int verbose;
 	int fd;
 };
 
 static const struct fuse_opt myfs_opts[] = {
 	{"--image=%s", offsetof(struct myfs_config, path), 0},
+	{"--rate=%lu", offsetof(struct myfs_config, rate), 0},
+	{"--memory=%lu", offsetof(struct myfs_config, memory), 0},
+	{"--cache=%lu", offsetof(struct myfs_config, cache), 0},
+	{"--lazy_csum", offsetof(struct myfs_config, lazy_csum), 1},
 	{"--verbose", offsetof(struct myfs_config, verbose), 1},
 	{"-v", offsetof(struct myfs_config, verbose), 1},
 	FUSE_OPT_END
@@ -499,7 +537,11 @@ static void version(void)
 static void usage(const char *name)
 {
 	fprintf(stderr, "usage: %s [options] <mountpoint>\n\n", name);
-	fprintf(stderr, "\t--image=path path to the image file\n\n");
+	fprintf(stderr, "\t--image=path path to the image file\n");
+	fprintf(stderr, "\t--rate=num background I/O rate limit in MB/s\n");
+	fprintf(stderr, "\t--memory=num memtables memory budget in MB\n");
+	fprintf(stderr, "\t--cache=num tree node cache size in MB\n");
+	fprintf(stderr, "\t--lazy_csum verify cached nodes in background\n\n");
 	fuse_cmdline_help();
 	fuse_lowlevel_help();
 }
@@ -548,14 +590,37 @@ int main(int argc, char **argv)
 	}
 
 	struct fuse_session *se = NULL;
+	struct bio_limiter limiter;
+	struct bio_queue queue;
 	struct sync_bdev bdev;
 	struct myfs myfs;
 
 	memset(&myfs, 0, sizeof(myfs));
+	myfs.mem_budget = (size_t)config.memory * 1024 * 1024;
+	myfs.ncache_size = (size_t)config.cache * 1024 * 1024;
+	myfs.lazy_csum = config.lazy_csum;
 	sync_bdev_setup(&bdev, config.fd);
-
-	if (myfs_mount(&myfs, &bdev.bdev)) {
+	bio_limiter_setup(&limiter, (uint64_t)config.rate * 1024 * 1024);
+	if (config.rate)
+		bdev_set_limiter(&bdev.bdev, &limiter);
+	bio_queue_setup(&queue);
+	bdev_set_queue(&bdev.bdev, &queue);
+
+	const int err = myfs_mount(&myfs, &bdev.bdev);
+
+	if (err == -EPROTONOSUPPORT) {
+		fprintf(stderr, "unsupported on-disk format version %lu, "
+			"expected %lu, the image must be recreated with "
+			"myfs-mkfs\n", (unsigned long)myfs.sb.version,
+			(unsigned long)MYFS_FS_VERSION);
+		bio_queue_release(&queue);
+		bio_limiter_release(&limiter);
+		goto out;
+	}
+	if (err) {
 		fprintf(stderr, "failed to parse superblock\n");
+		bio_queue_release(&queue);
+		bio_limiter_release(&limiter);
 		goto out;
 	}
 	myfs.verbose = config.verbose;
@@ -594,6 +659,8 @@ destroy_session:
 	fuse_session_destroy(se);
 unmount:
 	myfs_unmount(&myfs);
+	bio_queue_release(&queue);
+	bio_limiter_release(&limiter);
 out:
 	if (config.fd >= 0)
 		close(config.fd);
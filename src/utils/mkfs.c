@@ -34,6 +34,9 @@
 struct myfs_config {
 	const char *name;
 	size_t page_size;
+	unsigned long features;
+	size_t fanout;
+	size_t node_pages;
 };
 
 
@@ -84,13 +87,22 @@ static int format(const struct myfs_config *config)
 
 	myfs.bdev = &bdev.bdev;
 	myfs.page_size = config->page_size;
-	myfs.fanout = MYFS_MIN_FANOUT;
+	myfs.fanout = config->fanout;
+	myfs.node_pages = config->node_pages;
 	myfs.sb.magic = MYFS_FS_MAGIC;
 	myfs.sb.page_size = config->page_size;
 	myfs.sb.check_size = check_size / config->page_size;
 	myfs.sb.check_offs = 1;
 	myfs.sb.backup_check_offs = 1 + myfs.sb.check_size;
 	myfs.sb.root = MYFS_FS_ROOT;
+	myfs.sb.features = config->features;
+	myfs.sb.version = MYFS_FS_VERSION;
+	ret = myfs_csum_setup(&myfs);
+	if (ret) {
+		fprintf(stderr, "unsupported checksum algorithm\n");
+		close(fd);
+		return ret;
+	}
 	myfs.check.ino = MYFS_FS_ROOT + 1;
 	myfs.next_offs = myfs.sb.backup_check_offs + myfs.sb.check_size;
 	atomic_store_explicit(&myfs.next_ino, myfs.check.ino,
@@ -98,6 +110,9 @@ static int format(const struct myfs_config *config)
 
 	myfs_inode_map_setup(&myfs.inode_map, &myfs, &myfs.check.inode_sb);
 	myfs_dentry_map_setup(&myfs.dentry_map, &myfs, &myfs.check.dentry_sb);
+	if (config->features & MYFS_FEATURE_DINDEX)
+		myfs_dindex_map_setup(&myfs.dindex_map, &myfs,
+					&myfs.check.dindex_sb);
 
 	ret = __myfs_inode_write(&myfs, &root);
 	if (ret) {
@@ -117,6 +132,14 @@ static int format(const struct myfs_config *config)
 		goto err;
 	}
 
+	if (config->features & MYFS_FEATURE_DINDEX) {
+		ret = myfs_lsm_flush(&myfs.dindex_map);
+		if (ret) {
+			fprintf(stderr, "failed to flush directory index\n");
+			goto err;
+		}
+	}
+
 	myfs_sb2disk(&sb.sb, &myfs.sb);
 
 	if (myfs_block_write(&myfs, &sb, sizeof(sb), 0)) {
@@ -130,6 +153,8 @@ static int format(const struct myfs_config *config)
 	}
 
 err:
+	if (config->features & MYFS_FEATURE_DINDEX)
+		myfs_dindex_map_release(&myfs.dindex_map);
 	myfs_dentry_map_release(&myfs.dentry_map);
 	myfs_inode_map_release(&myfs.inode_map);
 	close(fd);
@@ -139,6 +164,11 @@ err:
 
 static const struct option opts[] = {
 	{"page_size", required_argument, NULL, 's'},
+	{"compress", no_argument, NULL, 'c'},
+	{"fanout", required_argument, NULL, 'f'},
+	{"node_pages", required_argument, NULL, 'n'},
+	{"csum", required_argument, NULL, 'C'},
+	{"dir_index", no_argument, NULL, 'i'},
 	{"help", no_argument, NULL, 's'},
 	{NULL, 0, NULL, 0},
 };
@@ -148,16 +178,24 @@ static void usage(FILE *out, const char *name)
 {
 	fprintf(out, "Usage: %s [options] filename\n\n", name);
 	fprintf(out, "\t--page_size, -s <num> - file system page size in bytes\n");
+	fprintf(out, "\t--compress, -c - compress metadata trees\n");
+	fprintf(out, "\t--fanout, -f <num> - minimal number of items in a tree node\n");
+	fprintf(out, "\t--node_pages, -n <num> - tree node size in pages\n");
+	fprintf(out, "\t--csum, -C <xxh64|xxh3|crc32c> - checksum algorithm\n");
+	fprintf(out, "\t--dir_index, -i - readdir in inode order\n");
 	fprintf(out, "\t--help, -h - show this message\n");
 }
 
 int main(int argc, char **argv)
 {
 	unsigned long page_size = 4096;
+	unsigned long features = 0;
+	unsigned long fanout = MYFS_MIN_FANOUT;
+	unsigned long node_pages = MYFS_CTREE_NODE_PAGES;
 	char *endptr;
 	int kind;
 
-	while ((kind = getopt_long(argc, argv, "hs:", opts, NULL)) != -1) {
+	while ((kind = getopt_long(argc, argv, "hcis:f:n:C:", opts, NULL)) != -1) {
 		switch (kind) {
 		case 's':
 			page_size = strtoul(optarg, &endptr, 10);
@@ -176,6 +214,40 @@ int main(int argc, char **argv)
 				return -1;
 			}
 			break;
+		case 'c':
+			features |= MYFS_FEATURE_COMPRESS;
+			break;
+		case 'i':
+			features |= MYFS_FEATURE_DINDEX;
+			break;
+		case 'f':
+			fanout = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0' || fanout < 2 || fanout > UINT16_MAX) {
+				fprintf(stderr, "fanout must be a number between 2 and %d\n",
+							UINT16_MAX);
+				return -1;
+			}
+			break;
+		case 'n':
+			node_pages = strtoul(optarg, &endptr, 10);
+			if (*endptr != '\0' || !node_pages ||
+					node_pages > MYFS_CTREE_MAX_NODE_PAGES) {
+				fprintf(stderr, "node size must be between 1 and %d pages\n",
+							MYFS_CTREE_MAX_NODE_PAGES);
+				return -1;
+			}
+			break;
+		case 'C':
+			features &= ~(MYFS_FEATURE_XXH3 | MYFS_FEATURE_CRC32C);
+			if (!strcmp(optarg, "xxh3")) {
+				features |= MYFS_FEATURE_XXH3;
+			} else if (!strcmp(optarg, "crc32c")) {
+				features |= MYFS_FEATURE_CRC32C;
+			} else if (strcmp(optarg, "xxh64")) {
+				fprintf(stderr, "unknown checksum algorithm\n");
+				return -1;
+			}
+			break;
 		case 'h':
 			usage(stdout, argv[0]);
 			return 0;
@@ -194,6 +266,9 @@ int main(int argc, char **argv)
 
 	config.name = argv[optind];
 	config.page_size = page_size;
+	config.features = features;
+	config.fanout = fanout;
+	config.node_pages = node_pages;
 
 	if (format(&config)) {
 		fprintf(stderr, "%s failed to create empty file system in %s\n",